@@ -370,6 +370,17 @@ def initDefaultAssets(mgr):
     m.setGPUProgram('BaseImage',PT_FRAGMENT)
     m.copySpectrumFrom(s2)
 
+    m=mgr.createMaterial('InstancedGlyph')
+    m.setGPUProgram('instancedGlyphVP',PT_VERTEX)
+
+    m=mgr.createMaterial('Keyframe')
+    m.setGPUProgram('keyframeVP',PT_VERTEX)
+
+    m=mgr.createMaterial('PointCloud')
+    m.useLighting(False)
+    m.usePointSprites(True)
+    m.setGPUProgram('pointSpriteVP',PT_VERTEX)
+
     m=mgr.createMaterial('BoundBoxes')
     m.useLighting(False)
 
@@ -300,17 +300,6 @@ def generateSphereImageStack(width,height,slices,center=vec3(0.5),scale=vec3(0.4
     return images
 
 
-@concurrent
-def calculateImageStackHistogramRange(process,imgs,minv,maxv):
-    hist=RealMatrix('histogram',int(maxv-minv),1,True)
-    hist.fill(0)
-
-    for i in process.prange():
-        renderer.calculateImageHistogram(imgs[i-process.startval].img,hist,minv)
-
-    return hist
-
-
 def calculateImageStackHistogram(imgs,minv=None,maxv=None,task=None):
     if isinstance(imgs,ImageSceneObject):
         imgs=imgs.images
@@ -324,13 +313,17 @@ def calculateImageStackHistogram(imgs,minv=None,maxv=None,task=None):
     if maxv is not None:
         imgmax=max(imgmax,maxv)
 
-    results=calculateImageStackHistogramRange(len(imgs),0,task,imgs,int(imgmin),int(imgmax),partitionArgs=(imgs,))
+    hist=RealMatrix('histogram',int(imgmax)-int(imgmin),1)
+    hist.fill(0)
+
+    if task:
+        task.setMaxProgress(len(imgs))
 
-    hists=list(results.values())
-    hist=hists[0]
-    for hh in hists[1:]:
-        hist.add(hh)
-        hh.clear()
+    # calculateImageHistogram() divides each image between threads itself so the images are counted in turn here
+    for i,img in enumerate(imgs):
+        renderer.calculateImageHistogram(img.img,hist,int(imgmin))
+        if task:
+            task.setProgress(i+1)
 
     hist.meta('minx',str(imgmin))
     hist.meta('maxx',str(imgmax))
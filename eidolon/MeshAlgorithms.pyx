@@ -34,7 +34,7 @@ from .MathDef import GeomType,ElemType
 import cython
 cimport cython
 
-from .renderer import IndexMatrix,RealMatrix,Vec3Matrix,ColorMatrix,vec3,color
+from .renderer import IndexMatrix,RealMatrix,Vec3Matrix,ColorMatrix,vec3,color,calculateIsosurface
 from Renderer cimport IndexMatrix,RealMatrix,Vec3Matrix,ColorMatrix,vec3,color
 
 import SceneUtils
@@ -2037,6 +2037,38 @@ def calculateIsosurfaceRange(process,nodes,ind,refine,field,fieldtopo,minv,maxv,
     return outnodes,outinds,outprops
 
 
+def calculateIsosurfaceNative(nodes,ind,field,planevals,indnum):
+    '''
+    Calculate the isosurfaces at the values `planevals' through the linear tets or hexes of `ind' for the per-node field 
+    `field' with the native calculateIsosurface(), returning (outnodes,outinds,outprops) in the same form as each process's
+    result from calculateIsosurfaceRange(). Vertices are shared between the triangles of each side of the surface.
+    '''
+    name='calculateIsosurfaceNative'
+    xis=[vec3(*xi) for xi in ElemType[ind.getType()].xis]
+
+    surfnodes,outinds,_,lerps,elems=calculateIsosurface(nodes,ind,field,planevals,True,name)
+
+    outnodes=Vec3Matrix(name+' Nodes',0,3)
+    outprops=IndexMatrix(name+MatrixType.props[1],0,3)
+    outnodes.reserveRows(surfnodes.n())
+    outprops.reserveRows(surfnodes.n())
+
+    # the xi value of each vertex is its position along the edge it lies on in the element it was found in
+    for i in xrange(surfnodes.n()):
+        elem,a,b=elems.getRow(i)
+        outnodes.append(surfnodes.getAt(i),surfnodes.getAt(i,1),xis[a].lerp(lerps.getAt(i),xis[b]))
+        outprops.append(elem,0,indnum)
+
+    surfnodes.clear()
+    lerps.clear()
+    elems.clear()
+
+    if outnodes.n()==0:
+        return None,None,None
+
+    return outnodes,outinds,outprops
+
+
 @concurrent
 def calculateIsolineRange(process,nodes,ind,ext,refine,field,fieldtopo,minv,maxv,radius,cylrefine,linevals,indnum):
     elemtype=ElemType[ind.getType()]
@@ -2223,7 +2255,9 @@ def generateIsoObjectDataSet(dataset,name,refine,externalOnly=False,task=None,**
     for ind,ext,adj in findIndexSets(dataset,acceptFunc=acceptFunc):
         shareMatrices(nodes,ind,field,fieldtopo)
 
-        if objtype=='surface':
+        if objtype=='surface' and refine==0 and ind.getType() in ('Tet1NL','Hex1NL') and fieldtopo.getName()==ind.getName():
+            result={0:calculateIsosurfaceNative(nodes,ind,fieldvals,vals,len(indlist))} # linear elements with node fields need no refinement
+        elif objtype=='surface':
             proccount=chooseProcCount(ind.n(),refine,2000)
             result=calculateIsosurfaceRange(ind.n(),proccount,task,nodes,ind,refine,field,fieldtopo,minv,maxv,vals,len(indlist))
         else:
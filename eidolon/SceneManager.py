@@ -1339,9 +1339,26 @@ class SceneManager(TaskQueue):
         if end==None:
             end=self.timestepMax+stepvalue
 
-        for i,ts in enumerate(Utils.frange(start,end,stepvalue)):
-            self.setTimestep(ts)
-            self.saveScreenshot('%s%04d%s'%(fileprefix,i,extension),camera_or_widget,width,height,stereoOffset,tformat)
+        camera_or_widget=camera_or_widget or self.cameras[0]
+
+        if not isinstance(camera_or_widget,renderer.Camera) or not self.scene:
+            for i,ts in enumerate(Utils.frange(start,end,stepvalue)):
+                self.setTimestep(ts)
+                self.saveScreenshot('%s%04d%s'%(fileprefix,i,extension),camera_or_widget,width,height,stereoOffset,tformat)
+            return
+
+        # capture every timestep in one batch which reuses the render target and writes the files in a background thread
+        def captureshot():
+            self.repaint(True)
+            camera_or_widget.captureFrame()
+
+        self.callThreadSafe(camera_or_widget.beginCapture,fileprefix,extension,width,height,tformat,stereoOffset)
+        try:
+            for ts in Utils.frange(start,end,stepvalue):
+                self.setTimestep(ts)
+                self.callThreadSafe(captureshot)
+        finally:
+            self.callThreadSafe(camera_or_widget.endCapture)
 
     def getSceneCode(self):
         '''Returns the code representation of the current scene as can be constructed by plugins.'''
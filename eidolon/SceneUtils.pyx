@@ -32,12 +32,12 @@ import glob
 
 from .renderer import (
     vec3,transform,rotator,color,Vec3Matrix,RealMatrix,IndexMatrix,ColorMatrix, getSharedDir, unlinkShared,
-    PyVertexBuffer,PyIndexBuffer, minmaxMatrixIndex, calculateBoundBox, calculateHexValueIntersects,
+    PyVertexBuffer,PyIndexBuffer, minmaxMatrixIndex, calculateBoundBox, calculateIsosurface,
     pointSearchLinTet,pointSearchLinHex
 )
 from Renderer cimport (
     vec3,transform,rotator,color,Vec3Matrix,RealMatrix,IndexMatrix,ColorMatrix, getSharedDir, unlinkShared,
-    PyVertexBuffer,PyIndexBuffer, minmaxMatrixIndex, calculateBoundBox, calculateHexValueIntersects,
+    PyVertexBuffer,PyIndexBuffer, minmaxMatrixIndex, calculateBoundBox, calculateIsosurface,
     pointSearchLinTet,pointSearchLinHex
 )
 
@@ -600,9 +600,9 @@ cdef class BoundBox(object):
         Returns a node within the bound box which is on the given plane and the radius of the spherical cap
         defined by the plane cutting through the bound sphere, or None,None if the node is not within the bound box.
         '''
-        cdef list nodes=self.getCorners()
-        cdef list heights=[n.planeDist(pt,norm) for n in nodes]
-        cdef list intersects=[nodes[i].lerp(lerpval,nodes[j]) for i,j,lerpval in calculateHexValueIntersects(0,*heights)]
+        cdef list heights=[n.planeDist(pt,norm) for n in self.getCorners()]
+        cdef list xis=calculateLinHexIsosurf(heights,0)[0]
+        cdef list intersects=[self.minv+(self.maxv-self.minv)*xi for xi in xis] # the box is its own trilinear map of xi space
         if intersects:
             center=avg(intersects,vec3())
             return center, math.sqrt(max(center.distToSq(i) for i in intersects))
@@ -1261,6 +1261,26 @@ def calculateTetIsosurf(fieldvals,fieldtype,elemtype,val,refine=0):
         yield xi2,xi4,xi3
 
 
+def calculateLinHexIsosurf(nodevals,val):
+    '''
+    Returns the isosurface at the value `val' in a linear hex whose node values are `nodevals' as the pair (xis,tris), where
+    `xis' is the list of the surface's vertex xi coordinates and `tris' the list of index triples into it. This uses the
+    native calculateIsosurface() over the hex in xi space, so the result doesn't depend on the shape of the element.
+    '''
+    cdef Vec3Matrix nodes=Vec3Matrix('hexxis',8)
+    cdef IndexMatrix inds=IndexMatrix('hexinds','Hex1NL',1,8)
+    cdef RealMatrix vals=RealMatrix('hexvals',8)
+
+    for i,xi in enumerate(ElemType.Hex1NL.xis):
+        nodes.setAt(vec3(*xi),i)
+        vals.setAt(nodevals[i],i)
+
+    inds.setRow(0,*range(8))
+    outnodes,outinds=calculateIsosurface(nodes,inds,vals,[val],False,'hexisosurf',1)[:2]
+
+    return [outnodes.getAt(i) for i in xrange(outnodes.n())],[outinds.getRow(i) for i in xrange(outinds.n())]
+
+
 def calculateHexIsosurf(fieldvals,fieldtype,elemtype,val,refine=0):
     '''
     Yields a series of xi coordinate triples defining a triangulation of the isosurface at the value `val' in the
@@ -1282,36 +1302,18 @@ def calculateHexIsosurf(fieldvals,fieldtype,elemtype,val,refine=0):
 
         return
 
-    elemtype=ElemType.Hex1NL
-    xis=[vec3(*xi) for xi in elemtype.xis]
+    hexxis=ElemType.Hex1NL.xis
 
-    if len(fieldvals)!=len(xis):
-        nodevals=[fieldtype.applyBasis(fieldvals,*xi) for x in xis]
+    if len(fieldvals)!=len(hexxis):
+        nodevals=[fieldtype.applyBasis(fieldvals,*xi) for xi in hexxis]
     else:
         nodevals=fieldvals
 
-    assert len(nodevals)==len(xis),str(len(nodevals))
-    intersects=[xis[i].lerp(lerpval,xis[j]) for i,j,lerpval in calculateHexValueIntersects(val,*nodevals)]
-
-    if len(intersects)>0:
-        invplane=rotator(intersects[0].planeNorm(intersects[1],intersects[2]),vec3(0,0,1))
-
-        center=avg(intersects,vec3()) # determine the center of the intersect patch
-        intersectangles=[]
-
-        for n in intersects: # rotate the points (centered around `center') to be on the XY plane and store their polar x angles
-            nn=invplane*(n-center)
-            intersectangles.append((n,math.atan2(nn.y(),nn.x())))
-
-        intersectangles.sort(key=lambda x:x[1]) # sort The points by their angles; this will yield a circular list of points
-
-        xi0,a=intersectangles.pop(0)
-
-        for i in xrange(len(intersectangles)-1):
-            xi1,a=intersectangles[i]
-            xi2,a=intersectangles[i+1]
+    assert len(nodevals)==len(hexxis),str(len(nodevals))
+    xis,tris=calculateLinHexIsosurf(nodevals,val)
 
-            yield xi0,xi1,xi2
+    for a,b,c in tris:
+        yield xis[a],xis[b],xis[c]
 
 
 def calculateElemIsosurf(fieldvals,fieldtype,elemtype,val,refine=-1):
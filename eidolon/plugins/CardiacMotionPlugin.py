@@ -290,31 +290,26 @@ def calculateRegionThicknessesRange(process,trinodes,stddevRange,triindlist):
     '''
     results=[]
 
-    maxlen=max(triind.n() for triind in triindlist)
-    centers=Vec3Matrix('centers',maxlen)
-    norms=Vec3Matrix('norms',maxlen)
-    radii2=RealMatrix('radii2',maxlen)
-
     for triind in triindlist:
-        # for each triangle, store the center, norm, and radius in the above matrices
-        for n in range(triind.n()):
+        numtris=triind.n()
+        centers=Vec3Matrix('centers',numtris)
+        invnorms=Vec3Matrix('invnorms',numtris)
+        selfinds=IndexMatrix('selfinds',numtris)
+        dists=RealMatrix('dists',numtris)
+        hitinds=IndexMatrix('hitinds',numtris)
+
+        # for each triangle, store the center, inverted norm, and its own index to exclude from its ray's intersection test
+        for n in range(numtris):
             nodes=trinodes.mapIndexRow(triind,n) # triangle nodes
-            center=(nodes[0]+nodes[1]+nodes[2])/3.0 # triangle center
-            centers.setAt(center,n) # store center
-            norms.setAt(nodes[0].planeNorm(nodes[1],nodes[2]),n) # store triangle norm
-            radii2.setAt(max(center.distToSq(v) for v in nodes),n) # store triangle radius**2
-
-        # for each triangle, project a ray inward and store in `lengths' the distance of the first intersection with the mesh
-        lengths=[]
-        for n in range(triind.n()):
-            center=centers.getAt(n)
-            norm=norms.getAt(n)
-            ray=eidolon.Ray(center,-norm)
+            centers.setAt((nodes[0]+nodes[1]+nodes[2])/3.0,n) # store center
+            invnorms.setAt(-nodes[0].planeNorm(nodes[1],nodes[2]),n) # store inward triangle norm
+            selfinds.setAt(n,n)
 
-            intres=ray.intersectsTriMesh(trinodes,triind,centers,radii2,1,n)
+        # for each triangle, project a ray inward and store in `lengths' the distance of the nearest intersection with the mesh
+        bvh=eidolon.TriMeshBVH(trinodes,triind)
+        eidolon.intersectsTriMeshRays(bvh,centers,invnorms,dists,hitinds,selfinds,1)
 
-            if len(intres)>0:
-                lengths.append(intres[0][1])
+        lengths=[dists.getAt(n) for n in range(numtris) if dists.getAt(n)>=0]
 
         avglen=avgDevRange(lengths,stddevRange)
         region=int(triind.getName().split('_')[2])
@@ -19,6 +19,7 @@
 
 from eidolon import vec3,rotator,ImageSceneObject,enum,ImageScenePlugin,ReprType,taskroutine,renameFile,SceneObject,printFlush
 from eidolon import ensureExt,splitPathExt,Future,SharedImage,avgspan,ImageSceneObjectRepr,first,setStrIndent, addPlugin
+from eidolon import decodeFileToRealMatrix, getStreamTypeSize, minmaxMatrixReal, ST_UBYTE, ST_USHORT
 
 import numpy as np
 
@@ -288,7 +289,7 @@ class ParRecPlugin(ImageScenePlugin):
                     raise IOError("Cannot find rec file '%s.rec'"%recfile)
 
                 geninfo,imginfo=parseParFile(filename) # read par file
-                rec=np.fromfile(recfile,np.uint8) # read rec file
+                recsize=os.path.getsize(recfile) # the rec file is decoded directly into each image matrix below
 
 #               numorients=geninfo[genInfoFields.maxgrad[2]][0]
 #               numslices=geninfo[genInfoFields.maxloc[2]][0]
@@ -317,8 +318,8 @@ class ParRecPlugin(ImageScenePlugin):
                     pixelsize=imgi[imgInfoFields.imgpix[-1]]/8 # convert from bits to bytes
                     datasize+=w*h*pixelsize
 
-                if rec.shape[0]!=datasize:
-                    raise IOError('Rec file incorrect size, should be %i but is %i'%(datasize,rec.shape[0]))
+                if recsize!=datasize:
+                    raise IOError('Rec file incorrect size, should be %i but is %i'%(datasize,recsize))
 
                 for imgi in imginfo:
                     dynamic=imgi[imgInfoFields.dynnum[-1]]
@@ -341,22 +342,22 @@ class ParRecPlugin(ImageScenePlugin):
 
                     images=typemap[itype][dynamic]
 
-                    dtype=np.dtype('uint'+str(pixelsize))
+                    stype=ST_UBYTE if pixelsize==8 else ST_USHORT
 
                     pos,rot=getTransformFromInfo(offcenter,angulation,orientation,vec3(*spacing),vec3(*dims))
 
-                    imgsize=dims[0]*dims[1]*dtype.itemsize
-                    arr=rec[rpos:rpos+imgsize].view(dtype).reshape(dims)
-                    rpos+=imgsize
-
-                    if scalemethod in ('dv','DV'):
-                        arr=(arr.astype(float)*reslope)+intercept # DV scaling method
-
                     simg=SharedImage(recfile,pos,rot,dims,spacing,trigger)
                     simg.allocateImg('%s_t%i_d%i_img%i'%(name,itype,dynamic,len(images)))
-                    #simg.setArrayImg(arr)
-                    simg.setMinMaxValues(arr.min(),arr.max())
-                    np.asarray(simg.img)[:,:]=arr
+
+                    if scalemethod in ('dv','DV'): # DV scaling method
+                        slope,icept=reslope,intercept
+                    else:
+                        slope,icept=1.0,0.0
+
+                    # decode and rescale the image's pixels straight from the mapped rec file in one parallel pass
+                    decodeFileToRealMatrix(recfile,rpos,stype,simg.img,False,slope,icept)
+                    simg.setMinMaxValues(*minmaxMatrixReal(simg.img))
+                    rpos+=dims[0]*dims[1]*getStreamTypeSize(stype)
 
                     images.append(simg)
 
@@ -34,6 +34,43 @@ cdef icolor ColorMatrixCallback(void* func,icolor val, sval n, sval m) with gil:
     return color._get(o(color._new(val),n,m))
 
 
+def mapColorMatrixFile(str name,str mtype,str filename,size_t offset,sval n,sval m=1,bint copyOnWrite=False,str serialmeta=''):
+    '''
+    Create a ColorMatrix of `n' rows and `m' columns whose data is mapped from `filename' starting from byte `offset' rather
+    than read into memory. See the C++ file-mapping constructor for Matrix, this is also used to unpickle such matrices.
+    Unless `copyOnWrite' is True the matrix is read-only, methods modifying it raise ValueError and buffer views of it
+    are read-only.
+    '''
+    cdef ColorMatrix mat=ColorMatrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[icolor](name,mtype,filename,offset,n,m,copyOnWrite)
+    mat.mat.deserializeMeta(serialmeta)
+    return mat
+
+
+def arenaColorMatrix(str name,object arena,sval n,sval m=1,str mtype=''):
+    '''
+    Create a shared ColorMatrix of `n' rows and `m' columns whose data is allocated from `arena', which may be a SharedArena
+    or SharedArenaPool. The matrix holds a reference to its arena's segment until it is cleared or deleted.
+    '''
+    cdef size_t offset=0
+    cdef iSharedArena* a=_allocateFromArena(arena,sizeof(icolor)*n*m,&offset)
+    cdef ColorMatrix mat=ColorMatrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[icolor](name,mtype,n,m,a,offset)
+    return mat
+
+
+def attachColorMatrixArena(str name,str mtype,str sharedname,size_t capacity,size_t offset,sval n,sval m,str serialmeta=''):
+    '''Create a ColorMatrix from the allocation at `offset' in the arena named `sharedname', this is used to unpickle arena matrices.'''
+    cdef iSharedArena* a=iSharedArena.attach(sharedname,capacity)
+    cdef ColorMatrix mat=ColorMatrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[icolor](name,mtype,n,m,a,offset)
+    mat.mat.deserializeMeta(serialmeta)
+    return mat
+
+
 cdef class ColorMatrix:
     cdef iMatrix[icolor]* mat
     cdef Py_ssize_t shape[2]
@@ -92,6 +129,10 @@ cdef class ColorMatrix:
         if self.viewCount>0:
             raise MemoryError('Cannot perform operation, external views of matrix exist')
 
+    cdef checkWritable(self):
+        if self.isReadOnly():
+            raise ValueError('Cannot modify matrix mapped read-only from file %s'%self.mat.getFileName())
+
     def subMatrix(self,str name,sval n, sval m=1,sval noff=0,sval moff=0,bint isShared=False):
         return ColorMatrix._new(self.mat.subMatrix(name,n,m,noff,moff,isShared))
 
@@ -99,6 +140,7 @@ cdef class ColorMatrix:
         return ColorMatrix._new(self.mat.reshape(name,n,m,isShared))
 
     def applyCell(self,object func,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         maxcol=RenderTypes._min[sval](self.mat.m(),maxcol)
         maxrow=RenderTypes._min[sval](self.mat.n(),maxrow)
         for n in range(minrow,maxrow):
@@ -139,8 +181,17 @@ cdef class ColorMatrix:
         return 'ColorMatrix<%s, %i x %i, %r>'%(self.getName(),self.n(),self.m(),self.isShared())
 
     def __reduce__(self):
+        cdef iSharedArena* arena=self.mat.getArena()
+        if arena!=NULL:
+            args=(self.getName(),self.getType(),arena.getSharedName(),arena.getCapacity(),self.mat.getArenaOffset(),self.n(),self.m(),self.mat.serializeMeta())
+            return attachColorMatrixArena,args
+
+        if self.isFileMapped() and not self.isCopyOnWrite():
+            args=(self.getName(),self.getType(),self.getFileName(),self.getFileOffset(),self.n(),self.m(),False,self.mat.serializeMeta())
+            return mapColorMatrixFile,args
+
         if not self.isShared():
-            raise MemoryError('Only shared memory matrices can be pickled')
+            raise MemoryError('Only shared memory or read-only file-mapped matrices can be pickled')
 
         return ColorMatrix,(self.getName(),self.getType(),self.mat.getSharedName(),self.mat.serializeMeta(),self.n(),self.m())
 
@@ -157,6 +208,28 @@ cdef class ColorMatrix:
     def isShared(self):
         return self.mat.isShared()
 
+    def isFileMapped(self):
+        return self.mat.isFileMapped()
+
+    def isCopyOnWrite(self):
+        return self.mat.isCopyOnWrite()
+
+    def isReadOnly(self):
+        '''Returns True if this matrix is mapped read-only from a file, methods which modify it then raise ValueError.'''
+        return self.mat.isReadOnly()
+
+    def getFileName(self):
+        return self.mat.getFileName()
+
+    def getFileOffset(self):
+        return self.mat.getFileOffset()
+
+    def isArenaAllocated(self):
+        return self.mat.isArenaAllocated()
+
+    def getArenaOffset(self):
+        return self.mat.getArenaOffset()
+
     def n(self):
         return self.mat.n()
 
@@ -180,15 +253,18 @@ cdef class ColorMatrix:
         self.mat.setShared(val)
 
     def swapEndian(self):
+        self.checkWritable()
         self.mat.swapEndian()
 
     def getAt(self,sval n,sval m=0):
         return color._new(self.mat.getAt(n,m))
 
     def setAt(self,color v,sval n,sval m=0):
+        self.checkWritable()
         self.mat.setAt(color._get(v),n,m)
 
     def fill(self,color v):
+        self.checkWritable()
         self.mat.fill(color._get(v))
 
     def setN(self,sval newn):
@@ -240,6 +316,7 @@ cdef class ColorMatrix:
 
     def setRow(self,sval n,*vals):
         cdef sval i,minlen=RenderTypes._min[sval](self.mat.m(),len(vals))
+        self.checkWritable()
         
         if n>=self.mat.n():
             raise IndexError("Bad value %i for index 'n' (0<=n<%i"%(n,self.n()))
@@ -278,6 +355,7 @@ cdef class ColorMatrix:
         cdef object line
         cdef sval n=min(self.mat.n(),len(listmat))
         cdef sval m=self.mat.m()
+        self.checkWritable()
 
         try:
             m=min(m,len(listmat[0]))
@@ -294,20 +372,42 @@ cdef class ColorMatrix:
 
     def fromIterable(self,iterable):
         cdef object it=iter(iterable)
+        self.checkWritable()
         self.setN(len(iterable))
         for i in range(len(iterable)):
             self.mat.ats(i,0,color._get(next(it)))
 
     def readBinaryFile(self, str filename,size_t offset):
+        self.checkWritable()
         self.mat.readBinaryFile(filename,offset)
 
     def readTextFile(self, str filename,sval numHeaders):
+        self.checkWritable()
         self.mat.readTextFile(filename,numHeaders)
 
     def storeBinaryFile(self, str filename, list header):
         cdef array.array a=array.array('i',header)
         self.mat.storeBinaryFile(filename,a.data.as_ints,len(header))
 
+    def storeContainerFile(self, str filename, sval chunkRows=0, bint compressed=True, sval numThreads=0):
+        '''
+        Store this matrix with its type and metadata in chunked container file `filename', each chunk having `chunkRows'
+        rows (about 1MB if 0) and being compressed if `compressed' is True using `numThreads' threads (0 for all).
+        '''
+        cdef string fname=filename
+        with nogil:
+            self.mat.storeContainerFile(fname.c_str(),chunkRows,compressed,numThreads)
+
+    def readContainerFile(self, str filename, sval startRow=0, sval numRows=-1, sval numThreads=0):
+        '''
+        Read `numRows' rows (the rest of the file if -1) starting at `startRow' from container file `filename' into this
+        matrix, resizing it to that many rows. Only the chunks containing the requested rows are decompressed.
+        '''
+        cdef string fname=filename
+        self.checkWritable()
+        with nogil:
+            self.mat.readContainerFile(fname.c_str(),startRow,numRows,numThreads)
+
     def __getitem__(self,index):
         origindex=index
 
@@ -354,6 +454,7 @@ cdef class ColorMatrix:
         raise TypeError('Index %r is not supported'%(origindex,))
 
     def __setitem__(self,index,value):
+        self.checkWritable()
         origindex=index
 
         if isinstance(index,tuple):
@@ -21,6 +21,8 @@
 #include "OgreRenderTypes.h"
 
 #include <cctype>
+#include <iomanip>
+#include <iterator>
 
 
 // if the renderer is configured to use Ogre, define getRenderAdapter() to return an Ogre object
@@ -191,6 +193,7 @@ void OgreMaterial::useSpectrumTexture(bool use)
 
 void OgreMaterial::updateSpectrum()
 {
+	Material::updateSpectrum();
 	scene->addResourceOp(new CommitOp<OgreMaterial>(this));
 }
 
@@ -211,7 +214,11 @@ void OgreMaterial::commit()
 
 OgreBaseRenderable::OgreBaseRenderable(const std::string& name,const std::string& matname,Ogre::RenderOperation::OperationType _opType,Ogre::SceneManager *mgr) throw(RenderException) : 
 		Ogre::MovableObject(name), movableType("OgreRenderable"), vertexData(NULL), _opType(_opType), 
-		indexData(NULL),_numVertices(0),_numIndices(0),localVertBuff(NULL),localIndBuff(NULL), depthSorting(true),deferFillOp(false)
+		indexData(NULL),_numVertices(0),_numIndices(0),localVertBuff(NULL),localIndBuff(NULL), 
+		vertFormat(VF_FULL),bufferFormat(VF_FULL),shortIndices(false),
+		backFill(NULL),backFillActive(false),readyFill(NULL),spareFill(NULL),committingFill(NULL), lastCam(NULL), depthSorting(true),
+		readyKeyframes(NULL),spareKeyframes(NULL),keyframeCount(0),keyframesBound(false),keyframeFields(false),cubicKeyframes(true),keyframeTime(0),
+		sortCacheValid(false),lastSortValid(false),depthSortThreshold(0.01)
 {
 	mat.setNull();
 	vertBuf.setNull();
@@ -224,13 +231,24 @@ OgreBaseRenderable::OgreBaseRenderable(const std::string& name,const std::string
 
 void OgreBaseRenderable::createBuffers(size_t numVerts,size_t numInds,bool deferCreate)
 {
-	// store these values for the next render cycle, these clue in the object that a deferred data fill operation was requested
-	deferFillOp=deferCreate;
+	// start a new back fill with these sizes, this is published for the render thread when the fill operation completes
+	if(deferCreate){
+		if(!backFill)
+			backFill=createFillBuffer();
+
+		backFill->reset(numVerts,numInds);
+		backFill->format=vertFormat;
+		backFillActive=true;
+		return;
+	}
+
+	u32 format=committingFill ? committingFill->format : vertFormat;
+
 	_numVertices=numVerts;
 	_numIndices=numInds;
 
-	// do nothing if creation is being deferred to a render cycle or if the existing data objects are present and don't need resizing
-	if(deferCreate || (vertexData && vertexData->vertexCount==numVerts && indexData && indexData->indexCount==numInds))
+	// do nothing if the existing data objects are present and don't need resizing or a different format, the index type depends on numVerts only
+	if(vertexData && vertexData->vertexCount==numVerts && indexData && indexData->indexCount==numInds && bufferFormat==format)
 		return;
 	
 	destroyBuffers();
@@ -248,105 +266,525 @@ void OgreBaseRenderable::createBuffers(size_t numVerts,size_t numInds,bool defer
 	Ogre::VertexDeclaration* decl = vertexData->vertexDeclaration;
 	size_t offset = 0;
 
-	// define vertex to match OgreBaseRenderable::Vertex
+	// define vertex in the same component order as OgreBaseRenderable::Vertex, VF_FULL matches its layout exactly
 	decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
 	offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
-	decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
-	offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+
+	if(format&VF_PACKEDNORMAL){
+		decl->addElement(0, offset, Ogre::VET_SHORT4_NORM, Ogre::VES_NORMAL);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_SHORT4_NORM);
+	}
+	else if(format&VF_NORMAL){
+		decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+	}
+
 	decl->addElement(0, offset, Ogre::VET_COLOUR, Ogre::VES_DIFFUSE);
 	offset += Ogre::VertexElement::getTypeSize(Ogre::VET_COLOUR);
-	decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES);
-	offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+
+	if(format&VF_TEXCOORD){
+		decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+	}
+
+	bufferFormat=format;
+	shortIndices=_numVertices<ShortIndexLimit;
 
 	Ogre::HardwareBufferManager& hbm=Ogre::HardwareBufferManager::getSingleton();
+	Ogre::HardwareIndexBuffer::IndexType itype=shortIndices ? Ogre::HardwareIndexBuffer::IT_16BIT : Ogre::HardwareIndexBuffer::IT_32BIT;
 	
 	// create the vertex and index buffers
 	vertBuf=hbm.createVertexBuffer(decl->getVertexSize(0), _numVertices,vertexBufferUsage);
 	vertexData->vertexBufferBinding->setBinding(0, vertBuf);
-	indexData->indexBuffer = hbm.createIndexBuffer(Ogre::HardwareIndexBuffer::IT_32BIT, _numIndices, indexBufferUsage);
+	indexData->indexBuffer = hbm.createIndexBuffer(itype, _numIndices, indexBufferUsage);
+}
+
+size_t OgreBaseRenderable::getVertexSize(u32 format)
+{
+	size_t size=sizeof(float)*3+sizeof(rgba); // position and color
+
+	if(format&VF_PACKEDNORMAL)
+		size+=sizeof(i16)*4;
+	else if(format&VF_NORMAL)
+		size+=sizeof(float)*3;
+
+	if(format&VF_TEXCOORD)
+		size+=sizeof(float)*3;
+
+	return size;
+}
+
+/// Swap the red and blue channels of a packed color, this converts between ABGR and ARGB
+static inline rgba swapRedBlue(rgba c)
+{
+	return (c&0xff00ff00)|((c&0xff)<<16)|((c>>16)&0xff);
+}
+
+/// Pack a unit normal component into a normalized short
+static inline i16 packNormalComp(float val)
+{
+	return i16(clamp(val,-1.0f,1.0f)*32767.0f+(val<0 ? -0.5f : 0.5f));
+}
+
+void OgreBaseRenderable::writeVertices(const Vertex* verts,size_t num,bool swapColors)
+{
+	num=_min(num,_numVertices);
+
+	if(bufferFormat==VF_FULL && !swapColors){ // the layouts match so write directly
+		vertBuf->writeData(0,num*sizeof(Vertex),verts,num==_numVertices);
+		return;
+	}
+
+	if(num==0)
+		return;
+
+	// only discard the old contents if they're all replaced, otherwise lock just the range written keeping the rest
+	size_t vsize=vertBuf->getVertexSize();
+	Ogre::HardwareBuffer::LockOptions opts=num==_numVertices ? Ogre::HardwareBuffer::HBL_DISCARD : Ogre::HardwareBuffer::HBL_NORMAL;
+	u8* buf=(u8*)vertBuf->lock(0,num*vsize,opts);
+
+	for(size_t i=0;i<num;i++,buf+=vsize){
+		const Vertex& v=verts[i];
+		u8* p=buf;
+
+		memcpy(p,v.pos,sizeof(v.pos));
+		p+=sizeof(v.pos);
+
+		if(bufferFormat&VF_PACKEDNORMAL){
+			i16* n=(i16*)p;
+			n[0]=packNormalComp(v.norm[0]);
+			n[1]=packNormalComp(v.norm[1]);
+			n[2]=packNormalComp(v.norm[2]);
+			n[3]=0;
+			p+=sizeof(i16)*4;
+		}
+		else if(bufferFormat&VF_NORMAL){
+			memcpy(p,v.norm,sizeof(v.norm));
+			p+=sizeof(v.norm);
+		}
+
+		*((rgba*)p)=swapColors ? swapRedBlue(v.col) : v.col;
+		p+=sizeof(rgba);
+
+		if(bufferFormat&VF_TEXCOORD)
+			memcpy(p,v.tex,sizeof(v.tex));
+	}
+
+	vertBuf->unlock();
+}
+
+void OgreBaseRenderable::writeIndices(const indexval* inds,size_t num)
+{
+	num=_min(num,_numIndices);
+
+	if(!shortIndices){
+		indexData->indexBuffer->writeData(0,num*sizeof(indexval),inds,num==_numIndices);
+		return;
+	}
+
+	if(num==0)
+		return;
+
+	Ogre::HardwareBuffer::LockOptions opts=num==_numIndices ? Ogre::HardwareBuffer::HBL_DISCARD : Ogre::HardwareBuffer::HBL_NORMAL;
+	u16* buf=(u16*)indexData->indexBuffer->lock(0,num*sizeof(u16),opts);
+
+	for(size_t i=0;i<num;i++)
+		buf[i]=u16(inds[i]);
+
+	indexData->indexBuffer->unlock();
 }
 
 void OgreBaseRenderable::destroyBuffers()
 {
+	applyChunks(NULL); // chunks refer to the index buffer so are removed with it
+
 	SAFE_DELETE(vertexData);
 	SAFE_DELETE(indexData);
 
 	vertBuf.setNull();
+	clearSortCache();
+	keyframesBound=false; // the keyframe elements were in the deleted declaration, the keyframe buffers are kept
 }
 
-void OgreBaseRenderable::_updateRenderQueue(Ogre::RenderQueue* queue) 
+void OgreBaseRenderable::setChunks(std::vector<indexval>& inds,std::vector<MeshChunk>& chunks)
 {
-	if(vertexData==NULL && !deferFillOp) // return if there's nothing to render
-		return;
-			
-	trylock(&mutex,0.0001){
-		// `deferFillOp' is true if a data fill operation was deferred until now, so now if there vertex or index data
-		// create the buffers, fill the data, and delete the temporary buffers, otherwise fill with the default data
-		if(deferFillOp){
-			deferFillOp=false;
-			if(_numVertices>0 || _numIndices>0){
-				createBuffers(_numVertices,_numIndices); // create the hardware buffers for real
-				commitBuffers();
-				deleteLocalIndBuff();
-				deleteLocalVertBuff();
-			}
-			else 
-				fillDefaultData();
+	if(backFillActive){
+		backFill->inds.swap(inds);
+		backFill->numIndices=backFill->inds.size();
+		backFill->hasInds=true;
+		backFill->chunks.swap(chunks);
+	}
+	else{ 
+		createBuffers(_numVertices,inds.size()); // nothing has been committed yet so the buffers can be recreated at the new size
+		deleteLocalIndBuff();
+
+		if(inds.size()>0)
+			memcpy(getLocalIndBuff(),&inds[0],inds.size()*sizeof(indexval));
+
+		localChunks.swap(chunks);
+	}
+}
+
+void OgreBaseRenderable::applyChunks(const std::vector<MeshChunk>* chunks)
+{
+	for(size_t i=0;i<chunkRends.size();i++)
+		delete chunkRends[i];
+
+	chunkRends.clear();
+
+	if(chunks && indexData)
+		for(size_t i=0;i<chunks->size();i++)
+			chunkRends.push_back(new ChunkRenderable(this,(*chunks)[i]));
+}
+
+void OgreBaseRenderable::addToRenderQueue(Ogre::RenderQueue* queue,Ogre::Renderable* rend)
+{
+	if (mRenderQueuePrioritySet)
+		queue->addRenderable(rend, mRenderQueueID, mRenderQueuePriority);
+	else if(mRenderQueueIDSet)
+		queue->addRenderable(rend, mRenderQueueID);
+	else
+		queue->addRenderable(rend);
+}
+
+void OgreBaseRenderable::visitRenderables(Ogre::Renderable::Visitor* visitor, bool debugRenderables) 
+{ 
+	visitor->visit(this, 0, false); 
+
+	for(size_t i=0;i<chunkRends.size();i++)
+		visitor->visit(chunkRends[i], Ogre::ushort(i+1), false);
+}
+
+void OgreBaseRenderable::addKeyframe(std::vector<float>& frame,bool hasField,vec3 minv,vec3 maxv)
+{
+	critical(&mutex){
+		publishKeyframe(&frame);
+
+		keyframeFields=keyframeFields || hasField;
+		keyframeCount++;
+
+		keyframeBox.merge(Ogre::AxisAlignedBox(convert(minv),convert(maxv)));
+		aabb.merge(keyframeBox);
+		boundRad=Ogre::Math::boundingRadiusFromAABB(aabb);
+	}
+}
+
+void OgreBaseRenderable::clearKeyframes()
+{
+	critical(&mutex){
+		publishKeyframe(NULL);
+		keyframeFields=false;
+		keyframeCount=0;
+		keyframeBox.setNull();
+	}
+}
+
+void OgreBaseRenderable::publishKeyframe(std::vector<float>* frame)
+{
+	// reclaim the ready batch if the render thread hasn't taken it so that its keyframes stay ahead of this one
+	KeyframeBatch* batch=(KeyframeBatch*)atomic_swap_ptr(&readyKeyframes,(KeyframeBatch*)NULL);
+
+	if(!batch){
+		batch=(KeyframeBatch*)atomic_swap_ptr(&spareKeyframes,(KeyframeBatch*)NULL);
+
+		if(!batch)
+			batch=new KeyframeBatch();
+
+		batch->frames.clear();
+		batch->clear=false;
+	}
+
+	if(frame){
+		batch->frames.push_back(std::vector<float>());
+		batch->frames.back().swap(*frame);
+	}
+	else{ // keyframes not yet taken are removed along with those already uploaded
+		batch->frames.clear();
+		batch->clear=true;
+	}
+
+	// only producers set the ready batch and they hold `mutex', so this was emptied above and `old' is always NULL
+	KeyframeBatch* old=(KeyframeBatch*)atomic_swap_ptr(&readyKeyframes,batch);
+	delete old;
+}
+
+/// Semantics and semantic indices of the keyframe elements bound to sources KeyframeSource to KeyframeSource+3
+static const Ogre::VertexElementSemantic KeyframeSemantics[4]={ 
+	Ogre::VES_TEXTURE_COORDINATES, Ogre::VES_TEXTURE_COORDINATES, Ogre::VES_TEXTURE_COORDINATES, Ogre::VES_TANGENT 
+};
+static const unsigned short KeyframeSemanticIndices[4]={ 5, 6, 7, 0 };
+
+bool OgreBaseRenderable::updateKeyframes()
+{
+	if(vertexData==NULL)
+		return false;
+
+	FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+	size_t numverts=vertexData->vertexCount;
+	Ogre::VertexDeclaration* decl=vertexData->vertexDeclaration;
+	Ogre::VertexBufferBinding* binding=vertexData->vertexBufferBinding;
+
+	// take the ready batch if there is one, producers never hold this so there's no waiting on keyframes being added
+	KeyframeBatch* batch=(KeyframeBatch*)atomic_swap_ptr(&readyKeyframes,(KeyframeBatch*)NULL);
+
+	if(batch){
+		if(batch->clear){
+			keyframeBufs.clear();
+			pendingKeyframes.clear();
+		}
+
+		for(size_t i=0;i<batch->frames.size();i++){
+			pendingKeyframes.push_back(std::vector<float>());
+			pendingKeyframes.back().swap(batch->frames[i]);
 		}
 
-		// sort indices if the parent is present, depth sorting is enabled, and the scene is valid
-		bool doSort=parent!=NULL && depthSorting && scene!=NULL && scene->getRenderHighQuality();
+		batch->frames.clear();
 
-		if(doSort) // if sorting is requested, only do so for triangles if there's more than 2 and we're not rendering in the main queue
-			doSort=getRenderQueueGroup()!=Ogre::RENDER_QUEUE_MAIN && (_numIndices/3)>2 && _opType==Ogre::RenderOperation::OT_TRIANGLE_LIST;
+		KeyframeBatch* old=(KeyframeBatch*)atomic_swap_ptr(&spareKeyframes,batch); // keep the batch to reuse its storage
+		delete old;
+	}
 
-		// if distance sorting is set and this object stores a triangle list, sort the triangle indices by inverse distance from the camera
-		if(doSort){
-			typedef quadruple<real,indexval,indexval,indexval> distindex;
-			typedef triple<indexval,indexval,indexval> triindex;
+	// upload pending keyframes in order once vertex data of the same size has been committed, each only once
+	size_t uploaded=0;
+	for(;uploaded<pendingKeyframes.size();uploaded++){
+		const std::vector<float>& frame=pendingKeyframes[uploaded];
+		size_t framelen=frame.size()*sizeof(float);
 
-			size_t numtris=_numIndices/3;
-			vec3 campos=parent->getTransform().inverse()*lastCamPos; 
-			float cx=campos.x(),cy=campos.y(),cz=campos.z();
+		if(frame.empty() || (numverts!=frame.size()/4 && numverts!=frame.size()/2))
+			break;
 
-			distindex* distindices=new distindex[numtris];
+		Ogre::HardwareVertexBufferSharedPtr buf=Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(
+			sizeof(float)*4,numverts,Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
 
-			Vertex* vbuf=(Vertex*)vertBuf->lock(Ogre::HardwareBuffer::HBL_NORMAL);
-			triindex* buf=(triindex*)indexData->indexBuffer->lock(Ogre::HardwareBuffer::HBL_NORMAL);
+		buf->writeData(0,framelen,&frame[0],true);
+		if(numverts!=frame.size()/4) // double sided figures store the vertices twice
+			buf->writeData(framelen,framelen,&frame[0]);
 
-			for(size_t i=0;i<numtris;i++){
-				indexval a=buf[i].first,b=buf[i].second,c=buf[i].third;
-				float x=(vbuf[a].pos[0]+vbuf[b].pos[0]+vbuf[c].pos[0])/3.0f-cx;
-				float y=(vbuf[a].pos[1]+vbuf[b].pos[1]+vbuf[c].pos[1])/3.0f-cy;
-				float z=(vbuf[a].pos[2]+vbuf[b].pos[2]+vbuf[c].pos[2])/3.0f-cz;
-				distindices[i]=distindex(-(x*x+y*y+z*z),a,b,c);
-			}
+		keyframeBufs.push_back(buf);
+
+		if(profiler)
+			profiler->addUpload(numverts*sizeof(float)*4);
+	}
 
-			qsort(distindices,numtris,sizeof(distindex),sortTupleFirstCB<distindex>);
+	pendingKeyframes.erase(pendingKeyframes.begin(),pendingKeyframes.begin()+uploaded);
 
-			for(size_t i=0;i<numtris;i++){
-				buf[i].first=distindices[i].second;
-				buf[i].second=distindices[i].third;
-				buf[i].third=distindices[i].fourth;
+	bool use=!keyframeBufs.empty() && keyframeBufs[0]->getNumVertices()==numverts;
+
+	if(use!=keyframesBound){ // add or remove the keyframe elements, see KeyframeSource for their sources and semantics
+		for(unsigned short i=0;i<4;i++){
+			if(use)
+				decl->addElement(KeyframeSource+i,0,Ogre::VET_FLOAT4,KeyframeSemantics[i],KeyframeSemanticIndices[i]);
+			else{
+				decl->removeElement(KeyframeSemantics[i],KeyframeSemanticIndices[i]);
+				binding->unsetBinding(KeyframeSource+i);
 			}
+		}
+
+		keyframesBound=use;
+	}
 
-			vertBuf->unlock();
-			indexData->indexBuffer->unlock();
-			delete distindices;
+	if(!use)
+		return false;
+
+	// bind the keyframes of the segment [k,k+1] containing the current time and those either side for the spline tangents
+	size_t last=keyframeBufs.size()-1;
+	real t=clamp<real>(keyframeTime,0,real(last));
+	size_t k=_min<size_t>(size_t(t),last>0 ? last-1 : 0);
+	size_t frames[4]={ k>0 ? k-1 : 0, k, _min(k+1,last), _min(k+2,last) };
+
+	for(unsigned short i=0;i<4;i++)
+		binding->setBinding(KeyframeSource+i,keyframeBufs[frames[i]]);
+
+	setCustomParameter(KeyframeParamIndex,Ogre::Vector4(Ogre::Real(t-k),cubicKeyframes ? 1 : 0,keyframeFields ? 1 : 0,0));
+	return true;
+}
+
+/// Number of pixels across the screen per vertex at which a chunk's next coarser level of detail is used
+static const real ChunkPixelsPerVertex=2.0;
+
+ChunkRenderable::ChunkRenderable(OgreBaseRenderable* parent,const MeshChunk& chunk) : parent(parent), chunk(chunk), level(0)
+{
+	indexData=OGRE_NEW Ogre::IndexData();
+	indexData->indexBuffer=parent->getIndexBuffer();
+	indexData->indexStart=chunk.levels[0].first;
+	indexData->indexCount=chunk.levels[0].second;
+	worldCenter=convert((chunk.minv+chunk.maxv)*0.5);
+}
+
+bool ChunkRenderable::update(const Ogre::Camera* cam,const Ogre::Matrix4& xform,bool highQuality)
+{
+	Ogre::AxisAlignedBox box(convert(chunk.minv),convert(chunk.maxv));
+	box.transformAffine(xform);
+	worldCenter=box.getCenter();
+
+	if(cam && !cam->isVisible(box))
+		return false;
+
+	level=0;
+
+	if(cam){ // find the on-screen diameter of the bounding sphere in pixels
+		Ogre::Viewport* vp=cam->getViewport();
+		real radius=box.getHalfSize().length();
+		real dist=_max<real>(cam->getDerivedPosition().distance(worldCenter),radius);
+		real halfheight=cam->getProjectionType()==Ogre::PT_ORTHOGRAPHIC ? cam->getOrthoWindowHeight()*0.5 : dist*tan(cam->getFOVy().valueRadians()*0.5);
+		real pixels=halfheight>0 ? radius/halfheight*(vp ? vp->getActualHeight() : 1024) : 0;
+
+		// level 0 has about sqrt(tris/2) vertices across, each level halves this, so use the first level sparse enough
+		real across=sqrt(real(chunk.levels[0].second/3)/2.0);
+
+		while(level+1<chunk.levels.size() && across>pixels/ChunkPixelsPerVertex){
+			level++;
+			across*=0.5;
 		}
 	}
 
-	if (mRenderQueuePrioritySet)
-		queue->addRenderable(this, mRenderQueueID, mRenderQueuePriority);
-	else if(mRenderQueueIDSet)
-		queue->addRenderable(this, mRenderQueueID);
-	else
-		queue->addRenderable(this);
+	if(!highQuality)
+		level=_min<sval>(level+1,chunk.levels.size()-1);
+
+	indexData->indexStart=chunk.levels[level].first;
+	indexData->indexCount=chunk.levels[level].second;
+
+	return indexData->indexCount>0;
+}
+
+void ChunkRenderable::getRenderOperation(Ogre::RenderOperation& op)
+{
+	parent->getRenderOperation(op);
+	op.useIndexes=true;
+	op.indexData=indexData;
+}
+
+void OgreBaseRenderable::clearSortCache()
+{
+	sortCacheValid=false;
+	lastSortValid=false;
+	sortCentroids.clear();
+	sortIndices.clear();
+	sortPositions.clear();
+}
+
+void OgreBaseRenderable::updateSortCache(const Vertex* verts,size_t numverts,const indexval* inds,size_t numinds)
+{
+	size_t numtris=_numIndices/3;
+	lastSortValid=false; // the index buffer contents are no longer in sorted order or the vertices have moved
+	sortCacheValid=false;
+
+	if(!depthSorting || _opType!=Ogre::RenderOperation::OT_TRIANGLE_LIST || numtris<3){
+		clearSortCache();
+		return;
+	}
+
+	// keep copies of what's committed so that either buffer can be replaced alone without reading the other back
+	if(verts){
+		numverts=_min(numverts,_numVertices);
+		sortPositions.assign(_numVertices*3,0.0f);
+
+		for(size_t i=0;i<numverts;i++)
+			memcpy(&sortPositions[i*3],verts[i].pos,sizeof(float)*3);
+	}
+
+	if(inds){
+		numinds=_min(numinds,numtris*3);
+		sortIndices.assign(inds,inds+numinds);
+		sortIndices.resize(numtris*3,0);
+	}
+
+	if(sortPositions.size()!=_numVertices*3 || sortIndices.size()!=numtris*3) // wait until both buffers have been committed
+		return;
+
+	sortCentroids.resize(numtris*3);
+
+	for(size_t i=0;i<numtris;i++){
+		indexval a=sortIndices[i*3],b=sortIndices[i*3+1],c=sortIndices[i*3+2];
+
+		if(a>=_numVertices || b>=_numVertices || c>=_numVertices) // don't sort bad index data, render it as given
+			return;
+
+		const float *pa=&sortPositions[a*3], *pb=&sortPositions[b*3], *pc=&sortPositions[c*3];
+
+		for(sval j=0;j<3;j++)
+			sortCentroids[i*3+j]=(pa[j]+pb[j]+pc[j])/3.0f;
+	}
+
+	sortCacheValid=true;
+}
+
+void OgreBaseRenderable::sortTriangles(const vec3& campos)
+{
+	size_t numtris=_numIndices/3;
+
+	// skip sorting if the current order was computed for a camera position close enough to the current one
+	if(lastSortValid && sortCacheValid && campos.distTo(lastSortCamPos)<=depthSortThreshold*boundRad)
+		return;
+
+	// the cache is only built from committed data, the write-only hardware buffers are never read back
+	if(!sortCacheValid || sortIndices.size()!=numtris*3)
+		return;
+
+	FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+	ProfileScope scope(profiler,&FrameStats::sortTime,&FrameStats::numSorts);
+
+	sortedIndices.resize(numtris*3);
+	depthSortTriangles(&sortCentroids[0],&sortIndices[0],numtris,campos,&sortedIndices[0],sortDists,sortKeys,sortOrder,sortOrderTemp);
+
+	// upload the indices only discarding the old contents, the vertex buffer is never touched and nothing is read back
+	writeIndices(&sortedIndices[0],numtris*3);
+
+	if(profiler)
+		profiler->addUpload(numtris*3*indexData->indexBuffer->getIndexSize());
+
+	lastSortCamPos=campos;
+	lastSortValid=true;
+}
+
+void OgreBaseRenderable::_updateRenderQueue(Ogre::RenderQueue* queue) 
+{
+	if(vertexData==NULL && readyFill==NULL) // return if there's nothing to render
+		return;
+			
+	ProfileScope scope(scene ? scene->getProfiler() : NULL,&FrameStats::updateTime,&FrameStats::numUpdates);
+
+	// take the newest complete fill if there is one, producers never hold this so there's no waiting on a fill in progress
+	FillBuffer* fill=(FillBuffer*)atomic_swap_ptr(&readyFill,(FillBuffer*)NULL);
+
+	if(fill){
+		commitFill(fill);
+
+		FillBuffer* old=(FillBuffer*)atomic_swap_ptr(&spareFill,fill); // keep the fill to reuse its storage
+		delete old;
+	}
+
+	// animated objects move their vertices in the vertex program so neither their triangles nor chunks can be sorted or culled
+	bool animated=updateKeyframes();
+
+	// the hardware buffers and sort state are only touched in this thread so sorting needs no lock, chunked objects aren't sorted
+	bool doSort=parent!=NULL && depthSorting && scene!=NULL && scene->getRenderHighQuality() && chunkRends.empty() && !animated;
+
+	if(doSort) // if sorting is requested, only do so for triangles if there's more than 2 and we're not rendering in the main queue
+		doSort=getRenderQueueGroup()!=Ogre::RENDER_QUEUE_MAIN && (_numIndices/3)>2 && _opType==Ogre::RenderOperation::OT_TRIANGLE_LIST;
+
+	// if distance sorting is set and this object stores a triangle list, sort the triangle indices by inverse distance from the camera
+	if(doSort)
+		sortTriangles(parent->getTransform().inverse()*lastCamPos);
+
+	if(chunkRends.empty()){
+		addToRenderQueue(queue,this);
+		return;
+	}
+
+	// queue the visible chunks at their levels of detail, the queue sorts transparent chunks by their own depths
+	bool highQuality=scene==NULL || scene->getRenderHighQuality();
+	Ogre::Matrix4 xform=_getParentNodeFullTransform();
+
+	for(size_t i=0;i<chunkRends.size();i++)
+		if(chunkRends[i]->update(animated ? NULL : lastCam,xform,highQuality))
+			addToRenderQueue(queue,chunkRends[i]);
 }
 
 void OgreBaseRenderable::_notifyCurrentCamera(Ogre::Camera* cam)
 {
 	lastCamPos=convert(cam->getPosition());
+	lastCam=cam;
 }
 	
 void OgreBaseRenderable::getRenderOperation(Ogre::RenderOperation& op)
@@ -359,6 +797,12 @@ void OgreBaseRenderable::getRenderOperation(Ogre::RenderOperation& op)
 
 OgreBaseRenderable::Vertex* OgreBaseRenderable::getLocalVertBuff()
 {
+	if(backFillActive){
+		backFill->verts.resize(backFill->numVertices);
+		backFill->hasVerts=true;
+		return backFill->numVertices>0 ? &backFill->verts[0] : NULL;
+	}
+
 	if(localVertBuff==NULL && _numVertices>0)
 		localVertBuff=new OgreBaseRenderable::Vertex[_numVertices];
 	
@@ -367,53 +811,126 @@ OgreBaseRenderable::Vertex* OgreBaseRenderable::getLocalVertBuff()
 
 indexval* OgreBaseRenderable::getLocalIndBuff()
 {
+	if(backFillActive){
+		backFill->inds.resize(backFill->numIndices);
+		backFill->hasInds=true;
+		return backFill->numIndices>0 ? &backFill->inds[0] : NULL;
+	}
+
 	if(localIndBuff==NULL && _numIndices>0)
 		localIndBuff=new indexval[_numIndices];
 	
 	return localIndBuff;
 }
 
-void OgreBaseRenderable::commitBuffers(bool commitVert, bool commitInd)
+void OgreBaseRenderable::publishFill(bool commit)
 {
-	if(commitVert && localVertBuff){
-		//void* buf=vertBuf->lock(Ogre::HardwareBuffer::HBL_NORMAL);
-		//memcpy(buf,localVertBuff,_numVertices*sizeof(OgreBaseRenderable::Vertex));
-		//vertBuf->unlock();
-		vertBuf->writeData(0,_numVertices*sizeof(OgreBaseRenderable::Vertex),localVertBuff);
+	if(!backFillActive)
+		return;
+
+	backFillActive=false;
+
+	if(!commit){ // leave the back fill to be reset by the next deferred fill
+		backFill->reset(0,0);
+		return;
+	}
+
+	FillBuffer* fill=backFill;
+	backFill=(FillBuffer*)atomic_swap_ptr(&spareFill,(FillBuffer*)NULL); // may be NULL, createBuffers() allocates one if so
+
+	// the ready fill is only read by the render thread and only modified by this thread once recycled, so reading it is safe
+	FillBuffer* ready=readyFill;
+	if(ready)
+		fill->carryOver(*ready);
+
+	FillBuffer* old=(FillBuffer*)atomic_swap_ptr(&readyFill,fill);
+
+	if(old){ // the superseded fill was never committed, keep it as the spare unless there is one already
+		old=(FillBuffer*)atomic_swap_ptr(&spareFill,old);
+		delete old;
 	}
+}
+
+void OgreBaseRenderable::commitFill(FillBuffer* fill)
+{
+	committingFill=fill; // createBuffers() takes the format from the fill since producers may be changing the members
 
-	if(commitInd && localIndBuff){
-		//void* buf=indexData->indexBuffer->lock(Ogre::HardwareBuffer::HBL_NORMAL);
-		//memcpy(buf,localIndBuff,_numIndices*sizeof(indexval));
-		//indexData->indexBuffer->unlock();
-		indexData->indexBuffer->writeData(0,_numIndices*sizeof(indexval),localIndBuff);
+	if(fill->isDefault || (fill->numVertices==0 && fill->numIndices==0))
+		fillDefaultData();
+	else{
+		createBuffers(fill->numVertices,fill->numIndices); // create the hardware buffers for real
+
+		if(fill->matVerts || fill->matInds) // commit matrices directly, the fill's arrays aren't used in this case
+			commitMatrices(fill->matVerts,fill->matInds,fill->swapColors);
+		else
+			commitData(fill->hasVerts && fill->numVertices>0 ? &fill->verts[0] : NULL,fill->hasInds && fill->numIndices>0 ? &fill->inds[0] : NULL,&fill->chunks);
 	}
+
+	committingFill=NULL;
+}
+
+void OgreBaseRenderable::commitBuffers(bool commitVert, bool commitInd)
+{
+	commitData(commitVert ? localVertBuff : NULL,commitInd ? localIndBuff : NULL,&localChunks);
 }
 
-void OgreBaseRenderable::commitMatrices(const Matrix<Vertex>* verts,const IndexMatrix *inds)
+void OgreBaseRenderable::commitData(const Vertex* verts,const indexval* inds,const std::vector<MeshChunk>* chunks)
 {
+	FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+	ProfileScope scope(profiler,&FrameStats::commitTime);
+
+	updateSortCache(verts,_numVertices,inds,_numIndices); // uses the stored copy of whichever buffer isn't being committed
+
 	if(verts){
-		//void* buf=vertBuf->lock(Ogre::HardwareBuffer::HBL_NORMAL);
-		//memcpy(buf,verts->dataPtr(),verts->memSize());
-		//vertBuf->unlock();
-		vertBuf->writeData(0,verts->memSize(),verts->dataPtr());
+		writeVertices(verts,_numVertices);
+
+		if(profiler)
+			profiler->addUpload(_numVertices*vertBuf->getVertexSize());
 	}
 
 	if(inds){
-		//void* buf=indexData->indexBuffer->lock(Ogre::HardwareBuffer::HBL_NORMAL);
-		//memcpy(buf,inds->dataPtr(),inds->memSize());
-		//indexData->indexBuffer->unlock();
-		indexData->indexBuffer->writeData(0,inds->memSize(),inds->dataPtr());
+		writeIndices(inds,_numIndices);
+		applyChunks(chunks);
+
+		if(profiler)
+			profiler->addUpload(_numIndices*indexData->indexBuffer->getIndexSize());
+	}
+}
+
+void OgreBaseRenderable::commitMatrices(const Matrix<Vertex>* verts,const IndexMatrix *inds,bool swapColors)
+{
+	FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+	ProfileScope scope(profiler,&FrameStats::commitTime);
+
+	size_t numverts=verts ? _min<size_t>(verts->n(),_numVertices) : 0;
+	size_t numinds=inds ? _min<size_t>(inds->n()*inds->m(),_numIndices) : 0;
+
+	if(profiler && verts)
+		profiler->addUpload(numverts*vertBuf->getVertexSize());
+	if(profiler && inds)
+		profiler->addUpload(numinds*indexData->indexBuffer->getIndexSize());
+
+	updateSortCache(verts ? verts->dataPtr() : NULL,numverts,inds ? inds->dataPtr() : NULL,numinds);
+
+	if(verts) // converts the colors if `swapColors' and the layout if the format isn't VF_FULL, otherwise writes directly
+		writeVertices(verts->dataPtr(),numverts,swapColors);
+
+	if(inds){
+		writeIndices(inds->dataPtr(),numinds);
+		applyChunks(NULL);
 	}
 }
 
 void OgreBaseRenderable::fillDefaultData(bool deferFill)
 {
-	deferFillOp=deferFill;
-	_numVertices=0;
-	_numIndices=0;
+	if(deferFill){
+		createBuffers(0,0,true);
+		backFill->isDefault=true;
+	}
+	else{
+		_numVertices=0;
+		_numIndices=0;
 
-	if(!deferFill){
 		// the buffers need to be filled with valid data for the type of renderable this is, so choose based on _opType how many vertices and indices to create
 		sval numvals=1;
 		if(_opType==Ogre::RenderOperation::OT_LINE_LIST)
@@ -423,25 +940,110 @@ void OgreBaseRenderable::fillDefaultData(bool deferFill)
 
 		createBuffers(numvals,numvals);
 
-		memset(getLocalVertBuff(),0,sizeof(OgreBaseRenderable::Vertex)*numvals);
-		memset(getLocalIndBuff(),0,sizeof(indexval)*numvals);
+		// use separate arrays rather than the local buffers since this may be called in the render thread during a deferred fill
+		Vertex verts[3];
+		indexval inds[3];
+		memset(verts,0,sizeof(verts));
+		memset(inds,0,sizeof(inds));
 		
-		commitBuffers(true,numvals>1); // only commit the index buffer if _opType!=Ogre::RenderOperation::OT_POINT_LIST
-		deleteLocalVertBuff();
-		deleteLocalIndBuff();
+		commitData(verts,numvals>1 ? inds : NULL); // only commit the index buffer if _opType!=Ogre::RenderOperation::OT_POINT_LIST
 		setBoundingBox(vec3(),vec3(1)); // this of course isn't correct but a zero- or negative-sized box isn't acceptable
 	}
 }
 
 OgreFigure::OgreFigure(const std::string &name,const std::string & matname,OgreRenderScene *scene,FigureType type) throw(RenderException) :
-		OgreBaseFigure(new OgreBaseRenderable(name,matname,convert(type),scene->mgr),scene->createNode(name),scene), type(type)
+		OgreBaseFigure(new OgreBaseRenderable(name,matname,convert(type),scene->mgr),scene->createNode(name),scene), type(type), packedNormals(false),
+		chunkSize(0), chunkLevels(1)
 {}
 
+/// Pack a color into the 32-bit vertex color format `vtype', this matches Ogre::ColourValue::getAsARGB/getAsABGR but clamps values
+static inline Ogre::RGBA packVertexColor(const color& c, Ogre::VertexElementType vtype)
+{
+	u32 r=u32(clamp(c.r(),0.0f,1.0f)*255), g=u32(clamp(c.g(),0.0f,1.0f)*255), b=u32(clamp(c.b(),0.0f,1.0f)*255), a=u32(clamp(c.a(),0.0f,1.0f)*255);
+
+	if(vtype==Ogre::VET_COLOUR_ARGB)
+		return (a<<24)|(r<<16)|(g<<8)|b;
+	else
+		return (a<<24)|(b<<16)|(g<<8)|r;
+}
+
+/**
+ * Packs the vertex data from the matrices of a MatrixVertexBuffer directly into an array of OgreBaseRenderable::Vertex without
+ * going through virtual calls. Each thread accumulates its own bound box which are combined by the caller afterwards.
+ */
+class VertexPackTask : public ParallelTask
+{
+public:
+	const Vec3Matrix* vecs;
+	const ColorMatrix* cols;
+	const IndexMatrix* extinds;
+	OgreBaseRenderable::Vertex* buf;
+	bool useUVW;
+	Ogre::VertexElementType coltype;
+	std::vector<vec3> minvals, maxvals;
+	std::vector<u8> hasBounds; // not vector<bool> since each thread writes its own element concurrently
+
+	VertexPackTask(const MatrixVertexBuffer* mvb, OgreBaseRenderable::Vertex* buf, bool useUVW, Ogre::VertexElementType coltype, sval numThreads) :
+		vecs(mvb->getVecs()), cols(mvb->getCols()), extinds(mvb->getExtInds()), buf(buf), useUVW(useUVW && vecs->m()>3), coltype(coltype),
+		minvals(numThreads), maxvals(numThreads), hasBounds(numThreads,0)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		bool hasNorm=vecs->m()>1;
+		vec3 minv=minvals[threadIndex], maxv=maxvals[threadIndex];
+
+		if(!hasBounds[threadIndex]){
+			minv=maxv=vecs->at(extinds ? extinds->at(start) : start);
+			hasBounds[threadIndex]=true;
+		}
+
+		for(sval i=start;i<end;i++){
+			sval ind=extinds ? extinds->at(i) : i;
+			const vec3 &pos=vecs->at(ind);
+			OgreBaseRenderable::Vertex &v=buf[i];
+
+			minv.setMinVals(pos);
+			maxv.setMaxVals(pos);
+
+			v.pos[0]=float(pos.x());
+			v.pos[1]=float(pos.y());
+			v.pos[2]=float(pos.z());
+
+			if(hasNorm){
+				const vec3 &norm=vecs->at(ind,1);
+				v.norm[0]=float(norm.x());
+				v.norm[1]=float(norm.y());
+				v.norm[2]=float(norm.z());
+			}
+			else
+				v.norm[0]=v.norm[1]=v.norm[2]=0.0f;
+
+			if(useUVW){
+				const vec3 &uvw=vecs->at(ind,3);
+				v.tex[0]=float(uvw.x());
+				v.tex[1]=float(uvw.y());
+				v.tex[2]=float(uvw.z());
+			}
+			else
+				v.tex[0]=v.tex[1]=v.tex[2]=0.0f;
+
+			v.col=cols ? packVertexColor(cols->at(ind),coltype) : 0xffffffff;
+		}
+
+		minvals[threadIndex]=minv;
+		maxvals[threadIndex]=maxv;
+	}
+};
+
+/// Vertex count above which MatrixVertexBuffer data is packed using multiple threads
+static const sval ParallelPackThreshold=50000;
+
 void OgreFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill,bool doubleSided) throw(RenderException) 
 {
 	try{
-		// ensure that only one operation can be performed on the buffers at a time, this will force the renderer to wait if needed
-		critical(obj->getMutex()){
+		// ensure that only one fill is performed at a time, a deferred fill is published for the renderer when the block exits
+		fillscope(obj){
 			Ogre::RenderSystem* rs=Ogre::Root::getSingleton().getRenderSystem();
 
 			size_t indexWidth=0,indexSum=0;
@@ -462,14 +1064,36 @@ void OgreFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool def
 			doubleSided=doubleSided && type==FT_TRILIST; // doubleSided is only meaningful for triangles
 			size_t buffmul=doubleSided ? 2 : 1;
 
+			// store only the vertex components the buffer provides, the hardware index width is chosen from the vertex count
+			u32 format=0;
+			if(vb->hasNormal())
+				format|=packedNormals ? OgreBaseRenderable::VF_PACKEDNORMAL : OgreBaseRenderable::VF_NORMAL;
+			if(vb->hasUVWCoord() && type!=FT_POINTLIST)
+				format|=OgreBaseRenderable::VF_TEXCOORD;
+
+			obj->setVertexFormat(format);
 			obj->createBuffers(numverts*buffmul,indexSum*buffmul,deferFill); // create buffers even if indexSum is 0
 			
 			if(indexSum!=0 || type==FT_POINTLIST){ // do nothing when there's no indices, this will work and is useful if all elements get filtered out
 				OgreBaseRenderable::Vertex *buf=obj->getLocalVertBuff();
+				const MatrixVertexBuffer* mvb=dynamic_cast<const MatrixVertexBuffer*>(vb);
+				const MatrixIndexBuffer* mib=dynamic_cast<const MatrixIndexBuffer*>(ib);
 
 				vec3 minv=vb->getVertex(0), maxv=vb->getVertex(0);
 			
-				for (sval i = 0; i < numverts; i++) {
+				if(mvb){ // read directly from the matrices, splitting large meshes between threads
+					sval numThreads=numverts>=ParallelPackThreshold ? getProcessorCount() : 1;
+					VertexPackTask task(mvb,buf,type!=FT_POINTLIST,rs->getColourVertexElementType(),numThreads);
+
+					runParallelTask(&task,sval(numverts),numThreads);
+
+					for(sval i=0;i<numThreads;i++)
+						if(task.hasBounds[i]){
+							minv.setMinVals(task.minvals[i]);
+							maxv.setMaxVals(task.maxvals[i]);
+						}
+				}
+				else for (sval i = 0; i < numverts; i++) {
 					vec3 pos = vb->getVertex(i),norm,uvw;
 					
 					minv.setMinVals(pos);
@@ -507,29 +1131,121 @@ void OgreFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool def
 					indexval *ibuf=obj->getLocalIndBuff();
 					size_t index=0;
 	
-					for (sval i = 0; i < numinds; i++)
+					if(mib && mib->getIndices()->m()==indexWidth){ // the index matrix rows have the same layout as the buffer so copy them directly
+						const IndexMatrix* inds=mib->getIndices();
+						const IndexMatrix* extinds=mib->getExtInds();
+
+						if(!extinds){
+							memcpy(ibuf,inds->dataPtr(),sizeof(indexval)*indexSum);
+							index=indexSum;
+						}
+						else for (sval i = 0; i < numinds; i++, index+=indexWidth){
+							indexval row=extinds->at(i);
+							if(row>=inds->n())
+								throw RenderException("Index buffer row index out of range",__FILE__,__LINE__);
+
+							memcpy(&ibuf[index],&inds->at(row),sizeof(indexval)*indexWidth);
+						}
+					}
+					else for (sval i = 0; i < numinds; i++)
 						for (sval j = 0; j < indexWidth; j++){
 							ibuf[index]=ib->getIndex(i, j);
 							index++;
 						}
 
-					if(doubleSided && indexWidth==3) // generate reversed triangles
-						for (sval i = 0; i < index; i+=3){
-							ibuf[index+i]=ibuf[i]+indexval(numverts);
-							ibuf[index+i+1]=ibuf[i+2]+indexval(numverts);
-							ibuf[index+i+2]=ibuf[i+1]+indexval(numverts);
-						}
-			
+					if(doubleSided && indexWidth==3) // generate reversed triangles
+						for (sval i = 0; i < index; i+=3){
+							ibuf[index+i]=ibuf[i]+indexval(numverts);
+							ibuf[index+i+1]=ibuf[i+2]+indexval(numverts);
+							ibuf[index+i+2]=ibuf[i+1]+indexval(numverts);
+						}
+
+					// divide large triangle meshes into separately culled chunks with coarser levels of detail
+					if(chunkSize>0 && type==FT_TRILIST && indexWidth==3){
+						std::vector<indexval> chunkinds;
+						std::vector<MeshChunk> chunks;
+						try{
+							chunkTriangleMesh(buf,numverts*buffmul,ibuf,indexSum*buffmul/3,chunkSize,chunkLevels,chunkinds,chunks);
+						} catch(IndexException &e){
+							throw RenderException(e.what(),__FILE__,__LINE__);
+						}
+						obj->setChunks(chunkinds,chunks);
+					}
+				}
+
+				obj->setBoundingBox(minv,maxv);
+				node->needUpdate();
+
+				if(!deferFill){ // if not deferring to render time, commit the buffers now and delete the local buffers
+					obj->commitBuffers();
+					obj->deleteLocalIndBuff();
+					obj->deleteLocalVertBuff();
+				}
+			}
+		}
+	} catch(Ogre::Exception &e){
+		THROW_RENDEREX(e);
+	}
+}
+
+void OgreFigure::addKeyframe(const Vec3Matrix* nodes,const RealMatrix* field,real minval,real maxval) throw(RenderException)
+{
+	if(!nodes || nodes->n()==0)
+		throw RenderException("Keyframe node matrix must not be empty",__FILE__,__LINE__);
+
+	if(field && field->n()<nodes->n())
+		throw RenderException("Keyframe field matrix must have a value for every node",__FILE__,__LINE__);
+
+	std::vector<float> frame(nodes->n()*4);
+	vec3 minv=nodes->at(0), maxv=nodes->at(0);
+
+	for(sval i=0;i<nodes->n();i++){
+		vec3 pos=nodes->at(i);
+		minv.setMinVals(pos);
+		maxv.setMaxVals(pos);
+
+		pos.setBuff(&frame[i*4]);
+		frame[i*4+3]=field ? float(lerpXi(field->at(i),minval,maxval)) : 0.0f;
+	}
+
+	obj->addKeyframe(frame,field!=NULL,minv,maxv);
+	node->needUpdate();
+}
+
+void OgreFigure::fillPackedData(const PackedVertexMatrix* verts, const IndexMatrix* inds,bool deferFill) throw(RenderException)
+{
+	try{
+		fillscope(obj){
+			size_t numverts=verts ? verts->n() : 0;
+			size_t indexSum=(inds && type!=FT_POINTLIST) ? inds->n()*inds->m() : 0;
+
+			if(numverts==0){
+				obj->fillDefaultData(deferFill);
+				node->needUpdate();
+				return;
+			}
+
+			bool swapColors=Ogre::Root::getSingleton().getRenderSystem()->getColourVertexElementType()==Ogre::VET_COLOUR_ARGB;
+			const OgreBaseRenderable::Vertex* vbuf=verts->dataPtr();
+			vec3 minv(vbuf[0].pos[0],vbuf[0].pos[1],vbuf[0].pos[2]), maxv=minv;
+
+			obj->setVertexFormat(OgreBaseRenderable::VF_FULL); // the matrix is in the hardware layout so it can be written directly
+			obj->createBuffers(numverts,indexSum,deferFill);
+
+			if(indexSum!=0 || type==FT_POINTLIST){
+				for(size_t i=1;i<numverts;i++){
+					vec3 pos(vbuf[i].pos[0],vbuf[i].pos[1],vbuf[i].pos[2]);
+					minv.setMinVals(pos);
+					maxv.setMaxVals(pos);
 				}
 
+				if(deferFill)
+					obj->setPendingMatrices(verts,indexSum ? inds : NULL,swapColors);
+				else
+					obj->commitMatrices(verts,indexSum ? inds : NULL,swapColors);
+
 				obj->setBoundingBox(minv,maxv);
 				node->needUpdate();
-
-				if(!deferFill){ // if not deferring to render time, commit the buffers now and delete the local buffers
-					obj->commitBuffers();
-					obj->deleteLocalIndBuff();
-					obj->deleteLocalVertBuff();
-				}
 			}
 		}
 	} catch(Ogre::Exception &e){
@@ -539,6 +1255,14 @@ void OgreFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool def
 	
 OgreCamera::~OgreCamera()
 {
+	if(capture){ // stop the writer thread, errors can't be reported at this point
+		try{
+			capture->finish();
+		} catch(RenderException&){}
+
+		SAFE_DELETE(capture);
+	}
+
 	scene->mgr->destroyCamera(camera); //TODO: as ResourceOp?
 }
 
@@ -641,8 +1365,501 @@ void OgreCamera::renderToTexture(sval width,sval height,TextureFormat format,rea
 	}
 }
 
+void OgreCamera::beginCapture(const std::string& fileprefix,const std::string& extension,sval width,sval height,TextureFormat format,
+		real stereoOffset,sval queueSize) throw(RenderException)
+{
+	if(capture)
+		throw RenderException("A capture is already in progress for this camera",__FILE__,__LINE__);
+
+	if(width==0 && height==0){
+		width=port->getActualWidth();
+		height=port->getActualHeight();
+	}
+
+	capture=new FrameWriter(fileprefix,extension,width,height,convert(format),queueSize);
+
+	if(!capture->start()){
+		SAFE_DELETE(capture);
+		throw RenderException("Failed to start capture writer thread",__FILE__,__LINE__);
+	}
+
+	captureFormat=format;
+	captureStereo=stereoOffset;
+	captureIndex=0;
+}
+
+void OgreCamera::captureFrame() throw(RenderException)
+{
+	if(!capture)
+		throw RenderException("No capture in progress, call beginCapture() first",__FILE__,__LINE__);
+
+	renderToTexture(capture->getWidth(),capture->getHeight(),captureFormat,captureStereo);
+
+	// the texture is reused for every frame so it must be read back before the next render, writing happens in the background
+	u8* buf=capture->acquire();
+
+	try{
+		Ogre::PixelBox pb(capture->getWidth(),capture->getHeight(),1,capture->getFormat(),buf);
+		rtt_texture->getBuffer()->blitToMemory(pb);
+	}
+	catch(Ogre::Exception &e){
+		capture->release(buf); // skip the frame rather than write a partially read buffer, the next frame takes its index
+		THROW_RENDEREX(e);
+	}
+
+	capture->submit(buf,captureIndex++);
+}
+
+void OgreCamera::capturePoses(const Vec3Matrix* positions,const Vec3Matrix* lookats) throw(RenderException)
+{
+	vec3 pos=position, look=lookat;
+	rotator rot=getRotation();
+
+	try{
+		for(sval i=0;i<positions->n();i++){
+			setPosition(positions->at(i));
+			setLookAt(lookats && lookats->n()>0 ? lookats->at(_min(i,lookats->n()-1)) : look);
+			captureFrame();
+		}
+	}
+	catch(RenderException&){
+		setPosition(pos);
+		setRotation(rot);
+		lookat=look;
+		throw;
+	}
+
+	setPosition(pos);
+	setRotation(rot);
+	lookat=look;
+}
+
+sval OgreCamera::endCapture() throw(RenderException)
+{
+	if(!capture)
+		return 0;
+
+	FrameWriter* w=capture;
+	capture=NULL;
+
+	sval numWritten=0;
+
+	try{
+		numWritten=w->finish();
+	}
+	catch(RenderException&){
+		delete w;
+		throw;
+	}
+
+	delete w;
+	return numWritten;
+}
+
+FrameWriter::FrameWriter(const std::string& fileprefix,const std::string& extension,sval width,sval height,Ogre::PixelFormat format,sval queueSize) throw(RenderException) :
+		fileprefix(fileprefix), extension(extension), width(width), height(height), format(format), rawFile(NULL), finished(false), numWritten(0)
+{
+	frameSize=Ogre::PixelUtil::getMemorySize(width,height,1,format);
+
+	if(frameSize==0)
+		throw RenderException("Capture frame size must not be 0",__FILE__,__LINE__);
+
+	if(extension==".raw"){
+		rawFile=fopen(fileprefix.c_str(),"wb");
+		if(!rawFile)
+			throw RenderException("Failed to open capture file "+fileprefix,__FILE__,__LINE__);
+	}
+
+	for(sval i=0;i<_max<sval>(1,queueSize);i++){
+		buffers.push_back(new u8[frameSize]);
+		available.push_back(buffers.back());
+	}
+}
+
+FrameWriter::~FrameWriter()
+{
+	join();
+
+	if(rawFile)
+		fclose(rawFile);
+
+	for(size_t i=0;i<buffers.size();i++)
+		delete[] buffers[i];
+}
+
+u8* FrameWriter::acquire()
+{
+	while(available.empty())
+		if(freeBufs.popAll(available)==0)
+			bufferFreed.wait();
+
+	u8* buf=available.back();
+	available.pop_back();
+	return buf;
+}
+
+void FrameWriter::submit(u8* data,sval index)
+{
+	Frame f;
+	f.data=data;
+	f.index=index;
+	pending.push(f);
+	frameQueued.post();
+}
+
+sval FrameWriter::finish() throw(RenderException)
+{
+	finished=true;
+	frameQueued.post(); // wake the writer thread if it's waiting so that it sees `finished'
+	join();
+
+	if(!error.empty())
+		throw RenderException(error,__FILE__,__LINE__);
+
+	return numWritten;
+}
+
+void FrameWriter::writeFrame(const Frame& frame)
+{
+	if(rawFile){
+		if(fwrite(frame.data,1,frameSize,rawFile)!=frameSize)
+			throw RenderException("Failed to write frame to capture file "+fileprefix,__FILE__,__LINE__);
+	}
+	else{
+		std::ostringstream out;
+		out << fileprefix << std::setfill('0') << std::setw(4) << frame.index << extension;
+
+		Ogre::Image img;
+		img.loadDynamicImage(frame.data,width,height,1,format);
+		img.save(out.str());
+	}
+}
+
+void FrameWriter::run()
+{
+	std::vector<Frame> frames;
+
+	for(;;){
+		frameQueued.wait(); // sleep until a frame is queued or finish() is called, posts made while writing aren't lost
+
+		bool done=finished; // read before popping so that frames queued before finish() was called aren't missed
+
+		frames.clear();
+
+		if(pending.popAll(frames)==0){
+			if(done)
+				break;
+
+			continue; // the frames for this post were taken with those of an earlier one
+		}
+
+		for(size_t i=0;i<frames.size();i++){
+			bool ok=true;
+
+			critical(&mutex){
+				ok=error.empty();
+			}
+
+			if(ok){
+				std::string msg;
+
+				try{
+					writeFrame(frames[i]);
+				}
+				catch(Ogre::Exception &e){ msg=e.getFullDescription(); }
+				catch(RenderException &e){ msg=e.what(); }
+				catch(std::exception &e){ msg=e.what(); }
+
+				critical(&mutex){
+					if(msg.empty())
+						numWritten++;
+					else if(error.empty())
+						error=msg;
+				}
+			}
+
+			freeBufs.push(frames[i].data);
+			bufferFreed.post();
+		}
+	}
+}
+
+/**
+ * Replace `dest' with `src' if they differ and add the range of values which differ to `range', `width' is the number of 
+ * values per point so that ranges cover whole points. The contents of `src' are undefined afterwards.
+ */
+template<typename T>
+static void updatePointAttribute(std::vector<T>& dest, std::vector<T>& src, size_t width, PointCloudRenderable::DirtyRange& range)
+{
+	if(dest.size()!=src.size()){ // different number of points, the whole buffer will be recreated and uploaded anyway
+		dest.swap(src);
+		return;
+	}
+
+	size_t first=0, last=src.size();
+
+	while(first<last && src[first]==dest[first])
+		first++;
+
+	while(last>first && src[last-1]==dest[last-1])
+		last--;
+
+	if(first<last){
+		range.add(first/width,(last+width-1)/width);
+		dest.swap(src);
+	}
+}
+
+/// Set `dest' to the values of `src' in `range', which has `width' values per point
+template<typename T>
+static void copyPointRange(std::vector<T>& dest, const std::vector<T>& src, size_t width, const PointCloudRenderable::DirtyRange& range)
+{
+	dest.clear();
+
+	if(!range.isEmpty())
+		dest.assign(src.begin()+range.start*width,src.begin()+_min(range.end*width,src.size()));
+}
+
+/// Add the range `src' to `dest' if it isn't empty
+static void mergePointRange(PointCloudRenderable::DirtyRange& dest, const PointCloudRenderable::DirtyRange& src)
+{
+	if(!src.isEmpty())
+		dest.add(src.start,src.end);
+}
+
+/**
+ * Upload the values for `range' in `data', which starts at the first value of the range, to `buf' and clear `range'. The
+ * whole buffer is discarded if it's completely written.
+ */
+static void uploadPointAttribute(Ogre::HardwareVertexBufferSharedPtr& buf, const void* data, size_t elemSize, 
+		PointCloudRenderable::DirtyRange& range, FrameProfiler* profiler)
+{
+	if(!range.isEmpty() && !buf.isNull() && range.start<buf->getNumVertices()){
+		size_t end=_min(range.end,buf->getNumVertices());
+		size_t len=(end-range.start)*elemSize;
+		bool discard=range.start==0 && end==buf->getNumVertices();
+
+		buf->writeData(range.start*elemSize,len,data,discard);
+
+		if(profiler)
+			profiler->addUpload(len);
+	}
+
+	range.clear();
+}
+
+void PointCloudRenderable::publishUpdate()
+{
+	if(dirtyPos.isEmpty() && dirtyCol.isEmpty() && dirtySize.isEmpty() && !resizeBuffers)
+		return;
+
+	// reclaim the ready update if the render thread hasn't taken it, its ranges are then published again with the new ones
+	PointUpdate* update=(PointUpdate*)atomic_swap_ptr(&readyUpdate,(PointUpdate*)NULL);
+
+	if(update){
+		resizeBuffers=resizeBuffers || update->resize;
+		mergePointRange(dirtyPos,update->pos);
+		mergePointRange(dirtyCol,update->col);
+		mergePointRange(dirtySize,update->size);
+	}
+	else{
+		update=(PointUpdate*)atomic_swap_ptr(&spareUpdate,(PointUpdate*)NULL);
+
+		if(!update)
+			update=new PointUpdate();
+	}
+
+	size_t numpoints=numPoints();
+
+	if(resizeBuffers){ // recreated buffers are uploaded in full
+		dirtyPos.clear();
+		dirtyCol.clear();
+		dirtySize.clear();
+		dirtyPos.add(0,numpoints);
+		dirtyCol.add(0,numpoints);
+		dirtySize.add(0,numpoints);
+	}
+
+	update->numPoints=numpoints;
+	update->resize=resizeBuffers;
+	update->pos=dirtyPos;
+	update->col=dirtyCol;
+	update->size=dirtySize;
+
+	copyPointRange(update->posData,positions,3,dirtyPos);
+	copyPointRange(update->colData,colors,1,dirtyCol);
+	copyPointRange(update->sizeData,sizes,1,dirtySize);
+
+	resizeBuffers=false;
+	dirtyPos.clear();
+	dirtyCol.clear();
+	dirtySize.clear();
+
+	// only producers set the ready update and they hold `mutex', so this was emptied above and `old' is always NULL
+	PointUpdate* old=(PointUpdate*)atomic_swap_ptr(&readyUpdate,update);
+	delete old;
+}
+
+void PointCloudRenderable::setPoints(const VertexBuffer* vb,real size,Ogre::VertexElementType coltype)
+{
+	size_t numpoints=vb ? vb->numVertices() : 0;
+	std::vector<float> newpos(numpoints*3), newsizes(numpoints,float(size));
+	std::vector<rgba> newcols(numpoints);
+	vec3 minv,maxv;
+
+	if(numpoints>0)
+		minv=maxv=vb->getVertex(0);
+
+	for(size_t i=0;i<numpoints;i++){ // pack the points outside the lock so the renderer isn't held up
+		vec3 pos=vb->getVertex(i);
+		minv.setMinVals(pos);
+		maxv.setMaxVals(pos);
+		pos.setBuff(&newpos[i*3]);
+		newcols[i]=packVertexColor(vb->hasColor() ? vb->getColor(i) : color(),coltype);
+	}
+
+	critical(&mutex){
+		if(numpoints!=numPoints())
+			resizeBuffers=true;
+
+		updatePointAttribute(positions,newpos,3,dirtyPos);
+		updatePointAttribute(colors,newcols,1,dirtyCol);
+		updatePointAttribute(sizes,newsizes,1,dirtySize);
+
+		if(numpoints>0)
+			setBoundingBox(minv-vec3(size*0.5),maxv+vec3(size*0.5));
+		else
+			setBoundingBox(vec3(),vec3(1)); // as with fillDefaultData() a zero-sized box isn't acceptable
+
+		publishUpdate();
+	}
+}
+
+void PointCloudRenderable::setPointPos(size_t index,const vec3& pos) throw(IndexException)
+{
+	critical(&mutex){
+		if(index>=numPoints())
+			throw IndexException("index",index,numPoints());
+
+		pos.setBuff(&positions[index*3]);
+		dirtyPos.add(index,index+1);
+
+		vec3 ext(sizes[index]*0.5);
+		vec3 minv=convert(aabb.getMinimum()),maxv=convert(aabb.getMaximum());
+		minv.setMinVals(pos-ext);
+		maxv.setMaxVals(pos+ext);
+		setBoundingBox(minv,maxv); // grow the box only, computing the tight box would mean visiting every point
+
+		publishUpdate();
+	}
+}
+
+void PointCloudRenderable::setPointColor(size_t index,const color& col,Ogre::VertexElementType coltype) throw(IndexException)
+{
+	critical(&mutex){
+		if(index>=numPoints())
+			throw IndexException("index",index,numPoints());
+
+		colors[index]=packVertexColor(col,coltype);
+		dirtyCol.add(index,index+1);
+
+		publishUpdate();
+	}
+}
+
+void PointCloudRenderable::setPointSize(real size)
+{
+	critical(&mutex){
+		std::vector<float> newsizes(numPoints(),float(size));
+		updatePointAttribute(sizes,newsizes,1,dirtySize);
+
+		publishUpdate();
+	}
+}
+
+void PointCloudRenderable::createPointBuffers(size_t numpoints)
+{
+	destroyBuffers();
+
+	_numVertices=numpoints;
+	_numIndices=0;
+
+	if(_numVertices==0)
+		return;
+
+	vertexData = OGRE_NEW Ogre::VertexData();
+	vertexData->vertexStart = 0;
+	vertexData->vertexCount = _numVertices;
+
+	// each attribute has its own source so that it can be uploaded independently of the others
+	Ogre::VertexDeclaration* decl = vertexData->vertexDeclaration;
+	decl->addElement(0, 0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+	decl->addElement(1, 0, Ogre::VET_COLOUR, Ogre::VES_DIFFUSE);
+	decl->addElement(2, 0, Ogre::VET_FLOAT1, Ogre::VES_TEXTURE_COORDINATES);
+
+	Ogre::HardwareBufferManager& hbm=Ogre::HardwareBufferManager::getSingleton();
+
+	posBuf=hbm.createVertexBuffer(decl->getVertexSize(0), _numVertices,vertexBufferUsage);
+	colBuf=hbm.createVertexBuffer(decl->getVertexSize(1), _numVertices,vertexBufferUsage);
+	sizeBuf=hbm.createVertexBuffer(decl->getVertexSize(2), _numVertices,vertexBufferUsage);
+
+	vertexData->vertexBufferBinding->setBinding(0, posBuf);
+	vertexData->vertexBufferBinding->setBinding(1, colBuf);
+	vertexData->vertexBufferBinding->setBinding(2, sizeBuf);
+}
+
+void PointCloudRenderable::destroyBuffers()
+{
+	OgreBaseRenderable::destroyBuffers();
+	posBuf.setNull();
+	colBuf.setNull();
+	sizeBuf.setNull();
+}
+
+void PointCloudRenderable::_updateRenderQueue(Ogre::RenderQueue* queue)
+{
+	FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+	ProfileScope scope(profiler,&FrameStats::updateTime,&FrameStats::numUpdates);
+
+	// take the newest update if there is one, producers never hold this so changes are uploaded the frame after they're made
+	PointUpdate* update=(PointUpdate*)atomic_swap_ptr(&readyUpdate,(PointUpdate*)NULL);
+
+	if(update){
+		ProfileScope commitScope(profiler,&FrameStats::commitTime);
+
+		if(update->resize)
+			createPointBuffers(update->numPoints);
+
+		uploadPointAttribute(posBuf,update->posData.empty() ? NULL : &update->posData[0],sizeof(float)*3,update->pos,profiler);
+		uploadPointAttribute(colBuf,update->colData.empty() ? NULL : &update->colData[0],sizeof(rgba),update->col,profiler);
+		uploadPointAttribute(sizeBuf,update->sizeData.empty() ? NULL : &update->sizeData[0],sizeof(float),update->size,profiler);
+
+		PointUpdate* old=(PointUpdate*)atomic_swap_ptr(&spareUpdate,update); // keep the update to reuse its storage
+		delete old;
+	}
+
+	if(vertexData==NULL) // return if there's nothing to render
+		return;
+
+	if (mRenderQueuePrioritySet)
+		queue->addRenderable(this, mRenderQueueID, mRenderQueuePriority);
+	else if(mRenderQueueIDSet)
+		queue->addRenderable(this, mRenderQueueID);
+	else
+		queue->addRenderable(this);
+}
+
+void PointCloudRenderable::getRenderOperation(Ogre::RenderOperation& op)
+{
+	op.operationType = Ogre::RenderOperation::OT_POINT_LIST;
+	op.useIndexes = false;
+	op.vertexData = vertexData;
+	op.indexData = NULL;
+}
+
 OgreBBSetFigure::OgreBBSetFigure(const std::string & name,const std::string & matname,OgreRenderScene *scene,FigureType type) throw(RenderException) :
-		node(NULL),scene(scene),matname(matname), name(name),type(type),isInitialized(false),width(1.0),height(1.0), tempvb(NULL), deleteTemp(false)
+		node(NULL),scene(scene),matname(matname), name(name),type(type),isInitialized(false),width(1.0),height(1.0), tempvb(NULL), deleteTemp(false),
+		pointCloud(false), cloud(NULL), cloudFilled(false)
 {
 	node=scene->createNode(name);
 }
@@ -655,8 +1872,9 @@ OgreBBSetFigure::~OgreBBSetFigure()
 		Ogre::SceneNode *node;
 		OgreRenderScene *scene;
 		bbsetlist sets;
+		PointCloudRenderable* cloud;
 		
-		DeleteBBSetOp(bbsetlist sets,Ogre::SceneNode *node,OgreRenderScene *scene) : sets(sets),node(node),scene(scene) {}
+		DeleteBBSetOp(bbsetlist sets,PointCloudRenderable* cloud,Ogre::SceneNode *node,OgreRenderScene *scene) : sets(sets),cloud(cloud),node(node),scene(scene) {}
 		
 		virtual void op() 
 		{
@@ -664,19 +1882,27 @@ OgreBBSetFigure::~OgreBBSetFigure()
 				node->detachObject(*i);
 				scene->mgr->destroyBillboardSet(*i);
 			}
+
+			if(cloud){
+				node->detachObject(cloud);
+				SAFE_DELETE(cloud);
+			}
 			
 			scene->destroyNode(node);
 		}
 	};
 	
 	scene->removeResourceOp(getName()); // remove any pending commit operations so that this isn't attempted on a deleted object
-	scene->addResourceOp(new DeleteBBSetOp(sets,node,scene));
+	scene->addResourceOp(new DeleteBBSetOp(sets,cloud,node,scene));
 }
 
 void OgreBBSetFigure::setCameraVisibility(const Camera* cam, bool isVisible)
 {
 	for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 		OgreRenderTypes::setCameraVisibility(cam,*i,isVisible,scene);
+
+	if(cloud)
+		OgreRenderTypes::setCameraVisibility(cam,cloud,isVisible,scene);
 }
 
 void OgreBBSetFigure::createBBSet()
@@ -706,13 +1932,36 @@ void OgreBBSetFigure::createBBSet()
 	sets.push_back(bbset);
 }
 
+void OgreBBSetFigure::createCloud()
+{
+	cloud=new PointCloudRenderable(name+"_cloud",matname,scene->mgr);
+	cloud->setParentObjects(this,scene);
+	cloud->setVisibilityFlags(sets.size()>0 ? sets[0]->getVisibilityFlags() : 1);
+
+	if(sets.size()>0)
+		cloud->setRenderQueueGroup(sets[0]->getRenderQueueGroup());
+
+	node->attachObject(cloud);
+}
+
 void OgreBBSetFigure::commit()
 {
 	critical(&mutex){
 		for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 			(*i)->clear();
-		
-		for (sval i = 0; i <tempvb->numVertices(); i++) {
+
+		cloudFilled=pointCloud;
+
+		if(pointCloud){ // store the points in the cloud, only the attributes which have changed get uploaded
+			if(!cloud)
+				createCloud();
+
+			cloud->setPoints(tempvb,width,Ogre::Root::getSingleton().getRenderSystem()->getColourVertexElementType());
+		}
+		else if(cloud)
+			cloud->clearPoints();
+
+		for (sval i = 0; !pointCloud && i <tempvb->numVertices(); i++) {
 			if(i==SETSIZE*sets.size())
 				createBBSet();
 			
@@ -743,7 +1992,7 @@ void OgreBBSetFigure::commit()
 void OgreBBSetFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill,bool doubleSided) throw(RenderException) 
 {
 	critical(&mutex){
-		if(deferFill){
+		if(deferFill){ // only copy the data here, creating the cloud or billboards and changing bounds is done in the render thread
 			deleteTemp=true;
 			tempvb=new MatrixVertexBuffer(vb);
 			scene->addResourceOp(new CommitOp<OgreBBSetFigure>(this));
@@ -757,10 +2006,14 @@ void OgreBBSetFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,boo
 
 void OgreBBSetFigure::setVisible(bool isVisible)
 {
-	if(sets.size()>0){
-		if(node->numAttachedObjects()==0)
+	if(sets.size()>0 || cloud){
+		if(node->numAttachedObjects()==0){
 			for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 				node->attachObject(*i);
+
+			if(cloud)
+				node->attachObject(cloud);
+		}
 			
 		node->setVisible(isVisible);
 	}
@@ -871,80 +2124,144 @@ void OgreRibbonFigure::setCameraVisibility(const Camera* cam, bool isVisible)
 	OgreRenderTypes::setCameraVisibility(cam,bbchain,isVisible,scene);
 }
 
-std::pair<sval,planevert*> TextureVolumeRenderable::getPlaneIntersects(vec3 planept, vec3 planenorm)
+sval TextureVolumeRenderable::intersectPlane(vec3 planept,const vec3& planenorm,planevert* pts) const
 {
+	real heights[8];
+	intersect bbintersects[6]; // stores the plane intersections with the bound box as index pairs plus xi value 
+
 	for(int i=0;i<8;i++)
 		heights[i]=fig->boundcube[i].planeDist(planept,planenorm);
 
 	sval numpts=calculateHexValueIntersects(0,heights,bbintersects); // determine where the plane intersects the bound box
 		
-	// fill interpts with the position and uvw coordinates
+	// fill pts with the position and uvw coordinates
 	for(sval j=0;j<numpts;j++){
 		indexval ind1=bbintersects[j].first;
 		indexval ind2=bbintersects[j].second;
 		real lerpval=bbintersects[j].third;
 			
-		interpts[j].first=lerp(lerpval,fig->boundcube[ind1],fig->boundcube[ind2]); 
-		interpts[j].second=lerp(lerpval,fig->texcube[ind1],fig->texcube[ind2]); 
+		pts[j].first=lerp(lerpval,fig->boundcube[ind1],fig->boundcube[ind2]); 
+		pts[j].second=lerp(lerpval,fig->texcube[ind1],fig->texcube[ind2]); 
 			
 		if(j==0) // choose the first position as the point on the plane to order with
-			planept=interpts[j].first;
+			planept=pts[j].first;
 		else // move the added vertex up to the correct position in the list to maintain clockwise circular ordering
-			for(sval jj=j;jj>0 && planept.planeOrder(planenorm,interpts[jj].first,interpts[jj-1].first)>0;jj--)
-				bswap(interpts[jj],interpts[jj-1]);
+			for(sval jj=j;jj>0 && planept.planeOrder(planenorm,pts[jj].first,pts[jj-1].first)>0;jj--)
+				bswap(pts[jj],pts[jj-1]);
 	}
 
-	return std::pair<sval,planevert*>(numpts,interpts);
+	return numpts;
 }
 
-void TextureVolumeRenderable::_updateRenderQueue(Ogre::RenderQueue* queue)
+std::pair<sval,planevert*> TextureVolumeRenderable::getPlaneIntersects(vec3 planept, vec3 planenorm)
 {
-	sval numplanes=fig->numplanes; // number of planes to render
-	vec3 center=fig->bbcenter; // bound box center
-	real radius=fig->bbradius; // bound box radius
-	rotator camrot=fig->getRotation(true).inverse()*lastCamRot; // get the rotation of the current camera relative to the figure's rotation
-	vec3 figscale=fig->getScale(true).inv(); // get the inverse of the figure's scaling values
+	sval numpts=intersectPlane(planept,planenorm,interpts);
+	return std::pair<sval,planevert*>(numpts,interpts);
+}
 
-	vec3 camdir=((vec3(0,0,1)*camrot)*figscale).norm(); // get the direction of the camera in the figure's local space
-					
-	float norm[3]; // store the plane norm (camera direction opposite) as a float 3-vector
-	(camdir*-1).setBuff(norm);
+/// Number of steps per unit the camera direction components are rounded to, slices are only rebuilt when the rounded direction changes
+static const sval SliceDirSteps=128;
 
-	if(scene!=NULL && !scene->getRenderHighQuality()) // if not rendering high quality, render with a quarter of the specified number of planes
-		numplanes=_max<sval>(100,numplanes/4);
-	
-	real radstep=(2.0*radius)/numplanes; // distance between planes
-				
-	vertices.setN(0);
-	indices.setN(0);
-	
-	// for each plane, determine where it intersects the bound box, sort those points, and store them with uvw coordinates and triangle indices
-	for(sval i=0;i<numplanes;i++){
-		vec3 planept=center+camdir*(i*radstep-radius); // center of plane
-
-		std::pair<sval,planevert*> result=getPlaneIntersects(planept,camdir); // get the intersection of the given plane with the volume
-		sval numpts=result.first;
-		sval startind=sval(vertices.n());
-
-		for(sval j=0;j<numpts;j++){ // store vertex information
-			OgreBaseRenderable::Vertex v;
-			interpts[j].first.setBuff(v.pos);
-			interpts[j].second.setBuff(v.tex);
-			v.norm[0]=norm[0];
-			v.norm[1]=norm[1];
-			v.norm[2]=norm[2];
-			v.col=fig->vertexcol;
-			vertices.append(v);
+/// Number of planes above which slice geometry is calculated using multiple threads
+static const sval ParallelSliceThreshold=256;
+
+/// Maximum number of vertices and triangles a plane's intersection with a box can have, a hexagon fanned into 4 triangles
+static const sval SliceMaxVerts=6;
+static const sval SliceMaxTris=4;
+
+/**
+ * Calculates the polygon of each slice plane into its own fixed sized block of the vertex and index arrays, each item being
+ * a plane. The triangle indices of each block are relative to its first vertex, compactSlices() removes the unused gaps after.
+ */
+class SlicePlaneTask : public ParallelTask
+{
+public:
+	const TextureVolumeRenderable* rend;
+	vec3 center, camdir;
+	real radius, radstep;
+	float norm[3];
+	rgba col;
+	OgreBaseRenderable::Vertex* verts;
+	indexval* inds;
+	std::vector<sval> counts;
+
+	SlicePlaneTask(const TextureVolumeRenderable* rend,sval numplanes,OgreBaseRenderable::Vertex* verts,indexval* inds) :
+		rend(rend), radius(0), radstep(0), col(0), verts(verts), inds(inds), counts(numplanes,0)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		planevert pts[SliceMaxVerts];
+
+		for(sval i=start;i<end;i++){
+			vec3 planept=center+camdir*(i*radstep-radius); // center of plane
+			sval numpts=rend->intersectPlane(planept,camdir,pts); // get the intersection of the given plane with the volume
+			OgreBaseRenderable::Vertex* v=verts+i*SliceMaxVerts;
+			indexval* ind=inds+i*SliceMaxTris*3;
+
+			counts[i]=numpts;
+
+			for(sval j=0;j<numpts;j++){ // store vertex information
+				pts[j].first.setBuff(v[j].pos);
+				pts[j].second.setBuff(v[j].tex);
+				v[j].norm[0]=norm[0];
+				v[j].norm[1]=norm[1];
+				v[j].norm[2]=norm[2];
+				v[j].col=col;
+			}
+
+			// store triangle indices, because the vertices are in a circular order we can easily make a triangle fan
+			for(sval j=0;(j+2)<numpts;j++,ind+=3){ // use (j+2) instead of (numpts-2) in case numpts is 0
+				ind[0]=0;
+				ind[1]=j+1;
+				ind[2]=j+2;
+			}
 		}
-				
-		// store triangle indices, because the vertices are in a circular order we can easily make a triangle fan
-		for(sval j=0;(j+2)<numpts;j++){ // there are 2 fewer indices than there are vertices hence (j+2), use this instead of (numpts-2) in case numpts is 0
-			indices.append(startind,0);
-			indices(indices.n()-1,1)=startind+j+1;
-			indices(indices.n()-1,2)=startind+j+2;
+	}
+
+	/// Move the planes' geometry into contiguous ranges of the arrays in plane order, returns the vertex and triangle counts
+	std::pair<sval,sval> compactSlices()
+	{
+		sval numverts=0, numtris=0;
+
+		for(sval i=0;i<counts.size();i++){
+			sval numpts=counts[i], ntris=numpts>2 ? numpts-2 : 0;
+			const indexval* ind=inds+i*SliceMaxTris*3;
+
+			if(numverts!=i*SliceMaxVerts) // ranges only move down so copying forwards is safe
+				memmove(verts+numverts,verts+i*SliceMaxVerts,numpts*sizeof(OgreBaseRenderable::Vertex));
+
+			for(sval j=0;j<ntris*3;j++)
+				inds[numtris*3+j]=ind[j]+numverts;
+
+			numverts+=numpts;
+			numtris+=ntris;
 		}
+
+		return std::pair<sval,sval>(numverts,numtris);
 	}
-	
+};
+
+void TextureVolumeRenderable::buildSlices(const vec3& camdir,sval numplanes)
+{
+	// size the stores for the most geometry the planes can have, this only allocates when the number of planes grows
+	vertices.setN(numplanes*SliceMaxVerts);
+	indices.setN(numplanes*SliceMaxTris);
+
+	SlicePlaneTask task(this,numplanes,vertices.dataPtr(),indices.dataPtr());
+	task.center=fig->bbcenter; // bound box center
+	task.radius=fig->bbradius; // bound box radius
+	task.radstep=(2.0*task.radius)/numplanes; // distance between planes
+	task.camdir=camdir;
+	task.col=fig->vertexcol;
+	(camdir*-1).setBuff(task.norm); // store the plane norm (camera direction opposite) as a float 3-vector
+
+	runParallelTask(&task,numplanes,numplanes>=ParallelSliceThreshold ? getProcessorCount() : 1);
+
+	std::pair<sval,sval> counts=task.compactSlices();
+	vertices.setN(counts.first);
+	indices.setN(counts.second);
+
 	// fill the vertex and index buffers
 	if(vertices.n()==0) // if no points fill the buffer with trivial data
 		fillDefaultData();
@@ -952,6 +2269,36 @@ void TextureVolumeRenderable::_updateRenderQueue(Ogre::RenderQueue* queue)
 		createBuffers(vertices.n(),indices.n()*3);
 		commitMatrices(&vertices,&indices);
 	}
+}
+
+void TextureVolumeRenderable::_updateRenderQueue(Ogre::RenderQueue* queue)
+{
+	sval numplanes=fig->numplanes; // number of planes to render
+	rotator camrot=fig->getRotation(true).inverse()*lastCamRot; // get the rotation of the current camera relative to the figure's rotation
+	vec3 figscale=fig->getScale(true).inv(); // get the inverse of the figure's scaling values
+
+	vec3 camdir=((vec3(0,0,1)*camrot)*figscale).norm(); // get the direction of the camera in the figure's local space
+
+	if(scene!=NULL && !scene->getRenderHighQuality()) // if not rendering high quality, render with a quarter of the specified number of planes
+		numplanes=_max<sval>(100,numplanes/4);
+
+	int key[3]={ 
+		int(floor(camdir.x()*SliceDirSteps+0.5)), 
+		int(floor(camdir.y()*SliceDirSteps+0.5)), 
+		int(floor(camdir.z()*SliceDirSteps+0.5)) 
+	};
+
+	// rebuild the slices only if the quantized direction, number of planes, or the volume itself has changed
+	if(!sliceValid || numplanes!=sliceNumPlanes || key[0]!=sliceKey[0] || key[1]!=sliceKey[1] || key[2]!=sliceKey[2]){
+		sliceValid=true; // set before building so that an invalidation during the build isn't lost
+		sliceNumPlanes=numplanes;
+		sliceKey[0]=key[0];
+		sliceKey[1]=key[1];
+		sliceKey[2]=key[2];
+
+		// slice along the quantized direction so that the geometry is the same for every camera direction with this key
+		buildSlices(vec3(key[0],key[1],key[2]).norm(),numplanes);
+	}
 	
 	OgreBaseRenderable::_updateRenderQueue(queue);
 }
@@ -970,8 +2317,126 @@ OgreTextureVolumeFigure::OgreTextureVolumeFigure(const std::string &name,const s
 	setAlpha(1.0);
 }
 
+bool GlyphRenderable::supportsInstancing() const
+{
+	Ogre::RenderSystem* rs=Ogre::Root::getSingleton().getRenderSystem();
+
+	if(!rs || !rs->getCapabilities()->hasCapability(Ogre::RSC_VERTEX_BUFFER_INSTANCE_DATA) || mat.isNull() || mat->getNumTechniques()==0)
+		return false;
+
+	Ogre::Technique* tech=mat->getTechnique(0);
+
+	// without a vertex program every instance would be drawn at the origin untransformed
+	return tech->getNumPasses()>0 && tech->getPass(0)->hasVertexProgram();
+}
+
+void GlyphRenderable::createBuffers(size_t numVerts,size_t numInds,bool deferCreate)
+{
+	OgreBaseRenderable::createBuffers(numVerts,numInds,deferCreate);
+
+	if(deferCreate){ // move the staged instances into the back fill, leaving the fill's cleared storage to be reused
+		GlyphFillBuffer* fill=(GlyphFillBuffer*)backFill;
+		fill->instanced=instanced;
+		fill->instances.swap(localInstBuff);
+		localInstBuff.clear();
+		return;
+	}
+
+	if(vertexData==NULL)
+		return;
+
+	// take the instances from the fill being committed in the render thread, otherwise from the local buffer
+	GlyphFillBuffer* fill=(GlyphFillBuffer*)committingFill;
+	bool useInstances=fill ? fill->instanced : instanced;
+	std::vector<Instance>& instances=fill ? fill->instances : localInstBuff;
+	size_t numInstances=fill ? instances.size() : _numInstances;
+
+	Ogre::VertexDeclaration* decl = vertexData->vertexDeclaration;
+	Ogre::VertexBufferBinding* binding = vertexData->vertexBufferBinding;
+	bool hasInstanceDecl=decl->findElementBySemantic(Ogre::VES_TEXTURE_COORDINATES,1)!=NULL;
+
+	if(!useInstances || numInstances==0){ // remove the instance buffer and its declaration if present, the buffers may be reused
+		if(hasInstanceDecl)
+			for(unsigned short i=1;i<=4;i++)
+				decl->removeElement(Ogre::VES_TEXTURE_COORDINATES,i);
+
+		if(binding->isBufferBound(1))
+			binding->unsetBinding(1);
+
+		instBuf.setNull();
+		return;
+	}
+
+	if(!hasInstanceDecl){ // define the instance elements to match GlyphRenderable::Instance
+		size_t offset = 0;
+		decl->addElement(1, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES, 1);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+		decl->addElement(1, offset, Ogre::VET_FLOAT4, Ogre::VES_TEXTURE_COORDINATES, 2);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT4);
+		decl->addElement(1, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES, 3);
+		offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+		decl->addElement(1, offset, Ogre::VET_FLOAT4, Ogre::VES_TEXTURE_COORDINATES, 4);
+	}
+
+	if(instBuf.isNull() || instBuf->getNumVertices()!=numInstances){
+		instBuf=Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(sizeof(Instance),numInstances,vertexBufferUsage);
+		instBuf->setIsInstanceData(true);
+		instBuf->setInstanceDataStepRate(1);
+	}
+
+	binding->setBinding(1,instBuf); // rebind in case the vertex data was recreated
+
+	if(instances.size()==numInstances){ // commit the staged instances, one write replaces the whole buffer
+		FrameProfiler* profiler=scene ? scene->getProfiler() : NULL;
+
+		instBuf->writeData(0,numInstances*sizeof(Instance),&instances[0],true);
+
+		if(profiler)
+			profiler->addUpload(numInstances*sizeof(Instance));
+
+		if(!fill) // free the local buffer, a fill's storage is kept for reuse
+			std::vector<Instance>().swap(localInstBuff);
+	}
+}
+
+void GlyphRenderable::destroyBuffers()
+{
+	OgreBaseRenderable::destroyBuffers();
+	instBuf.setNull();
+}
+
+void GlyphRenderable::getRenderOperation(Ogre::RenderOperation& op)
+{
+	OgreBaseRenderable::getRenderOperation(op);
+	op.numberOfInstances = instBuf.isNull() ? 1 : instBuf->getNumVertices(); // the buffer size is what was last committed
+}
+
+/// Get the position, rotation, scale, and color of glyph `g' defined by the vertex buffer `vb'
+static void getGlyphInstance(const VertexBuffer* vb,sval g,const vec3& glyphscale,vec3& pos,rotator& rot,vec3& scale,color& col)
+{
+	vec3 dir(0,0,1);
+
+	pos=vb->getVertex(g);
+	scale=glyphscale;
+	col=color();
+
+	if(vb->hasNormal())
+		dir=vb->getNormal(g);
+
+	if(dir.isZero()) // make glyph really small
+		scale=scale*0.05;
+	
+	if(vb->hasUVWCoord())
+		scale=scale*vb->getUVWCoord(g);
+
+	if(vb->hasColor())
+		col=vb->getColor(g);
+
+	rot=rotator(vec3(0,0,1),dir);
+}
+
 OgreGlyphFigure::OgreGlyphFigure(const std::string& name,const std::string & matname,OgreRenderScene *scene) throw(RenderException)
-	: OgreBaseFigure(new OgreBaseRenderable(name,matname,convert(FT_TRILIST),scene->mgr),scene->createNode(name),scene),glyphscale(1),glyphname("sphere")
+	: OgreBaseFigure(new GlyphRenderable(name,matname,scene->mgr),scene->createNode(name),scene),glyphscale(1),glyphname("sphere"),instanced(false)
 {
 	OgreGlyphFigure::fillDefaultGlyphs(glyphs);
 }
@@ -1041,27 +2506,109 @@ void OgreGlyphFigure::fillDefaultGlyphs(glyphmap &map)
 	map["arrow"]=glyphmesh(new Vec3Matrix("arrownodes","",(vec3*)arrownodes,32,1),new Vec3Matrix("arrownorms","",(vec3*)arrownorms,32,1),new IndexMatrix("arrowinds","",(indexval*)arrowinds,36,3));
 }
 
+void OgreGlyphFigure::fillInstanced(const VertexBuffer* vb,const glyphmesh& gmesh,bool deferFill)
+{
+	const Vec3Matrix* gverts=gmesh.first;
+	const Vec3Matrix* gnorms=gmesh.second;
+	const IndexMatrix* ginds=gmesh.third;
+
+	sval numverts=gverts->n(), numinds=ginds->n(), numglyphs=vb->numVertices();
+	bool commitMesh=!obj->isMeshCommitted(glyphname,numverts,numinds*3);
+	real glyphrad=0;
+
+	for(sval v=0;v<numverts;v++)
+		glyphrad=_max(glyphrad,gverts->at(v).len());
+
+	// fill the instances first since they are committed by createBuffers() if not deferring
+	GlyphRenderable::Instance* ibuf=obj->getLocalInstBuff(numglyphs);
+	vec3 minv=vb->getVertex(0), maxv=vb->getVertex(0);
+
+	for(sval g=0;g<numglyphs;g++){
+		vec3 pos,scale;
+		rotator rot;
+		color col;
+		GlyphRenderable::Instance &inst=ibuf[g];
+
+		getGlyphInstance(vb,g,glyphscale,pos,rot,scale,col);
+
+		vec3 ext=vec3(scale.abs().len()*glyphrad); // rotation agnostic bound of the transformed glyph
+		minv.setMinVals(pos-ext);
+		maxv.setMaxVals(pos+ext);
+
+		pos.setBuff(inst.pos);
+		scale.setBuff(inst.scale);
+		col.setBuff(inst.col);
+		inst.rot[0]=float(rot.x());
+		inst.rot[1]=float(rot.y());
+		inst.rot[2]=float(rot.z());
+		inst.rot[3]=float(rot.w());
+	}
+
+	obj->createBuffers(numverts,numinds*3,deferFill);
+
+	if(commitMesh){ // the glyph mesh is only filled when it or the buffers have changed, color comes from the instances
+		OgreBaseRenderable::Vertex *vbuf=obj->getLocalVertBuff();
+		indexval *indbuf=obj->getLocalIndBuff();
+
+		for(sval v=0;v<numverts;v++){
+			gverts->at(v).setBuff(vbuf[v].pos);
+			gnorms->at(v).setBuff(vbuf[v].norm);
+			vec3().setBuff(vbuf[v].tex);
+			vbuf[v].col=0xffffffff;
+		}
+
+		for(sval i=0;i<numinds;i++){
+			indbuf[i*3]=ginds->at(i,0);
+			indbuf[i*3+1]=ginds->at(i,1);
+			indbuf[i*3+2]=ginds->at(i,2);
+		}
+
+		obj->setCommittedMesh(glyphname,numverts,numinds*3);
+	}
+
+	if(!deferFill){ // if not deferring to render time, commit the buffers now and delete the local buffers
+		obj->commitBuffers();
+		obj->deleteLocalIndBuff();
+		obj->deleteLocalVertBuff();
+	}
+
+	obj->setBoundingBox(minv,maxv);
+}
+
 void OgreGlyphFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill,bool doubleSided) throw(RenderException)
 {
 	Ogre::RenderSystem* rs=Ogre::Root::getSingleton().getRenderSystem();
 
 	glyphmap::const_iterator iglyph=glyphs.find(glyphname);
 
-	// ensure that only one operation can be performed on the buffers at a time, this will force the renderer to wait if needed
-	critical(obj->getMutex()){
+	// ensure that only one fill is performed at a time, a deferred fill is published for the renderer when the block exits
+	fillscope(obj){
+		obj->setInstanced(instanced && obj->supportsInstancing()); // fall back on filling a mesh per glyph if instancing isn't possible
+
 		if(vb->numVertices()==0 || iglyph==glyphs.end()){
+			obj->clearInstances();
+			obj->setCommittedMesh("");
 			obj->fillDefaultData(deferFill);
 			node->needUpdate();
 			return;
 		}
 
 		const glyphmesh gmesh=(*iglyph).second;
+
+		if(obj->isInstanced()){
+			fillInstanced(vb,gmesh,deferFill);
+			node->needUpdate();
+			return;
+		}
+
 		const Vec3Matrix* gverts=gmesh.first;
 		const Vec3Matrix* gnorms=gmesh.second;
 		const IndexMatrix* ginds=gmesh.third;
 
 		sval numverts=gverts->n(), numinds=ginds->n();
 
+		obj->clearInstances();
+		obj->setCommittedMesh("");
 		obj->createBuffers(vb->numVertices()*numverts,vb->numVertices()*numinds*3,deferFill);
 
 		vec3 minv=vb->getVertex(0), maxv=vb->getVertex(0);
@@ -1071,21 +2618,12 @@ void OgreGlyphFigure::fillData(const VertexBuffer* vb, const IndexBuffer* ib,boo
 		indexval *ibuf=obj->getLocalIndBuff();
 
 		for (sval g = 0; g < vb->numVertices(); g++) {
-			vec3 pos = vb->getVertex(g),dir(0,0,1),scale=glyphscale;
+			vec3 pos,scale;
+			rotator rot;
 			color col;
 
-			if(vb->hasNormal())
-				dir=vb->getNormal(g);
-				if(dir.isZero()) // make glyph really small
-					scale=scale*0.05;
-			
-			if(vb->hasUVWCoord())
-				scale=scale*vb->getUVWCoord(g);
+			getGlyphInstance(vb,g,glyphscale,pos,rot,scale,col);
 
-			if(vb->hasColor())
-				col=vb->getColor(g);
-				
-			rotator rot(vec3(0,0,1),dir);
 			transform trans(pos,scale,rot);
 
 			sval vstart=numverts*g;
@@ -1322,9 +2860,12 @@ OgreTexture::~OgreTexture()
 void OgreTexture::commit()
 {
 	if(buffer){
+		ProfileScope scope(scene->getProfiler(),&FrameStats::textureTime);
 		Ogre::PixelBox pb=getPixelBuffer();
+
 		ptr->getBuffer()->blitFromMemory(pb);
-		SAFE_DELETE(buffer);
+		scene->getProfiler()->addUpload(sizeBytes);
+		SAFE_DELETE_ARRAY(buffer);
 	}
 }
 
@@ -1332,68 +2873,351 @@ void OgreTexture::fillBlack()
 {
 	getPixelBuffer();
 	memset(buffer,0,sizeBytes);
-	scene->addResourceOp(new CommitOp<OgreTexture>(this));
+	scene->addResourceOp(new CommitOp<OgreTexture>(this,sizeBytes));
+}
+
+/// Convert a unit value to a fixed point integer of `bits' bits the same way as Ogre::Bitwise::floatToFixed
+static inline u32 unitToFixed(float val, sval bits)
+{
+	return val<=0.0f ? 0 : (val>=1.0f ? (1u<<bits)-1 : u32(val*float(1u<<bits)));
+}
+
+/// Pack a row of `width' RGBA float colors in `cols' into `dest' with format F, specializations exist for the TextureFormat types
+template<Ogre::PixelFormat F> 
+static void packTexelRow(u8* dest, const float* cols, sval width);
+
+template<> void packTexelRow<Ogre::PF_A8R8G8B8>(u8* dest, const float* cols, sval width)
+{
+	u32* d=(u32*)dest;
+	for(sval x=0;x<width;x++,cols+=4)
+		d[x]=(unitToFixed(cols[3],8)<<24)|(unitToFixed(cols[0],8)<<16)|(unitToFixed(cols[1],8)<<8)|unitToFixed(cols[2],8);
+}
+
+template<> void packTexelRow<Ogre::PF_R8G8B8A8>(u8* dest, const float* cols, sval width)
+{
+	u32* d=(u32*)dest;
+	for(sval x=0;x<width;x++,cols+=4)
+		d[x]=(unitToFixed(cols[0],8)<<24)|(unitToFixed(cols[1],8)<<16)|(unitToFixed(cols[2],8)<<8)|unitToFixed(cols[3],8);
+}
+
+template<> void packTexelRow<Ogre::PF_R8G8B8>(u8* dest, const float* cols, sval width)
+{
+	for(sval x=0;x<width;x++,cols+=4,dest+=3){ // 24-bit native endian value with red in the most significant byte
+#if OGRE_ENDIAN == OGRE_ENDIAN_BIG
+		dest[0]=u8(unitToFixed(cols[0],8));
+		dest[1]=u8(unitToFixed(cols[1],8));
+		dest[2]=u8(unitToFixed(cols[2],8));
+#else
+		dest[0]=u8(unitToFixed(cols[2],8));
+		dest[1]=u8(unitToFixed(cols[1],8));
+		dest[2]=u8(unitToFixed(cols[0],8));
+#endif
+	}
+}
+
+template<> void packTexelRow<Ogre::PF_L8>(u8* dest, const float* cols, sval width)
+{
+	for(sval x=0;x<width;x++,cols+=4)
+		dest[x]=u8(unitToFixed(cols[0],8));
+}
+
+template<> void packTexelRow<Ogre::PF_L16>(u8* dest, const float* cols, sval width)
+{
+	u16* d=(u16*)dest;
+	for(sval x=0;x<width;x++,cols+=4)
+		d[x]=u16(unitToFixed(cols[0],16));
 }
 
+template<> void packTexelRow<Ogre::PF_A8>(u8* dest, const float* cols, sval width)
+{
+	for(sval x=0;x<width;x++,cols+=4)
+		dest[x]=u8(unitToFixed(cols[3],8));
+}
+
+template<> void packTexelRow<Ogre::PF_A4L4>(u8* dest, const float* cols, sval width)
+{
+	for(sval x=0;x<width;x++,cols+=4)
+		dest[x]=u8((unitToFixed(cols[3],4)<<4)|unitToFixed(cols[0],4));
+}
+
+/// Write the row of colors `cols' into row `y' of slice `z' of `pb', known formats are packed directly otherwise setColourAt() is used
+static void writeTexelRow(const Ogre::PixelBox& pb, sval y, sval z, const float* cols, sval width)
+{
+	u8* dest=((u8*)pb.data)+(y*pb.rowPitch+z*pb.slicePitch)*Ogre::PixelUtil::getNumElemBytes(pb.format);
+
+	switch(pb.format){
+	case Ogre::PF_A8R8G8B8 : packTexelRow<Ogre::PF_A8R8G8B8>(dest,cols,width); break;
+	case Ogre::PF_R8G8B8A8 : packTexelRow<Ogre::PF_R8G8B8A8>(dest,cols,width); break;
+	case Ogre::PF_R8G8B8   : packTexelRow<Ogre::PF_R8G8B8>(dest,cols,width); break;
+	case Ogre::PF_L8       : packTexelRow<Ogre::PF_L8>(dest,cols,width); break;
+	case Ogre::PF_L16      : packTexelRow<Ogre::PF_L16>(dest,cols,width); break;
+	case Ogre::PF_A8       : packTexelRow<Ogre::PF_A8>(dest,cols,width); break;
+	case Ogre::PF_A4L4     : packTexelRow<Ogre::PF_A4L4>(dest,cols,width); break;
+	default:
+		for(sval x=0;x<width;x++,cols+=4)
+			pb.setColourAt(Ogre::ColourValue(cols[0],cols[1],cols[2],cols[3]),x,y,z);
+	}
+}
+
+/// Number of texels above which texture fills are split between threads
+static const sval ParallelFillThreshold=65536;
+
+/**
+ * Fills rows of a texture's pixel buffer from a solid color, a ColorMatrix, or a value matrix with an optional spectrum lookup
+ * table and alpha matrix. Each item is a row, for solid fills these are numbered over every slice otherwise within `depth'.
+ * Value matrices are read through readValueRow() which TextureValueFillTask implements for each image matrix type.
+ */
+class TextureFillTask : public ParallelTask
+{
+public:
+	Ogre::PixelBox pb;
+	sval width, height, depth;
+	color fillcol;
+	const ColorMatrix* cmat;
+	bool hasValues;
+	const RealMatrix* alphamat;
+	const Material* colormat;
+	std::vector<color> lut;
+	real minval, maxval;
+	bool mulAlpha;
+
+	TextureFillTask(const Ogre::PixelBox& pb, sval width, sval height, sval depth) : pb(pb), width(width), height(height), depth(depth),
+		cmat(NULL), hasValues(false), alphamat(NULL), colormat(NULL), minval(0), maxval(1), mulAlpha(false)
+	{}
+
+	/// Read the first `width' values of row `y' of the value matrix into `vals'
+	virtual void readValueRow(real* vals, sval y) const {}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		std::vector<float> row(width*4);
+		std::vector<real> vals(hasValues ? width : 0);
+		float* cols=&row[0];
+
+		if(!cmat && !hasValues)
+			for(sval x=0;x<width;x++)
+				fillcol.setBuff(&cols[x*4]);
+
+		for(sval r=start;r<end;r++){
+			sval y=r%height, z=(cmat || hasValues) ? depth : r/height;
+
+			if(cmat)
+				for(sval x=0;x<width;x++)
+					cmat->at(y,x).setBuff(&cols[x*4]);
+			else if(hasValues){
+				readValueRow(&vals[0],y);
+				valuesToColors(cols,&vals[0],width,minval,maxval,colormat,lut,alphamat ? &alphamat->at(y,0) : NULL,mulAlpha);
+			}
+
+			writeTexelRow(pb,y,z,cols,width);
+		}
+	}
+
+	void fill(sval numRows)
+	{
+		sval numThreads=numRows*width>=ParallelFillThreshold ? getProcessorCount() : 1;
+		runParallelTask(this,numRows,numThreads);
+	}
+};
+
+/// Fills a texture from the values of a matrix of type Matrix<T>
+template<typename T>
+class TextureValueFillTask : public TextureFillTask
+{
+public:
+	const Matrix<T>* mat;
+
+	TextureValueFillTask(const Ogre::PixelBox& pb, sval width, sval height, sval depth, const Matrix<T>* mat) : 
+		TextureFillTask(pb,width,height,depth), mat(mat)
+	{
+		hasValues=true;
+	}
+
+	virtual void readValueRow(real* vals, sval y) const
+	{
+		const T* row=&mat->at(y,0);
+		for(sval x=0;x<width;x++)
+			vals[x]=real(row[x]);
+	}
+};
+
 void OgreTexture::fillColor(color col)
 {
 	sval w=getWidth();
 	sval h=getHeight();
 	sval d=getDepth();
-	Ogre::ColourValue cv=convert(col);
-	Ogre::PixelBox pb=getPixelBuffer();
-	
-	for(sval z=0;z<d;z++)
-		for(sval y=0;y<h;y++)
-			for(sval x=0;x<w;x++)
-				pb.setColourAt(cv,x,y,z);
+	TextureFillTask task(getPixelBuffer(),w,h,0);
+
+	task.fillcol=col;
+	task.fill(h*d);
 	
-	scene->addResourceOp(new CommitOp<OgreTexture>(this));
+	scene->addResourceOp(new CommitOp<OgreTexture>(this,sizeBytes));
 }
 
 void OgreTexture::fillColor(const ColorMatrix *mat,indexval depth)
 {
 	sval w=_min(getWidth(),mat->m());
 	sval h=_min(getHeight(),mat->n());
-	Ogre::PixelBox pb=getPixelBuffer();
 
-	for(sval y=0;y<h;y++)
-		for(sval x=0;x<w;x++)
-			pb.setColourAt(convert(mat->at(y,x)),x,y,depth);
+	if(depth>=getDepth())
+		return;
+
+	TextureFillTask task(getPixelBuffer(),w,h,depth);
 
-	scene->addResourceOp(new CommitOp<OgreTexture>(this));
+	task.cmat=mat;
+	task.fill(h);
+
+	scene->addResourceOp(new CommitOp<OgreTexture>(this,sizeBytes));
 }
 
-void OgreTexture::fillColor(const RealMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
+template<typename T>
+void OgreTexture::fillValues(const Matrix<T> *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
 {
 	sval w=_min(getWidth(),mat->m());
 	sval h=_min(getHeight(),mat->n());
-	Ogre::PixelBox pb=getPixelBuffer();
-	Ogre::ColourValue col;
 
-	for(sval y=0;y<h;y++)
-		for(sval x=0;x<w;x++){
-			real val=lerpXi(mat->at(y,x),minval,maxval);
-			
-			if(colormat!=NULL){
-				color c=colormat->interpolateColor(val);
-				c.setBuff(&col.r);
+	if(depth>=getDepth())
+		return;
+
+	TextureValueFillTask<T> task(getPixelBuffer(),w,h,depth,mat);
+
+	// use the spectrum's lookup table if it's cheaper than calling interpolateColor() for every texel
+	if(colormat!=NULL && w*h>Spectrum::LUTSize)
+		colormat->lookupTable(task.lut);
+
+	task.minval=minval;
+	task.maxval=maxval;
+	task.colormat=colormat;
+	task.alphamat=alphamat;
+	task.mulAlpha=mulAlpha;
+	task.fill(h);
+
+	scene->addResourceOp(new CommitOp<OgreTexture>(this,sizeBytes));
+}
+
+void OgreTexture::fillColor(const RealMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
+{
+	fillValues(mat,depth,minval,maxval,colormat,alphamat,mulAlpha);
+}
+
+void OgreTexture::fillColor(const FloatMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
+{
+	fillValues(mat,depth,minval,maxval,colormat,alphamat,mulAlpha);
+}
+
+void OgreTexture::fillColor(const UShortMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
+{
+	fillValues(mat,depth,minval,maxval,colormat,alphamat,mulAlpha);
+}
+
+void OgreTexture::fillColor(const ShortMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha)
+{
+	fillValues(mat,depth,minval,maxval,colormat,alphamat,mulAlpha);
+}
+
+/// Orders ResourceOp objects by decreasing priority
+static bool compareOpPriority(const ResourceOp* a, const ResourceOp* b)
+{
+	return a->priority>b->priority;
+}
+
+void OgreRenderScene::sortIncomingOps()
+{
+	std::vector<ResourceOp*> ops;
+	incomingOps.popAll(ops);
+
+	for(std::vector<ResourceOp*>::iterator i=ops.begin();i!=ops.end();++i){
+		if(pendingOps.empty() || pendingOps.back()->priority>=(*i)->priority) // common case of equal priorities is a simple append
+			pendingOps.push_back(*i);
+		else // insert after all operations with greater or equal priority, keeping the order of ops of equal priority
+			pendingOps.insert(std::upper_bound(pendingOps.begin(),pendingOps.end(),*i,compareOpPriority),*i);
+	}
+}
+
+/// Merge the priority ordered queues `first' and `second' into `first', ops of equal priority in `first' coming before those in `second'
+static void mergeOpQueues(std::deque<ResourceOp*>& first, std::deque<ResourceOp*>& second)
+{
+	if(second.empty())
+		return;
+
+	std::deque<ResourceOp*> merged;
+	std::merge(first.begin(),first.end(),second.begin(),second.end(),std::back_inserter(merged),compareOpPriority); // stable
+	first.swap(merged);
+	second.clear();
+}
+
+void OgreRenderScene::applyResourceOps(bool useBudget)
+{
+	ProfileScope scope(&profiler,&FrameStats::opsTime);
+
+	useBudget=useBudget && (opsTimeBudget>0 || opsByteBudget>0);
+
+	real start=useBudget ? getWallTime() : 0;
+	size_t bytes=0;
+	sval numops=0;
+	bool overBudget=false;
+
+	critical(&sceneMutex){ // take the whole queue so the ops can be applied without holding the lock
+		sortIncomingOps();
+		mergeOpQueues(activeOps,pendingOps);
+	}
+
+	// stop at the first op once over budget, the rest stay queued in order so no op overtakes an earlier one on the same resource
+	while(!overBudget){
+		ResourceOp* rop=NULL;
+
+		// removeResourceOp() waits on `applyMutex' so an object can't be destroyed in another thread while its op is running
+		critical(&applyMutex){
+			// take each op under the lock so that removeResourceOp() can still remove those not yet applied
+			critical(&sceneMutex){
+				if(!activeOps.empty()){
+					rop=activeOps.front();
+					activeOps.pop_front();
+				}
 			}
-			else{
-				col.r=col.g=col.b=val;
-				col.a=1.0;
+
+			if(rop){
+				bytes+=rop->sizeBytes;
+				rop->op();
+				delete rop;
+				numops++;
 			}
+		}
 
-			if(alphamat!=NULL)
-				col.a=alphamat->at(y,x);
+		if(!rop)
+			break;
 
-			if(mulAlpha)
-				col.a*=val; // set alpha to the commonly desired value
+		if(useBudget)
+			overBudget=(opsTimeBudget>0 && getWallTime()-start>=opsTimeBudget) || (opsByteBudget>0 && bytes>=opsByteBudget);
+	}
 
-			pb.setColourAt(col,x,y,depth);
-		}
+	critical(&sceneMutex){ // ops left over go back ahead of any of equal priority queued since
+		mergeOpQueues(activeOps,pendingOps);
+		activeOps.swap(pendingOps);
+	}
+
+	profiler.addCount(&FrameStats::numOps,numops);
+}
+
+void OgreRenderScene::removeResourceOp(std::string parentname)
+{
+	// wait for an op being applied to finish, the mutex is recursive so destructors called by an op in the render thread don't block
+	critical(&applyMutex){
+		critical(&sceneMutex){
+			sortIncomingOps(); // ensure ops added by other threads but not yet moved are also checked
 
-	scene->addResourceOp(new CommitOp<OgreTexture>(this));
+			std::deque<ResourceOp*>* queues[2]={&activeOps,&pendingOps};
+
+			for(sval q=0;q<2;q++)
+				for(std::deque<ResourceOp*>::iterator i=queues[q]->begin();i!=queues[q]->end();)
+					if((*i)->parentname==parentname){
+						delete *i;
+						i=queues[q]->erase(i);
+					}
+					else
+						++i;
+		}
+	}
 }
 
 Camera* OgreRenderScene::createCamera(const char* name, real left, real top, real width, real height) throw(RenderException)
@@ -1608,7 +3432,7 @@ std::string OgreRenderScene::getUniqueFigureName(const std::string& name)
 	std::ostringstream os;
 	std::string uname=name;
 	
-	critical(&sceneMutex){ // ensures there's no contention when determining if a name is unique or not
+	readlock(&nodeMutex){ // ensures there's no contention when determining if a name is unique or not
 		for(int i=0;i<MAXNAMECOUNT;i++){
 			if(nmap.find(uname)==nmap.end())
 				break;
@@ -1707,7 +3531,7 @@ OgreRenderAdapter::OgreRenderAdapter(Config *config) throw(RenderException) : mg
 			s=strtok(NULL," ");
 		}
 	
-		delete pbuf;
+		delete[] pbuf;
 	
 		// fill in the render system config values
 
@@ -1818,7 +3642,12 @@ u64 OgreRenderAdapter::createWindow(int width, int height) throw(RenderTypes::Re
 void OgreRenderAdapter::paint()
 {
 	if(scene){
-		scene->applyResourceOps();
+		FrameProfiler* profiler=scene->getProfiler();
+
+		if(profiler->isEnabled())
+			profiler->beginFrame(scene->numPendingOps());
+
+		scene->applyResourceOps(true);
 		
 		if(root->_fireFrameStarted()){
 			win->update();
@@ -1828,6 +3657,8 @@ void OgreRenderAdapter::paint()
 		
 			scene->setRenderHighQuality(false);
 		}
+
+		profiler->endFrame();
 	}
 }
 
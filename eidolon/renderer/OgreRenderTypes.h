@@ -151,13 +151,23 @@ inline mat4 convert(const Ogre::Matrix4& m)
  * been deleted. Objects who may have operations pending when their destructors are called can remove them from the queue
  * using the OgreRenderScene::removeResourceOp() method in their destructors with their own names as the argument; this
  * will ensure any operation with that name as its `parentname' field will be removed before being called.
+ *
+ * Operations with higher `priority' values are applied first, those of equal priority in the order they were added. If an
+ * operation uploads data `sizeBytes' should be the approximate size. Once the scene's per-frame resource budget is exceeded
+ * the remaining operations are left in order for later frames, so operations on the same resource are never reordered.
  */
 class ResourceOp
 {
 public:
 	/// Name of parent object which created this op and whose internal state is associated with it  
 	std::string parentname; 
-	ResourceOp(std::string parentname="") : parentname(parentname) {}
+	/// Approximate number of bytes this operation uploads to the GPU
+	size_t sizeBytes;
+	/// Ordering priority, higher values are applied first
+	int priority;
+
+	ResourceOp(std::string parentname="",size_t sizeBytes=0,int priority=0) : parentname(parentname), sizeBytes(sizeBytes), priority(priority) {}
+	virtual ~ResourceOp() {}
 	/// Before each render operation, this method is called for every ResourceOp object the renderer stores, the object is deleted
 	virtual void op() {}
 };
@@ -168,7 +178,7 @@ class CommitOp : public ResourceOp
 {
 public:
 	T* obj;
-	CommitOp(T* obj) : ResourceOp(obj->getName()), obj(obj){}
+	CommitOp(T* obj,size_t sizeBytes=0,int priority=0) : ResourceOp(obj->getName(),sizeBytes,priority), obj(obj){}
 	virtual void op() { obj->commit(); }
 };
 
@@ -252,6 +262,75 @@ public:
 	}
 };
 
+/**
+ * Writes the frames of a batch capture in a background thread so that encoding and writing each frame overlaps with rendering
+ * and reading back the next ones. Frames are read into a fixed pool of buffers reused for the whole capture, the render thread
+ * waits in acquire() only when every buffer is queued to be written. Frames are saved to files named with the prefix, a 4 digit
+ * frame number, and the extension, or if the extension is ".raw" every frame is appended unencoded to the file named by the
+ * prefix so that the output can be streamed to a video encoder.
+ */
+class FrameWriter : public WorkerThread
+{
+public:
+	struct Frame
+	{
+		u8* data;
+		sval index;
+	};
+
+protected:
+	std::string fileprefix;
+	std::string extension;
+	sval width, height;
+	Ogre::PixelFormat format;
+	size_t frameSize;
+
+	/// Every buffer in the pool, each is either in `pending', `freeBufs', `available', or being filled by the render thread
+	std::vector<u8*> buffers;
+	/// Frames waiting to be written, pushed by the render thread and popped by the writer thread
+	LockFreeQueue<Frame> pending;
+	/// Buffers which have been written, pushed by the writer thread and popped into `available' by the render thread
+	LockFreeQueue<u8*> freeBufs;
+	std::vector<u8*> available;
+
+	/// Posted for every frame pushed onto `pending' and by finish(), the writer thread sleeps on this while there's nothing to write
+	Semaphore frameQueued;
+	/// Posted for every buffer pushed onto `freeBufs', acquire() sleeps on this when every buffer is in use
+	Semaphore bufferFreed;
+
+	FILE* rawFile;
+	volatile bool finished;
+	volatile sval numWritten;
+
+	Mutex mutex;
+	std::string error; // message of the first write error, once set the remaining frames are discarded
+
+	void writeFrame(const Frame& frame);
+
+public:
+	FrameWriter(const std::string& fileprefix,const std::string& extension,sval width,sval height,Ogre::PixelFormat format,sval queueSize) throw(RenderException);
+
+	virtual ~FrameWriter();
+
+	/// Returns a buffer to read the next frame into, waiting for one to be written if none are free
+	u8* acquire();
+
+	/// Queue the buffer `data' returned by acquire() to be written as frame `index'
+	void submit(u8* data,sval index);
+
+	/// Return the buffer `data' returned by acquire() to the pool without writing it, used when a frame couldn't be read
+	void release(u8* data) { available.push_back(data); }
+
+	/// Wait for every queued frame to be written and the thread to stop, returning the number written or throwing the first error
+	sval finish() throw(RenderException);
+
+	sval getWidth() const { return width; }
+	sval getHeight() const { return height; }
+	Ogre::PixelFormat getFormat() const { return format; }
+
+	virtual void run();
+};
+
 class DLLEXPORT OgreCamera: public Camera
 {
 protected:
@@ -262,10 +341,16 @@ protected:
 
 	Ogre::TexturePtr rtt_texture;
 
+	/// Writer for the batch capture begun by beginCapture(), NULL if there's none in progress
+	FrameWriter* capture;
+	TextureFormat captureFormat;
+	real captureStereo;
+	sval captureIndex;
+
 	vec3 position,lookat;
 public:
 	OgreCamera(Ogre::Camera * camera, Ogre::Viewport *port, OgreRenderScene * scene,u32 id) :
-			camera(camera), port(port), scene(scene),id(id)
+			camera(camera), port(port), scene(scene),id(id), capture(NULL), captureFormat(TF_RGB24), captureStereo(0), captureIndex(0)
 	{
 		rtt_texture.setNull();
 	}
@@ -479,6 +564,17 @@ public:
 		return new OgreImage(img);
 	}
 
+	virtual void beginCapture(const std::string& fileprefix,const std::string& extension,sval width=0,sval height=0,TextureFormat format=TF_RGB24,
+			real stereoOffset=0.0,sval queueSize=4) throw(RenderException);
+
+	virtual void captureFrame() throw(RenderException);
+
+	virtual void capturePoses(const Vec3Matrix* positions,const Vec3Matrix* lookats=NULL) throw(RenderException);
+
+	virtual sval endCapture() throw(RenderException);
+
+	virtual bool isCapturing() const { return capture!=NULL; }
+
 protected:
 	/// Render to the off-screen texture `rtt_texture' with the given parameters in stereo if `stereoOffset'>0.0
 	void renderToTexture(sval width,sval height,TextureFormat format,real stereoOffset) throw(RenderException);
@@ -869,6 +965,8 @@ public:
 };
 
 
+class ChunkRenderable;
+
 /** 
  * This is the base class for Ogre renderables used by the Figure subtypes.
  *
@@ -879,13 +977,104 @@ public:
 class OgreBaseRenderable : public Ogre::MovableObject, public Ogre::Renderable
 {
 public:
-	/// Fixed definition of a vertex used in the renderer 
-	struct Vertex
+	/// Fixed definition of a vertex used in the renderer, this is PackedVertex so that matrices of these can be committed directly
+	typedef PackedVertex Vertex;
+
+	/** 
+	 * Flags stating which optional components are stored in the hardware vertex buffer, position and color are always present.
+	 * Local data is always stored as Vertex and converted to the hardware layout when committed unless the format is VF_FULL.
+	 */
+	enum VertexFormat
+	{
+		VF_NORMAL=1,       /// normals as 3 floats
+		VF_PACKEDNORMAL=2, /// normals as 4 normalized shorts, this takes precedence over VF_NORMAL
+		VF_TEXCOORD=4,     /// 3D texture coordinates as 3 floats
+		VF_FULL=VF_NORMAL|VF_TEXCOORD /// the layout of Vertex
+	};
+
+	/// Vertex count below which 16-bit index buffers are used
+	static const size_t ShortIndexLimit=65536;
+
+	/**
+	 * Data from one deferred fill operation waiting to be committed by the render thread. A producer fills the back buffer
+	 * while holding the renderable's mutex, once complete it's published as the ready buffer replacing any which the render
+	 * thread hasn't yet taken. Subtypes store extra data by overriding createFillBuffer(), commitFill() and reset().
+	 */
+	struct FillBuffer
+	{
+		size_t numVertices;
+		size_t numIndices;
+		std::vector<Vertex> verts;
+		std::vector<indexval> inds;
+		/// True if `verts' or `inds' were filled, otherwise the hardware buffer contents are left as they are
+		bool hasVerts, hasInds;
+		/// Matrices to commit directly instead of `verts' and `inds', these are not owned by this object
+		const Matrix<Vertex>* matVerts;
+		const IndexMatrix* matInds;
+		/// True if the matrix vertices' colors must be converted from ABGR to ARGB for the render system when committed
+		bool swapColors;
+		/// True if the default data should be committed instead of anything stored here
+		bool isDefault;
+		/// The VertexFormat flags to create the hardware buffers with
+		u32 format;
+		/// Chunks the index data is divided into, empty if the whole object is drawn at once
+		std::vector<MeshChunk> chunks;
+
+		FillBuffer() { reset(0,0); }
+		virtual ~FillBuffer() {}
+
+		/// Clear the stored data and set the sizes for the next fill, the vectors keep their storage to avoid reallocation
+		virtual void reset(size_t numVerts,size_t numInds)
+		{
+			numVertices=numVerts;
+			numIndices=numInds;
+			verts.clear();
+			inds.clear();
+			hasVerts=hasInds=false;
+			matVerts=NULL;
+			matInds=NULL;
+			swapColors=false;
+			isDefault=false;
+			format=VF_FULL;
+			chunks.clear();
+		}
+
+		/** 
+		 * Take vertex or index data from the superseded fill `old' when this fill has none of its own but is the same size,
+		 * this ensures data filled once and then left unchanged by later fills isn't lost if `old' is never committed.
+		 */
+		void carryOver(const FillBuffer& old)
+		{
+			if(isDefault || old.isDefault || numVertices!=old.numVertices || numIndices!=old.numIndices || format!=old.format)
+				return;
+
+			if(!hasVerts && !matVerts){
+				verts=old.verts;
+				hasVerts=old.hasVerts;
+				matVerts=old.matVerts;
+				swapColors=old.swapColors;
+			}
+
+			if(!hasInds && !matInds){
+				inds=old.inds;
+				hasInds=old.hasInds;
+				matInds=old.matInds;
+				chunks=old.chunks;
+			}
+		}
+	};
+
+	/** 
+	 * Locks the renderable's mutex for a fill operation and publishes any deferred fill when it goes out of scope, or discards 
+	 * it if this happens because of an exception. Use through the fillscope() macro in the same way as critical().
+	 */
+	class FillScope : public Mutex::Locker
 	{
-		float pos[3];
-		float norm[3];
-		Ogre::RGBA col;
-		float tex[3]; // 3D texture coordinates for volume textures
+		OgreBaseRenderable* obj;
+
+	public:
+		FillScope(OgreBaseRenderable* obj) : Mutex::Locker(obj->getMutex()), obj(obj) {}
+		~FillScope() { obj->publishFill(!std::uncaught_exception()); }
 	};
 
 protected:
@@ -907,8 +1096,13 @@ protected:
 	
 	Ogre::RenderOperation::OperationType _opType;
 
-	bool deferFillOp;
-	
+	/// VertexFormat flags for the next fill, set by producers
+	u32 vertFormat;
+	/// VertexFormat flags of the current hardware vertex buffer
+	u32 bufferFormat;
+	/// True if the current hardware index buffer stores 16-bit indices
+	bool shortIndices;
+
 	size_t _numVertices;
 	size_t _numIndices;
 
@@ -916,6 +1110,17 @@ protected:
 	Vertex *localVertBuff;
 	/// Index buffer in main memory used to stage data before being committed to video memory
 	indexval *localIndBuff;
+
+	/// Fill being written by a producer, this is only accessed while holding `mutex'
+	FillBuffer* backFill;
+	/// True if `backFill' was started by a deferred createBuffers() or fillDefaultData() call and so should be published
+	bool backFillActive;
+	/// Newest complete fill for the render thread to commit, exchanged atomically so neither thread waits for the other
+	FillBuffer* volatile readyFill;
+	/// Committed fill kept to be reused as the next back buffer, exchanged atomically
+	FillBuffer* volatile spareFill;
+	/// Fill being committed by commitFill(), createBuffers() takes its format and other values from this rather than members if set
+	FillBuffer* committingFill;
 	
 	Ogre::MaterialPtr mat;
 	
@@ -925,22 +1130,94 @@ protected:
 	Ogre::String movableType;
 
 	vec3 lastCamPos;
+	/// Camera given to the last _notifyCurrentCamera() call, used to cull chunks and choose their levels of detail
+	Ogre::Camera* lastCam;
 	bool depthSorting;
 
+	/// Chunks set by setChunks() for the local index buffer, committed along with it
+	std::vector<MeshChunk> localChunks;
+	/// Renderables for each chunk of the committed index buffer, these are queued instead of this object if present
+	std::vector<ChunkRenderable*> chunkRends;
+
+	/// Keyframes added or cleared since the render thread last took a batch, published like fills so neither thread waits
+	struct KeyframeBatch
+	{
+		/// New keyframes of 4 floats per vertex (position and normalized field value) in the order they were added
+		std::vector<std::vector<float> > frames;
+		/// True if clearKeyframes() was called before `frames' were added so the uploaded keyframes must be removed
+		bool clear;
+
+		KeyframeBatch() : clear(false) {}
+	};
+
+	/// Newest batch for the render thread to take, exchanged atomically and reclaimed by producers if not yet taken
+	KeyframeBatch* volatile readyKeyframes;
+	/// Batch taken by the render thread kept to be reused by the next producer, exchanged atomically
+	KeyframeBatch* volatile spareKeyframes;
+	/// Keyframes taken from batches waiting for vertex data of the same size to be committed, only used in the render thread
+	std::vector<std::vector<float> > pendingKeyframes;
+	/// Hardware buffers of the uploaded keyframes, the 4 around the current time are bound to sources KeyframeSource to KeyframeSource+3
+	std::vector<Ogre::HardwareVertexBufferSharedPtr> keyframeBufs;
+	/// Number of keyframes added so far, pending or uploaded
+	sval keyframeCount;
+	/// True if the keyframe elements are in the current vertex declaration
+	bool keyframesBound;
+	bool keyframeFields;
+	bool cubicKeyframes;
+	/// Time in keyframe units set in any thread and read by the render thread every frame
+	volatile real keyframeTime;
+	/// Bounds of every keyframe which are merged with those given to setBoundingBox()
+	Ogre::AxisAlignedBox keyframeBox;
+
+	/// CPU-side copy of the triangle centroids (3 floats per triangle) and unsorted triangle indices used for depth sorting
+	std::vector<float> sortCentroids;
+	std::vector<indexval> sortIndices;
+	/// CPU-side copy of the committed vertex positions (3 floats per vertex) so centroids can be rebuilt when only indices change
+	std::vector<float> sortPositions;
+	/// Working storage for depth sorting kept between frames to avoid reallocation
+	std::vector<float> sortDists;
+	std::vector<u16> sortKeys;
+	std::vector<u32> sortOrder, sortOrderTemp;
+	std::vector<indexval> sortedIndices;
+	/// True if sortCentroids and sortIndices correspond to what's in the hardware buffers
+	bool sortCacheValid;
+	/// True if the index buffer is sorted for the camera position lastSortCamPos (in local space)
+	bool lastSortValid;
+	vec3 lastSortCamPos;
+	/// Camera movement as a fraction of the bounding radius needed before re-sorting, 0 to sort every frame
+	real depthSortThreshold;
+
 	Mutex mutex;
 
 public:	
 	OgreBaseRenderable(const std::string& name,const std::string& matname,Ogre::RenderOperation::OperationType opType,Ogre::SceneManager *mgr) throw(RenderException);
 	
-	virtual ~OgreBaseRenderable() { destroyBuffers(); deleteLocalVertBuff(); deleteLocalIndBuff(); }
+	virtual ~OgreBaseRenderable() 
+	{ 
+		destroyBuffers(); 
+		deleteLocalVertBuff(); 
+		deleteLocalIndBuff(); 
+		delete backFill;
+		delete readyFill;
+		delete spareFill;
+		delete readyKeyframes;
+		delete spareKeyframes;
+	}
 
 	void setParentObjects(Figure *parent,OgreRenderScene *scene) { this->parent=parent; this->scene=scene; }
 
 	void setDepthSorting(bool val) { depthSorting=val; }
 
+	/// Set how far as a fraction of the bounding radius the camera must move before triangles are re-sorted
+	void setDepthSortThreshold(real val) { depthSortThreshold=_max<real>(0,val); lastSortValid=false; }
+
 	Mutex* getMutex()  { return &mutex; }
 	
-	/// Create the hardware buffers with the given number of vertices and indices (NOTE: must be executed in renderer thread)
+	/**
+	 * Create the hardware buffers with the given number of vertices and indices (NOTE: must be executed in renderer thread). If
+	 * `deferCreate' is true this instead starts a new back buffer fill with these sizes for the render thread to commit later,
+	 * the local buffer methods then refer to that fill until it's published when the enclosing fillscope() block ends.
+	 */
 	virtual void createBuffers(size_t numVerts,size_t numInds,bool deferCreate=false);
 	
 	/// Delete the hardware and local buffers (NOTE: must be executed in renderer thread)
@@ -950,19 +1227,140 @@ public:
 	virtual void getRenderOperation(Ogre::RenderOperation& op);
 	virtual void _notifyCurrentCamera(Ogre::Camera* cam);
 
-	/// Get (and allocate if needed) the local memory vertex buffer of the same size as the hardware buffer
+	/// Get (and allocate if needed) the local memory vertex buffer of the same size as the hardware buffer or the deferred fill
 	Vertex* getLocalVertBuff();
 	
-	/// Get (and allocate if needed) the local memory index buffer of the same size as the hardware buffer
+	/// Get (and allocate if needed) the local memory index buffer of the same size as the hardware buffer or the deferred fill
 	indexval* getLocalIndBuff();
+
+	/// Create a new empty fill buffer, subtypes storing extra data in their fills override this
+	virtual FillBuffer* createFillBuffer() const { return new FillBuffer(); }
+
+	/**
+	 * Make the current deferred fill, if there is one, the ready fill for the render thread to commit in its next update. This
+	 * replaces any ready fill not yet committed. If `commit' is false the fill is discarded instead. This must be called while
+	 * holding the mutex, normally by the FillScope destructor.
+	 */
+	void publishFill(bool commit=true);
+
+	/// Commit the data from `fill' to the hardware buffers (NOTE: must be executed in renderer thread)
+	virtual void commitFill(FillBuffer* fill);
 	
 	/// Copy the local buffers to the hardware buffers (NOTE: must be executed in renderer thread)
 	void commitBuffers(bool commitVert=true, bool commitInd=true);
-	/// Copy the data from matrices to the hardware buffers (NOTE: must be executed in renderer thread)
-	void commitMatrices(const Matrix<Vertex>* verts,const IndexMatrix *inds);
+
+	/** 
+	 * Copy the given arrays, which may be NULL, sized to the current buffers into the hardware buffers. If `inds' is given the
+	 * chunk renderables are replaced with those for `chunks' or removed if it's NULL (NOTE: must be executed in renderer thread).
+	 */
+	void commitData(const Vertex* verts,const indexval* inds,const std::vector<MeshChunk>* chunks=NULL);
+
+	/**
+	 * Write `num' vertices to the hardware vertex buffer converting to its format, swapping red and blue channels if `swapColors'
+	 * is true. Full format vertices without swapping are written directly (NOTE: must be executed in renderer thread).
+	 */
+	void writeVertices(const Vertex* verts,size_t num,bool swapColors=false);
+
+	/// Write `num' indices to the hardware index buffer, narrowing them if it's 16-bit (NOTE: must be executed in renderer thread)
+	void writeIndices(const indexval* inds,size_t num);
+
+
+	/**
+	 * Set the VertexFormat flags for the hardware vertex buffer created by the next fill, fills of matrices in the Vertex layout
+	 * should use VF_FULL to avoid conversion. This is only meaningful when called by producers while holding the mutex.
+	 */
+	void setVertexFormat(u32 format) { vertFormat=format; }
+	u32 getVertexFormat() const { return vertFormat; }
+
+	/// Get the size in bytes of one vertex in the hardware layout for the given VertexFormat flags
+	static size_t getVertexSize(u32 format);
+
+	/// Returns true if the current hardware index buffer stores 16-bit indices
+	bool hasShortIndices() const { return shortIndices; }
+	/** 
+	 * Copy the data from matrices to the hardware buffers (NOTE: must be executed in renderer thread). If `swapColors' is true the
+	 * red and blue channels of vertex colors are swapped, converting ABGR to ARGB, while copying into the locked buffer.
+	 */
+	void commitMatrices(const Matrix<Vertex>* verts,const IndexMatrix *inds,bool swapColors=false);
+
+	/// Set the matrices to commit in the next render cycle, createBuffers() must be called with deferCreate true beforehand
+	void setPendingMatrices(const Matrix<Vertex>* verts,const IndexMatrix *inds,bool swapColors)
+	{
+		if(backFillActive){
+			backFill->matVerts=verts; 
+			backFill->matInds=inds; 
+			backFill->swapColors=swapColors; 
+		}
+	}
 	
-	void deleteLocalVertBuff() { SAFE_DELETE(localVertBuff); }
-	void deleteLocalIndBuff() { SAFE_DELETE(localIndBuff); }
+	void deleteLocalVertBuff() { SAFE_DELETE_ARRAY(localVertBuff); }
+	void deleteLocalIndBuff() { SAFE_DELETE_ARRAY(localIndBuff); localChunks.clear(); }
+
+	/**
+	 * Replace the index data of the current fill with `inds' divided into `chunks' as computed by chunkTriangleMesh(), the
+	 * contents of both are swapped out. Each chunk is then culled and has its level of detail chosen separately when rendered,
+	 * which disables triangle depth sorting. This must be called after filling the vertices and before committing.
+	 */
+	void setChunks(std::vector<indexval>& inds,std::vector<MeshChunk>& chunks);
+
+	/// Replace the chunk renderables with ones for `chunks', or remove them if NULL (NOTE: must be executed in renderer thread)
+	void applyChunks(const std::vector<MeshChunk>* chunks);
+
+	size_t numChunks() const { return chunkRends.size(); }
+
+	/// Add `rend' to `queue' with this object's queue ID and priority
+	void addToRenderQueue(Ogre::RenderQueue* queue,Ogre::Renderable* rend);
+
+	/// Index of the custom parameter given to vertex programs as `keyframeParams', see res/keyframeVP.cg
+	static const size_t KeyframeParamIndex=0;
+
+	/**
+	 * First of the 4 vertex sources the keyframes are bound to, these are bound as TEXCOORD5 to TEXCOORD7 and TANGENT so that
+	 * they don't collide with the glyph instance buffer bound to source 1 as TEXCOORD1 to TEXCOORD4, see res/keyframeVP.cg.
+	 */
+	static const unsigned short KeyframeSource=5;
+
+	/**
+	 * Add a keyframe to be uploaded in the render thread, `frame' stores 4 floats per vertex of the figure (or half of them if
+	 * filled as double sided) and is swapped out. Each keyframe is uploaded once to its own vertex buffer, the vertex program
+	 * then blends the 4 keyframes around the current time so that animating needs only a new time value per frame.
+	 */
+	void addKeyframe(std::vector<float>& frame,bool hasField,vec3 minv,vec3 maxv);
+
+	void clearKeyframes();
+
+	/**
+	 * Publish `frame' as a new keyframe, or a request to remove every keyframe if NULL, adding it to the ready batch if the
+	 * render thread hasn't taken it yet. This must be called with `mutex' held.
+	 */
+	void publishKeyframe(std::vector<float>* frame);
+
+	sval numKeyframes() const { return keyframeCount; }
+
+	void setKeyframeTime(real t,bool cubic) { keyframeTime=t; cubicKeyframes=cubic; }
+	real getKeyframeTime() const { return keyframeTime; }
+
+	/**
+	 * Take the ready keyframe batch, upload pending keyframes and bind the buffers for the current time to the vertex data
+	 * with the blend parameters, or remove the keyframe elements if there's none matching the vertex count. This never
+	 * waits on producers. Returns true if keyframes are bound.
+	 * (NOTE: must be executed in renderer thread)
+	 */
+	bool updateKeyframes();
+
+	/**
+	 * Store the `numverts' vertex positions and `numinds' indices used for depth sorting from the given vertex and index data,
+	 * which must be the same as what's committed to the hardware buffers. If either of `verts' or `inds' is NULL the copy
+	 * stored by an earlier commit is used, so the write-only hardware buffers are never read back. The triangle centroids
+	 * are computed once both are present. If sorting isn't needed for this object the cache is cleared instead.
+	 */
+	void updateSortCache(const Vertex* verts,size_t numverts,const indexval* inds,size_t numinds);
+
+	/// Clear the depth sorting cache, sorting resumes once both buffers have been committed again
+	void clearSortCache();
+
+	/// Sort the triangles by decreasing distance from `campos' (in local space) and upload the index buffer only
+	void sortTriangles(const vec3& campos);
 
 	void fillDefaultData(bool deferFill=false);
 	
@@ -1009,12 +1407,56 @@ public:
 	virtual void setBoundingBox(vec3 minv, vec3 maxv) 
 	{ 
 		aabb.setExtents(convert(minv),convert(maxv)); 
+		aabb.merge(keyframeBox);
 		boundRad=Ogre::Math::boundingRadiusFromAABB(aabb);
 	}
 	
-	virtual void visitRenderables(Ogre::Renderable::Visitor* visitor, bool debugRenderables) { visitor->visit(this, 0, false); }
+	virtual void visitRenderables(Ogre::Renderable::Visitor* visitor, bool debugRenderables);
+};
+
+/**
+ * Renderable for one chunk of an OgreBaseRenderable's triangles, sharing its vertex and index buffers but drawing only the
+ * range of indices for the level of detail chosen by update(). These are owned and queued by the parent renderable.
+ */
+class ChunkRenderable : public Ogre::Renderable
+{
+protected:
+	OgreBaseRenderable* parent;
+	MeshChunk chunk;
+	/// Index data referring to the parent's index buffer, the start and count are set for the current level
+	Ogre::IndexData* indexData;
+	/// World space center of the chunk's bounds as of the last update()
+	Ogre::Vector3 worldCenter;
+	sval level;
+
+public:
+	ChunkRenderable(OgreBaseRenderable* parent,const MeshChunk& chunk);
+	virtual ~ChunkRenderable() { SAFE_DELETE(indexData); }
+
+	/**
+	 * Update the world space bounds with `xform' and choose the level of detail so that there's no more than one vertex
+	 * across every few pixels, or one level coarser if `highQuality' is false. Returns false if the chunk isn't visible to `cam'.
+	 */
+	bool update(const Ogre::Camera* cam,const Ogre::Matrix4& xform,bool highQuality);
+
+	sval getLevel() const { return level; }
+	sval numLevels() const { return chunk.levels.size(); }
+
+	virtual const Ogre::MaterialPtr& getMaterial() const { return parent->getMaterial(); }
+	virtual void getRenderOperation(Ogre::RenderOperation& op);
+	virtual void getWorldTransforms(Ogre::Matrix4 *xform) const { parent->getWorldTransforms(xform); }
+	virtual Ogre::Real getSquaredViewDepth(const Ogre::Camera* cam) const { return cam->getDerivedPosition().squaredDistance(worldCenter); }
+	virtual const Ogre::LightList& getLights() const { return parent->getLights(); }
+
+	virtual void _updateCustomGpuParameter(const Ogre::GpuProgramParameters::AutoConstantEntry& entry,Ogre::GpuProgramParameters* params) const
+	{
+		parent->_updateCustomGpuParameter(entry,params); // custom parameters like the keyframe time are stored in the parent
+	}
 };
 
+/// Lock the renderable `obj' for the duration of a fill operation's block and publish any deferred fill afterwards
+#define fillscope(obj) for(OgreBaseRenderable::FillScope __fillscope__(obj);__fillscope__.loopOnce();)
+
 /**
  * This is the base figure type which merges Ogre renderable objects with the renderer interface types. It inherits from 
  * the template parameter F which must be Figure or one of its subtypes. The parameter T must be OgreBaseRenderable or
@@ -1144,13 +1586,143 @@ class DLLEXPORT OgreFigure : public OgreBaseFigure<OgreBaseRenderable,Figure>
 {
 protected:
 	FigureType type;
+	bool packedNormals;
+	sval chunkSize;
+	sval chunkLevels;
 
 public:
 	OgreFigure(const std::string& name,const std::string & matname,OgreRenderScene *scene,FigureType type) throw(RenderException);
 
 	virtual ~OgreFigure(){}
+
+	virtual void setPackedNormals(bool val) { packedNormals=val; }
+	virtual bool isPackedNormals() const { return packedNormals; }
+
+	virtual void setChunking(sval trisPerChunk,sval numLevels=1) 
+	{ 
+		chunkSize=trisPerChunk; 
+		chunkLevels=_max<sval>(1,numLevels); 
+	}
+
+	virtual sval getChunkSize() const { return chunkSize; }
+	virtual sval getChunkLevels() const { return chunkLevels; }
+
+	virtual void addKeyframe(const Vec3Matrix* nodes,const RealMatrix* field=NULL,real minval=0.0,real maxval=1.0) throw(RenderException);
+	virtual void clearKeyframes() { obj->clearKeyframes(); }
+	virtual sval numKeyframes() const { return obj->numKeyframes(); }
+	virtual void setKeyframeTime(real t,bool cubic=true) { obj->setKeyframeTime(t,cubic); }
+	virtual real getKeyframeTime() const { return obj->getKeyframeTime(); }
 	
 	virtual void fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill=false,bool doubleSided=false) throw(RenderException) ;
+
+	virtual void fillPackedData(const PackedVertexMatrix* verts, const IndexMatrix* inds,bool deferFill=false) throw(RenderException);
+};
+
+/**
+ * Renderable for billboard set figures in point cloud mode which stores every point in one static vertex buffer drawn as
+ * point sprites. Positions, colors, and sizes are stored in separate buffers bound to sources 0, 1, and 2 so that changing
+ * one attribute uploads only the range of that attribute's buffer which changed. The material should have point sprites
+ * enabled and a vertex program like res/pointSpriteVP.cg to size the points from the size attribute, otherwise the point
+ * size of the material is used. The local copies may be modified in any thread, each change publishing the changed ranges
+ * as a PointUpdate which the render thread takes and uploads without waiting on the producers.
+ */
+class PointCloudRenderable : public OgreBaseRenderable
+{
+public:
+	/// Range of values [start,end) of an attribute which must be uploaded, this is empty if start>=end
+	struct DirtyRange
+	{
+		size_t start,end;
+
+		DirtyRange() : start(0), end(0) {}
+
+		bool isEmpty() const { return start>=end; }
+		void clear() { start=end=0; }
+
+		void add(size_t s, size_t e)
+		{
+			start=isEmpty() ? s : _min(start,s);
+			end=isEmpty() ? e : _max(end,e);
+		}
+	};
+
+	/**
+	 * Changed attribute values for the render thread to upload, each data vector storing the values of its range only. If
+	 * `resize' is true the hardware buffers are recreated for `numPoints' points and the ranges cover every point.
+	 */
+	struct PointUpdate
+	{
+		size_t numPoints;
+		bool resize;
+		DirtyRange pos, col, size;
+		std::vector<float> posData;
+		std::vector<rgba> colData;
+		std::vector<float> sizeData;
+
+		PointUpdate() : numPoints(0), resize(false) {}
+	};
+
+protected:
+	/// Current attribute values, these and the dirty ranges are only accessed by producers while holding `mutex'
+	std::vector<float> positions;
+	std::vector<rgba> colors;
+	std::vector<float> sizes;
+
+	/// Ranges changed since the last publishUpdate()
+	DirtyRange dirtyPos, dirtyCol, dirtySize;
+	/// True if the number of points has changed so the hardware buffers must be recreated
+	bool resizeBuffers;
+
+	/// Newest update for the render thread to upload, exchanged atomically so neither thread waits for the other
+	PointUpdate* volatile readyUpdate;
+	/// Uploaded update kept to be reused by the next publishUpdate(), exchanged atomically
+	PointUpdate* volatile spareUpdate;
+
+	Ogre::HardwareVertexBufferSharedPtr posBuf, colBuf, sizeBuf;
+
+	/// Recreate the hardware buffers to store `numpoints' points, this is only called in the render thread
+	void createPointBuffers(size_t numpoints);
+
+	/**
+	 * Publish the dirty ranges as the ready update, merging in those of the ready update if the render thread hasn't taken
+	 * it yet so that no change is lost, and clear them. This must be called with `mutex' held.
+	 */
+	void publishUpdate();
+
+public:
+	PointCloudRenderable(const std::string& name,const std::string& matname,Ogre::SceneManager *mgr) throw(RenderException) :
+		OgreBaseRenderable(name,matname,Ogre::RenderOperation::OT_POINT_LIST,mgr), resizeBuffers(false), readyUpdate(NULL), spareUpdate(NULL)
+	{
+		depthSorting=false;
+		posBuf.setNull();
+		colBuf.setNull();
+		sizeBuf.setNull();
+	}
+
+	virtual ~PointCloudRenderable() 
+	{
+		delete readyUpdate;
+		delete spareUpdate;
+	}
+
+	size_t numPoints() const { return sizes.size(); }
+
+	/**
+	 * Set the points from the vertices and colors of `vb' all with size `size', colors are packed as `coltype'. Attributes whose
+	 * values are unchanged aren't uploaded again, for those that did change only the range of points which differ is uploaded.
+	 */
+	void setPoints(const VertexBuffer* vb,real size,Ogre::VertexElementType coltype);
+
+	void clearPoints() { setPoints(NULL,0,Ogre::VET_COLOUR_ARGB); }
+
+	void setPointPos(size_t index,const vec3& pos) throw(IndexException);
+	void setPointColor(size_t index,const color& col,Ogre::VertexElementType coltype) throw(IndexException);
+	void setPointSize(real size);
+
+	virtual void destroyBuffers();
+
+	virtual void _updateRenderQueue(Ogre::RenderQueue* queue);
+	virtual void getRenderOperation(Ogre::RenderOperation& op);
 };
 
 class DLLEXPORT OgreBBSetFigure : public BBSetFigure
@@ -1164,6 +1736,13 @@ protected:
 	std::string matname;
 	FigureType type;
 	bool isInitialized;
+
+	/// True if the next fill should use `cloud' instead of billboard sets, which is only possible for FT_BB_POINT figures
+	bool pointCloud;
+	/// Point cloud renderable created at the first point cloud fill, NULL until then
+	PointCloudRenderable* cloud;
+	/// True if the last fill stored its data in `cloud' rather than the billboard sets
+	bool cloudFilled;
 	
 	const VertexBuffer* tempvb;
 	bool deleteTemp;
@@ -1193,6 +1772,11 @@ public:
 		try{
 			for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 				(*i)->setMaterialName(mat); 
+
+			if(cloud)
+				cloud->setMaterial(std::string(mat));
+
+			matname=mat; // billboard sets and clouds created later use this material too
 		}
 		catch(Ogre::Exception &e){
 			THROW_RENDEREX(e);
@@ -1201,6 +1785,9 @@ public:
 
 	virtual const char* getMaterial() const 
 	{ 
+		if(isCloudActive())
+			return cloud->getMaterial().isNull() ? "" : cloud->getMaterial()->getName().c_str();
+
 		if(sets.size()==0)
 			return "";
 
@@ -1212,7 +1799,12 @@ public:
 	{
 		vec3 minv,maxv;
 
-		if(sets.size()>0){
+		if(isCloudActive()){
+			Ogre::AxisAlignedBox aabb=cloud->getBoundingBox();
+			minv=convert(aabb.getMinimum());
+			maxv=convert(aabb.getMaximum());
+		}
+		else if(sets.size()>0){
 			Ogre::AxisAlignedBox aabb=sets[0]->getBoundingBox();
 			for(size_t i=1;i<sets.size();i++)
 				aabb=aabb.intersection(sets[i]->getBoundingBox());
@@ -1234,6 +1826,9 @@ public:
 	
 	virtual bool isVisible() const
 	{
+		if(isCloudActive())
+			return cloud->isVisible();
+
 		return sets.size()>0 && sets[0]->isVisible();
 	}
 		
@@ -1259,11 +1854,21 @@ public:
 
 	virtual void setRenderQueue(sval queue)
 	{
-		if(queue<=Ogre::RENDER_QUEUE_MAX)
+		if(queue<=Ogre::RENDER_QUEUE_MAX){
 			for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 				(*i)->setRenderQueueGroup((Ogre::uint8)queue);
+
+			if(cloud)
+				cloud->setRenderQueueGroup((Ogre::uint8)queue);
+		}
+	}
+	virtual sval getRenderQueue() const 
+	{ 
+		if(isCloudActive())
+			return cloud->getRenderQueueGroup();
+
+		return sets.size()>0 ? sets[0]->getRenderQueueGroup() : 0; 
 	}
-	virtual sval getRenderQueue() const { return sets.size()>0 ? sets[0]->getRenderQueueGroup() : 0; }
 
 	virtual void setDimension(real width, real height)
 	{
@@ -1271,6 +1876,9 @@ public:
 		this->height=height;
 		for(bbsetlist::iterator i=sets.begin();i!=sets.end();++i)
 			(*i)->setDefaultDimensions(width,height);
+
+		if(cloud)
+			cloud->setPointSize(width); // only the size buffer is uploaded again
 	}
 	
 	virtual real getWidth() const { return width; }
@@ -1282,8 +1890,15 @@ public:
 			(*i)->setCommonUpVector(convert(v));
 	}
 
+	/// Set whether the next fillData() stores points in a single vertex buffer drawn as point sprites, FT_BB_POINT figures only
+	virtual void setPointCloud(bool val) { pointCloud=val && type==FT_BB_POINT; }
+	virtual bool isPointCloud() const { return pointCloud; }
+
 	virtual int numBillboards() const 
 	{
+		if(isCloudActive())
+			return int(cloud->numPoints());
+
 		int count=0;
 		for(bbsetlist::const_iterator i=sets.begin();i!=sets.end();++i)
 			count+=(*i)->getNumBillboards();
@@ -1293,20 +1908,34 @@ public:
 
 	virtual void setBillboardPos(indexval index, const vec3& pos) throw(IndexException) 
 	{
-		Ogre::Billboard *b=getBillboard(index);
-		b->mPosition=convert(pos);
+		if(isCloudActive())
+			cloud->setPointPos(index,pos);
+		else{
+			Ogre::Billboard *b=getBillboard(index);
+			b->mPosition=convert(pos);
+		}
 	}
 
 	virtual void setBillboardDir(indexval index, const vec3& dir) throw(IndexException) 
 	{
-		Ogre::Billboard *b=getBillboard(index);
-		b->mDirection=convert(dir);
+		if(isCloudActive()){ // points have no direction so only check the index
+			if(index>=cloud->numPoints())
+				throw IndexException("index",index,cloud->numPoints());
+		}
+		else{
+			Ogre::Billboard *b=getBillboard(index);
+			b->mDirection=convert(dir);
+		}
 	}
 
 	virtual void setBillboardColor(indexval index, const color& col) throw(IndexException) 
 	{
-		Ogre::Billboard *b=getBillboard(index);
-		b->mColour=convert(col);
+		if(isCloudActive())
+			cloud->setPointColor(index,col,Ogre::Root::getSingleton().getRenderSystem()->getColourVertexElementType());
+		else{
+			Ogre::Billboard *b=getBillboard(index);
+			b->mColour=convert(col);
+		}
 	}
 	
 	virtual void setPosition(const vec3& v) { node->setPosition(convert(v)); }
@@ -1351,6 +1980,12 @@ public:
 	
 protected:
 	void createBBSet();
+
+	/// Create `cloud' and attach it to the node with the same visibility and render queue as the billboard sets
+	void createCloud();
+
+	/// Returns true if the figure's current data is stored in `cloud' rather than the billboard sets
+	bool isCloudActive() const { return cloud!=NULL && cloudFilled; }
 	
 	Ogre::Billboard* getBillboard(indexval index) const throw(IndexException) {
 		for(bbsetlist::const_iterator i=sets.begin();index<(indexval)numBillboards() && i!=sets.end();++i)
@@ -1611,19 +2246,27 @@ class TextureVolumeRenderable : public OgreBaseRenderable
 	rotator lastCamRot;
 	bool cameraMoved;
 	
-	real heights[8];
-	intersect bbintersects[6]; // stores the plane intersections with the bound box as index pairs plus xi value 
 	planevert interpts[6]; // stores the vertices where the plane intersects the bound box, which defines a (3,4,5,or 6)-sided polygon
 	
-	Matrix<OgreBaseRenderable::Vertex> vertices; // temporary store for calculated plane vertices
-	IndexMatrix indices; // temporary store for calculated plane triangle indices
+	Matrix<OgreBaseRenderable::Vertex> vertices; // store for calculated plane vertices, reserved for the most vertices the planes can have
+	IndexMatrix indices; // store for calculated plane triangle indices, reserved like `vertices'
+
+	/// Quantized camera direction and number of planes the slice geometry in the buffers was built for
+	int sliceKey[3];
+	sval sliceNumPlanes;
+	/// False if the slice geometry must be rebuilt regardless of the camera direction
+	bool sliceValid;
+
+	/// Rebuild the slice geometry for `numplanes' planes perpendicular to `camdir' and commit it to the buffers
+	void buildSlices(const vec3& camdir,sval numplanes);
 
 public:
 	TextureVolumeRenderable(const std::string &name,const std::string & matname,OgreTextureVolumeFigure *fig,Ogre::SceneManager *mgr)
 		: OgreBaseRenderable(name,matname,Ogre::RenderOperation::OT_TRIANGLE_LIST ,mgr), 
-		fig(fig),vertices("tprverts",0,1,false), indices("tprinds",0,3,false)
+		fig(fig),vertices("tprverts",0,1,false), indices("tprinds",0,3,false), sliceNumPlanes(0), sliceValid(false)
 	{
 		depthSorting=false;
+		sliceKey[0]=sliceKey[1]=sliceKey[2]=0;
 	}
 
 	virtual ~TextureVolumeRenderable() {}
@@ -1631,6 +2274,12 @@ public:
 	virtual void _updateRenderQueue(Ogre::RenderQueue* queue); 
 	virtual void _notifyCurrentCamera(Ogre::Camera* cam);
 
+	/// Mark the slice geometry to be rebuilt at the next render, this must be called when the volume's box, texture box, or color change
+	void invalidateSlices() { sliceValid=false; }
+
+	/// Stores the polygon where the plane intersects the bound box into `pts' in clockwise order and returns the number of vertices
+	sval intersectPlane(vec3 planept,const vec3& planenorm,planevert* pts) const;
+
 	std::pair<sval,planevert*> getPlaneIntersects(vec3 planept,vec3 planenorm);
 };
 
@@ -1677,11 +2326,13 @@ public:
 		alpha=a;
 		Ogre::RenderSystem* rs=Ogre::Root::getSingleton().getRenderSystem();
 		rs->convertColourValue(Ogre::ColourValue(1.0f,1.0f,1.0f,alpha),&vertexcol);
+		obj->invalidateSlices();
 	}
 
 	virtual void setTexAABB(const vec3& minv, const vec3& maxv) 
 	{
 		setCube(texcube,minv,maxv);
+		obj->invalidateSlices();
 	}
 
 	virtual void setAABB(const vec3& minv, const vec3& maxv) 
@@ -1697,6 +2348,7 @@ public:
 			minv1.setMinVals(maxv);
 			maxv1.setMaxVals(minv);
 			obj->setBoundingBox(minv1,maxv1); 
+			obj->invalidateSlices();
 			node->needUpdate();
 		} 
 	}
@@ -1742,7 +2394,106 @@ public:
 	}
 };
 
-class DLLEXPORT OgreGlyphFigure : public OgreBaseFigure<OgreBaseRenderable,GlyphFigure>
+/**
+ * Renderable for glyph figures which either stores every glyph expanded into one mesh or, in instanced mode, stores a single
+ * copy of the glyph mesh which is drawn once per instance. In instanced mode a second vertex buffer bound to source 1 holds
+ * the Instance values for each glyph, the material must have a vertex program like res/instancedGlyphVP.cg to apply these.
+ */
+class GlyphRenderable : public OgreBaseRenderable
+{
+public:
+	/// Per-instance values stored in the instance buffer, these match the TEXCOORD1-4 inputs of res/instancedGlyphVP.cg
+	struct Instance
+	{
+		float pos[3];
+		float rot[4]; /// rotation quaternion in (x,y,z,w) order
+		float scale[3];
+		float col[4];
+	};
+
+	/// Deferred fill which also stores the instances and instancing mode
+	struct GlyphFillBuffer : public FillBuffer
+	{
+		bool instanced;
+		std::vector<Instance> instances;
+
+		virtual void reset(size_t numVerts,size_t numInds)
+		{
+			FillBuffer::reset(numVerts,numInds);
+			instanced=false;
+			instances.clear();
+		}
+	};
+
+protected:
+	bool instanced;
+	size_t _numInstances;
+	Ogre::HardwareVertexBufferSharedPtr instBuf;
+	/// Instance values in main memory used to stage data before being committed in createBuffers()
+	std::vector<Instance> localInstBuff;
+	/// Name and size of the glyph mesh last filled in instanced mode, empty if the buffers were last filled with anything else
+	std::string committedMesh;
+	size_t committedVerts, committedInds;
+
+public:
+	GlyphRenderable(const std::string& name,const std::string& matname,Ogre::SceneManager *mgr) throw(RenderException) :
+		OgreBaseRenderable(name,matname,Ogre::RenderOperation::OT_TRIANGLE_LIST,mgr), instanced(false), _numInstances(0),
+		committedVerts(0), committedInds(0)
+	{
+		instBuf.setNull();
+	}
+
+	virtual ~GlyphRenderable() {}
+
+	void setInstanced(bool val) { instanced=val; }
+	bool isInstanced() const { return instanced; }
+
+	size_t numInstances() const { return _numInstances; }
+
+	/// Returns true if the render system can draw instances and the material's first pass has a vertex program to apply them
+	bool supportsInstancing() const;
+
+	/// Set the number of instances and get the local buffer to fill with their values, these are committed by createBuffers()
+	Instance* getLocalInstBuff(size_t numInstances)
+	{
+		_numInstances=numInstances;
+		localInstBuff.resize(numInstances);
+		return numInstances>0 ? &localInstBuff[0] : NULL;
+	}
+
+	/// Remove all instances, the next createBuffers() call will unbind the instance buffer
+	void clearInstances() { getLocalInstBuff(0); }
+
+	/** 
+	 * Returns true if the glyph mesh `name' with the given vertex and index counts was the last filled, so that the buffers
+	 * will contain it once any deferred fill is committed. This is only tracked by producers so needn't query the buffers.
+	 */
+	bool isMeshCommitted(const std::string& name,size_t numVerts,size_t numInds) const
+	{
+		return committedMesh.size()>0 && committedMesh==name && committedVerts==numVerts && committedInds==numInds;
+	}
+
+	void setCommittedMesh(const std::string& name,size_t numVerts=0,size_t numInds=0) 
+	{ 
+		committedMesh=name; 
+		committedVerts=numVerts;
+		committedInds=numInds;
+	}
+
+	/** 
+	 * Creates the buffers as OgreBaseRenderable does then creates, commits, or unbinds the instance buffer as needed. If
+	 * deferring, the local instances are moved into the back fill instead.
+	 */
+	virtual void createBuffers(size_t numVerts,size_t numInds,bool deferCreate=false);
+
+	virtual FillBuffer* createFillBuffer() const { return new GlyphFillBuffer(); }
+
+	virtual void destroyBuffers();
+
+	virtual void getRenderOperation(Ogre::RenderOperation& op);
+};
+
+class DLLEXPORT OgreGlyphFigure : public OgreBaseFigure<GlyphRenderable,GlyphFigure>
 {
 	typedef triple<const Vec3Matrix*, const Vec3Matrix*, const IndexMatrix*> glyphmesh;
 	typedef std::map<std::string,glyphmesh> glyphmap; 
@@ -1750,9 +2501,13 @@ class DLLEXPORT OgreGlyphFigure : public OgreBaseFigure<OgreBaseRenderable,Glyph
 	std::string glyphname;
 	glyphmap glyphs;
 	vec3 glyphscale;
+	bool instanced;
 
 	static void fillDefaultGlyphs(glyphmap &map);
 
+	/// Fill the renderable with one copy of the glyph mesh and an instance for each vertex of `vb'
+	void fillInstanced(const VertexBuffer* vb,const glyphmesh& gmesh,bool deferFill);
+
 public:
 	OgreGlyphFigure(const std::string& name,const std::string & matname,OgreRenderScene *scene) throw(RenderException);
 	virtual ~OgreGlyphFigure(){}
@@ -1769,10 +2524,15 @@ public:
 
 	virtual std::string getGlyphName() const {return glyphname; }
 
+	virtual void setInstanced(bool val) { instanced=val; }
+	virtual bool isInstanced() const { return instanced; }
+
 	virtual void addGlyphMesh(const std::string& name,const Vec3Matrix* nodes,const Vec3Matrix* norms, const IndexMatrix* inds) 
 	{
 		glyphmap::iterator i=glyphs.find(name);
 
+		obj->setCommittedMesh(""); // the mesh must be recommitted in case `name' is the one in the hardware buffers
+
 		if(i!=glyphs.end()){
 			delete (*i).second.first;
 			delete (*i).second.second;
@@ -1966,6 +2726,14 @@ public:
 	virtual void fillColor(color col);
 	virtual void fillColor(const ColorMatrix *mat,indexval depth) ;
 	virtual void fillColor(const RealMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) ;
+	virtual void fillColor(const FloatMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) ;
+	virtual void fillColor(const UShortMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) ;
+	virtual void fillColor(const ShortMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) ;
+
+protected:
+	/// Fill the texture at `depth' from the values of `mat' of any image matrix type, this implements the fillColor() methods for value matrices
+	template<typename T>
+	void fillValues(const Matrix<T> *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bool mulAlpha);
 };
 
 class DLLEXPORT OgreGPUProgram : public GPUProgram
@@ -2012,6 +2780,7 @@ class DLLEXPORT OgreGPUProgram : public GPUProgram
 			{ "worldView",			Ogre::GpuProgramParameters::ACT_WORLDVIEW_MATRIX },
 			{ "worldViewProj",		Ogre::GpuProgramParameters::ACT_WORLDVIEWPROJ_MATRIX },
 			{ "invWorld",           Ogre::GpuProgramParameters::ACT_INVERSE_WORLD_MATRIX },
+			{ "proj",				Ogre::GpuProgramParameters::ACT_PROJECTION_MATRIX },
 			{ "invProj",			Ogre::GpuProgramParameters::ACT_INVERSE_PROJECTION_MATRIX },
 			{ "invView",			Ogre::GpuProgramParameters::ACT_INVERSE_VIEW_MATRIX },
 			{ "flip",				Ogre::GpuProgramParameters::ACT_RENDER_TARGET_FLIPPING },
@@ -2035,6 +2804,10 @@ class DLLEXPORT OgreGPUProgram : public GPUProgram
 		for (size_t i=0; i<numParams; i++)
 			if (params->_findNamedConstantDefinition(autoparams[i].name))
 				params->setNamedAutoConstant(autoparams[i].name, autoparams[i].type);
+
+		// per-object values set with Renderable::setCustomParameter()
+		if (params->_findNamedConstantDefinition("keyframeParams"))
+			params->setNamedAutoConstant("keyframeParams", Ogre::GpuProgramParameters::ACT_CUSTOM, OgreBaseRenderable::KeyframeParamIndex);
 	}
 
 public:
@@ -2215,15 +2988,29 @@ public:
 
 	/// Maps Figure objects to SceneNode objects created for them
 	nodemap nmap;
+	/// Guards `nmap' so that queries needn't wait for `sceneMutex', which is held while resource operations are run
+	ReadWriteMutex nodeMutex;
 	/// Counts how many cameras have been created and assigns a unique number to each (up to 31)
 	u32 cameraCount;
 
 	u32 assetCount;
 	
-	std::vector<ResourceOp*> pendingOps;
+	/// Newly added operations, any thread can add to this without locking
+	LockFreeQueue<ResourceOp*> incomingOps;
+	/// Operations moved from `incomingOps' ordered by priority, only accessed by the render thread or removeResourceOp() with `sceneMutex' held
+	std::deque<ResourceOp*> pendingOps;
+	/// Operations taken from `pendingOps' by applyResourceOps() to be applied outside the lock, also guarded by `sceneMutex'
+	std::deque<ResourceOp*> activeOps;
 	Mutex sceneMutex;
+	/// Held while an operation is applied so that removeResourceOp() waits for it, always acquired before `sceneMutex'
+	Mutex applyMutex;
+
+	/// Time in seconds and bytes uploaded per frame after which operations with data to upload are left for the next frame, 0 for no limit
+	real opsTimeBudget;
+	size_t opsByteBudget;
 
-	OgreRenderScene(OgreRenderAdapter *adapt) : root(adapt->root), mgr(adapt->mgr), win(adapt->win),config(adapt->config),cameraCount(0),assetCount(0)
+	OgreRenderScene(OgreRenderAdapter *adapt) : root(adapt->root), mgr(adapt->mgr), win(adapt->win),config(adapt->config),cameraCount(0),assetCount(0),
+			opsTimeBudget(0),opsByteBudget(0)
 	{
 		resGroupName=Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
 	}
@@ -2255,41 +3042,41 @@ public:
 	
 	virtual Config* getConfig() const { return config; }
 
-	/// Iterate over all queued ResourceOp objects, calling their op() method, deleting them, and clearing the queue
-	virtual void applyResourceOps()
+	/**
+	 * Call the op() method of queued ResourceOp objects in priority order and delete them. The queue is taken under `sceneMutex'
+	 * but the operations are applied holding only `applyMutex'. If `useBudget' is true and the time or byte budget is exceeded, the
+	 * remaining operations are left in the queue in their current order for the next call.
+	 */
+	virtual void applyResourceOps(bool useBudget=false);
+
+	/// Returns the number of queued ResourceOp objects
+	sval numPendingOps()
 	{
+		sval result=incomingOps.size();
 		critical(&sceneMutex){
-			for(std::vector<ResourceOp*>::iterator i=pendingOps.begin();i!=pendingOps.end();++i){
-				(*i)->op();
-				delete *i;
-			}
-			
-			pendingOps.clear();
+			result+=sval(pendingOps.size()+activeOps.size());
 		}
+		return result;
 	}
 	
 	/// Add the resource operation to the queue, this assigns responsibility to delete `op' to the OgreRenderScene object
 	virtual void addResourceOp(ResourceOp *op)
 	{
-		critical(&sceneMutex){
-			pendingOps.push_back(op);
-		}
+		incomingOps.push(op);
 	}
 	
-	/// Remove operations with the given parent name from the queue
-	virtual void removeResourceOp(std::string parentname)
+	/// Remove operations with the given parent name from the queue, waiting for any operation being applied to finish first
+	virtual void removeResourceOp(std::string parentname);
+
+	virtual void setResourceOpBudget(real seconds, size_t bytes)
 	{
-		critical(&sceneMutex){
-			for(std::vector<ResourceOp*>::iterator i=pendingOps.begin();i!=pendingOps.end();)
-				if((*i)->parentname==parentname){
-					delete *i;
-					pendingOps.erase(i);
-				}
-				else
-					++i;
-		}
+		opsTimeBudget=_max<real>(0,seconds);
+		opsByteBudget=bytes;
 	}
 
+	/// Move operations from `incomingOps' into `pendingOps' in priority order (NOTE: `sceneMutex' must be held)
+	void sortIncomingOps();
+
 	virtual void logMessage(const char* msg)
 	{
 		Ogre::LogManager::getSingleton().getDefaultLog()->logMessage(msg);
@@ -2309,36 +3096,38 @@ public:
 	
 	virtual Ogre::SceneNode* createNode(const std::string& name)
 	{
-		critical(&sceneMutex){ // used to ensure a nodes cannot be created, queried, or deleted simultaneously
+		critical(&sceneMutex){ // used to ensure a nodes cannot be created or deleted simultaneously
 			Ogre::SceneNode* node=mgr->getRootSceneNode()->createChildSceneNode();
-			nmap[name]=node;
+			writelock(&nodeMutex){
+				nmap[name]=node;
+			}
 			return node;
 		}
 	}
 
 	virtual Ogre::SceneNode* getNode(Figure *fig)
 	{
-		critical(&sceneMutex){ // used to ensure a nodes cannot be created, queried, or deleted simultaneously
-			std::string name=fig->getName();
-			if(nmap.find(name)!=nmap.end())
-				return nmap[name];
-			else
-				return NULL;
+		readlock(&nodeMutex){ // queries can proceed concurrently but not while a node is being created or deleted
+			nodemap::const_iterator it=nmap.find(fig->getName());
+			return it!=nmap.end() ? it->second : NULL;
 		}
 	}
 
 	virtual void destroyNode(Ogre::SceneNode *node) throw(Ogre::InternalErrorException)
 	{
-		critical(&sceneMutex){ // used to ensure a nodes cannot be created, queried, or deleted simultaneously
+		critical(&sceneMutex){ // used to ensure a nodes cannot be created or deleted simultaneously
 			std::string  name="";
-			for(nodemap::iterator it=nmap.begin();!name.size() && it!=nmap.end();++it)
-				if(it->second==node)
-					name=it->first;
+			writelock(&nodeMutex){
+				for(nodemap::iterator it=nmap.begin();!name.size() && it!=nmap.end();++it)
+					if(it->second==node)
+						name=it->first;
 				
-			if(name.size()){
-				nmap.erase(name);
-				mgr->destroySceneNode(node);
+				if(name.size())
+					nmap.erase(name);
 			}
+				
+			if(name.size())
+				mgr->destroySceneNode(node);
 			else
 				OGRE_EXCEPT(Ogre::Exception::ERR_INTERNAL_ERROR,"Cannot find Figure for node","OgreRenderScene::destroyNode");
 		}
@@ -0,0 +1,580 @@
+/*
+ * Eidolon Biomedical Framework
+ * Copyright (C) 2016-8 Eric Kerfoot, King's College London, all rights reserved
+ *
+ * This file is part of Eidolon.
+ *
+ * Eidolon is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Eidolon is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program (LICENSE.txt).  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Standalone benchmarks of the renderer's CPU kernels using synthetic data, built with "make benchmark" without Ogre or Python.
+ * Each benchmark builds its data outside the timed region and then runs its kernel a number of times, printing one JSON object
+ * per line with the best and mean times, the throughput of the best run, and the process's peak resident memory. Data is
+ * generated with a fixed seed so that runs are reproducible between builds and machines. Usage:
+ *
+ *     RenderBenchmark [--list] [--filter NAME] [--size N] [--reps R] [--threads T]
+ *
+ * The size is the number of items a benchmark processes (triangles, vertices, pixels, etc.), 0 uses each benchmark's default.
+ * Since peak memory covers the whole process, run benchmarks separately with --filter to get per-benchmark values. The Ogre
+ * dependent parts of figure and texture filling aren't included, instead the CPU kernels the Ogre types call are covered by the
+ * pack_vertices, chunk_mesh, depth_sort, and texture_lut benchmarks.
+ */
+
+#include "RenderTypes.h"
+
+#ifdef WIN32
+  #include <psapi.h>
+#else
+  #include <sys/resource.h>
+#endif
+
+using namespace RenderTypes;
+
+/// Parameters given to every benchmark
+struct BenchParams
+{
+	sval size;
+	sval reps;
+	sval threads;
+};
+
+/**
+ * Base type for benchmarks, setup() creates the data for `size' items and run() is the timed kernel. The run() method returns
+ * a value computed from the results so that the work can't be optimized away, this is included in the output.
+ */
+class Benchmark
+{
+public:
+	virtual ~Benchmark() {}
+	virtual const char* name() const=0;
+	virtual const char* unit() const=0;
+	virtual sval defaultSize() const=0;
+	virtual void setup(const BenchParams& p)=0;
+	virtual real run(const BenchParams& p)=0;
+};
+
+/// Simple linear congruential generator so that data is the same on every platform, unlike rand()
+class BenchRandom
+{
+	u64 state;
+public:
+	BenchRandom(u64 seed=12345) : state(seed) {}
+
+	u32 next()
+	{
+		state=state*6364136223846793005ULL+1442695040888963407ULL;
+		return u32(state>>33);
+	}
+
+	/// Returns a value in [0,1)
+	real unit() { return real(next())/real(0x80000000u); }
+};
+
+/// Returns the peak resident memory of the process in kilobytes
+static u64 getPeakMemoryKB()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if(GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc)))
+		return u64(pmc.PeakWorkingSetSize/1024);
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+#ifdef __APPLE__
+	return u64(usage.ru_maxrss/1024); // bytes on OSX
+#else
+	return u64(usage.ru_maxrss);
+#endif
+#endif
+}
+
+/// Fill `nodes' and `inds' with a bumpy grid mesh of about `numtris' triangles in the unit square
+static void createGridMesh(sval numtris, Vec3Matrix& nodes, IndexMatrix& inds)
+{
+	sval dim=_max<sval>(2,sval(sqrt(real(numtris)/2))+1);
+
+	nodes.setN(dim*dim);
+	inds.setN((dim-1)*(dim-1)*2);
+
+	for(sval y=0;y<dim;y++)
+		for(sval x=0;x<dim;x++){
+			real fx=real(x)/(dim-1), fy=real(y)/(dim-1);
+			nodes.at(x+y*dim)=vec3(fx,fy,0.1*sin(fx*20)*cos(fy*20));
+		}
+
+	for(sval y=0,t=0;y<dim-1;y++)
+		for(sval x=0;x<dim-1;x++,t+=2){
+			indexval i=x+y*dim;
+			inds.at(t,0)=i; inds.at(t,1)=i+1; inds.at(t,2)=i+dim;
+			inds.at(t+1,0)=i+1; inds.at(t+1,1)=i+dim+1; inds.at(t+1,2)=i+dim;
+		}
+}
+
+/// Brute force ray intersection over every triangle with Ray::intersectsTriMesh(), the size is the number of triangles
+class RayTriMeshBench : public Benchmark
+{
+	Vec3Matrix nodes;
+	IndexMatrix inds;
+public:
+	RayTriMeshBench() : nodes("nodes",sval(0)), inds("inds","",sval(0),3) {}
+	virtual const char* name() const { return "ray_trimesh"; }
+	virtual const char* unit() const { return "triangles"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p) { createGridMesh(p.size,nodes,inds); }
+
+	virtual real run(const BenchParams& p)
+	{
+		Ray r(vec3(0.5,0.5,1),vec3(0.01,0.02,-1));
+		return r.intersectsTriMesh(&nodes,&inds,NULL,NULL).size();
+	}
+};
+
+/// Batched BVH ray intersection with intersectsTriMeshRays() of a mesh of 10 triangles per ray, the size is the number of rays
+class RayBVHBench : public Benchmark
+{
+	Vec3Matrix nodes, bounds, origins, dirs;
+	IndexMatrix inds, nodeinfo, triorder, triinds;
+	RealMatrix dists;
+	TriMeshBVH* bvh;
+public:
+	RayBVHBench() : nodes("nodes",sval(0)), bounds("bounds",sval(0),2), origins("origins",sval(0)), dirs("dirs",1), inds("inds","",sval(0),3),
+		nodeinfo("nodeinfo",sval(0),2), triorder("triorder",sval(0)), triinds("triinds",sval(0)), dists("dists",sval(0)), bvh(NULL)
+	{}
+
+	virtual ~RayBVHBench() { delete bvh; }
+	virtual const char* name() const { return "ray_trimesh_bvh"; }
+	virtual const char* unit() const { return "rays"; }
+	virtual sval defaultSize() const { return 100000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		createGridMesh(p.size*10,nodes,inds);
+		bvh=new TriMeshBVH(&nodes,&inds,&bounds,&nodeinfo,&triorder);
+		bvh->build();
+
+		origins.setN(p.size);
+		dists.setN(p.size);
+		triinds.setN(p.size);
+		dirs.at(0)=vec3(0,0,-1);
+
+		for(sval i=0;i<p.size;i++)
+			origins.at(i)=vec3(rnd.unit(),rnd.unit(),1);
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		intersectsTriMeshRays(bvh,&origins,&dirs,&dists,&triinds,NULL,p.threads);
+		return dists.at(0);
+	}
+};
+
+/// Packing position, normal, and color matrices into vertex buffer layout as fillData() does, the size is the number of vertices
+class PackVerticesBench : public Benchmark
+{
+	Vec3Matrix vecs;
+	ColorMatrix cols;
+	PackedVertexMatrix verts;
+public:
+	PackVerticesBench() : vecs("vecs",sval(0),4), cols("cols",sval(0)), verts("verts",sval(0)) {}
+	virtual const char* name() const { return "pack_vertices"; }
+	virtual const char* unit() const { return "vertices"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		vecs.setN(p.size);
+		cols.setN(p.size);
+		verts.setN(p.size);
+
+		for(sval i=0;i<p.size;i++){
+			vecs.at(i,0)=vec3(rnd.unit(),rnd.unit(),rnd.unit());
+			vecs.at(i,1)=vec3(0,0,1);
+			vecs.at(i,3)=vec3(rnd.unit(),rnd.unit(),0);
+			cols.at(i)=color(rnd.unit(),rnd.unit(),rnd.unit());
+		}
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		packVertices(&vecs,&cols,&verts);
+		return verts.at(p.size-1).pos[0];
+	}
+};
+
+/// Spatial chunking with 3 levels of detail as done by fillData() for chunked figures, the size is the number of triangles
+class ChunkMeshBench : public Benchmark
+{
+	Vec3Matrix nodes;
+	IndexMatrix inds;
+	std::vector<PackedVertex> verts;
+	std::vector<indexval> outinds;
+	std::vector<MeshChunk> chunks;
+public:
+	ChunkMeshBench() : nodes("nodes",sval(0)), inds("inds","",sval(0),3) {}
+	virtual const char* name() const { return "chunk_mesh"; }
+	virtual const char* unit() const { return "triangles"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		createGridMesh(p.size,nodes,inds);
+		verts.resize(nodes.n());
+
+		for(sval i=0;i<nodes.n();i++){
+			memset(&verts[i],0,sizeof(PackedVertex));
+			nodes.at(i).setBuff(verts[i].pos);
+		}
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		outinds.clear();
+		chunks.clear();
+		chunkTriangleMesh(&verts[0],verts.size(),inds.dataPtr(),inds.n(),8192,3,outinds,chunks);
+		return chunks.size();
+	}
+};
+
+/// Triangle depth sorting of transparent figures with depthSortTriangles(), the size is the number of triangles
+class DepthSortBench : public Benchmark
+{
+	std::vector<float> cents, dists;
+	std::vector<indexval> inds, sortedinds;
+	std::vector<u16> keys;
+	std::vector<u32> order, temp;
+public:
+	virtual const char* name() const { return "depth_sort"; }
+	virtual const char* unit() const { return "triangles"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		cents.resize(p.size*3);
+		inds.resize(p.size*3);
+		sortedinds.resize(p.size*3);
+
+		for(sval i=0;i<cents.size();i++){
+			cents[i]=float(rnd.unit());
+			inds[i]=indexval(i);
+		}
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		depthSortTriangles(&cents[0],&inds[0],p.size,vec3(0.5,0.5,2),&sortedinds[0],dists,keys,order,temp);
+		return sortedinds[0];
+	}
+};
+
+/// Trilinear resampling of a 64 slice image stack with interpolateImageStack(), the size is the number of output pixels
+class ImageStackBench : public Benchmark
+{
+	std::vector<RealMatrix*> stack;
+	RealMatrix* out;
+public:
+	ImageStackBench() : out(NULL) {}
+
+	virtual ~ImageStackBench()
+	{
+		for(sval i=0;i<stack.size();i++)
+			delete stack[i];
+		delete out;
+	}
+
+	virtual const char* name() const { return "image_stack"; }
+	virtual const char* unit() const { return "pixels"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		sval dim=_max<sval>(2,sval(sqrt(real(p.size))));
+
+		for(sval k=0;k<64;k++){
+			RealMatrix* img=new RealMatrix("img",dim,dim);
+			for(sval i=0;i<dim*dim;i++)
+				img->at(i/dim,i%dim)=rnd.unit();
+			stack.push_back(img);
+		}
+
+		out=new RealMatrix("out",dim,dim);
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		// sample the plane half way through the stack rotated so that every pixel interpolates between slices
+		interpolateImageStack(stack,transform(),out,transform(vec3(0,0,0.25),vec3(1,1,0.5),rotator(vec3(1,0,0),0.5)));
+		return out->at(0,0);
+	}
+};
+
+/// Direct spectrum interpolation with Spectrum::interpolateColor(), the size is the number of values
+class SpectrumBench : public Benchmark
+{
+	Spectrum spec;
+	std::vector<real> vals;
+public:
+	virtual const char* name() const { return "spectrum_interp"; }
+	virtual const char* unit() const { return "values"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		spec.addSpectrumValue(0,color(0,0,1));
+		spec.addSpectrumValue(0.25,color(0,1,1));
+		spec.addSpectrumValue(0.5,color(0,1,0));
+		spec.addSpectrumValue(0.75,color(1,1,0));
+		spec.addSpectrumValue(1,color(1,0,0));
+
+		vals.resize(p.size);
+		for(sval i=0;i<p.size;i++)
+			vals[i]=rnd.unit();
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		real total=0;
+		for(sval i=0;i<p.size;i++)
+			total+=spec.interpolateColor(vals[i]).r();
+		return total;
+	}
+};
+
+/// Converting rows of image values to texel colors with valuesToColors() as texture fills do, the size is the number of texels
+class TextureLUTBench : public Benchmark
+{
+	std::vector<color> table;
+	std::vector<real> vals;
+	std::vector<float> texels;
+public:
+	virtual const char* name() const { return "texture_lut"; }
+	virtual const char* unit() const { return "texels"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		vals.resize(p.size);
+		texels.resize(p.size*4);
+
+		for(sval i=0;i<p.size;i++)
+			vals[i]=real(i%4096);
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		Spectrum s;
+		s.addSpectrumValue(0,color(0,0,0));
+		s.addSpectrumValue(1,color(1,1,1));
+		s.lookupTable(table); // include building the table since a fill does this whenever the spectrum changes
+
+		// convert in rows of 1024 texels as the fill tasks do for each image row
+		for(sval i=0;i<p.size;i+=1024)
+			valuesToColors(&texels[i*4],&vals[i],_min<sval>(1024,p.size-i),0,4095,&s,table,NULL,true);
+		return texels[4];
+	}
+};
+
+/// Per-vertex normals of a grid mesh with calculateTriNorms(), the size is the number of triangles
+class TriNormsBench : public Benchmark
+{
+	Vec3Matrix nodes;
+	IndexMatrix inds;
+public:
+	TriNormsBench() : nodes("nodes",sval(0)), inds("inds","",sval(0),3) {}
+	virtual const char* name() const { return "tri_norms"; }
+	virtual const char* unit() const { return "triangles"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p) { createGridMesh(p.size,nodes,inds); }
+
+	virtual real run(const BenchParams& p)
+	{
+		vec3* norms=calculateTriNorms(nodes.dataPtr(),nodes.n(),inds.dataPtr(),inds.n());
+		real z=norms[0].z();
+		delete[] norms;
+		return z;
+	}
+};
+
+/// Reading a whitespace separated text file of 3 real columns with readTextFileMatrix(), the size is the number of rows
+class TextMatrixBench : public Benchmark
+{
+	std::string filename;
+	Matrix<real> mat;
+public:
+	TextMatrixBench() : mat("mat",sval(0),3) {}
+	virtual ~TextMatrixBench() { remove(filename.c_str()); }
+	virtual const char* name() const { return "read_text_matrix"; }
+	virtual const char* unit() const { return "rows"; }
+	virtual sval defaultSize() const { return 1000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		filename="RenderBenchmark_text.tmp";
+
+		FILE* f=fopen(filename.c_str(),"w");
+		fprintf(f,"%u 3\n",u32(p.size));
+		for(sval i=0;i<p.size;i++)
+			fprintf(f,"%.9f %.9f %.9f\n",rnd.unit(),rnd.unit()*100,rnd.unit()-0.5);
+		fclose(f);
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		mat.clear();
+		readTextFileMatrix(filename,1,&mat);
+		return mat.at(mat.n()-1,0);
+	}
+};
+
+/// Converting a raw image stream to a RealMatrix with the convert*StreamToRealMatrix functions, the size is the number of values
+template<typename T>
+class StreamConvertBench : public Benchmark
+{
+	typedef void (*ConvertFunc)(const char*,RealMatrix*);
+
+	const char* bname;
+	ConvertFunc func;
+	std::vector<T> stream;
+	RealMatrix mat;
+public:
+	StreamConvertBench(const char* bname,ConvertFunc func) : bname(bname), func(func), mat("mat",sval(0)) {}
+	virtual const char* name() const { return bname; }
+	virtual const char* unit() const { return "values"; }
+	virtual sval defaultSize() const { return 4000000; }
+
+	virtual void setup(const BenchParams& p)
+	{
+		BenchRandom rnd;
+		sval dim=_max<sval>(1,sval(sqrt(real(p.size))));
+		stream.resize(dim*dim);
+		mat.setN(dim*dim);
+		mat.setM(dim);
+
+		for(sval i=0;i<stream.size();i++)
+			stream[i]=T(rnd.next()&0x7fff);
+	}
+
+	virtual real run(const BenchParams& p)
+	{
+		func((const char*)&stream[0],&mat);
+		return mat.at(mat.n()-1,mat.m()-1);
+	}
+};
+
+static void printUsage()
+{
+	printf("Usage: RenderBenchmark [--list] [--filter NAME] [--size N] [--reps R] [--threads T]\n");
+}
+
+int main(int argc, char** argv)
+{
+	std::string filter;
+	bool listOnly=false;
+	BenchParams params;
+	params.size=0;
+	params.reps=5;
+	params.threads=0;
+
+	for(int i=1;i<argc;i++){
+		std::string arg=argv[i];
+		bool hasVal=i+1<argc;
+
+		if(arg=="--list")
+			listOnly=true;
+		else if(arg=="--filter" && hasVal)
+			filter=argv[++i];
+		else if(arg=="--size" && hasVal)
+			params.size=sval(atol(argv[++i]));
+		else if(arg=="--reps" && hasVal)
+			params.reps=_max<sval>(1,sval(atol(argv[++i])));
+		else if(arg=="--threads" && hasVal)
+			params.threads=sval(atol(argv[++i]));
+		else{
+			printUsage();
+			return 1;
+		}
+	}
+
+	std::vector<Benchmark*> benches;
+	benches.push_back(new RayTriMeshBench());
+	benches.push_back(new RayBVHBench());
+	benches.push_back(new PackVerticesBench());
+	benches.push_back(new ChunkMeshBench());
+	benches.push_back(new DepthSortBench());
+	benches.push_back(new ImageStackBench());
+	benches.push_back(new SpectrumBench());
+	benches.push_back(new TextureLUTBench());
+	benches.push_back(new TriNormsBench());
+	benches.push_back(new TextMatrixBench());
+	benches.push_back(new StreamConvertBench<u8>("convert_ubyte_stream",convertUByteStreamToRealMatrix));
+	benches.push_back(new StreamConvertBench<u16>("convert_ushort_stream",convertUShortStreamToRealMatrix));
+	benches.push_back(new StreamConvertBench<float>("convert_float_stream",convertFloatStreamToRealMatrix));
+
+	int result=0;
+
+	for(sval b=0;b<benches.size();b++){
+		Benchmark* bench=benches[b];
+
+		if(listOnly){
+			printf("%s\n",bench->name());
+			continue;
+		}
+
+		if(!filter.empty() && filter!=bench->name())
+			continue;
+
+		BenchParams p=params;
+		if(p.size==0)
+			p.size=bench->defaultSize();
+
+		try{
+			bench->setup(p);
+
+			real best=0, total=0, check=0;
+			for(sval r=0;r<p.reps;r++){
+				real start=getWallTime();
+				check=bench->run(p);
+				real elapsed=getWallTime()-start;
+
+				best=r==0 ? elapsed : _min(best,elapsed);
+				total+=elapsed;
+			}
+
+			printf("{\"name\": \"%s\", \"size\": %u, \"unit\": \"%s\", \"reps\": %u, \"threads\": %u, \"best_sec\": %.6f, \"mean_sec\": %.6f, "
+				"\"per_sec\": %.1f, \"peak_mem_kb\": %llu, \"check\": %g}\n",bench->name(),u32(p.size),bench->unit(),u32(p.reps),
+				u32(p.threads==0 ? getProcessorCount() : p.threads),best,total/p.reps,best>0 ? p.size/best : 0.0,
+				(unsigned long long)getPeakMemoryKB(),check);
+		}
+		catch(std::exception &e){
+			printf("{\"name\": \"%s\", \"error\": \"%s\"}\n",bench->name(),e.what());
+			result=1;
+		}
+
+		fflush(stdout);
+	}
+
+	for(sval b=0;b<benches.size();b++)
+		delete benches[b];
+
+	return result;
+}
@@ -66,6 +66,314 @@ void unlinkShared(const std::string& name)
 #endif
 }
 
+/// Arenas mapped in this process by shared name, so that each is mapped once however many matrices use it
+static std::map<std::string,SharedArena*> arenaRegistry;
+
+/// Guards arenaRegistry and the reference counts of every arena
+static Mutex arenaRegistryMutex;
+
+/// Choose a shared name for an arena from `name' and `counter' the same way Matrix::chooseSharedName() does for matrices
+static std::string chooseArenaSharedName(const std::string& name, int counter)
+{
+	std::ostringstream out;
+#ifdef WIN32
+	out << "Local\\" ;
+
+	if(counter>0)
+		out << std::hex << counter << std::dec;
+
+	out << GetCurrentProcessId() << name;
+	return out.str();
+#else
+
+#ifdef __APPLE__
+	if(counter>0)
+		out << std::hex << counter << std::dec;
+
+	out << getpid() << name;
+#else
+	out << "__viz__" << getppid() << "_" << getpid() << "_arena";
+	if(counter>0)
+		out << "_" << std::hex << counter << std::dec;
+
+	out << "_" << name;
+#endif // __APPLE__
+
+	std::string result=out.str();
+
+	for(sval i=0;i<result.size();i++)
+		if(result[i]=='/')
+			result[i]='_';
+
+	if(result.size()>=MAXSHMNAMLEN)
+		result.resize(MAXSHMNAMLEN-1);
+
+	return result;
+#endif // WIN32
+}
+
+SharedArena::SharedArena(const char* sharedname, size_t capacity, bool isCreator, const char* name) throw(MemException) : 
+	_name(name), _sharedname(sharedname), _capacity(capacity), _used(HeaderSize), _numAllocated(0), _refcount(0), _isCreator(isCreator), _pid(getPIDStr()), _base(NULL)
+{
+	if(capacity<=HeaderSize)
+		throw MemException("Shared arena capacity must be larger than its header");
+
+#ifdef WIN32
+	std::ostringstream out;
+
+	for(int c=1;;c++){
+#ifdef UNICODE
+		wchar_t namebuff[1024];
+		::MultiByteToWideChar(CP_ACP, NULL,_sharedname.c_str(), -1, namebuff,int(_sharedname.size()+1));
+#else
+		const char* namebuff=_sharedname.c_str();
+#endif // UNICODE
+
+		u64 size=capacity;
+		mapFile=CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(size>>32), DWORD(size&0xffffffff), namebuff);
+
+		// attempt to choose a unique shared name only when creating a segment
+		if(!isCreator || !mapFile || GetLastError()!=ERROR_ALREADY_EXISTS || c>=100000)
+			break;
+
+		CloseHandle(mapFile);
+		_sharedname=chooseArenaSharedName(_name,c);
+	}
+
+	if(!mapFile){
+		out << "Unable to open shared memory handle to " << _sharedname << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	_base=MapViewOfFile(mapFile,FILE_MAP_ALL_ACCESS,0,0,capacity);
+
+	if(!_base){
+		CloseHandle(mapFile);
+		out << "Unable to map view of memory file " << _sharedname << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+#else // Linux/OSX
+
+	int shm_fd=shm_open(_sharedname.c_str(), O_CREAT | O_RDWR | (isCreator ? O_EXCL : 0), S_IRUSR | S_IWUSR);
+
+	// attempt to choose a unique shared name only when creating a segment
+	for(int c=1;c<100000 && isCreator && shm_fd==-1 && errno==EEXIST;c++){
+		_sharedname=chooseArenaSharedName(_name,c);
+		shm_fd=shm_open(_sharedname.c_str(), O_CREAT | O_RDWR | O_EXCL, S_IRUSR | S_IWUSR);
+	}
+
+	if(shm_fd==-1)
+		throw MemException(std::string("Unable to open shared memory descriptor, filename:")+_sharedname,errno);
+
+	if(isCreator && ftruncate(shm_fd, capacity) == -1){
+		int err=errno;
+		close(shm_fd);
+		shm_unlink(_sharedname.c_str());
+		throw MemException(std::string("Unable to extend shared memory section, filename:")+_sharedname,err);
+	}
+
+	_base=mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+
+	close(shm_fd);
+
+	if(!_base || _base==MAP_FAILED){
+		int err=errno;
+		if(isCreator)
+			shm_unlink(_sharedname.c_str());
+
+		throw MemException("Unable to mmap shared memory arena",err);
+	}
+
+	addShared(_sharedname); // store the name for later cleanup
+#endif // Linux/OSX
+}
+
+SharedArena::~SharedArena()
+{
+	// failures here aren't thrown since there is nothing that can be done with the mapping after its last reference is gone
+#ifdef WIN32
+	UnmapViewOfFile(_base);
+	CloseHandle(mapFile);
+#else
+	munmap(_base,_capacity);
+
+	if(isCreator())
+		unlinkShared(_sharedname);
+#endif
+}
+
+SharedArena* SharedArena::create(const char* name, size_t capacity) throw(MemException)
+{
+	SharedArena* arena=new SharedArena(chooseArenaSharedName(name,0).c_str(),capacity,true,name);
+
+	critical(&arenaRegistryMutex){
+		arena->_refcount=1;
+		arenaRegistry[arena->_sharedname]=arena;
+	}
+
+	return arena;
+}
+
+SharedArena* SharedArena::attach(const char* sharedname, size_t capacity) throw(MemException)
+{
+	SharedArena* arena=NULL;
+
+	critical(&arenaRegistryMutex){
+		std::map<std::string,SharedArena*>::iterator it=arenaRegistry.find(sharedname);
+
+		// an arena inherited through fork() is left to the allocations made before the fork, this process maps its own
+		if(it!=arenaRegistry.end() && it->second->isMappedHere())
+			arena=it->second;
+		else{
+			arena=new SharedArena(sharedname,capacity,false,sharedname);
+			arenaRegistry[sharedname]=arena;
+		}
+
+		arena->_refcount++;
+
+		critical(&arena->mutex){
+			arena->_numAllocated++;
+		}
+
+		// the creator's allocation state is local to its process so other processes count their use in the segment itself
+		if(arena->isCounted())
+			atomic_add_u32(arena->attachCount(),1);
+	}
+
+	return arena;
+}
+
+bool SharedArena::fits(size_t size) const
+{
+	size_t start=((_used+Alignment-1)/Alignment)*Alignment;
+	return start<=_capacity && size<=_capacity-start;
+}
+
+bool SharedArena::canAllocate(size_t size) const
+{
+	critical(&mutex){
+		return fits(size);
+	}
+
+	return false; // never reached
+}
+
+size_t SharedArena::allocate(size_t size) throw(MemException)
+{
+	if(!isCreator())
+		throw MemException("Only the process creating a shared arena can allocate from it");
+
+	size_t start=0;
+
+	critical(&mutex){
+		if(!fits(size)){
+			std::ostringstream out;
+			out << "Shared arena " << _sharedname << " cannot allocate " << size << " bytes, " << (_capacity-_used) << " free";
+			throw MemException(out.str());
+		}
+
+		start=((_used+Alignment-1)/Alignment)*Alignment;
+		_used=start+size;
+		_numAllocated++;
+	}
+
+	memset(ptr(start),0,size);
+	incRef();
+	return start;
+}
+
+void SharedArena::release()
+{
+	critical(&mutex){
+		_numAllocated--;
+	}
+
+	if(isCounted())
+		atomic_add_u32(attachCount(),-1);
+
+	decRef();
+}
+
+void SharedArena::reset() throw(MemException)
+{
+	critical(&mutex){
+		if(_numAllocated>0 || numAttached()>0)
+			throw MemException("Cannot reset shared arena with allocations still in use");
+
+		_used=HeaderSize;
+	}
+}
+
+void SharedArena::incRef()
+{
+	critical(&arenaRegistryMutex){
+		_refcount++;
+	}
+}
+
+void SharedArena::decRef()
+{
+	bool isLast=false;
+
+	critical(&arenaRegistryMutex){
+		isLast=(--_refcount)==0;
+
+		// after a fork() the registry may hold this process's own mapping in place of this inherited arena
+		std::map<std::string,SharedArena*>::iterator it=arenaRegistry.find(_sharedname);
+		if(isLast && it!=arenaRegistry.end() && it->second==this)
+			arenaRegistry.erase(it);
+	}
+
+	if(isLast)
+		delete this;
+}
+
+SharedArenaPool::~SharedArenaPool()
+{
+	for(sval i=0;i<arenas.size();i++)
+		arenas[i]->decRef();
+}
+
+SharedArena* SharedArenaPool::getArena(sval i) const throw(IndexException)
+{
+	if(i>=arenas.size())
+		throw IndexException("i",i,arenas.size());
+
+	return arenas[i];
+}
+
+SharedArena* SharedArenaPool::allocate(size_t size, size_t* offset) throw(MemException)
+{
+	SharedArena* arena=NULL;
+
+	critical(&mutex){
+		if(arenas.size()>0 && arenas.back()->canAllocate(size))
+			arena=arenas.back();
+
+		// reuse an arena whose allocations have all been released by this and other processes, moving it to the back to allocate from next time
+		for(sval i=0;!arena && i<arenas.size();i++){
+			if(arenas[i]->numAllocated()==0 && arenas[i]->numAttached()==0 && arenas[i]->getCapacity()>=size+SharedArena::HeaderSize){
+				arena=arenas[i];
+				arena->reset();
+				arenas.erase(arenas.begin()+i);
+				arenas.push_back(arena);
+			}
+		}
+
+		if(!arena){
+			std::ostringstream out;
+			out << _name << "_" << arenas.size();
+			arena=SharedArena::create(out.str().c_str(),_max(_arenaSize,size+SharedArena::HeaderSize));
+			arenas.push_back(arena);
+		}
+
+		*offset=arena->allocate(size);
+	}
+
+	return arena;
+}
+
 
 #ifdef WIN32
 std::string formatLastErrorMsg()
@@ -87,214 +395,2352 @@ std::string formatLastErrorMsg()
 }
 #endif
 
-void readBinaryFileToBuff(const char* filename,size_t offset,void* dest,size_t len) throw(MemException)
+sval getProcessorCount()
 {
 #ifdef WIN32
-	std::ostringstream out;
-#ifdef UNICODE
-	wchar_t namebuff[1024];
-	::MultiByteToWideChar(CP_ACP, NULL,filename, -1, namebuff,int(strlen(filename)+1));
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return _max<sval>(1,sval(info.dwNumberOfProcessors));
 #else
-	const char* namebuff=filename;
+	long count=sysconf(_SC_NPROCESSORS_ONLN);
+	return count>0 ? sval(count) : 1;
 #endif
+}
 
-	HANDLE file = CreateFile(namebuff, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+real getWallTime()
+{
+#ifdef WIN32
+	LARGE_INTEGER freq,count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return real(count.QuadPart)/real(freq.QuadPart);
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return real(ts.tv_sec)+real(ts.tv_nsec)*1.0e-9;
+#endif
+}
 
-	if(file == INVALID_HANDLE_VALUE){
-		out << "Failed to open file " << filename << ": " << formatLastErrorMsg();
-		throw MemException(out.str());
-	}
+void waitBackoff(sval attempt)
+{
+#ifdef WIN32
+	Sleep(attempt<16 ? 0 : 1);
+#else
+	if(attempt<16)
+		sched_yield();
+	else
+		usleep(attempt<64 ? 50 : 500);
+#endif
+}
 
-	DWORD size=GetFileSize(file,NULL);
-	HANDLE mapFile=CreateFileMapping(file,NULL,PAGE_READONLY,0,size,NULL);
+#if !defined(WIN32) && !defined(__APPLE__)
+/// Get the CLOCK_REALTIME absolute deadline `timeout' seconds from now, as needed by the pthread timed lock functions
+static timespec getLockDeadline(real timeout)
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
 
-	if(mapFile == INVALID_HANDLE_VALUE){
-		CloseHandle(file);
-		out << "Failed to create file mapping for " << filename << ": " << formatLastErrorMsg();
-		throw MemException(out.str());
+	real secs=std::floor(timeout);
+	ts.tv_sec+=time_t(secs);
+	ts.tv_nsec+=long((timeout-secs)*1.0e9);
+
+	if(ts.tv_nsec>=1000000000L){
+		ts.tv_sec++;
+		ts.tv_nsec-=1000000000L;
 	}
 
-	char* ptr=(char*)MapViewOfFile(mapFile,FILE_MAP_READ,0,0,0);
+	return ts;
+}
+#endif
 
-	if(!ptr){
-		CloseHandle(mapFile);
-		CloseHandle(file);
-		out << "Unable to map view of file " << filename << ": " << formatLastErrorMsg();
-		throw MemException(out.str());
+/// Poll the locking function `trylockfunc' with argument `m' until it succeeds or `timeout' seconds have passed
+template<typename M, typename F>
+static bool pollLock(M* m, F trylockfunc, real timeout)
+{
+	real deadline=getWallTime()+timeout;
+
+	for(sval attempt=0;;attempt++){
+		if(trylockfunc(m))
+			return true;
+
+		if(getWallTime()>=deadline)
+			return false;
+
+		waitBackoff(attempt);
 	}
+}
 
-	memcpy(dest,ptr+offset,len);
+#ifdef WIN32
+static bool trylockCS(CRITICAL_SECTION* m) { return TryEnterCriticalSection(m)!=0; }
+static bool trylockShared(SRWLOCK* m) { return TryAcquireSRWLockShared(m)!=0; }
+static bool trylockExclusive(SRWLOCK* m) { return TryAcquireSRWLockExclusive(m)!=0; }
+#else
+static bool trylockMutex(pthread_mutex_t* m) { return pthread_mutex_trylock(m)==0; }
+static bool trylockRead(pthread_rwlock_t* m) { return pthread_rwlock_tryrdlock(m)==0; }
+static bool trylockWrite(pthread_rwlock_t* m) { return pthread_rwlock_trywrlock(m)==0; }
+#endif
 
-	UnmapViewOfFile(ptr);
-	CloseHandle(mapFile);
-	CloseHandle(file);
+bool Mutex::timedLock(real timeout)
+{
+#ifdef WIN32
+	return pollLock(&_mutex,trylockCS,timeout);
+#elif defined(__APPLE__)
+	return pollLock(&_mutex,trylockMutex,timeout); // no pthread_mutex_timedlock on OSX
 #else
-	struct stat info;
-	int fd=open(filename,O_RDONLY);
-	fstat(fd,&info);
+	if(trylockMutex(&_mutex)) // avoid the clock call in the uncontended case
+		return true;
 
-	char* map=(char*)mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	timespec deadline=getLockDeadline(timeout);
+	return pthread_mutex_timedlock(&_mutex,&deadline)==0;
+#endif
+}
 
-	if(map==MAP_FAILED)
-		throw MemException("Failed to mmap file");
+#ifdef WIN32
+Semaphore::Semaphore() { _sem=CreateSemaphore(NULL,0,MAXLONG,NULL); }
+Semaphore::~Semaphore() { CloseHandle(_sem); }
+void Semaphore::post() { ReleaseSemaphore(_sem,1,NULL); }
+void Semaphore::wait() { WaitForSingleObject(_sem,INFINITE); }
+#else
+Semaphore::Semaphore() : _count(0)
+{
+	pthread_mutex_init(&_mutex,NULL);
+	pthread_cond_init(&_cond,NULL);
+}
 
-	memcpy(dest,map+offset,len);
+Semaphore::~Semaphore()
+{
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_mutex);
+}
 
-	close(fd);
+void Semaphore::post()
+{
+	pthread_mutex_lock(&_mutex);
+	_count++;
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
 
-	if(munmap(map,len))
-		throw MemException("Failed to munmap file");
-#endif
+void Semaphore::wait()
+{
+	pthread_mutex_lock(&_mutex);
+	while(_count==0) // loop since waits can wake spuriously
+		pthread_cond_wait(&_cond,&_mutex);
+	_count--;
+	pthread_mutex_unlock(&_mutex);
 }
+#endif
 
-void storeBufftoBinaryFile(const char* filename,void* src,size_t srcsize,int* header, size_t headerlen) throw(MemException)
+bool ReadWriteMutex::readLock(real timeout)
 {
 #ifdef WIN32
-	std::ostringstream out;
-#ifdef UNICODE
-	wchar_t namebuff[1024];
+	if(timeout<=0){
+		AcquireSRWLockShared(&_lock);
+		return true;
+	}
+	return pollLock(&_lock,trylockShared,timeout);
+#else
+	if(timeout<=0)
+		return pthread_rwlock_rdlock(&_lock)==0;
+#ifdef __APPLE__
+	return pollLock(&_lock,trylockRead,timeout);
+#else
+	timespec deadline=getLockDeadline(timeout);
+	return trylockRead(&_lock) || pthread_rwlock_timedrdlock(&_lock,&deadline)==0;
+#endif
+#endif
+}
 
-	::MultiByteToWideChar(CP_ACP, NULL,filename, -1, namebuff,int(strlen(filename)+1));
+bool ReadWriteMutex::writeLock(real timeout)
+{
+#ifdef WIN32
+	if(timeout<=0){
+		AcquireSRWLockExclusive(&_lock);
+		return true;
+	}
+	return pollLock(&_lock,trylockExclusive,timeout);
 #else
-	const char* namebuff=filename;
+	if(timeout<=0)
+		return pthread_rwlock_wrlock(&_lock)==0;
+#ifdef __APPLE__
+	return pollLock(&_lock,trylockWrite,timeout);
+#else
+	timespec deadline=getLockDeadline(timeout);
+	return trylockWrite(&_lock) || pthread_rwlock_timedwrlock(&_lock,&deadline)==0;
 #endif
-	HANDLE file = CreateFile(namebuff, GENERIC_WRITE|GENERIC_READ, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+}
 
-	if(file == INVALID_HANDLE_VALUE){
-		out << "Failed to open/create file " << filename << ": " << formatLastErrorMsg();
-		throw MemException(out.str());
+/// State shared between the threads of one runParallelTask() call, threads take blocks of items by advancing `next'
+struct ParallelTaskState
+{
+	ParallelTask* task;
+	sval numItems;
+	sval chunkSize;
+	sval next;
+	Mutex mutex;
+	std::exception* error; // copy of the first exception thrown by a thread
+
+	/// Store a copy of the first exception thrown and stop other threads from taking more work
+	template<typename E> void setError(const E& e)
+	{
+		critical(&mutex){
+			if(error==NULL)
+				error=new E(e);
+			next=numItems;
+		}
 	}
+};
 
-	DWORD totalsize=DWORD(srcsize+headerlen*sizeof(int));
+/// Argument for each thread of a runParallelTask() call
+struct ParallelTaskThread
+{
+	ParallelTaskState* state;
+	sval threadIndex;
+};
 
-	//SetFilePointer(file,totalsize-1,NULL,0);
-	//WriteFile(file,"",1,NULL,NULL);
+static void runParallelTaskThread(ParallelTaskState* state, sval threadIndex)
+{
+	while(true){
+		sval start=0;
 
-	HANDLE mapFile=CreateFileMapping(file,NULL,PAGE_READWRITE,0,totalsize,NULL);
+		critical(&state->mutex){
+			start=state->next;
+			state->next=_min(state->numItems,start+state->chunkSize);
+		}
 
-	if(mapFile == INVALID_HANDLE_VALUE){
-		CloseHandle(file);
-		out << "Failed to create file mapping for " << filename << ": " << formatLastErrorMsg();
-		throw MemException(out.str());
-	}
+		if(start>=state->numItems)
+			break;
 
-	char* map=(char*)MapViewOfFile(mapFile,FILE_MAP_READ|FILE_MAP_WRITE,0,0,0);
+		try{
+			state->task->run(start,_min(state->numItems,start+state->chunkSize),threadIndex);
+		}
+		catch(IndexException &e){ state->setError(e); }
+		catch(ValueException &e){ state->setError(e); }
+		catch(MemException &e){ state->setError(e); }
+		catch(RenderException &e){ state->setError(e); }
+		catch(std::exception &e){ state->setError(RenderException(e.what())); }
+	}
+}
 
-	if(!map){
-		CloseHandle(mapFile);
-		CloseHandle(file);
+#ifdef WIN32
+static DWORD WINAPI parallelTaskThreadFunc(LPVOID arg)
+{
+	ParallelTaskThread* t=(ParallelTaskThread*)arg;
+	runParallelTaskThread(t->state,t->threadIndex);
+	return 0;
+}
+#else
+static void* parallelTaskThreadFunc(void* arg)
+{
+	ParallelTaskThread* t=(ParallelTaskThread*)arg;
+	runParallelTaskThread(t->state,t->threadIndex);
+	return NULL;
+}
+#endif
+
+void runParallelTask(ParallelTask* task, sval numItems, sval numThreads, sval chunkSize) throw(IndexException,ValueException,MemException,RenderException)
+{
+	if(numItems==0)
+		return;
+
+	if(numThreads==0)
+		numThreads=getProcessorCount();
+
+	if(chunkSize==0) // aim for several blocks per thread so that uneven workloads are balanced
+		chunkSize=_max<sval>(1,numItems/(numThreads*8));
+
+	numThreads=_max<sval>(1,_min(numThreads,(numItems+chunkSize-1)/chunkSize)); // no more threads than blocks
+
+	ParallelTaskState state;
+	state.task=task;
+	state.numItems=numItems;
+	state.chunkSize=chunkSize;
+	state.next=0;
+	state.error=NULL;
+
+	std::vector<ParallelTaskThread> args(numThreads);
+#ifdef WIN32
+	std::vector<HANDLE> threads;
+#else
+	std::vector<pthread_t> threads;
+#endif
+
+	for(sval i=0;i<numThreads;i++){
+		args[i].state=&state;
+		args[i].threadIndex=i;
+	}
+
+	// start threads 1 to numThreads-1, the calling thread acts as thread 0
+	for(sval i=1;i<numThreads;i++){
+#ifdef WIN32
+		HANDLE h=CreateThread(NULL,0,parallelTaskThreadFunc,&args[i],0,NULL);
+		if(h!=NULL)
+			threads.push_back(h);
+#else
+		pthread_t t;
+		if(pthread_create(&t,NULL,parallelTaskThreadFunc,&args[i])==0)
+			threads.push_back(t);
+#endif
+		// if a thread can't be created the work is done by those that were, ultimately by the calling thread alone
+	}
+
+	runParallelTaskThread(&state,0);
+
+	for(size_t i=0;i<threads.size();i++){
+#ifdef WIN32
+		WaitForSingleObject(threads[i],INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i],NULL);
+#endif
+	}
+
+	if(state.error){
+		std::exception* err=state.error;
+		IndexException* ie=dynamic_cast<IndexException*>(err);
+		ValueException* ve=dynamic_cast<ValueException*>(err);
+		MemException* me=dynamic_cast<MemException*>(err);
+		RenderException* re=dynamic_cast<RenderException*>(err);
+
+		if(ie){ IndexException e(*ie); delete err; throw e; }
+		if(ve){ ValueException e(*ve); delete err; throw e; }
+		if(me){ MemException e(*me); delete err; throw e; }
+
+		RenderException e(*re);
+		delete err;
+		throw e;
+	}
+}
+
+#ifdef WIN32
+static DWORD WINAPI workerThreadFunc(LPVOID arg)
+{
+	((WorkerThread*)arg)->run();
+	return 0;
+}
+#else
+static void* workerThreadFunc(void* arg)
+{
+	((WorkerThread*)arg)->run();
+	return NULL;
+}
+#endif
+
+bool WorkerThread::start()
+{
+	if(started)
+		return false;
+
+#ifdef WIN32
+	thread=CreateThread(NULL,0,workerThreadFunc,this,0,NULL);
+	started=thread!=NULL;
+#else
+	started=pthread_create(&thread,NULL,workerThreadFunc,this)==0;
+#endif
+
+	return started;
+}
+
+void WorkerThread::join()
+{
+	if(!started)
+		return;
+
+#ifdef WIN32
+	WaitForSingleObject(thread,INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread,NULL);
+#endif
+
+	started=false;
+}
+
+bool getFileSize(const char* filename,size_t* size)
+{
+#ifdef WIN32
+	struct _stati64 info;
+	if(_stati64(filename,&info))
+		return false;
+#else
+	struct stat info;
+	if(stat(filename,&info))
+		return false;
+#endif
+	*size=size_t(info.st_size);
+	return true;
+}
+
+void readBinaryFileToBuff(const char* filename,size_t offset,void* dest,size_t len) throw(MemException)
+{
+#ifdef WIN32
+	std::ostringstream out;
+#ifdef UNICODE
+	wchar_t namebuff[1024];
+	::MultiByteToWideChar(CP_ACP, NULL,filename, -1, namebuff,int(strlen(filename)+1));
+#else
+	const char* namebuff=filename;
+#endif
+
+	HANDLE file = CreateFile(namebuff, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(file == INVALID_HANDLE_VALUE){
+		out << "Failed to open file " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	DWORD size=GetFileSize(file,NULL);
+	HANDLE mapFile=CreateFileMapping(file,NULL,PAGE_READONLY,0,size,NULL);
+
+	if(mapFile == INVALID_HANDLE_VALUE){
+		CloseHandle(file);
+		out << "Failed to create file mapping for " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	char* ptr=(char*)MapViewOfFile(mapFile,FILE_MAP_READ,0,0,0);
+
+	if(!ptr){
+		CloseHandle(mapFile);
+		CloseHandle(file);
+		out << "Unable to map view of file " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	memcpy(dest,ptr+offset,len);
+
+	UnmapViewOfFile(ptr);
+	CloseHandle(mapFile);
+	CloseHandle(file);
+#else
+	struct stat info;
+	int fd=open(filename,O_RDONLY);
+
+	if(fd==-1)
+		throw MemException(std::string("Failed to open file ")+filename,errno);
+
+	fstat(fd,&info);
+
+	if(offset+len>size_t(info.st_size)){
+		close(fd);
+		throw MemException(std::string("File too short to read requested data: ")+filename);
+	}
+
+	char* map=(char*)mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(map==MAP_FAILED)
+		throw MemException("Failed to mmap file",errno);
+
+	memcpy(dest,map+offset,len);
+
+	if(munmap(map,info.st_size))
+		throw MemException("Failed to munmap file",errno);
+#endif
+}
+
+void* mapFileRegion(const char* filename,size_t offset,size_t len,bool copyOnWrite,void** base,size_t* baselen) throw(MemException)
+{
+	std::ostringstream out;
+
+	if(len==0)
+		throw MemException("Cannot map empty file region");
+
+#ifdef WIN32
+#ifdef UNICODE
+	wchar_t namebuff[1024];
+	::MultiByteToWideChar(CP_ACP, NULL,filename, -1, namebuff,int(strlen(filename)+1));
+#else
+	const char* namebuff=filename;
+#endif
+
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+
+	size_t mapoffset=offset-(offset%sysinfo.dwAllocationGranularity); // views must start on an allocation granularity boundary
+	size_t maplen=len+(offset-mapoffset);
+
+	HANDLE file = CreateFile(namebuff, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(file == INVALID_HANDLE_VALUE){
+		out << "Failed to open file " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file,&size) || offset+len>size_t(size.QuadPart)){
+		CloseHandle(file);
+		out << "File too short to map requested region: " << filename;
+		throw MemException(out.str());
+	}
+
+	HANDLE mapFile=CreateFileMapping(file,NULL,copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY,0,0,NULL);
+
+	if(!mapFile){
+		CloseHandle(file);
+		out << "Failed to create file mapping for " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	u64 off64=mapoffset;
+	char* ptr=(char*)MapViewOfFile(mapFile,copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ,DWORD(off64>>32),DWORD(off64&0xffffffff),maplen);
+
+	// the view keeps the mapping object alive so the handles aren't needed past this point
+	CloseHandle(mapFile);
+	CloseHandle(file);
+
+	if(!ptr){
+		out << "Unable to map view of file " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+#else
+	size_t mapoffset=offset-(offset%sysconf(_SC_PAGE_SIZE)); // mmap offsets must be page aligned
+	size_t maplen=len+(offset-mapoffset);
+	struct stat info;
+
+	int fd=open(filename,O_RDONLY);
+
+	if(fd==-1)
+		throw MemException(std::string("Failed to open file ")+filename,errno);
+
+	fstat(fd,&info);
+
+	if(offset+len>size_t(info.st_size)){
+		close(fd);
+		out << "File too short to map requested region: " << filename;
+		throw MemException(out.str());
+	}
+
+	// pages are only read from the file when first accessed, a private mapping keeps writes local to this process
+	char* ptr=(char*)mmap(0, maplen, copyOnWrite ? PROT_READ|PROT_WRITE : PROT_READ, copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, mapoffset);
+	close(fd);
+
+	if(ptr==MAP_FAILED)
+		throw MemException(std::string("Failed to mmap file ")+filename,errno);
+#endif
+
+	*base=ptr;
+	*baselen=maplen;
+	return ptr+(offset-mapoffset);
+}
+
+void unmapFileRegion(void* base,size_t baselen) throw(MemException)
+{
+#ifdef WIN32
+	if(!UnmapViewOfFile(base))
+		throw MemException("Failed to unmap file view");
+#else
+	if(munmap(base,baselen))
+		throw MemException("Failed to munmap file",errno);
+#endif
+}
+
+void storeBufftoBinaryFile(const char* filename,void* src,size_t srcsize,int* header, size_t headerlen) throw(MemException)
+{
+#ifdef WIN32
+	std::ostringstream out;
+#ifdef UNICODE
+	wchar_t namebuff[1024];
+
+	::MultiByteToWideChar(CP_ACP, NULL,filename, -1, namebuff,int(strlen(filename)+1));
+#else
+	const char* namebuff=filename;
+#endif
+	HANDLE file = CreateFile(namebuff, GENERIC_WRITE|GENERIC_READ, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(file == INVALID_HANDLE_VALUE){
+		out << "Failed to open/create file " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	DWORD totalsize=DWORD(srcsize+headerlen*sizeof(int));
+
+	//SetFilePointer(file,totalsize-1,NULL,0);
+	//WriteFile(file,"",1,NULL,NULL);
+
+	HANDLE mapFile=CreateFileMapping(file,NULL,PAGE_READWRITE,0,totalsize,NULL);
+
+	if(mapFile == INVALID_HANDLE_VALUE){
+		CloseHandle(file);
+		out << "Failed to create file mapping for " << filename << ": " << formatLastErrorMsg();
+		throw MemException(out.str());
+	}
+
+	char* map=(char*)MapViewOfFile(mapFile,FILE_MAP_READ|FILE_MAP_WRITE,0,0,0);
+
+	if(!map){
+		CloseHandle(mapFile);
+		CloseHandle(file);
 		out << "Unable to map view of file " << filename << ": " << formatLastErrorMsg();
 		throw MemException(out.str());
 	}
 
-	if(headerlen>0)
-		memcpy(map,header,headerlen*sizeof(int));
+	if(headerlen>0)
+		memcpy(map,header,headerlen*sizeof(int));
+
+	memcpy(map+headerlen*sizeof(int),src,srcsize);
+
+	UnmapViewOfFile(map);
+	CloseHandle(mapFile);
+	CloseHandle(file);
+#else
+	size_t totalsize=srcsize+headerlen*sizeof(int);
+	int fd=open(filename,O_RDWR|O_CREAT|O_TRUNC,(mode_t)0600);
+
+	if(fd==-1)
+		throw MemException(std::string("Failed to open/create file ")+filename,errno);
+
+	if(totalsize==0){ // nothing to map, the truncated file is the result
+		close(fd);
+		return;
+	}
+
+	// extend the file to its final size by writing its last byte, mapping past the end of a file is invalid
+	if(lseek(fd,totalsize-1,SEEK_SET)==-1 || write(fd,"",1)!=1){
+		int err=errno;
+		close(fd);
+		throw MemException(std::string("Failed to resize file ")+filename,err);
+	}
+
+	char* map=(char*)mmap(0, totalsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	int err=errno;
+	close(fd);
+
+	if(map==MAP_FAILED)
+		throw MemException(std::string("Failed to mmap file ")+filename,err);
+
+	if(headerlen>0)
+		memcpy(map,header,headerlen*sizeof(int));
+
+	memcpy(map+headerlen*sizeof(int),src,srcsize);
+
+	if(munmap(map,totalsize))
+		throw MemException("Failed to munmap file",errno);
+#endif
+}
+
+static const char ContainerMagic[8]={'E','I','D','M','A','T','R','X'};
+static const u32 ContainerEndianMark=0x01020304;
+static const u32 ContainerVersion=1;
+static const size_t ContainerDefaultChunkSize=1024*1024;
+static const size_t ContainerMaxChunkSize=0x40000000; // chunk sizes are stored in 64 bits but the codec works within 32 bit offsets
+
+static const sval LZMinMatch=4;
+static const sval LZHashBits=12;
+static const sval LZMaxOffset=0xffff;
+
+static inline u32 readLZ32(const u8* p)
+{
+	u32 v;
+	memcpy(&v,p,sizeof(u32));
+	return v;
+}
+
+static inline u32 hashLZ(u32 v)
+{
+	return (v*2654435761U)>>(32-LZHashBits);
+}
+
+/// Write `len' for a token nibble whose value was 15 as a sequence of bytes terminated by one less than 255
+static inline u8* writeLZLength(u8* op, size_t len)
+{
+	for(;len>=255;len-=255)
+		*op++=255;
+
+	*op++=u8(len);
+	return op;
+}
+
+/**
+ * Compress `len' bytes from `src' into `dest' with an LZ77 codec in the style of LZ4, returning the compressed size or 0 if this
+ * doesn't fit in `destlen' bytes. Each sequence is a token byte holding the literal count and match length minus 4 in its nibbles,
+ * extended by further length bytes if either is 15, followed by the literals, a 16 bit offset back into the output, and the
+ * match length extension. The last sequence has only literals. Matches are found through a hash of the next 4 bytes which only
+ * remembers the most recent position, the search skipping ahead faster through data that isn't compressing.
+ */
+static size_t compressLZ(const u8* src, size_t len, u8* dest, size_t destlen)
+{
+	u32 table[1<<LZHashBits]; // stores position+1 of the last occurrence of each hash, 0 for none
+	memset(table,0,sizeof(table));
+
+	const u8* ip=src;
+	const u8* anchor=src;
+	const u8* iend=src+len;
+	const u8* mlimit=len>LZMinMatch ? iend-LZMinMatch : src;
+	u8* op=dest;
+	u8* oend=dest+destlen;
+	sval misses=0;
+
+	while(ip<mlimit){
+		u32 seq=readLZ32(ip);
+		u32 h=hashLZ(seq);
+		u32 last=table[h];
+		const u8* cand=src+(last-1);
+		table[h]=u32(ip-src)+1;
+
+		if(last==0 || size_t(ip-cand)>LZMaxOffset || readLZ32(cand)!=seq){
+			ip+=1+(misses++>>6);
+			continue;
+		}
+
+		misses=0;
+		const u8* mend=ip+LZMinMatch;
+		while(mend<iend && *mend==cand[mend-ip])
+			mend++;
+
+		size_t litlen=ip-anchor;
+		size_t matchlen=(mend-ip)-LZMinMatch;
+
+		if(size_t(oend-op)<1+litlen/255+1+litlen+2+matchlen/255+1)
+			return 0;
+
+		u8* token=op++;
+		*token=u8((_min<size_t>(litlen,15)<<4)|_min<size_t>(matchlen,15));
+
+		if(litlen>=15)
+			op=writeLZLength(op,litlen-15);
+
+		memcpy(op,anchor,litlen);
+		op+=litlen;
+
+		size_t offset=ip-cand;
+		*op++=u8(offset&0xff);
+		*op++=u8(offset>>8);
+
+		if(matchlen>=15)
+			op=writeLZLength(op,matchlen-15);
+
+		if(mend-2>ip && mend-2<mlimit) // remember a position near the match end so repeated runs are found again
+			table[hashLZ(readLZ32(mend-2))]=u32(mend-2-src)+1;
+
+		ip=anchor=mend;
+	}
+
+	size_t litlen=iend-anchor;
+
+	if(size_t(oend-op)<1+litlen/255+1+litlen)
+		return 0;
+
+	*op++=u8(_min<size_t>(litlen,15)<<4);
+	if(litlen>=15)
+		op=writeLZLength(op,litlen-15);
+
+	memcpy(op,anchor,litlen);
+	op+=litlen;
+
+	return op-dest;
+}
+
+/// Reads a length extension, returning false if it runs past `iend'
+static inline bool readLZLength(const u8*& ip, const u8* iend, size_t& len)
+{
+	u8 b;
+	do{
+		if(ip>=iend)
+			return false;
+		b=*ip++;
+		len+=b;
+	} while(b==255);
+
+	return true;
+}
+
+/**
+ * Decompress `len' bytes of compressLZ() output from `src' into the `destlen' bytes of `dest'. Every length and offset is
+ * checked against the input and output bounds, returning false if the data is corrupt or doesn't decompress to exactly
+ * `destlen' bytes.
+ */
+static bool decompressLZ(const u8* src, size_t len, u8* dest, size_t destlen)
+{
+	const u8* ip=src;
+	const u8* iend=src+len;
+	u8* op=dest;
+	u8* oend=dest+destlen;
+
+	while(ip<iend){
+		u8 token=*ip++;
+		size_t litlen=token>>4;
+
+		if(litlen==15 && !readLZLength(ip,iend,litlen))
+			return false;
+
+		if(litlen>size_t(iend-ip) || litlen>size_t(oend-op))
+			return false;
+
+		memcpy(op,ip,litlen);
+		op+=litlen;
+		ip+=litlen;
+
+		if(ip==iend) // last sequence has only literals
+			return op==oend;
+
+		if(iend-ip<2)
+			return false;
+
+		size_t offset=size_t(ip[0])|(size_t(ip[1])<<8);
+		ip+=2;
+
+		size_t matchlen=token&15;
+		if(matchlen==15 && !readLZLength(ip,iend,matchlen))
+			return false;
+
+		matchlen+=LZMinMatch;
+
+		if(offset==0 || offset>size_t(op-dest) || matchlen>size_t(oend-op))
+			return false;
+
+		const u8* match=op-offset;
+
+		if(offset>=matchlen)
+			memcpy(op,match,matchlen);
+		else{ // overlapping match repeats the last `offset' bytes, copy a byte at a time so each reads what was just written
+			for(size_t i=0;i<matchlen;i++)
+				op[i]=match[i];
+		}
+
+		op+=matchlen;
+	}
+
+	return false;
+}
+
+/// Rearrange the `num' elements of `elemsize' bytes in `src' into `dest' as planes of each element's first byte, then second, etc.
+static void shuffleBytes(const u8* src, u8* dest, size_t num, size_t elemsize)
+{
+	for(size_t b=0;b<elemsize;b++){
+		u8* plane=dest+b*num;
+		for(size_t i=0;i<num;i++)
+			plane[i]=src[i*elemsize+b];
+	}
+}
+
+/// Reverses shuffleBytes()
+static void unshuffleBytes(const u8* src, u8* dest, size_t num, size_t elemsize)
+{
+	for(size_t b=0;b<elemsize;b++){
+		const u8* plane=src+b*num;
+		for(size_t i=0;i<num;i++)
+			dest[i*elemsize+b]=plane[i];
+	}
+}
+
+/// Adler-32 checksum of `len' bytes from `data', stored for each chunk to detect corrupted files
+static u32 checksumAdler32(const u8* data, size_t len)
+{
+	u32 a=1,b=0;
+
+	while(len>0){
+		size_t block=_min<size_t>(len,5552); // largest block before `b' can overflow 32 bits
+		len-=block;
+
+		for(size_t i=0;i<block;i++){
+			a+=data[i];
+			b+=a;
+		}
+
+		data+=block;
+		a%=65521;
+		b%=65521;
+	}
+
+	return (b<<16)|a;
+}
+
+static void appendContainerU32(std::string& out, u32 v)
+{
+	out.append((const char*)&v,sizeof(u32));
+}
+
+static void appendContainerU64(std::string& out, u64 v)
+{
+	out.append((const char*)&v,sizeof(u64));
+}
+
+static void appendContainerStr(std::string& out, const std::string& str)
+{
+	appendContainerU32(out,u32(str.size()));
+	out.append(str);
+}
+
+/// Returns the size in bytes of the chunk `chunk', the last chunk holding the rows left over from the others
+static size_t containerChunkSize(const MatrixContainerInfo& info, sval chunk)
+{
+	sval rows=_min(info.chunkRows,info.n-chunk*info.chunkRows);
+	return size_t(rows)*info.m*info.elemsize;
+}
+
+/// Shuffles and compresses a range of chunks from a batch, chunks which don't become smaller are left empty to be stored raw
+class ContainerCompressTask : public ParallelTask
+{
+public:
+	const u8* src;
+	const MatrixContainerInfo& info;
+	sval firstChunk;
+	std::vector<std::string>& outs;
+	std::vector<std::vector<u8> > temps;
+
+	ContainerCompressTask(const u8* src, const MatrixContainerInfo& info, sval firstChunk, std::vector<std::string>& outs, sval numThreads) :
+		src(src), info(info), firstChunk(firstChunk), outs(outs), temps(numThreads)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		std::vector<u8>& temp=temps[threadIndex];
+		size_t chunksize=size_t(info.chunkRows)*info.m*info.elemsize;
+		temp.resize(chunksize*2);
+
+		for(sval i=start;i<end;i++){
+			sval chunk=firstChunk+i;
+			size_t rawsize=containerChunkSize(info,chunk);
+			const u8* raw=src+size_t(chunk)*chunksize;
+			u8* shuffled=&temp[0];
+			u8* packed=&temp[chunksize];
+
+			if(info.elemsize>1)
+				shuffleBytes(raw,shuffled,rawsize/info.elemsize,info.elemsize);
+			else
+				shuffled=(u8*)raw;
+
+			size_t packedsize=rawsize>1 ? compressLZ(shuffled,rawsize,packed,rawsize-1) : 0;
+
+			if(packedsize>0)
+				outs[i].assign((const char*)packed,packedsize);
+			else
+				outs[i].clear();
+		}
+	}
+};
+
+void storeBuffToContainerFile(const char* filename, const void* src, const MatrixContainerInfo& info, sval numThreads)
+		throw(IndexException,ValueException,MemException,RenderException)
+{
+	MatrixContainerInfo cinfo=info;
+	size_t rowsize=size_t(info.m)*info.elemsize;
+
+	if(info.elemsize==0)
+		throw ValueException("info","Element size must be greater than 0",__FILE__,__LINE__);
+
+	if(rowsize>ContainerMaxChunkSize)
+		throw ValueException("info","Rows are too large to store in a container file",__FILE__,__LINE__);
+
+	if(cinfo.chunkRows==0)
+		cinfo.chunkRows=sval(_max<size_t>(1,ContainerDefaultChunkSize/_max<size_t>(1,rowsize)));
+
+	if(rowsize>0 && cinfo.chunkRows>ContainerMaxChunkSize/rowsize)
+		cinfo.chunkRows=sval(ContainerMaxChunkSize/rowsize);
+
+	cinfo.chunkRows=_max<sval>(1,_min(cinfo.chunkRows,_max<sval>(1,info.n)));
+
+	if(numThreads==0)
+		numThreads=getProcessorCount();
+
+	sval numChunks=cinfo.numChunks();
+	const u8* bytes=(const u8*)src;
+
+	std::string header(ContainerMagic,sizeof(ContainerMagic));
+	appendContainerU32(header,ContainerEndianMark);
+	appendContainerU32(header,ContainerVersion);
+	appendContainerU32(header,cinfo.compressed ? 1 : 0);
+	appendContainerU32(header,u32(cinfo.elemsize));
+	appendContainerU32(header,cinfo.n);
+	appendContainerU32(header,cinfo.m);
+	appendContainerU32(header,cinfo.chunkRows);
+	appendContainerU32(header,numChunks);
+	appendContainerStr(header,cinfo.elemtag);
+	appendContainerStr(header,cinfo.name);
+	appendContainerStr(header,cinfo.type);
+	appendContainerStr(header,cinfo.meta);
+
+	FILE* f=fopen(filename,"wb");
+
+	if(!f)
+		throw MemException(std::string("Failed to open/create file ")+filename,errno);
+
+	std::string table;
+	u64 offset=header.size();
+	bool failed=fwrite(header.data(),1,header.size(),f)!=header.size();
+
+	// compress a batch of chunks in parallel then write them in order, this bounds the memory held for compressed chunks
+	sval batchsize=numThreads*4;
+	std::vector<std::string> outs(batchsize);
+
+	try{
+		for(sval first=0;first<numChunks && !failed;first+=batchsize){
+			sval count=_min(batchsize,numChunks-first);
+
+			if(cinfo.compressed){
+				ContainerCompressTask task(bytes,cinfo,first,outs,numThreads);
+				runParallelTask(&task,count,numThreads,1);
+			}
+
+			for(sval i=0;i<count && !failed;i++){
+				sval chunk=first+i;
+				size_t rawsize=containerChunkSize(cinfo,chunk);
+				const std::string& out=outs[i];
+				bool israw=!cinfo.compressed || out.empty();
+				const void* data=israw ? (const void*)(bytes+size_t(chunk)*cinfo.chunkRows*rowsize) : (const void*)out.data();
+				size_t size=israw ? rawsize : out.size(); // a stored size equal to the raw size means the chunk is uncompressed
+
+				failed=size>0 && fwrite(data,1,size,f)!=size;
+
+				appendContainerU64(table,offset);
+				appendContainerU64(table,size);
+				appendContainerU64(table,checksumAdler32((const u8*)data,size));
+				offset+=size;
+			}
+		}
+	}
+	catch(...){
+		fclose(f);
+		throw;
+	}
+
+	appendContainerU64(table,offset);
+
+	if(!failed)
+		failed=fwrite(table.data(),1,table.size(),f)!=table.size();
+
+	int err=errno;
+
+	if(fclose(f)!=0 && !failed){
+		failed=true;
+		err=errno;
+	}
+
+	if(failed)
+		throw MemException(std::string("Failed to write container file ")+filename,err);
+}
+
+/**
+ * Maps a container file and parses its header and chunk table, the file is unmapped when this is destroyed. Every offset and
+ * size is checked against the file size so that reading chunks doesn't need further checks against corrupt or truncated files.
+ */
+class ContainerFileReader
+{
+public:
+	void* base;
+	size_t baselen;
+	const u8* data;
+	size_t size;
+	size_t pos;
+	MatrixContainerInfo info;
+	std::vector<u64> offsets;
+	std::vector<u64> sizes;
+	std::vector<u32> checksums;
+
+	ContainerFileReader(const char* filename) throw(MemException,ValueException) : base(NULL), baselen(0), data(NULL), size(0), pos(0)
+	{
+		if(!getFileSize(filename,&size))
+			throw MemException(std::string("Cannot read size of file ")+filename,errno);
+
+		if(size<sizeof(ContainerMagic)+sizeof(u32)*8+sizeof(u64) || size!=size_t(u64(size)))
+			throw ValueException(filename,"File is too short to be a matrix container",__FILE__,__LINE__);
+
+		data=(const u8*)mapFileRegion(filename,0,size,false,&base,&baselen);
+
+		try{
+			parse(filename);
+		}
+		catch(...){
+			unmapFileRegion(base,baselen);
+			throw;
+		}
+	}
+
+	~ContainerFileReader()
+	{
+		try{
+			unmapFileRegion(base,baselen);
+		}
+		catch(MemException&){}
+	}
+
+	void corrupt(const char* filename) throw(ValueException)
+	{
+		throw ValueException(filename,"Matrix container file is corrupt or truncated",__FILE__,__LINE__);
+	}
+
+	u32 readU32(const char* filename)
+	{
+		u32 v;
+		if(size-pos<sizeof(u32))
+			corrupt(filename);
+
+		memcpy(&v,data+pos,sizeof(u32));
+		pos+=sizeof(u32);
+		return info.swapEndian ? swapEndian32(v) : v;
+	}
+
+	u64 readU64(const char* filename)
+	{
+		u64 v;
+		if(size-pos<sizeof(u64))
+			corrupt(filename);
+
+		memcpy(&v,data+pos,sizeof(u64));
+		pos+=sizeof(u64);
+		return info.swapEndian ? swapEndian64(v) : v;
+	}
+
+	std::string readStr(const char* filename)
+	{
+		u32 len=readU32(filename);
+		if(size-pos<len)
+			corrupt(filename);
+
+		std::string s((const char*)data+pos,len);
+		pos+=len;
+		return s;
+	}
+
+	void parse(const char* filename)
+	{
+		if(memcmp(data,ContainerMagic,sizeof(ContainerMagic))!=0)
+			throw ValueException(filename,"File is not a matrix container",__FILE__,__LINE__);
+
+		pos=sizeof(ContainerMagic);
+
+		u32 mark=readU32(filename);
+		if(mark!=ContainerEndianMark){
+			if(swapEndian32(mark)!=ContainerEndianMark)
+				corrupt(filename);
+
+			info.swapEndian=true;
+		}
+
+		if(readU32(filename)!=ContainerVersion)
+			throw ValueException(filename,"Unsupported matrix container version",__FILE__,__LINE__);
+
+		u32 codec=readU32(filename);
+		info.compressed=codec==1;
+		info.elemsize=readU32(filename);
+		info.n=readU32(filename);
+		info.m=readU32(filename);
+		info.chunkRows=readU32(filename);
+		u32 numChunks=readU32(filename);
+		info.elemtag=readStr(filename);
+		info.name=readStr(filename);
+		info.type=readStr(filename);
+		info.meta=readStr(filename);
+
+		size_t rowsize=size_t(info.m)*info.elemsize;
+
+		if(codec>1 || info.elemsize==0 || info.chunkRows==0 || numChunks!=info.numChunks() || rowsize>ContainerMaxChunkSize
+				|| info.chunkRows>ContainerMaxChunkSize/_max<size_t>(1,rowsize))
+			corrupt(filename);
+
+		size_t headerend=pos;
+		pos=size-sizeof(u64);
+		u64 tableoffset=readU64(filename);
+
+		if(tableoffset<headerend || tableoffset>size || (size-tableoffset-sizeof(u64))/(sizeof(u64)*3)!=numChunks
+				|| (size-tableoffset-sizeof(u64))%(sizeof(u64)*3)!=0)
+			corrupt(filename);
+
+		pos=size_t(tableoffset);
+		offsets.resize(numChunks);
+		sizes.resize(numChunks);
+		checksums.resize(numChunks);
+
+		for(u32 i=0;i<numChunks;i++){
+			offsets[i]=readU64(filename);
+			sizes[i]=readU64(filename);
+			checksums[i]=u32(readU64(filename));
+
+			if(offsets[i]<headerend || offsets[i]>tableoffset || sizes[i]>tableoffset-offsets[i] || sizes[i]>containerChunkSize(info,i))
+				corrupt(filename);
+		}
+	}
+};
+
+/// Decompresses the chunks overlapping a range of rows into the destination, copying only the overlapping part of partial chunks
+class ContainerDecompressTask : public ParallelTask
+{
+public:
+	const ContainerFileReader& reader;
+	u8* dest;
+	sval startRow;
+	sval numRows;
+	sval firstChunk;
+	std::vector<std::vector<u8> > temps;
+	bool failed;
+
+	ContainerDecompressTask(const ContainerFileReader& reader, u8* dest, sval startRow, sval numRows, sval firstChunk, sval numThreads) :
+		reader(reader), dest(dest), startRow(startRow), numRows(numRows), firstChunk(firstChunk), temps(numThreads), failed(false)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		const MatrixContainerInfo& info=reader.info;
+		size_t rowsize=size_t(info.m)*info.elemsize;
+		std::vector<u8>& temp=temps[threadIndex];
+
+		for(sval i=start;i<end;i++){
+			sval chunk=firstChunk+i;
+			sval chunkstart=chunk*info.chunkRows;
+			size_t rawsize=containerChunkSize(info,chunk);
+			sval chunkrows=sval(rawsize/_max<size_t>(1,rowsize));
+			sval first=_max(startRow,chunkstart);
+			sval last=_min(startRow+numRows,chunkstart+chunkrows);
+			const u8* stored=reader.data+size_t(reader.offsets[chunk]);
+			size_t storedsize=size_t(reader.sizes[chunk]);
+			u8* out=dest+size_t(first-startRow)*rowsize;
+			size_t outsize=size_t(last-first)*rowsize;
+			size_t outoffset=size_t(first-chunkstart)*rowsize;
+
+			if(checksumAdler32(stored,storedsize)!=reader.checksums[chunk]){
+				failed=true;
+				return;
+			}
+
+			if(storedsize==rawsize){
+				memcpy(out,stored+outoffset,outsize);
+				continue;
+			}
+
+			// decompress into the destination directly when the whole chunk is wanted and needs no unshuffling
+			bool full=outsize==rawsize;
+			bool shuffled=info.elemsize>1;
+
+			temp.resize(rawsize*((full || !shuffled) ? 1 : 2));
+			u8* packed=(full && !shuffled) ? out : &temp[0];
+
+			if(!decompressLZ(stored,storedsize,packed,rawsize)){
+				failed=true;
+				return;
+			}
+
+			if(shuffled){
+				u8* unpacked=full ? out : &temp[rawsize];
+				unshuffleBytes(packed,unpacked,rawsize/info.elemsize,info.elemsize);
+				packed=unpacked;
+			}
+
+			if(!full)
+				memcpy(out,packed+outoffset,outsize);
+		}
+	}
+};
+
+MatrixContainerInfo readContainerFileInfo(const char* filename) throw(MemException,ValueException)
+{
+	ContainerFileReader reader(filename);
+	return reader.info;
+}
+
+bool readContainerFileToBuff(const char* filename, void* dest, const char* elemtag, size_t elemsize, sval m, sval startRow, sval numRows,
+		sval numThreads) throw(IndexException,ValueException,MemException,RenderException)
+{
+	ContainerFileReader reader(filename);
+	const MatrixContainerInfo& info=reader.info;
+
+	if(elemtag && elemtag[0] && !info.elemtag.empty() && info.elemtag!=elemtag)
+		throw ValueException(filename,"Matrix container stores elements of type "+info.elemtag+" rather than "+elemtag,__FILE__,__LINE__);
+
+	if(info.elemsize!=elemsize)
+		throw ValueException(filename,"Matrix container stores elements of a different size",__FILE__,__LINE__);
+
+	if(info.m!=m)
+		throw ValueException(filename,"Matrix container stores a different number of columns",__FILE__,__LINE__);
+
+	if(startRow>info.n || numRows>info.n-startRow)
+		throw IndexException("startRow+numRows",size_t(startRow)+numRows,size_t(info.n)+1);
+
+	if(numRows>0 && m>0){
+		sval firstChunk=startRow/info.chunkRows;
+		sval lastChunk=(startRow+numRows-1)/info.chunkRows;
+		sval count=lastChunk-firstChunk+1;
+
+		if(numThreads==0)
+			numThreads=getProcessorCount();
+
+		numThreads=_min(numThreads,count);
+
+		ContainerDecompressTask task(reader,(u8*)dest,startRow,numRows,firstChunk,numThreads);
+		runParallelTask(&task,count,numThreads,1);
+
+		if(task.failed)
+			reader.corrupt(filename);
+	}
+
+	return info.swapEndian;
+}
+
+void convertUByteStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_UBYTE,mat);
+}
+
+void convertUShortStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_USHORT,mat);
+}
+
+void convertByteStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_BYTE,mat);
+}
+
+void convertShortStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_SHORT,mat);
+}
+
+void convertUIntStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_UINT,mat);
+}
+
+void convertIntStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_INT,mat);
+}
+
+void convertFloatStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_FLOAT,mat);
+}
+
+void convertRealStreamToRealMatrix(const char* stream, RealMatrix* mat)
+{
+	decodeStreamToRealMatrix(stream,ST_DOUBLE,mat);
+}
+
+/// Number of values decoded in each item of a StreamDecodeTask
+static const sval StreamDecodeChunkSize=65536;
+
+/**
+ * Decodes chunks of StreamDecodeChunkSize values of type T from a byte stream into a real array, doing the endian swap
+ * and rescale in the same pass. The range of each chunk is stored in `chunkmin' and `chunkmax' to be combined afterwards.
+ */
+template<typename T>
+class StreamDecodeTask : public ParallelTask
+{
+public:
+	const char* stream;
+	real* dest;
+	sval total;
+	bool swapEndian;
+	real slope, intercept;
+	std::vector<real> chunkmin, chunkmax;
+
+	StreamDecodeTask(const char* stream, real* dest, sval total, bool swapEndian, real slope, real intercept) :
+		stream(stream), dest(dest), total(total), swapEndian(swapEndian), slope(slope), intercept(intercept),
+		chunkmin(numChunks()), chunkmax(numChunks())
+	{}
+
+	sval numChunks() const { return (total+StreamDecodeChunkSize-1)/StreamDecodeChunkSize; }
+
+	/// Decode values [first,last) and store their range in `minv' and `maxv', `Swap' is a parameter so each loop is branch-free
+	template<bool Swap>
+	void decode(sval first, sval last, real& minv, real& maxv) const
+	{
+		const char* src=stream+first*sizeof(T);
+		real* d=dest+first;
+		T val;
+
+		memcpy(&val,src,sizeof(T)); // the stream may not be aligned for T, this compiles to a plain load
+		T tmin=Swap ? swapEndianN(val) : val, tmax=tmin;
+
+		// the range is tracked in the stream's type which is cheaper than comparing reals
+		for(sval i=first;i<last;i++,src+=sizeof(T)){
+			memcpy(&val,src,sizeof(T));
+			if(Swap)
+				val=swapEndianN(val);
+
+			*d++=real(val)*slope+intercept;
+			tmin=_min(val,tmin);
+			tmax=_max(val,tmax);
+		}
+
+		minv=real(tmin)*slope+intercept;
+		maxv=real(tmax)*slope+intercept;
+
+		if(slope<0)
+			std::swap(minv,maxv);
+	}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		for(sval c=start;c<end;c++){
+			sval first=c*StreamDecodeChunkSize, last=_min(total,first+StreamDecodeChunkSize);
+
+			if(swapEndian)
+				decode<true>(first,last,chunkmin[c],chunkmax[c]);
+			else
+				decode<false>(first,last,chunkmin[c],chunkmax[c]);
+		}
+	}
+};
+
+template<typename T>
+void decodeStream(const char* stream, RealMatrix* mat, bool swapEndian, real slope, real intercept)
+{
+	StreamDecodeTask<T> task(stream,mat->dataPtr(),mat->n()*mat->m(),swapEndian,slope,intercept);
+	sval numchunks=task.numChunks();
+
+	runParallelTask(&task,numchunks,numchunks>=4 ? 0 : 1);
+
+	real minval=task.chunkmin[0], maxval=task.chunkmax[0];
+	for(sval c=1;c<numchunks;c++){
+		minval=_min(minval,task.chunkmin[c]);
+		maxval=_max(maxval,task.chunkmax[c]);
+	}
+
+	setMatrixMinMax<real,real>(mat,minval,maxval);
+}
+
+sval getStreamTypeSize(StreamType type) throw(ValueException)
+{
+	switch(type){
+	case ST_UBYTE:
+	case ST_BYTE: return 1;
+	case ST_USHORT:
+	case ST_SHORT: return 2;
+	case ST_UINT:
+	case ST_INT: return 4;
+	case ST_FLOAT: return sizeof(float);
+	case ST_DOUBLE: return sizeof(double);
+	default:
+		throw ValueException("type","Unknown stream type");
+	}
+}
+
+void decodeStreamToRealMatrix(const char* stream, StreamType type, RealMatrix* mat, bool swapEndian, real slope, real intercept) throw(ValueException)
+{
+	if(mat->n()==0 || mat->m()==0)
+		throw ValueException("mat","Matrix must be non-empty");
+
+	switch(type){
+	case ST_UBYTE:  decodeStream<u8>(stream,mat,false,slope,intercept); break;
+	case ST_BYTE:   decodeStream<signed char>(stream,mat,false,slope,intercept); break;
+	case ST_USHORT: decodeStream<u16>(stream,mat,swapEndian,slope,intercept); break;
+	case ST_SHORT:  decodeStream<short>(stream,mat,swapEndian,slope,intercept); break;
+	case ST_UINT:   decodeStream<unsigned int>(stream,mat,swapEndian,slope,intercept); break;
+	case ST_INT:    decodeStream<int>(stream,mat,swapEndian,slope,intercept); break;
+	case ST_FLOAT:  decodeStream<float>(stream,mat,swapEndian,slope,intercept); break;
+	case ST_DOUBLE: decodeStream<double>(stream,mat,swapEndian,slope,intercept); break;
+	default:
+		throw ValueException("type","Unknown stream type");
+	}
+}
+
+void decodeFileToRealMatrix(const char* filename, size_t offset, StreamType type, RealMatrix* mat, bool swapEndian, 
+		real slope, real intercept) throw(MemException,ValueException)
+{
+	if(mat->n()==0 || mat->m()==0)
+		throw ValueException("mat","Matrix must be non-empty");
+
+	void* base;
+	size_t baselen;
+	size_t len=size_t(mat->n())*mat->m()*getStreamTypeSize(type);
+	const char* stream=(const char*)mapFileRegion(filename,offset,len,false,&base,&baselen);
+
+	try{
+		decodeStreamToRealMatrix(stream,type,mat,swapEndian,slope,intercept);
+	}
+	catch(...){
+		unmapFileRegion(base,baselen);
+		throw;
+	}
+
+	unmapFileRegion(base,baselen);
+}
+
+/// Returns true if the text at [p,end) starts with the lower case word `word' ignoring case
+static bool matchTextWord(const char* p, const char* end, const char* word)
+{
+	for(;*word;word++,p++)
+		if(p>=end || (*p|0x20)!=*word)
+			return false;
+	return true;
+}
+
+const char* parseTextReal(const char* p, const char* end, real* val)
+{
+	// powers of 10 which are exactly representable as doubles
+	static const double pow10[]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+	static const int MaxDigits=19; // most decimal digits which fit into a u64
+
+	bool neg=p<end && *p=='-';
+	if(p<end && (*p=='-' || *p=='+'))
+		p++;
+
+	u64 mant=0;
+	int digits=0, exp10=0;
+	bool found=false;
+
+	// accumulate the significant digits into `mant' and count the digits either dropped or after the decimal point in `exp10'
+	for(;p<end && *p>='0' && *p<='9';p++,found=true){
+		if(digits<MaxDigits){
+			mant=mant*10+(*p-'0');
+			digits+=mant>0 ? 1 : 0;
+		}
+		else
+			exp10++;
+	}
+
+	if(p<end && *p=='.'){
+		for(p++;p<end && *p>='0' && *p<='9';p++,found=true){
+			if(digits<MaxDigits){
+				mant=mant*10+(*p-'0');
+				digits+=mant>0 ? 1 : 0;
+				exp10--;
+			}
+		}
+	}
+
+	if(!found){
+		real v=0;
+		if(matchTextWord(p,end,"inf"))
+			v=std::numeric_limits<real>::infinity();
+		else if(matchTextWord(p,end,"nan"))
+			v=std::numeric_limits<real>::quiet_NaN();
+
+		*val=neg ? -v : v;
+		return skipTextToken(p,end);
+	}
+
+	if(p<end && (*p=='e' || *p=='E')){
+		const char* q=p+1;
+		bool eneg=q<end && *q=='-';
+		if(q<end && (*q=='-' || *q=='+'))
+			q++;
+
+		if(q<end && *q>='0' && *q<='9'){ // only an exponent if there are digits following the sign
+			int e=0;
+			for(;q<end && *q>='0' && *q<='9';q++)
+				e=_min(e*10+(*q-'0'),100000);
+
+			exp10+=eneg ? -e : e;
+			p=q;
+		}
+	}
+
+	double v;
+	if(mant==0)
+		v=0;
+	else if(mant<=(u64(1)<<53) && exp10>=-22 && exp10<=22) // mantissa and power are both exact so one rounding gives the nearest value
+		v=exp10<0 ? double(mant)/pow10[-exp10] : double(mant)*pow10[exp10];
+	else if(exp10<0)
+		v=double((long double)mant/std::pow(10.0L,-exp10));
+	else
+		v=double((long double)mant*std::pow(10.0L,exp10));
+
+	*val=real(neg ? -v : v);
+	return skipTextToken(p,end);
+}
+
+sval countTextLines(const char* p, const char* end)
+{
+	sval count=0;
+
+	while(p<end){
+		const char* lineend=(const char*)memchr(p,'\n',end-p);
+		if(!lineend)
+			lineend=end;
+
+		if(skipTextSpace(p,lineend)<lineend)
+			count++;
+
+		p=lineend+1;
+	}
+
+	return count;
+}
+
+/// Evaluates blocks of RealMatrixExpr::BlockSize values of an expression into the destination matrix, each item is a block
+class MatrixExprTask : public ParallelTask
+{
+public:
+	const RealMatrixExpr* expr;
+	real* dest;
+	sval total;
+
+	MatrixExprTask(const RealMatrixExpr* expr, real* dest, sval total) : expr(expr), dest(dest), total(total) {}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		real buff[RealMatrixExpr::BlockSize];
+
+		for(sval b=start;b<end;b++){
+			sval first=b*RealMatrixExpr::BlockSize, count=_min(RealMatrixExpr::BlockSize,total-first);
+			expr->evalBlock(first,count,buff);
+			memcpy(dest+first,buff,count*sizeof(real)); // copied only after every operation so `dest' can also be an operand
+		}
+	}
+};
+
+RealMatrixExpr::RealMatrixExpr(const RealMatrix* src) throw(ValueException) : src(src)
+{
+	if(!src)
+		throw ValueException("src","Source matrix must not be NULL");
+}
+
+RealMatrixExpr& RealMatrixExpr::matop(ExprOpType type, const RealMatrix* mat) throw(ValueException)
+{
+	if(!mat || mat->n()!=src->n() || mat->m()!=src->m())
+		throw ValueException("mat","Operand matrix must have the same dimensions as the source matrix");
+
+	ops.push_back(ExprOp(type,0,0,mat));
+	return *this;
+}
+
+void RealMatrixExpr::evalBlock(sval start, sval count, real* buff) const
+{
+	memcpy(buff,src->dataPtr()+start,count*sizeof(real));
+
+	// each operation is a separate loop over the block rather than a switch per value so that the loops can be vectorized
+	for(sval o=0;o<ops.size();o++){
+		const ExprOp& op=ops[o];
+		const real a=op.a, b=op.b;
+		const real* m=op.mat ? op.mat->dataPtr()+start : NULL;
+
+		switch(op.type){
+		case EO_ADD:    for(sval i=0;i<count;i++) buff[i]+=a; break;
+		case EO_SUB:    for(sval i=0;i<count;i++) buff[i]-=a; break;
+		case EO_MUL:    for(sval i=0;i<count;i++) buff[i]*=a; break;
+		case EO_DIV:    for(sval i=0;i<count;i++) buff[i]/=a; break;
+		case EO_MIN:    for(sval i=0;i<count;i++) buff[i]=a<buff[i] ? a : buff[i]; break;
+		case EO_MAX:    for(sval i=0;i<count;i++) buff[i]=a>buff[i] ? a : buff[i]; break;
+		case EO_MULADD: for(sval i=0;i<count;i++) buff[i]=buff[i]*a+b; break;
+		case EO_CLAMP:  for(sval i=0;i<count;i++) buff[i]=buff[i]<a ? a : (buff[i]>b ? b : buff[i]); break;
+		case EO_ADDM:   for(sval i=0;i<count;i++) buff[i]+=m[i]; break;
+		case EO_SUBM:   for(sval i=0;i<count;i++) buff[i]-=m[i]; break;
+		case EO_MULM:   for(sval i=0;i<count;i++) buff[i]*=m[i]; break;
+		case EO_DIVM:   for(sval i=0;i<count;i++) buff[i]/=m[i]; break;
+		case EO_MINM:   for(sval i=0;i<count;i++) buff[i]=m[i]<buff[i] ? m[i] : buff[i]; break;
+		case EO_MAXM:   for(sval i=0;i<count;i++) buff[i]=m[i]>buff[i] ? m[i] : buff[i]; break;
+		case EO_ABS:    for(sval i=0;i<count;i++) buff[i]=std::fabs(buff[i]); break;
+		case EO_NEG:    for(sval i=0;i<count;i++) buff[i]=-buff[i]; break;
+		case EO_SQRT:   for(sval i=0;i<count;i++) buff[i]=std::sqrt(buff[i]); break;
+		}
+	}
+}
+
+const sval RealMatrixExpr::BlockSize; // definition needed since _min() binds a reference to it
+
+void RealMatrixExpr::eval(RealMatrix* dest, sval numThreads) const throw(ValueException)
+{
+	if(!dest || dest->n()!=src->n() || dest->m()!=src->m())
+		throw ValueException("dest","Destination matrix must have the same dimensions as the source matrix");
+
+	sval total=src->n()*src->m();
+
+	if(numThreads==0)
+		numThreads=total>=ParallelReduceThreshold ? getProcessorCount() : 1;
+
+	MatrixExprTask task(this,dest->dataPtr(),total);
+	runParallelTask(&task,(total+BlockSize-1)/BlockSize,numThreads);
+}
+
+/// Reducer for calculateBoundBox(), partials are seeded with the first vector so that an empty block doesn't affect the result
+struct BoundBoxReducer
+{
+	typedef std::pair<vec3,vec3> Result;
+	vec3 seed;
+
+	BoundBoxReducer(const vec3& seed) : seed(seed) {}
+
+	Result initial() const { return Result(seed,seed); }
+
+	void reduceRow(Result& r, const vec3* row, sval, sval) const
+	{
+		r.first.setMinVals(row[0]);
+		r.second.setMaxVals(row[0]);
+	}
+
+	void merge(Result& r, const Result& next) const
+	{
+		r.first.setMinVals(next.first);
+		r.second.setMaxVals(next.second);
+	}
+};
+
+std::pair<vec3,vec3> calculateBoundBox(const Vec3Matrix* mat)
+{
+	if(mat && mat->n()>0)
+		return reduceMatrix(mat,BoundBoxReducer(mat->atc(0)));
+
+	return std::pair<vec3,vec3>(vec3(),vec3());
+}
+
+/// Compares triangle indices by one axis of their centroids, used to partition triangles when building a TriMeshBVH
+struct CentroidAxisCompare
+{
+	const std::vector<vec3>& centroids;
+	int axis;
+
+	CentroidAxisCompare(const std::vector<vec3>& centroids, int axis) : centroids(centroids), axis(axis) {}
+
+	real component(const vec3& v) const { return axis==0 ? v.x() : (axis==1 ? v.y() : v.z()); }
+
+	bool operator()(indexval a, indexval b) const { return component(centroids[a])<component(centroids[b]); }
+};
+
+/// Orders intersection results by distance along the ray
+static bool compareIntersectDist(const indextriple& a, const indextriple& b)
+{
+	return a.second.first<b.second.first;
+}
+
+/**
+ * Returns true if the ray from `pos' in direction `dir' passes through the box (minv,maxv) somewhere between t=0 and t=maxt,
+ * storing the entry distance (or 0 if `pos' is in the box) in `tnear'. Unlike Ray::intersectsAABB() this handles directions
+ * with zero components, which are common for meshes whose faces are aligned with the axes.
+ */
+static bool intersectsBoxRange(const vec3& pos, const vec3& dir, const vec3& invdir, const vec3& minv, const vec3& maxv, real maxt, real &tnear)
+{
+	real p[3]={pos.x(),pos.y(),pos.z()}, d[3]={dir.x(),dir.y(),dir.z()}, id[3]={invdir.x(),invdir.y(),invdir.z()};
+	real mn[3]={minv.x(),minv.y(),minv.z()}, mx[3]={maxv.x(),maxv.y(),maxv.z()};
+	real tmin=0, tmax=maxt;
+
+	for(int i=0;i<3;i++){
+		if(d[i]==0){ // ray is parallel with this slab so it must start within it
+			if(p[i]<mn[i] || p[i]>mx[i])
+				return false;
+		}
+		else{
+			real t1=(mn[i]-p[i])*id[i], t2=(mx[i]-p[i])*id[i];
+			if(t1>t2)
+				bswap(t1,t2);
+
+			tmin=_max(tmin,t1);
+			tmax=_min(tmax,t2);
+
+			if(tmin>tmax)
+				return false;
+		}
+	}
+
+	tnear=tmin;
+	return true;
+}
+
+/**
+ * Build a bounding volume hierarchy in `bounds', `nodeinfo', and `order' over the primitives of the index matrix `inds', the
+ * bounds and centroid of each being that of the nodes in its first `numcols' columns. This is the shared implementation of
+ * TriMeshBVH::build() and ElemMeshBVH::build(), see the former for the method and the layout of the matrices.
+ */
+static void buildMeshBVH(const Vec3Matrix* nodes, const IndexMatrix* inds, sval numcols, Vec3Matrix* bounds, IndexMatrix* nodeinfo,
+		IndexMatrix* triorder, sval leafSize) throw(IndexException,MemException)
+{
+	typedef triple<sval,sval,sval> buildnode; // (tree node, first triangle in `order', triangle count)
+
+	if(bounds->m()!=2 || nodeinfo->m()!=2)
+		throw MemException("Bounds and node info matrices must have 2 columns");
+
+	sval numtris=inds->n();
+	sval maxnodes=numtris>0 ? numtris*2-1 : 1; // a binary tree with at most `numtris' leaves
+	leafSize=_max<sval>(1,leafSize);
+
+	std::vector<vec3> centroids(numtris), trimins(numtris), trimaxs(numtris);
+
+	for(sval i=0;i<numtris;i++){
+		vec3 v=nodes->getAt(inds->at(i,0));
+		vec3 sum=v;
+		trimins[i]=v;
+		trimaxs[i]=v;
+
+		for(sval c=1;c<numcols;c++){
+			v=nodes->getAt(inds->at(i,c));
+			sum=sum+v;
+			trimins[i].setMinVals(v);
+			trimaxs[i].setMaxVals(v);
+		}
+
+		centroids[i]=sum/real(numcols);
+	}
+
+	triorder->setN(_max<sval>(1,numtris));
+	bounds->setN(maxnodes);
+	nodeinfo->setN(maxnodes);
+
+	indexval* order=triorder->dataPtr();
+
+	for(sval i=0;i<triorder->n();i++)
+		order[i]=i;
+
+	if(numtris==0){ // an empty mesh is represented by a single leaf with no triangles
+		bounds->at(0,0)=vec3();
+		bounds->at(0,1)=vec3();
+		nodeinfo->at(0,0)=0;
+		nodeinfo->at(0,1)=0;
+		return;
+	}
+
+	std::vector<buildnode> stack;
+	sval numnodes=1;
+
+	stack.push_back(buildnode(0,0,numtris));
+
+	while(!stack.empty()){
+		buildnode bn=stack.back();
+		stack.pop_back();
+
+		sval node=bn.first, start=bn.second, count=bn.third;
+		vec3 minv=trimins[order[start]], maxv=trimaxs[order[start]];
+		vec3 cmin=centroids[order[start]], cmax=cmin;
+
+		for(sval i=start+1;i<start+count;i++){
+			minv.setMinVals(trimins[order[i]]);
+			maxv.setMaxVals(trimaxs[order[i]]);
+			cmin.setMinVals(centroids[order[i]]);
+			cmax.setMaxVals(centroids[order[i]]);
+		}
+
+		bounds->at(node,0)=minv;
+		bounds->at(node,1)=maxv;
+
+		if(count<=leafSize){
+			nodeinfo->at(node,0)=start;
+			nodeinfo->at(node,1)=count;
+			continue;
+		}
+
+		// split at the median centroid along the longest axis of the centroid bounds, this always halves the count so the depth is O(log n)
+		vec3 extent=cmax-cmin;
+		int axis=(extent.x()>=extent.y() && extent.x()>=extent.z()) ? 0 : (extent.y()>=extent.z() ? 1 : 2);
+		sval half=count/2;
+
+		std::nth_element(order+start,order+start+half,order+start+count,CentroidAxisCompare(centroids,axis));
+
+		nodeinfo->at(node,0)=numnodes;
+		nodeinfo->at(node,1)=0;
+
+		stack.push_back(buildnode(numnodes,start,half));
+		stack.push_back(buildnode(numnodes+1,start+half,count-half));
+		numnodes+=2;
+	}
+
+	bounds->setN(numnodes);
+	nodeinfo->setN(numnodes);
+}
+
+void TriMeshBVH::build(sval leafSize) throw(IndexException,MemException)
+{
+	buildMeshBVH(nodes,inds,3,bounds,nodeinfo,triorder,leafSize);
+}
+
+void TriMeshBVH::intersect(const Ray& ray, std::vector<indextriple>& results, sval numResults, sval excludeInd) const throw(IndexException)
+{
+	typedef std::pair<real,sval> travnode; // (entry distance, tree node)
+
+	results.clear();
+
+	if(inds->n()==0 || bounds->n()==0)
+		return;
+
+	vec3 pos=ray.getPosition(), dir=ray.getDirection(), invdir=dir.inv();
+	real maxt=realInf; // distance beyond which nodes can be skipped, this is the furthest kept result once `numResults' have been found
+	real tnear=0;
+	std::vector<travnode> stack;
+
+	if(intersectsBoxRange(pos,dir,invdir,bounds->at(0,0),bounds->at(0,1),maxt,tnear))
+		stack.push_back(travnode(tnear,0));
+
+	while(!stack.empty()){
+		travnode tn=stack.back();
+		stack.pop_back();
+
+		if(tn.first>maxt) // node was reached before a closer set of results was found
+			continue;
+
+		sval first=nodeinfo->at(tn.second,0), count=nodeinfo->at(tn.second,1);
+
+		if(count>0){ // leaf node, test each triangle and keep results sorted by distance
+			for(sval i=first;i<first+count;i++){
+				indexval tri=triorder->at(i);
+				if(tri==excludeInd)
+					continue;
+
+				realtriple inter=ray.intersectsTri(nodes->getAt(inds->at(tri,0)),nodes->getAt(inds->at(tri,1)),nodes->getAt(inds->at(tri,2)));
+
+				if(inter.first<0 || inter.first>maxt)
+					continue;
+
+				indextriple it(tri,inter);
+				results.insert(std::upper_bound(results.begin(),results.end(),it,compareIntersectDist),it);
+
+				if(numResults>0 && results.size()>=numResults){
+					results.resize(numResults);
+					maxt=results.back().second.first;
+				}
+			}
+		}
+		else{ // internal node, push the further child first so that the nearer is visited next
+			real t0=0,t1=0;
+			bool hit0=intersectsBoxRange(pos,dir,invdir,bounds->at(first,0),bounds->at(first,1),maxt,t0);
+			bool hit1=intersectsBoxRange(pos,dir,invdir,bounds->at(first+1,0),bounds->at(first+1,1),maxt,t1);
+
+			if(hit0 && hit1){
+				if(t0<=t1){
+					stack.push_back(travnode(t1,first+1));
+					stack.push_back(travnode(t0,first));
+				}
+				else{
+					stack.push_back(travnode(t0,first));
+					stack.push_back(travnode(t1,first+1));
+				}
+			}
+			else if(hit0)
+				stack.push_back(travnode(t0,first));
+			else if(hit1)
+				stack.push_back(travnode(t1,first+1));
+		}
+	}
+}
+
+/// Colors rows of a RealMatrix into a ColorMatrix from a spectrum's lookup table, see Spectrum::fillColorMatrix()
+class SpectrumColorsTask : public ParallelTask
+{
+public:
+	const Spectrum* spec;
+	const RealMatrix *mat;
+	ColorMatrix *col;
+	std::vector<color> table;
+	bool useValAsAlpha;
+
+	SpectrumColorsTask(const Spectrum* spec,const RealMatrix *mat,ColorMatrix *col,bool useValAsAlpha) : 
+		spec(spec), mat(mat), col(col), useValAsAlpha(useValAsAlpha)
+	{
+		spec->lookupTable(table);
+	}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		bool hasMatAlpha=mat->m()>=col->m()*2;
+		sval width=_min(col->m(),mat->m());
+
+		for(sval i=start;i<end;i++)
+			for(sval j=0;j<width;j++){
+				real val=mat->at(i,j);
+				color c=spec->lookupColor(val,table);
+
+				if(hasMatAlpha)
+					c.a(mat->at(i,col->m()+j)*c.a());
+				else if(useValAsAlpha)
+					c.a(val*c.a());
+
+				col->at(i,j)=c;
+			}
+	}
+};
+
+void Spectrum::interpolateColors(const RealMatrix *mat,ColorMatrix *col,bool useValAsAlpha) const throw(IndexException)
+{
+	sval len=_min(col->n(),mat->n());
+	SpectrumColorsTask task(this,mat,col,useValAsAlpha);
+
+	runParallelTask(&task,len,len*mat->m()>=100000 ? 0 : 1);
+}
+
+void packVertices(const Vec3Matrix* vecs, const ColorMatrix* cols, PackedVertexMatrix* verts, sval start) throw(ValueException)
+{
+	CHECK_NULL(vecs);
+	CHECK_NULL(verts);
+
+	sval numverts=vecs->n();
+
+	if(start+numverts>verts->n())
+		throw ValueException("verts","Not enough rows for the given vertices at the starting row",__FILE__,__LINE__);
+
+	if(cols && cols->n()<numverts)
+		throw ValueException("cols","Must have as many rows as vecs",__FILE__,__LINE__);
+
+	bool hasNorm=vecs->m()>1, hasUVW=vecs->m()>3;
+	vec3 zero;
+
+	for(sval i=0;i<numverts;i++){
+		PackedVertex &v=verts->at(start+i);
+
+		vecs->at(i).setBuff(v.pos);
+		(hasNorm ? vecs->at(i,1) : zero).setBuff(v.norm);
+		(hasUVW ? vecs->at(i,3) : zero).setBuff(v.tex);
+		v.col=cols ? cols->at(i).toABGR() : 0xffffffff;
+	}
+}
+
+/// Triangle indices rotated so the smallest index is first, preserving winding, used to remove duplicate decimated triangles
+struct ChunkTriangle
+{
+	indexval a,b,c;
+
+	ChunkTriangle(indexval x, indexval y, indexval z)
+	{
+		if(x<=y && x<=z){ a=x; b=y; c=z; }
+		else if(y<=z){ a=y; b=z; c=x; }
+		else{ a=z; b=x; c=y; }
+	}
+
+	bool operator<(const ChunkTriangle& t) const { return a<t.a || (a==t.a && (b<t.b || (b==t.b && c<t.c))); }
+	bool operator==(const ChunkTriangle& t) const { return a==t.a && b==t.b && c==t.c; }
+};
+
+/// Triangle count above which the decimated levels of chunks are computed using multiple threads
+static const sval ParallelChunkThreshold=200000;
+
+/// Computes the decimated levels of each chunk's level 0 triangles in `inds', storing each chunk's levels in `levelinds'
+class ChunkDecimateTask : public ParallelTask
+{
+public:
+	const PackedVertex* verts;
+	const std::vector<indexval>& inds;
+	const std::vector<MeshChunk>& chunks;
+	sval numLevels;
+	std::vector<std::vector<std::vector<indexval> > > levelinds; // indexed by chunk then level-1
+
+	ChunkDecimateTask(const PackedVertex* verts, const std::vector<indexval>& inds, const std::vector<MeshChunk>& chunks, sval numLevels) :
+		verts(verts), inds(inds), chunks(chunks), numLevels(numLevels), levelinds(chunks.size())
+	{}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		typedef std::pair<u64,std::pair<indexval,sval> > cellvert; // (cell key, (vertex, position in chunk's indices))
+		std::vector<cellvert> cells;
+		std::vector<indexval> reps;
+		std::vector<ChunkTriangle> tris;
+
+		for(sval c=start;c<end;c++){
+			const MeshChunk& chunk=chunks[c];
+			sval first=chunk.levels[0].first, count=chunk.levels[0].second;
+			vec3 ext=chunk.maxv-chunk.minv;
+			real maxext=_max(ext.x(),_max(ext.y(),ext.z()));
+
+			levelinds[c].resize(numLevels-1);
+			reps.resize(count);
+
+			for(sval level=1;level<numLevels;level++){
+				// a surface of `count' triangles has about sqrt(count/2) vertices along each side, each level halves this
+				real divs=_max<real>(1.0,sqrt(real(count)/2.0)/real(1<<_min<sval>(level,30)));
+				real cellsize=maxext>0 ? maxext/divs : 1.0;
+
+				cells.clear();
+				tris.clear();
+
+				for(sval i=0;i<count;i++){
+					indexval ind=inds[first+i];
+					const float* p=verts[ind].pos;
+					u64 cx=u64(_max<real>(0,(p[0]-chunk.minv.x())/cellsize));
+					u64 cy=u64(_max<real>(0,(p[1]-chunk.minv.y())/cellsize));
+					u64 cz=u64(_max<real>(0,(p[2]-chunk.minv.z())/cellsize));
+					cells.push_back(cellvert((cx<<42)|(cy<<21)|cz,std::pair<indexval,sval>(ind,i)));
+				}
+
+				// sorting by key then vertex makes the lowest vertex index in each cell its representative
+				std::sort(cells.begin(),cells.end());
+
+				for(sval i=0,rep=0;i<count;i++){
+					if(i==0 || cells[i].first!=cells[i-1].first)
+						rep=cells[i].second.first;
+
+					reps[cells[i].second.second]=indexval(rep);
+				}
+
+				for(sval i=0;i<count;i+=3)
+					if(reps[i]!=reps[i+1] && reps[i+1]!=reps[i+2] && reps[i]!=reps[i+2])
+						tris.push_back(ChunkTriangle(reps[i],reps[i+1],reps[i+2]));
+
+				std::sort(tris.begin(),tris.end());
+				tris.erase(std::unique(tris.begin(),tris.end()),tris.end());
+
+				std::vector<indexval>& out=levelinds[c][level-1];
+				for(sval t=0;t<tris.size();t++){
+					out.push_back(tris[t].a);
+					out.push_back(tris[t].b);
+					out.push_back(tris[t].c);
+				}
+			}
+		}
+	}
+};
+
+void chunkTriangleMesh(const PackedVertex* verts, sval numverts, const indexval* inds, sval numtris, sval trisPerChunk, sval numLevels,
+		std::vector<indexval>& outinds, std::vector<MeshChunk>& chunks) throw(IndexException)
+{
+	typedef std::pair<sval,sval> trirange; // (first triangle in `order', triangle count)
+
+	trisPerChunk=_max<sval>(1,trisPerChunk);
+	numLevels=_max<sval>(1,numLevels);
+	outinds.clear();
+	chunks.clear();
+
+	if(numtris==0)
+		return;
+
+	std::vector<vec3> centroids(numtris);
+	std::vector<indexval> order(numtris);
+
+	for(sval i=0;i<numtris;i++){
+		vec3 c;
+		for(sval j=0;j<3;j++){
+			indexval ind=inds[i*3+j];
+			if(ind>=numverts)
+				throw IndexException("inds",ind,numverts);
+
+			c=c+vec3(verts[ind].pos[0],verts[ind].pos[1],verts[ind].pos[2]);
+		}
+
+		centroids[i]=c/3.0;
+		order[i]=i;
+	}
+
+	// split at the median centroid along the longest axis as TriMeshBVH::build() does, leaves are produced in spatial order
+	std::vector<trirange> stack, leaves;
+	stack.push_back(trirange(0,numtris));
+
+	while(!stack.empty()){
+		trirange r=stack.back();
+		stack.pop_back();
+
+		if(r.second<=trisPerChunk){
+			leaves.push_back(r);
+			continue;
+		}
+
+		vec3 cmin=centroids[order[r.first]], cmax=cmin;
+		for(sval i=r.first+1;i<r.first+r.second;i++){
+			cmin.setMinVals(centroids[order[i]]);
+			cmax.setMaxVals(centroids[order[i]]);
+		}
+
+		vec3 extent=cmax-cmin;
+		int axis=(extent.x()>=extent.y() && extent.x()>=extent.z()) ? 0 : (extent.y()>=extent.z() ? 1 : 2);
+		sval half=r.second/2;
+
+		std::nth_element(&order[r.first],&order[r.first+half],&order[0]+r.first+r.second,CentroidAxisCompare(centroids,axis));
+
+		stack.push_back(trirange(r.first+half,r.second-half));
+		stack.push_back(trirange(r.first,half));
+	}
+
+	outinds.reserve(numtris*3);
+	chunks.resize(leaves.size());
+
+	for(sval c=0;c<leaves.size();c++){
+		MeshChunk& chunk=chunks[c];
+		const float* p0=verts[inds[order[leaves[c].first]*3]].pos;
+
+		chunk.minv=chunk.maxv=vec3(p0[0],p0[1],p0[2]);
+		chunk.levels.push_back(std::pair<sval,sval>(outinds.size(),leaves[c].second*3));
+
+		for(sval i=leaves[c].first;i<leaves[c].first+leaves[c].second;i++)
+			for(sval j=0;j<3;j++){
+				indexval ind=inds[order[i]*3+j];
+				const float* p=verts[ind].pos;
+
+				chunk.minv.setMinVals(vec3(p[0],p[1],p[2]));
+				chunk.maxv.setMaxVals(vec3(p[0],p[1],p[2]));
+				outinds.push_back(ind);
+			}
+	}
+
+	if(numLevels==1)
+		return;
+
+	ChunkDecimateTask task(verts,outinds,chunks,numLevels);
+	runParallelTask(&task,chunks.size(),numtris>=ParallelChunkThreshold ? 0 : 1,1);
+
+	// append the levels, a level with no triangles or no fewer than the last reuses the last level's range
+	for(sval c=0;c<chunks.size();c++){
+		MeshChunk& chunk=chunks[c];
+
+		for(sval level=1;level<numLevels;level++){
+			const std::vector<indexval>& li=task.levelinds[c][level-1];
+			std::pair<sval,sval> last=chunk.levels.back();
+
+			if(li.size()==0 || li.size()>=last.second)
+				chunk.levels.push_back(last);
+			else{
+				chunk.levels.push_back(std::pair<sval,sval>(outinds.size(),li.size()));
+				outinds.insert(outinds.end(),li.begin(),li.end());
+			}
+		}
+	}
+}
+
+/// Intersects one range of the rays given to intersectsTriMeshRays(), each thread keeps its own result vector to avoid reallocation
+class TriMeshRaysTask : public ParallelTask
+{
+public:
+	const TriMeshBVH* bvh;
+	const Vec3Matrix* origins;
+	const Vec3Matrix* dirs;
+	RealMatrix* dists;
+	IndexMatrix* triinds;
+	const IndexMatrix* excludeInds;
+	std::vector<std::vector<indextriple> > results;
+
+	TriMeshRaysTask(const TriMeshBVH* bvh, const Vec3Matrix* origins, const Vec3Matrix* dirs, RealMatrix* dists, IndexMatrix* triinds,const IndexMatrix* excludeInds, sval numThreads) :
+		bvh(bvh), origins(origins), dirs(dirs), dists(dists), triinds(triinds), excludeInds(excludeInds), results(numThreads)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		std::vector<indextriple> &res=results[threadIndex];
+		sval numResults=dists->m();
+
+		for(sval i=start;i<end;i++){
+			vec3 dir=dirs->at(dirs->n()==1 ? 0 : i);
+			res.clear();
+
+			if(!dir.isZero())
+				bvh->intersect(Ray(origins->at(i),dir),res,numResults,excludeInds ? excludeInds->at(i) : sval(-1));
+
+			for(sval j=0;j<numResults;j++){
+				bool hashit=j<res.size();
+				dists->at(i,j)=hashit ? res[j].second.first : -1;
+				triinds->at(i,j)=hashit ? res[j].first : indexval(-1);
+			}
+		}
+	}
+};
+
+void intersectsTriMeshRays(const TriMeshBVH* bvh, const Vec3Matrix* origins, const Vec3Matrix* dirs, RealMatrix* dists, IndexMatrix* triinds,
+		const IndexMatrix* excludeInds, sval numThreads) throw(IndexException,ValueException,MemException,RenderException)
+{
+	CHECK_NULL(bvh);
+	CHECK_NULL(origins);
+	CHECK_NULL(dirs);
+	CHECK_NULL(dists);
+	CHECK_NULL(triinds);
 
-	memcpy(map+headerlen*sizeof(int),src,srcsize);
+	sval numrays=origins->n();
 
-	UnmapViewOfFile(map);
-	CloseHandle(mapFile);
-	CloseHandle(file);
-#else
-	size_t totalsize=srcsize+headerlen*sizeof(int);
-	int fd=open(filename,O_RDWR|O_CREAT|O_TRUNC,(mode_t)0600);
+	if(dirs->n()!=1 && dirs->n()!=numrays)
+		throw ValueException("dirs","Must have 1 row or as many rows as origins",__FILE__,__LINE__);
 
-	lseek(fd,totalsize-1,SEEK_SET);
-	ssize_t s=write(fd,"",1);
+	if(dists->n()<numrays || triinds->n()<numrays || dists->m()!=triinds->m())
+		throw ValueException("dists, triinds","Must have as many rows as origins and the same number of columns",__FILE__,__LINE__);
 
-	char* map=(char*)mmap(0, totalsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	close(fd);
+	if(excludeInds && excludeInds->n()<numrays)
+		throw ValueException("excludeInds","Must have as many rows as origins",__FILE__,__LINE__);
 
-	if(map==MAP_FAILED)
-		throw MemException("Failed to mmap file");
+	if(!bvh->isBuilt())
+		throw ValueException("bvh","Hierarchy has not been built for the current mesh",__FILE__,__LINE__);
 
-	if(headerlen>0)
-		memcpy(map,header,headerlen*sizeof(int));
+	if(numThreads==0)
+		numThreads=getProcessorCount();
 
-	memcpy(map+headerlen*sizeof(int),src,srcsize);
+	TriMeshRaysTask task(bvh,origins,dirs,dists,triinds,excludeInds,numThreads);
+	runParallelTask(&task,numrays,numThreads);
+}
 
-	if(munmap(map,totalsize))
-		throw MemException("Failed to munmap file");
-#endif
+void ElemMeshBVH::build(sval leafSize) throw(IndexException,MemException)
+{
+	buildMeshBVH(nodes,inds,inds->m(),bounds,nodeinfo,elemorder,leafSize);
 }
 
-/*template<typename T>
-void convertStreamToRealMatrix(const T* stream, RealMatrix* mat)
+bool ElemMeshBVH::inElem(const vec3& pt, sval elem, vec3& xi) const throw(IndexException)
 {
-	T minval=stream[0];
-	T maxval=minval;
-	sval mn=mat->n(),mm=mat->m();
+	if(elem>=inds->n())
+		throw IndexException("elem",elem,inds->n());
 
-	for(sval n=0;n<mn;n++)
-		for(sval m=0;m<mm;m++){
-			T val=stream[n*mm+m]; // totally unsafe if stream is too short
-			minval=_min(val,minval);
-			maxval=_max(val,maxval);
+	const indexval* e=&inds->at(elem,0);
+	const vec3* n=nodes->dataPtr();
+	sval numnodes=nodes->n();
 
-			mat->at(n,m)=val;
-		}
+	for(sval i=0;i<inds->m();i++)
+		if(e[i]>=numnodes)
+			throw IndexException("inds",e[i],numnodes);
 
-	setMatrixMinMax<real,real>(mat,minval,maxval);
-}*/
+	if(inds->m()==4){
+		xi=pointSearchLinTet(pt,n[e[0]],n[e[1]],n[e[2]],n[e[3]]);
+		return xi.isInUnitCube() && (xi.x()+xi.y()+xi.z())<=(1.0+dEPSILON);
+	}
 
-void convertUByteStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const unsigned char*)stream,mat);
+	xi=pointSearchLinHex(pt,n[e[0]],n[e[1]],n[e[2]],n[e[3]],n[e[4]],n[e[5]],n[e[6]],n[e[7]]);
+	return xi.isInUnitCube();
 }
 
-void convertUShortStreamToRealMatrix(const char* stream, RealMatrix* mat)
+sval ElemMeshBVH::locate(const vec3& pt, vec3& xi, sval hint) const throw(IndexException)
 {
-	convertStreamToRealMatrix((const unsigned short*)stream,mat);
-}
+	if(hint!=sval(-1) && hint<inds->n() && inElem(pt,hint,xi))
+		return hint;
 
-void convertByteStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const char*)stream,mat);
-}
+	xi=vec3(-1);
 
-void convertShortStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const short*)stream,mat);
-}
+	if(inds->n()==0 || bounds->n()==0 || !pt.inAABB(bounds->at(0,0),bounds->at(0,1)))
+		return -1;
 
-void convertUIntStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const u32*)stream,mat);
-}
+	sval stack[64]; // the tree is balanced so its depth is at most log2 of the element count plus 1
+	sval stacksize=0;
+	stack[stacksize++]=0;
 
-void convertIntStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const i32*)stream,mat);
-}
+	while(stacksize>0){
+		sval node=stack[--stacksize];
+		sval first=nodeinfo->at(node,0), count=nodeinfo->at(node,1);
 
-void convertFloatStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix((const float*)stream,mat);
-}
+		if(count>0){
+			for(sval i=first;i<first+count;i++){
+				sval elem=elemorder->at(i);
+				if(elem!=hint && inElem(pt,elem,xi))
+					return elem;
+			}
+		}
+		else{
+			for(sval c=first;c<first+2;c++)
+				if(pt.inAABB(bounds->at(c,0),bounds->at(c,1)))
+					stack[stacksize++]=c;
+		}
+	}
 
-void convertRealStreamToRealMatrix(const char* stream, RealMatrix* mat)
-{
-	convertStreamToRealMatrix<real>((const double*)stream,mat);
+	xi=vec3(-1);
+	return -1;
 }
 
-std::pair<vec3,vec3> calculateBoundBox(const Vec3Matrix* mat)
+/// Locates one range of the points given to locatePoints(), each range starting its search hint over
+class LocatePointsTask : public ParallelTask
 {
-	vec3 minv,maxv;
+public:
+	const ElemMeshBVH* bvh;
+	const Vec3Matrix* pts;
+	IndexMatrix* elems;
+	Vec3Matrix* xis;
+
+	LocatePointsTask(const ElemMeshBVH* bvh, const Vec3Matrix* pts, IndexMatrix* elems, Vec3Matrix* xis) :
+		bvh(bvh), pts(pts), elems(elems), xis(xis)
+	{}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		sval hint=-1;
 
-	if(mat && mat->n()>0){
-		minv=mat->getAt(0);
-		maxv=mat->getAt(0);
+		for(sval i=start;i<end;i++){
+			vec3 xi;
+			sval elem=bvh->locate(pts->at(i),xi,hint);
 
-		sval rows=mat->n();
+			elems->at(i)=elem;
+			xis->at(i)=xi;
 
-		for(sval i=1;i<rows;i++){
-			vec3 pos=mat->getAt(i);
-			minv.setMinVals(pos);
-			maxv.setMaxVals(pos);
+			if(elem!=sval(-1))
+				hint=elem;
 		}
 	}
+};
+
+void locatePoints(const ElemMeshBVH* bvh, const Vec3Matrix* pts, IndexMatrix* elems, Vec3Matrix* xis, sval numThreads) 
+		throw(IndexException,ValueException,MemException,RenderException)
+{
+	CHECK_NULL(bvh);
+	CHECK_NULL(pts);
+	CHECK_NULL(elems);
+	CHECK_NULL(xis);
+
+	sval numpts=pts->n();
 
-	return std::pair<vec3,vec3>(minv,maxv);
+	if(elems->n()<numpts || xis->n()<numpts)
+		throw ValueException("elems, xis","Must have as many rows as points",__FILE__,__LINE__);
+
+	if(!bvh->isBuilt())
+		throw ValueException("bvh","Hierarchy has not been built for the current mesh",__FILE__,__LINE__);
+
+	if(numThreads==0)
+		numThreads=getProcessorCount();
+
+	LocatePointsTask task(bvh,pts,elems,xis);
+	runParallelTask(&task,numpts,numThreads);
 }
 
 void basis_Tet1NL(real xi0, real xi1, real xi2, real* coeffs)
@@ -322,75 +2768,77 @@ void basis_Hex1NL(real xi0, real xi1, real xi2, real* coeffs)
 	coeffs[7]=xi012;
 }
 
-real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix* knots)
+/**
+ * Store in `coeffs' the values of the `count' NURBS basis functions of degree `degree' at `xi' for the knots `knots', which must
+ * have count+degree+1 values with count+degree no more than NURBSMaxKnots. This evaluates the Cox-de Boor recurrence in place, 
+ * starting with the degree 0 functions for every knot span and raising them one degree at a time, which gives the same values
+ * as evaluating the recurrence recursively for each function.
+ */
+static void basisNURBSValues(real xi, sval count, sval degree, const real* knots, real* coeffs)
 {
-	real pt1=knots->at(ctrlpt), pt2=knots->at(ctrlpt+1);
-
-	if(degree==0)
-		return (pt1<=xi && xi<=pt2) ? 1.0 : 0.0;
-
-	real pt3=knots->at(ctrlpt+degree), pt4=knots->at(ctrlpt+degree+1);
+	real n[NURBSMaxKnots];
+	sval numspans=count+degree;
+
+	for(sval i=0;i<numspans;i++)
+		n[i]=(knots[i]<=xi && xi<=knots[i+1]) ? 1.0 : 0.0;
+
+	// after raising to degree d the first numspans-d entries of `n' are the degree d basis values
+	for(sval d=1;d<=degree;d++){
+		for(sval i=0;i<numspans-d;i++){
+			real dd1=knots[i+d]-knots[i], dd2=knots[i+d+1]-knots[i+1];
+			real f=fabs(dd1)<0.0000001 ? 0 : (xi-knots[i])/dd1;
+			real g=fabs(dd2)<0.0000001 ? 0 : (knots[i+d+1]-xi)/dd2;
+			n[i]=(f*n[i])+(g*n[i+1]);
+		}
+	}
 
-	real nn1=xi-pt1, dd1=pt3-pt1;
-	real f=fabs(dd1)<0.0000001 ? 0 : nn1/dd1;
+	for(sval i=0;i<count;i++)
+		coeffs[i]=n[i];
+}
 
-	real nn2=pt4-xi, dd2=pt4-pt2;
-	real g=fabs(dd2)<0.0000001 ? 0 : nn2/dd2;
+real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix* knots) throw(IndexException,ValueException)
+{
+	if(degree+2>NURBSMaxKnots)
+		throw ValueException("degree","Degree too large for NURBS basis evaluation",__FILE__,__LINE__);
 
-	real b1=basis_n_NURBS(ctrlpt,degree-1,xi,knots);
-	real b2=basis_n_NURBS(ctrlpt+1,degree-1,xi,knots);
+	if(ctrlpt+degree+1>=knots->n())
+		throw IndexException("ctrlpt",ctrlpt,knots->n()>degree+1 ? knots->n()-degree-1 : 0);
 
-	return (f*b1)+(g*b2);
+	real coeff;
+	basisNURBSValues(xi,1,degree,&knots->at(ctrlpt),&coeff);
+	return coeff;
 }
 
-std::map<std::pair<sval,sval>,RealMatrix*> defaultKnots;
-
-RealMatrix* getDefaultKnotMat(sval length,sval degree)
+/// Fill `knots' with the length+degree+1 evenly spaced knots in [0,1] and return `xi' scaled to the curve's range of these
+static real defaultKnotsNURBS(real xi, sval length, sval degree, real* knots) throw(ValueException)
 {
-	std::pair<sval,sval> index(length,degree);
-
-	if(defaultKnots.find(index)==defaultKnots.end()){
-		RealMatrix *mat=new RealMatrix("knots",0);
+	sval numspans=length+degree;
 
-		for(real i=0;i<1.0;i+=1.0/(length+degree))
-			mat->append(i);
+	if(length==0 || numspans>NURBSMaxKnots)
+		throw ValueException("length","Control point count must be non-zero and within NURBSMaxKnots with degree",__FILE__,__LINE__);
 
-		mat->append(1.0);
-		defaultKnots[index]=mat;
-	}
-
-	return defaultKnots[index];
-}
+	for(sval i=0;i<=numspans;i++)
+		knots[i]=real(i)/numspans;
 
-real scaleXiMat(real xi, sval degree,RealMatrix* knots)
-{
-	return lerp(xi,knots->at(degree),knots->at(knots->n()-degree-1));
+	return lerp(xi,knots[degree],knots[length]);
 }
 
-void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs)
+void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs) 
+		throw(ValueException)
 {
-	RealMatrix *uknots=getDefaultKnotMat(ul,udegree);
-	RealMatrix *vknots=getDefaultKnotMat(vl,vdegree);
-	RealMatrix *wknots=getDefaultKnotMat(wl,wdegree);
+	real knots[NURBSMaxKnots+1];
+	real ub[NURBSMaxKnots], vb[NURBSMaxKnots], wb[NURBSMaxKnots];
 
-	u=scaleXiMat(u,udegree,uknots);
-	v=scaleXiMat(v,vdegree,vknots);
-	w=scaleXiMat(w,wdegree,wknots);
+	u=defaultKnotsNURBS(u,ul,udegree,knots);
+	basisNURBSValues(u,ul,udegree,knots,ub);
 
-	real denom=0;
-
-	RealMatrix ub("ub",ul);
-	RealMatrix vb("vb",vl);
-	RealMatrix wb("wb",wl);
+	v=defaultKnotsNURBS(v,vl,vdegree,knots);
+	basisNURBSValues(v,vl,vdegree,knots,vb);
 
-	for(sval i=0;i<ul;i++)
-		ub[i]=basis_n_NURBS(i,udegree,u,uknots);
+	w=defaultKnotsNURBS(w,wl,wdegree,knots);
+	basisNURBSValues(w,wl,wdegree,knots,wb);
 
-	for(sval j=0;j<vl;j++)
-		vb[j]=basis_n_NURBS(j,vdegree,v,vknots);
-
-	for(sval k=0;k<wl;k++)
-		wb[k]=basis_n_NURBS(k,wdegree,w,wknots);
+	real denom=0;
 
 	for(sval k=0;k<wl;k++)
 		for(sval j=0;j<vl;j++)
@@ -406,6 +2854,53 @@ void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval
 			coeffs[i]/=denom;
 }
 
+/// Check the arguments for the fillBasisTable functions and resize `coeffs' to have a row for each xi value
+static void checkBasisTableArgs(const RealMatrix* xis, RealMatrix* coeffs, sval numcoeffs) throw(ValueException)
+{
+	if(!xis || !coeffs)
+		throw ValueException("xis","Xi and coefficient matrices must not be NULL");
+
+	if(xis->m()>3)
+		throw ValueException("xis","Xi matrix must have 1 to 3 columns");
+
+	if(coeffs->m()!=numcoeffs)
+		throw ValueException("coeffs","Coefficient matrix must have a column for each coefficient of the basis");
+
+	coeffs->setN(xis->n());
+}
+
+/// Get the xi value from row `n' of `xis', components beyond its column count are 0
+static inline void getBasisTableXi(const RealMatrix* xis, sval n, real* xi)
+{
+	sval dims=xis->m();
+	xi[0]=xis->at(n,0);
+	xi[1]=dims>1 ? xis->at(n,1) : 0;
+	xi[2]=dims>2 ? xis->at(n,2) : 0;
+}
+
+void fillBasisTable(BasisFunc func, sval numcoeffs, const RealMatrix* xis, RealMatrix* coeffs) throw(ValueException)
+{
+	checkBasisTableArgs(xis,coeffs,numcoeffs);
+
+	for(sval n=0;n<xis->n();n++){
+		real xi[3];
+		getBasisTableXi(xis,n,xi);
+		func(xi[0],xi[1],xi[2],&coeffs->at(n,0));
+	}
+}
+
+void fillBasisTable_NURBS_default(const RealMatrix* xis, sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,
+		RealMatrix* coeffs) throw(ValueException)
+{
+	checkBasisTableArgs(xis,coeffs,ul*vl*wl);
+
+	for(sval n=0;n<xis->n();n++){
+		real xi[3];
+		getBasisTableXi(xis,n,xi);
+		basis_NURBS_default(xi[0],xi[1],xi[2],ul,vl,wl,udegree,vdegree,wdegree,&coeffs->at(n,0));
+	}
+}
+
 void catmullRomSpline(real t, real* coeffs)
 {
 	real t2=t*t;
@@ -608,57 +3103,669 @@ sval calculateHexValueIntersects(real val,const real* vals,intersect* results)
 	return count;
 }
 
-void interpolateImageStack(const std::vector<RealMatrix*>& stack,const transform& stacktransinv,RealMatrix *out,const transform& outtrans)
+/// Number of elements above which isosurface and isoline extraction is divided between threads by default
+static const sval ParallelIsoThreshold=4096;
+
+/// Number of elements in each block of an IsoExtractTask, the primitives for each block are kept separately in element order
+static const sval IsoBlockSize=1024;
+
+// the tets or triangles each element type is divided into, as indices of the element's nodes
+static const sval IsoTetSimplices[1][4]={ {0,1,2,3} };
+static const sval IsoHexSimplices[6][4]={ {0,1,3,7}, {0,1,5,7}, {0,2,3,7}, {0,2,6,7}, {0,4,5,7}, {0,4,6,7} };
+static const sval IsoTriSimplices[1][4]={ {0,1,2,0} };
+static const sval IsoQuadSimplices[2][4]={ {0,1,3,0}, {0,3,2,0} };
+
+/**
+ * Identifies a vertex of an isosurface or isoline as the mesh edge (a,b), with a<b, it lies on and the index of its isovalue.
+ * The element the vertex was produced from is also kept but isn't compared, so the welded vertex uses the first one.
+ */
+struct IsoEdgeKey
+{
+	u64 edge;
+	u32 iso;
+	u32 elem;
+
+	IsoEdgeKey() : edge(0), iso(0), elem(0) {}
+	IsoEdgeKey(indexval a, indexval b, sval iso, sval elem) : edge(a<b ? (u64(a)<<32)|b : (u64(b)<<32)|a), iso(u32(iso)), elem(u32(elem)) {}
+
+	indexval first() const { return indexval(edge>>32); }
+	indexval second() const { return indexval(edge&0xffffffff); }
+
+	bool operator<(const IsoEdgeKey& k) const { return edge<k.edge || (edge==k.edge && iso<k.iso); }
+	bool operator==(const IsoEdgeKey& k) const { return edge==k.edge && iso==k.iso; }
+};
+
+/**
+ * Intersects each element of an index matrix with every isovalue, each item being a block of IsoBlockSize elements. The
+ * elements are divided into simplices, tets for isosurfaces or triangles for isolines, and the vertices of the triangles
+ * or line segments intersecting these are stored as IsoEdgeKey values in the list for the block, 3 per triangle or 2 per
+ * line. For isolines the normal of the element each segment lies in is also stored.
+ */
+class IsoExtractTask : public ParallelTask
+{
+public:
+	const Vec3Matrix* nodes;
+	const IndexMatrix* inds;
+	const RealMatrix* field;
+	const std::vector<real>& isovals;
+	const sval (*simplices)[4];
+	sval numSimplices;
+	bool isLine;
+
+	std::vector<std::vector<IsoEdgeKey> > blockKeys;
+	std::vector<std::vector<vec3> > blockNorms;
+
+	IsoExtractTask(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const std::vector<real>& isovals,
+			const sval (*simplices)[4], sval numSimplices, bool isLine) : nodes(nodes), inds(inds), field(field), isovals(isovals),
+			simplices(simplices), numSimplices(numSimplices), isLine(isLine), blockKeys(numBlocks()), blockNorms(numBlocks())
+	{}
+
+	sval numBlocks() const { return (inds->n()+IsoBlockSize-1)/IsoBlockSize; }
+
+	/// Returns the position of the vertex `key' for the isovalue `val'
+	vec3 edgePos(const IsoEdgeKey& key, real val) const
+	{
+		indexval a=key.first(), b=key.second();
+		real fa=field->atc(a), fb=field->atc(b);
+		real t=(val-fa)/(fb-fa); // an edge with a key has one node at or above `val' and one below, so fa!=fb
+
+		if(t>=1.0) // return the node exactly so that vertices at the same node coincide
+			return nodes->atc(b);
+
+		return nodes->atc(a)+(nodes->atc(b)-nodes->atc(a))*t;
+	}
+
+	/**
+	 * Add the triangle for `keys', swapping its winding if needed so that its normal points toward `ref' if `refAbove' is
+	 * true or away from it otherwise. The point `ref' is a simplex node which can't be on the triangle's plane.
+	 */
+	void addTri(std::vector<IsoEdgeKey>& out, const IsoEdgeKey* keys, real val, const vec3& ref, bool refAbove) const
+	{
+		vec3 p0=edgePos(keys[0],val), p1=edgePos(keys[1],val), p2=edgePos(keys[2],val);
+		vec3 norm=(p1-p0).cross(p2-p0);
+
+		if(norm.x()==0 && norm.y()==0 && norm.z()==0) // degenerate triangles occur when a node's value equals `val', these are skipped
+			return;
+
+		real side=norm.dot(ref-p0);
+		bool swap=refAbove ? side<0 : side>0;
+
+		out.push_back(keys[0]);
+		out.push_back(keys[swap ? 2 : 1]);
+		out.push_back(keys[swap ? 1 : 2]);
+	}
+
+	void extractTet(std::vector<IsoEdgeKey>& out, const indexval* n, sval iso, sval elem) const
+	{
+		real val=isovals[iso];
+		sval above[4], below[4], na=0, nb=0;
+
+		for(sval k=0;k<4;k++){
+			if(field->atc(n[k])>=val)
+				above[na++]=k;
+			else
+				below[nb++]=k;
+		}
+
+		if(na==0 || nb==0)
+			return;
+
+		IsoEdgeKey keys[4];
+
+		if(na==1 || na==3){ // one node is separated from the other three so the intersection is a triangle
+			sval s=na==1 ? above[0] : below[0];
+			const sval* others=na==1 ? below : above;
+
+			for(sval k=0;k<3;k++)
+				keys[k]=IsoEdgeKey(n[s],n[others[k]],iso,elem);
+
+			addTri(out,keys,val,nodes->atc(n[s]),na==1);
+		}
+		else{ // two nodes on either side so the intersection is a quad, the keys are in cyclic order around it
+			keys[0]=IsoEdgeKey(n[above[0]],n[below[0]],iso,elem);
+			keys[1]=IsoEdgeKey(n[above[0]],n[below[1]],iso,elem);
+			keys[2]=IsoEdgeKey(n[above[1]],n[below[1]],iso,elem);
+			keys[3]=IsoEdgeKey(n[above[1]],n[below[0]],iso,elem);
+
+			// each triangle has two vertices on edges from one of the nodes above, which is used as its reference point
+			IsoEdgeKey second[3]={ keys[0], keys[2], keys[3] };
+			addTri(out,keys,val,nodes->atc(n[above[0]]),true);
+			addTri(out,second,val,nodes->atc(n[above[1]]),true);
+		}
+	}
+
+	void extractTri(std::vector<IsoEdgeKey>& out, std::vector<vec3>& norms, const indexval* n, sval iso, sval elem) const
+	{
+		real val=isovals[iso];
+		sval above[3], below[3], na=0, nb=0;
+
+		for(sval k=0;k<3;k++){
+			if(field->atc(n[k])>=val)
+				above[na++]=k;
+			else
+				below[nb++]=k;
+		}
+
+		if(na==0 || nb==0)
+			return;
+
+		sval s=na==1 ? above[0] : below[0];
+		const sval* others=na==1 ? below : above;
+
+		out.push_back(IsoEdgeKey(n[s],n[others[0]],iso,elem));
+		out.push_back(IsoEdgeKey(n[s],n[others[1]],iso,elem));
+		norms.push_back(nodes->atc(n[0]).planeNorm(nodes->atc(n[1]),nodes->atc(n[2])));
+	}
+
+	virtual void run(sval start, sval end, sval)
+	{
+		sval numelems=inds->n(), elemsize=inds->m(), numnodes=_min(nodes->n(),field->n());
+		indexval simplex[4];
+
+		for(sval b=start;b<end;b++){
+			std::vector<IsoEdgeKey>& keys=blockKeys[b];
+			std::vector<vec3>& norms=blockNorms[b];
+
+			for(sval e=b*IsoBlockSize;e<_min(numelems,(b+1)*IsoBlockSize);e++){
+				const indexval* elem=&inds->atc(e);
+
+				for(sval k=0;k<elemsize;k++)
+					if(elem[k]>=numnodes)
+						throw IndexException("inds",elem[k],numnodes);
+
+				for(sval s=0;s<numSimplices;s++){
+					for(sval k=0;k<4;k++)
+						simplex[k]=elem[simplices[s][k]];
+
+					for(sval iso=0;iso<isovals.size();iso++){
+						if(isLine)
+							extractTri(keys,norms,simplex,iso,e);
+						else
+							extractTet(keys,simplex,iso,e);
+					}
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Extract the primitives of `task', of `primsize' vertices each, and weld their vertices into the output matrices. The
+ * normals of triangle vertices are the area-weighted averages of their triangles' normals, for lines the element normals.
+ */
+static void fillIsoOutput(IsoExtractTask& task, sval primsize, Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges, 
+		RealMatrix* outlerps, IndexMatrix* outelems, bool doubleSided, sval numThreads) throw(IndexException,ValueException,MemException)
+{
+	runParallelTask(&task,task.numBlocks(),numThreads,1);
+
+	std::vector<IsoEdgeKey> prims;
+	std::vector<vec3> primnorms;
+
+	for(sval b=0;b<task.blockKeys.size();b++){
+		prims.insert(prims.end(),task.blockKeys[b].begin(),task.blockKeys[b].end());
+		primnorms.insert(primnorms.end(),task.blockNorms[b].begin(),task.blockNorms[b].end());
+		std::vector<IsoEdgeKey>().swap(task.blockKeys[b]);
+	}
+
+	// weld vertices by sorting their keys, each unique key is then one vertex whose index is its position in the sorted list,
+	// the sort is stable so that the key kept for each vertex is from the first element since `prims' is in element order
+	std::vector<IsoEdgeKey> verts(prims);
+	std::stable_sort(verts.begin(),verts.end());
+	verts.erase(std::unique(verts.begin(),verts.end()),verts.end());
+
+	sval numverts=verts.size(), numprims=prims.size()/primsize, copies=doubleSided ? 2 : 1;
+
+	outnodes->setN(numverts*copies);
+	outinds->setN(numprims*copies);
+	outnodes->fill(vec3());
+
+	if(outedges)
+		outedges->setN(numverts*copies);
+	if(outlerps)
+		outlerps->setN(numverts*copies);
+	if(outelems)
+		outelems->setN(numverts*copies);
+
+	for(sval v=0;v<numverts;v++){
+		const IsoEdgeKey& key=verts[v];
+		indexval a=key.first(), b=key.second();
+		real fa=task.field->atc(a), fb=task.field->atc(b);
+		real t=(task.isovals[key.iso]-fa)/(fb-fa);
+
+		outnodes->at(v,0)=task.edgePos(key,task.isovals[key.iso]);
+
+		if(outedges){
+			outedges->at(v,0)=a;
+			outedges->at(v,1)=b;
+			outedges->at(v,2)=key.iso;
+		}
+
+		if(outlerps)
+			outlerps->at(v)=t;
+
+		if(outelems){
+			const indexval* elem=&task.inds->atc(key.elem);
+			outelems->at(v,0)=key.elem;
+
+			for(sval k=0;k<task.inds->m();k++){
+				if(elem[k]==a)
+					outelems->at(v,1)=k;
+				if(elem[k]==b)
+					outelems->at(v,2)=k;
+			}
+		}
+	}
+
+	for(sval p=0;p<numprims;p++){
+		indexval pinds[3];
+
+		for(sval k=0;k<primsize;k++){
+			pinds[k]=indexval(std::lower_bound(verts.begin(),verts.end(),prims[p*primsize+k])-verts.begin());
+			outinds->at(p,k)=pinds[k];
+		}
+
+		vec3 norm;
+		if(primsize==3){
+			const vec3& p0=outnodes->at(pinds[0]);
+			norm=(outnodes->at(pinds[1])-p0).cross(outnodes->at(pinds[2])-p0); // unnormalized so larger triangles are weighted more
+		}
+		else
+			norm=primnorms[p];
+
+		for(sval k=0;k<primsize;k++)
+			outnodes->at(pinds[k],1)=outnodes->at(pinds[k],1)+norm;
+	}
+
+	for(sval v=0;v<numverts;v++)
+		outnodes->at(v,1)=outnodes->at(v,1).norm();
+
+	if(doubleSided){
+		for(sval v=0;v<numverts;v++){
+			outnodes->at(v+numverts,0)=outnodes->at(v,0);
+			outnodes->at(v+numverts,1)=-outnodes->at(v,1);
+
+			if(outedges)
+				for(sval k=0;k<3;k++)
+					outedges->at(v+numverts,k)=outedges->at(v,k);
+
+			if(outlerps)
+				outlerps->at(v+numverts)=outlerps->at(v);
+
+			if(outelems)
+				for(sval k=0;k<3;k++)
+					outelems->at(v+numverts,k)=outelems->at(v,k);
+		}
+
+		for(sval p=0;p<numprims;p++)
+			for(sval k=0;k<primsize;k++)
+				outinds->at(p+numprims,k)=outinds->at(p,primsize-1-k)+numverts;
+	}
+}
+
+/// Checks the arguments common to calculateIsosurface() and calculateIsoline()
+static void checkIsoArgs(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, Vec3Matrix* outnodes, 
+		IndexMatrix* outinds, sval primsize, IndexMatrix* outedges, IndexMatrix* outelems) throw(ValueException)
+{
+	if(!nodes || !inds || !field || !outnodes || !outinds)
+		throw ValueException("nodes","Input and output matrices must not be NULL");
+
+	if(outnodes->m()<2)
+		throw ValueException("outnodes","Output node matrix must have at least 2 columns for positions and normals");
+
+	if(outinds->m()<primsize)
+		throw ValueException("outinds","Output index matrix has too few columns");
+
+	if(outedges && outedges->m()<3)
+		throw ValueException("outedges","Output edge matrix must have at least 3 columns");
+
+	if(outelems && outelems->m()<3)
+		throw ValueException("outelems","Output element matrix must have at least 3 columns");
+}
+
+void calculateIsosurface(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const std::vector<real>& isovals,
+		Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges, RealMatrix* outlerps, IndexMatrix* outelems, 
+		bool doubleSided, sval numThreads) throw(IndexException,ValueException,MemException)
+{
+	checkIsoArgs(nodes,inds,field,outnodes,outinds,3,outedges,outelems);
+
+	if(inds->m()!=4 && inds->m()!=8)
+		throw ValueException("inds","Index matrix must define linear tetrahedra or hexahedra with 4 or 8 columns");
+
+	bool isHex=inds->m()==8;
+	IsoExtractTask task(nodes,inds,field,isovals,isHex ? IsoHexSimplices : IsoTetSimplices,isHex ? 6 : 1,false);
+
+	if(numThreads==0)
+		numThreads=inds->n()>=ParallelIsoThreshold ? getProcessorCount() : 1;
+
+	fillIsoOutput(task,3,outnodes,outinds,outedges,outlerps,outelems,doubleSided,numThreads);
+}
+
+void calculateIsoline(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const std::vector<real>& isovals,
+		Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges, RealMatrix* outlerps, IndexMatrix* outelems, 
+		sval numThreads) throw(IndexException,ValueException,MemException)
+{
+	checkIsoArgs(nodes,inds,field,outnodes,outinds,2,outedges,outelems);
+
+	if(inds->m()!=3 && inds->m()!=4)
+		throw ValueException("inds","Index matrix must define linear triangles or quads with 3 or 4 columns");
+
+	bool isQuad=inds->m()==4;
+	IsoExtractTask task(nodes,inds,field,isovals,isQuad ? IsoQuadSimplices : IsoTriSimplices,isQuad ? 2 : 1,true);
+
+	if(numThreads==0)
+		numThreads=inds->n()>=ParallelIsoThreshold ? getProcessorCount() : 1;
+
+	fillIsoOutput(task,2,outnodes,outinds,outedges,outlerps,outelems,false,numThreads);
+}
+
+/// Bilinearly interpolate `img' at the clamped xi coordinate (x,y) in [0,1], or return the nearest value if `nearest' is true
+template<typename T>
+static inline real sampleImage(const Matrix<T>* img, real x, real y, bool nearest)
+{
+	sval m1=img->m()-1, n1=img->n()-1;
+	const T* data=img->dataPtr();
+
+	x*=m1;
+	y*=n1;
+
+	if(nearest)
+		return data[sval(x+0.5)+img->m()*sval(y+0.5)];
+
+	sval sx=sval(x), sy=sval(y);
+	sval sx1=_min(sx+1,m1), sy1=_min(sy+1,n1);
+	real dx=x-sx, dy=y-sy;
+	const T* row=data+img->m()*sy;
+	const T* row1=data+img->m()*sy1;
+
+	real top=row[sx]+dx*(real(row[sx1])-row[sx]);
+	real bottom=row1[sx]+dx*(real(row1[sx1])-row1[sx]);
+
+	return top+dy*(bottom-top);
+}
+
+/// Returns the value of the `numimgs' images of `stack' at the xi coordinate `pos', this is getImageStackValue() without the checks
+template<typename T>
+static inline real sampleImageStack(Matrix<T>* const* stack, sval numimgs, vec3 pos, bool nearest)
 {
-	sval n=out->n()-1,m=out->m()-1;
+	pos=pos.clamp(vec3(dEPSILON),vec3(1-dEPSILON));
+
+	real numimgs1=real(numimgs)-1;
+	real z=pos.z()*numimgs1;
+	sval img1=sval(z);
+
+	if(nearest)
+		return sampleImage(stack[sval(z+0.5)],pos.x(),pos.y(),true);
+
+	sval img2=_min<sval>(img1+1,numimgs-1);
+	real dz=z-img1;
+	real val1=sampleImage(stack[img1],pos.x(),pos.y(),false);
 
-	out->fill(0);
+	return img1==img2 || dz==0 ? val1 : lerp(dz,val1,sampleImage(stack[img2],pos.x(),pos.y(),false));
+}
 
-	real minval=stack[0]->at(0,0);
-	real maxval=minval;
+/// Number of output pixels above which resampling is split between threads
+static const sval ParallelResampleThreshold=65536;
 
-	mat4 trans=stacktransinv.toMatrix()*outtrans.toMatrix();
+/// Converts a resampled value to T, rounding to the nearest value for integer types
+template<typename T>
+static inline T fromSampledValue(real val)
+{
+	return std::numeric_limits<T>::is_integer ? T(floor(val+0.5)) : T(val);
+}
 
-	for(sval i=0;i<=n;i++){
-		for(sval j=0;j<=m;j++){
-			vec3 xi=vec3(real(j)/m,real(i)/n); // the xi value of the position (i,j) in `out'
-			vec3 pos=xi*trans;
+/**
+ * Resamples rows of the images in `out' from `stack', treating `out' and `stack' as `timesteps' consecutive volumes. 
+ * Each item is a row number counted over all the images of `out', the minimum and maximum value for each is stored
+ * in `rowmin' and `rowmax' so that the range of each image can be calculated afterwards.
+ */
+template<typename T>
+class ImageStackTask : public ParallelTask
+{
+public:
+	typedef Matrix<T> ImageMatrix;
+
+	const std::vector<ImageMatrix*>& stack;
+	const std::vector<ImageMatrix*>& out;
+	sval stackdepth, outdepth, rows;
+	bool nearest;
+	mat4 trans;
+	std::vector<real> rowmin, rowmax;
+
+	ImageStackTask(const std::vector<ImageMatrix*>& stack,const transform& stacktransinv,const std::vector<ImageMatrix*>& out,
+			const transform& outtrans,sval timesteps,bool nearest) : 
+		stack(stack), out(out), stackdepth(stack.size()/timesteps), outdepth(out.size()/timesteps), rows(out[0]->n()), 
+		nearest(nearest), rowmin(out.size()*rows), rowmax(out.size()*rows)
+	{
+		trans=stacktransinv.toMatrix()*outtrans.toMatrix();
+	}
 
-			if(pos.isInUnitCube(dEPSILON)){
-				real val=getImageStackValue(stack,pos.clamp(vec3(0),vec3(1)));
-				out->at(i,j)=val;
-				minval=_min(val,minval);
-				maxval=_max(val,maxval);
+	virtual void run(sval start, sval end, sval)
+	{
+		for(sval r=start;r<end;r++){
+			sval k=r/rows, i=r%rows;
+			sval t=k/outdepth; // timestep index
+			ImageMatrix* img=out[k];
+			ImageMatrix* const* vol=&stack[t*stackdepth];
+			sval m=img->m();
+			T* row=img->dataPtr()+i*m;
+
+			// the xi value of the row's start in `out', a dimension of length 1 is sampled at xi 0
+			real xistep=m>1 ? 1.0/(m-1) : 0;
+			real yi=rows>1 ? real(i)/(rows-1) : 0;
+			real zi=outdepth>1 ? real(k%outdepth)/(outdepth-1) : 0;
+
+			// the transform is linear in xi so the homogeneous position and its divisor are stepped along the row
+			vec3 pos(trans.m01*yi+trans.m02*zi+trans.m03, trans.m11*yi+trans.m12*zi+trans.m13, trans.m21*yi+trans.m22*zi+trans.m23);
+			real d=trans.m31*yi+trans.m32*zi+trans.m33;
+			vec3 posstep=vec3(trans.m00,trans.m10,trans.m20)*xistep;
+			real dstep=trans.m30*xistep;
+
+			real minv=stack[0]->at(0,0), maxv=minv;
+
+			for(sval j=0;j<m;j++){
+				vec3 p=d==0 ? vec3() : pos/d;
+				real val=0;
+
+				if(p.isInUnitCube(dEPSILON)){
+					val=sampleImageStack(vol,stackdepth,p,nearest);
+					minv=_min(val,minv);
+					maxv=_max(val,maxv);
+				}
+
+				row[j]=fromSampledValue<T>(val);
+				pos=pos+posstep;
+				d+=dstep;
 			}
+
+			rowmin[r]=minv;
+			rowmax[r]=maxv;
+		}
+	}
+};
+
+template<typename T>
+void interpolateImageStack(const std::vector<Matrix<T>*>& stack,const transform& stacktransinv,Matrix<T> *out,const transform& outtrans,bool nearest)
+{
+	std::vector<Matrix<T>*> outstack(1,out);
+	interpolateImageVolume(stack,stacktransinv,outstack,outtrans,1,nearest);
+}
+
+template<typename T>
+void interpolateImageVolume(const std::vector<Matrix<T>*>& stack,const transform& stacktransinv,const std::vector<Matrix<T>*>& out,
+		const transform& outtrans, sval timesteps, bool nearest) throw(ValueException)
+{
+	if(stack.size()==0 || out.size()==0 || timesteps==0 || stack.size()%timesteps || out.size()%timesteps)
+		throw ValueException("timesteps","Image stack and output sizes must be non-zero multiples of the number of timesteps");
+
+	for(sval k=1;k<out.size();k++)
+		if(out[k]->n()!=out[0]->n())
+			throw ValueException("out","Output images must have the same number of rows");
+
+	ImageStackTask<T> task(stack,stacktransinv,out,outtrans,timesteps,nearest);
+	sval numrows=task.rows*out.size();
+
+	runParallelTask(&task,numrows,out.size()*out[0]->n()*out[0]->m()>=ParallelResampleThreshold ? 0 : 1);
+
+	for(sval k=0;k<out.size();k++){
+		real minval=task.rowmin[k*task.rows], maxval=task.rowmax[k*task.rows];
+
+		for(sval i=1;i<task.rows;i++){
+			minval=_min(minval,task.rowmin[k*task.rows+i]);
+			maxval=_max(maxval,task.rowmax[k*task.rows+i]);
+		}
+
+		setMatrixMinMax<T,real>(out[k],minval,maxval);
+	}
+}
+
+template<typename T>
+real getImageStackValue(const std::vector<Matrix<T>*>& stack,const vec3& pos)
+{
+	return sampleImageStack(&stack[0],stack.size(),pos,false);
+}
+
+/// Reducer for calculateImageHistogram(), each partial is a separate histogram of counts for the block's rows
+template<typename T>
+struct ImageHistogramReducer
+{
+	typedef std::vector<real> Result;
+	i32 minv;
+	sval numBins;
+
+	ImageHistogramReducer(i32 minv, sval numBins) : minv(minv), numBins(numBins) {}
+
+	Result initial() const { return Result(numBins,0.0); }
+
+	void reduceRow(Result& r, const T* row, sval, sval cols) const
+	{
+		for(sval j=0;j<cols;j++){
+			sval val=sval(i32(row[j]+0.5)-minv);
+			if(val<numBins)
+				r[val]++;
 		}
 	}
 
-	setMatrixMinMax<real,real>(out,minval,maxval);
+	void merge(Result& r, const Result& next) const
+	{
+		for(sval i=0;i<numBins;i++)
+			r[i]+=next[i];
+	}
+};
+
+template<typename T>
+void calculateImageHistogram(const Matrix<T>* img, RealMatrix* hist,i32 minv)
+{
+	sval hn=hist->n();
+	std::vector<real> counts=reduceMatrix(img,ImageHistogramReducer<T>(minv,hn));
+
+	for(sval i=0;i<hn;i++)
+		hist->at(i)+=counts[i];
 }
 
+// instantiate the image functions for each type of image matrix
+#define INSTANTIATE_IMAGE_FUNCS(T) \
+	template void interpolateImageStack<T>(const std::vector<Matrix<T>*>&,const transform&,Matrix<T>*,const transform&,bool); \
+	template void interpolateImageVolume<T>(const std::vector<Matrix<T>*>&,const transform&,const std::vector<Matrix<T>*>&, \
+		const transform&,sval,bool) throw(ValueException); \
+	template real getImageStackValue<T>(const std::vector<Matrix<T>*>&,const vec3&); \
+	template void calculateImageHistogram<T>(const Matrix<T>*,RealMatrix*,i32);
+
+INSTANTIATE_IMAGE_FUNCS(real)
+INSTANTIATE_IMAGE_FUNCS(float)
+INSTANTIATE_IMAGE_FUNCS(u16)
+INSTANTIATE_IMAGE_FUNCS(i16)
 
-real getImageStackValue(const std::vector<RealMatrix*>& stack,const vec3& pos)
+void radixSortKeys16(const u16* keys, u32* order, u32* temp, size_t n)
 {
-	vec3 cpos=pos.clamp(vec3(dEPSILON),vec3(1-dEPSILON));
-	real numimgs1=real(stack.size())-1;
-	sval img1=sval(floor(cpos.z()*numimgs1));
-	sval img2=sval(ceil(cpos.z()*numimgs1));
-	real dz=numimgs1==0 ? 0 :lerpXi(cpos.z(),img1/numimgs1,img2/numimgs1);
+	size_t counts[256];
+
+	for(size_t i=0;i<n;i++)
+		order[i]=u32(i);
+
+	// first pass sorts by the low byte from `order' into `temp', second by the high byte from `temp' back into `order'
+	for(sval pass=0;pass<2;pass++){
+		const u32* src=pass==0 ? order : temp;
+		u32* dest=pass==0 ? temp : order;
+		sval shift=pass*8;
 
-	return trilerpMatrices(stack[img1],stack[img2],vec3(cpos.x(),cpos.y(),dz),vec3(cpos.x(),cpos.y(),1.0-dz));
+		memset(counts,0,sizeof(counts));
+
+		for(size_t i=0;i<n;i++)
+			counts[(keys[src[i]]>>shift)&0xff]++;
+
+		for(size_t i=0,total=0;i<256;i++){
+			size_t c=counts[i];
+			counts[i]=total;
+			total+=c;
+		}
+
+		for(size_t i=0;i<n;i++){
+			u32 ind=src[i];
+			dest[counts[(keys[ind]>>shift)&0xff]++]=ind;
+		}
+	}
 }
 
+void depthSortTriangles(const float* cents, const indexval* inds, size_t numtris, const vec3& campos, indexval* outinds,
+		std::vector<float>& dists, std::vector<u16>& keys, std::vector<u32>& order, std::vector<u32>& temp)
+{
+	if(numtris==0)
+		return;
+
+	float cx=float(campos.x()),cy=float(campos.y()),cz=float(campos.z());
+	float mindist=0,maxdist=0;
+
+	dists.resize(numtris);
+	keys.resize(numtris);
+	order.resize(numtris);
+	temp.resize(numtris);
+
+	// calculate the distances from the camera to each centroid
+	for(size_t i=0;i<numtris;i++,cents+=3){
+		float x=cents[0]-cx, y=cents[1]-cy, z=cents[2]-cz;
+		float d=sqrtf(x*x+y*y+z*z);
+		dists[i]=d;
+
+		if(i==0 || d<mindist)
+			mindist=d;
+		if(i==0 || d>maxdist)
+			maxdist=d;
+	}
+
+	// quantize the distances so that the farthest triangles have the lowest keys and so are drawn first
+	float scale=maxdist>mindist ? 65535.0f/(maxdist-mindist) : 0.0f;
+	for(size_t i=0;i<numtris;i++)
+		keys[i]=u16((maxdist-dists[i])*scale);
+
+	radixSortKeys16(&keys[0],&order[0],&temp[0],numtris);
+
+	for(size_t i=0;i<numtris;i++){
+		const indexval* tri=&inds[order[i]*3];
+		outinds[i*3]=tri[0];
+		outinds[i*3+1]=tri[1];
+		outinds[i*3+2]=tri[2];
+	}
+}
 
-void calculateImageHistogram(const RealMatrix* img, RealMatrix* hist,i32 minv)
+void valuesToColors(float* cols, const real* vals, sval width, real minval, real maxval, const Spectrum* spec,
+		const std::vector<color>& lut, const real* alphas, bool mulAlpha)
 {
-	sval n=img->n(), m=img->m(), hn=hist->n();
+	for(sval x=0;x<width;x++,cols+=4){
+		real val=lerpXi(vals[x],minval,maxval);
 
-	for(sval i=0;i<n;i++)
-		for(sval j=0;j<m;j++){
-			sval val=sval(i32(img->at(i,j)+0.5)-minv);
-			if(val<hn)
-				hist->at(val)++;
+		if(spec==NULL){
+			cols[0]=cols[1]=cols[2]=float(val);
+			cols[3]=1.0f;
 		}
+		else
+			spec->lookupColor(val,lut).setBuff(cols);
+
+		if(alphas!=NULL)
+			cols[3]=float(alphas[x]);
+
+		if(mulAlpha)
+			cols[3]*=float(val); // set alpha to the commonly desired value
+	}
 }
 
 vec3* calculateTriNorms(vec3* nodes, sval numnodes, indexval* inds, sval numinds)
@@ -33,6 +33,7 @@
 #include <cmath>
 #include <vector>
 #include <map>
+#include <deque>
 #include <algorithm>
 #include <utility>
 #include <limits>
@@ -56,6 +57,7 @@
 #elif defined(__APPLE__)
   #include <unistd.h>
   #include <pthread.h>
+  #include <sched.h>
   #include <sys/mman.h>
   #include <sys/stat.h>
   #include <sys/time.h>
@@ -68,6 +70,7 @@
 #else
   #include <unistd.h>
   #include <pthread.h>
+  #include <sched.h>
   #include <sys/mman.h>
   #include <sys/stat.h>
   #include <fcntl.h>
@@ -89,6 +92,8 @@
 
 #define SAFE_DELETE(p) do { if((p)!=NULL){ delete (p); (p)=NULL; } } while(0)
 
+#define SAFE_DELETE_ARRAY(p) do { if((p)!=NULL){ delete[] (p); (p)=NULL; } } while(0)
+
 namespace RenderTypes {
 
 // various string names
@@ -99,7 +104,9 @@ static const char* RenderParamGroup="RenderParam";
 // platform-independent basic type definitions
 typedef int i32;
 typedef long long i64;
+typedef short i16;
 typedef unsigned char u8;
+typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 
@@ -364,7 +371,7 @@ public:
   #define destroy_mutex pthread_mutex_destroy
 #endif
 
-/// Simple mutex type allowing locking and attempted locking with timeout
+/// Simple recursive mutex type allowing locking and attempted locking with timeout
 class Mutex
 {
 	MutexType _mutex;
@@ -377,7 +384,12 @@ public:
 		bool runblock;
 
 	public:
-		Locker(Mutex* p, real timeout=0.0) : parent(p) { runblock=parent->lock(timeout); }
+		Locker(Mutex* p, real timeout=0.0) : parent(p) 
+		{ 
+			runblock=parent->lock(timeout); 
+			if(!runblock)
+				parent=NULL; // don't release a lock which wasn't acquired
+		}
 
 		~Locker() { if(parent)parent->release(); }
 
@@ -411,31 +423,211 @@ public:
 	 */
 	bool lock(real timeout=0.0)
 	{
-		if(timeout>0){
-			clock_t start=clock();
-			real delta=0;
-			bool result=false;
-
-			while(!result && delta<timeout){
-				result=trylock_mutex(&_mutex);
-				delta=real(clock()-start)/CLOCKS_PER_SEC;
-			}
+		if(timeout>0)
+			return timedLock(timeout);
 
-			return result;
-		}
-		else{
-			lock_mutex(&_mutex);
-			return true;
-		}
+		lock_mutex(&_mutex);
+		return true;
 	}
 	
 	/// Releases the mutex lock
 	void release() { unlock_mutex(&_mutex); }
+
+protected:
+	/// Wait for the lock for up to `timeout' seconds of wall clock time, the waiting thread sleeps rather than spins
+	bool timedLock(real timeout);
 };
 
 #define critical(m) for(Mutex::Locker __locker__=Mutex::Locker(m);__locker__.loopOnce();)
 #define trylock(m,timeout) for(Mutex::Locker __locker__=Mutex::Locker(m,timeout);__locker__.loopOnce();)
 
+/**
+ * Reader/writer lock allowing any number of threads to hold the read lock at once or one thread to hold the write lock.
+ * This isn't recursive, a thread holding either lock must not attempt to acquire it again. Use the readlock() and 
+ * writelock() macros in the same way as critical() to hold the lock for the duration of a block.
+ */
+class ReadWriteMutex
+{
+#ifdef WIN32
+	SRWLOCK _lock;
+#else
+	pthread_rwlock_t _lock;
+#endif
+
+public:
+	class Locker
+	{
+	protected:
+		ReadWriteMutex *parent;
+		bool isWrite;
+		bool runblock;
+
+	public:
+		Locker(ReadWriteMutex* p, bool isWrite, real timeout=0.0) : parent(p), isWrite(isWrite) 
+		{ 
+			runblock=isWrite ? parent->writeLock(timeout) : parent->readLock(timeout); 
+			if(!runblock)
+				parent=NULL; // don't release a lock which wasn't acquired
+		}
+
+		~Locker() 
+		{ 
+			if(parent && isWrite)
+				parent->releaseWrite();
+			else if(parent)
+				parent->releaseRead();
+		}
+
+		bool loopOnce()
+		{
+			if(!runblock)
+				return false;
+
+			runblock=false;
+			return true;
+		}
+	};
+
+#ifdef WIN32
+	ReadWriteMutex() { InitializeSRWLock(&_lock); } // SRW locks need no destruction
+#else
+	ReadWriteMutex() { pthread_rwlock_init(&_lock,NULL); }
+	~ReadWriteMutex() { pthread_rwlock_destroy(&_lock); }
+#endif
+
+	/// Acquire the read lock, if `timeout' is >0 wait at most that many seconds and return false if the lock wasn't acquired
+	bool readLock(real timeout=0.0);
+	/// Acquire the write lock, if `timeout' is >0 wait at most that many seconds and return false if the lock wasn't acquired
+	bool writeLock(real timeout=0.0);
+
+#ifdef WIN32
+	void releaseRead() { ReleaseSRWLockShared(&_lock); }
+	void releaseWrite() { ReleaseSRWLockExclusive(&_lock); }
+#else
+	void releaseRead() { pthread_rwlock_unlock(&_lock); }
+	void releaseWrite() { pthread_rwlock_unlock(&_lock); }
+#endif
+};
+
+#define readlock(m) for(ReadWriteMutex::Locker __rwlocker__(m,false);__rwlocker__.loopOnce();)
+#define writelock(m) for(ReadWriteMutex::Locker __rwlocker__(m,true);__rwlocker__.loopOnce();)
+
+/**
+ * Counting semaphore for one thread to sleep until another signals that work is available. Each post() increments the count
+ * and each wait() blocks until the count is non-zero then decrements it, so no post is lost if it happens before the wait.
+ */
+class Semaphore
+{
+#ifdef WIN32
+	HANDLE _sem;
+#else
+	pthread_mutex_t _mutex; // unnamed POSIX semaphores aren't supported on OSX so use a mutex and condition
+	pthread_cond_t _cond;
+	sval _count;
+#endif
+
+	Semaphore(const Semaphore&);
+	Semaphore& operator=(const Semaphore&);
+
+public:
+	Semaphore();
+	~Semaphore();
+
+	/// Increment the count, waking a thread waiting in wait() if there is one
+	void post();
+
+	/// Wait until the count is non-zero then decrement it
+	void wait();
+};
+
+// atomic operations on pointers and 32-bit counters, these act as full memory barriers
+#ifdef WIN32
+  #define atomic_cas_ptr(p,oldval,newval) (InterlockedCompareExchangePointer((PVOID volatile*)(p),(PVOID)(newval),(PVOID)(oldval))==(PVOID)(oldval))
+  #define atomic_swap_ptr(p,newval) InterlockedExchangePointer((PVOID volatile*)(p),(PVOID)(newval))
+  #define atomic_add_u32(p,val) ((u32)InterlockedExchangeAdd((LONG volatile*)(p),(LONG)(val))+(u32)(val))
+#else
+  #define atomic_cas_ptr(p,oldval,newval) __sync_bool_compare_and_swap((p),(oldval),(newval))
+  #define atomic_swap_ptr(p,newval) (__sync_synchronize(),__sync_lock_test_and_set((p),(newval)))
+  #define atomic_add_u32(p,val) __sync_add_and_fetch((p),(u32)(val))
+#endif
+
+/**
+ * A multiple producer, single consumer queue which doesn't lock. Any thread can push() values onto the queue concurrently,
+ * only one thread at a time may call popAll() to remove every queued value in the order they were pushed. Producers push
+ * onto a linked stack with compare-and-swap and the consumer takes the whole stack with one atomic swap and reverses it,
+ * so there's no ABA problem since nodes are never removed individually.
+ */
+template<typename T>
+class LockFreeQueue
+{
+	struct Node
+	{
+		T value;
+		Node* next;
+	};
+
+	Node* volatile head;
+	volatile u32 count;
+
+	LockFreeQueue(const LockFreeQueue&);
+	LockFreeQueue& operator=(const LockFreeQueue&);
+
+public:
+	LockFreeQueue() : head(NULL), count(0) {}
+
+	~LockFreeQueue()
+	{
+		std::vector<T> vals;
+		popAll(vals);
+	}
+
+	/// Add `val' to the queue, this is safe to call from any thread
+	void push(const T& val)
+	{
+		Node* n=new Node;
+		Node* old;
+		n->value=val;
+
+		do{
+			old=head;
+			n->next=old;
+		} while(!atomic_cas_ptr(&head,old,n));
+
+		atomic_add_u32(&count,1);
+	}
+
+	/// Remove every queued value and append them to `out' in the order they were pushed, returning how many were removed
+	sval popAll(std::vector<T>& out)
+	{
+		Node* n=(Node*)atomic_swap_ptr(&head,(Node*)NULL);
+		Node* rev=NULL;
+		sval num=0;
+
+		while(n){ // reverse the stack into FIFO order
+			Node* next=n->next;
+			n->next=rev;
+			rev=n;
+			n=next;
+			num++;
+		}
+
+		while(rev){
+			Node* next=rev->next;
+			out.push_back(rev->value);
+			delete rev;
+			rev=next;
+		}
+
+		atomic_add_u32(&count,-num);
+		return num;
+	}
+
+	/// Returns the approximate number of queued values, this may be out of date as soon as it's returned
+	sval size() const { return count; }
+
+	bool empty() const { return head==NULL; }
+};
+
 
 /// Defines the figure types which the Figure class and subclasses are capable of representing
 enum FigureType
@@ -503,6 +695,19 @@ enum VAlignType
 	V_CENTER
 };
 
+/// Element types of raw binary data streams decoded into matrices by decodeStreamToRealMatrix()
+enum StreamType
+{
+	ST_UBYTE,  // unsigned 8-bit integers
+	ST_BYTE,   // signed 8-bit integers
+	ST_USHORT, // unsigned 16-bit integers
+	ST_SHORT,  // signed 16-bit integers
+	ST_UINT,   // unsigned 32-bit integers
+	ST_INT,    // signed 32-bit integers
+	ST_FLOAT,  // 32-bit floats
+	ST_DOUBLE  // 64-bit doubles
+};
+
 
 
 #ifdef WIN32
@@ -579,6 +784,17 @@ public:
 		return result;
 	}
 
+	/// Convert this color to a 32-bit value with alpha in the highest byte and red in the lowest, ie. RGBA byte order in memory on little endian
+	rgba toABGR() const
+	{
+		color c=unitClamp();
+		rgba result=u8(c._a*255);
+		result=(result<<8)|u8(c._b*255);
+		result=(result<<8)|u8(c._g*255);
+		result=(result<<8)|u8(c._r*255);
+		return result;
+	}
+
 	/// Linearly interpolate between `this' and `col', val==0.0 yields `this', val==1.0 yields `col'.
 	color interpolate(real val,const color& col) const
 	{
@@ -592,7 +808,7 @@ public:
 		return color(_r*val1+col.r()*val,_g*val1+col.g()*val,_b*val1+col.b()*val,_a*val1+col.a()*val);
 	}
 
-	color unitClamp()
+	color unitClamp() const
 	{
 		return color(clamp(_r,0.0f,1.0f),clamp(_g,0.0f,1.0f),clamp(_b,0.0f,1.0f),clamp(_a,0.0f,1.0f));
 	}
@@ -1479,16 +1695,270 @@ inline void checkNull(const std::string valuename, const void* val, const char*
 
 #define CHECK_NULL(val) checkNull("val",(const void*)val,__FILE__,__LINE__)
 
+/// Returns the number of processors available on this system, this is at least 1
+sval getProcessorCount();
+
+/// Returns a monotonic wall clock time in seconds, unlike TimingObject's clock() this includes time spent waiting on the GPU or IO
+real getWallTime();
+
+/// Yield the processor for the `attempt'th time while waiting on a lock or condition, the first few attempts yield and later ones sleep briefly
+void waitBackoff(sval attempt);
+
+/**
+ * Base type for work over a range of items which can be divided between threads with runParallelTask(). Subclasses
+ * implement run() to process items [start,end), which will be called concurrently from multiple threads with disjoint
+ * ranges so must only write to state specific to those items or to the thread identified by `threadIndex'.
+ */
+class ParallelTask
+{
+public:
+	virtual ~ParallelTask() {}
+
+	virtual void run(sval start, sval end, sval threadIndex)=0;
+};
+
+/**
+ * Process `numItems' items with `task' using `numThreads' threads, or one thread per processor if this is 0. The items
+ * are handed to threads in blocks of `chunkSize' items (or a size chosen from `numItems' if 0) as threads become free,
+ * the calling thread being one of the workers. This returns once every item has been processed. If run() throws an
+ * exception in any thread the remaining blocks are abandoned and the first exception is rethrown in the calling thread.
+ */
+void runParallelTask(ParallelTask* task, sval numItems, sval numThreads=0, sval chunkSize=0) throw(IndexException,ValueException,MemException,RenderException);
+
+/**
+ * Base type for long running work done in a single background thread. Subclasses implement run() which is called in a new
+ * thread by start(), join() must then be called before the object is deleted to wait for run() to return. Exceptions must
+ * not escape run(), subclasses should store any errors for the thread calling join() to handle.
+ */
+class WorkerThread
+{
+protected:
+#ifdef WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	bool started;
+
+	WorkerThread(const WorkerThread&);
+	WorkerThread& operator=(const WorkerThread&);
+
+public:
+	WorkerThread() : started(false) {}
+	virtual ~WorkerThread() {}
+
+	virtual void run()=0;
+
+	/// Start run() in a new thread, returning false if the thread couldn't be created or was already started
+	bool start();
+
+	/// Wait for run() to return if the thread was started
+	void join();
+
+	bool isStarted() const { return started; }
+};
+
 /*****************************************************************************************************************************/
 /* Data Structure Objects */
 /*****************************************************************************************************************************/
 
+/// Store the size in bytes of file `filename' in `size', returning false if the file doesn't exist or can't be queried
+bool getFileSize(const char* filename,size_t* size);
+
 /// Using mmap, copy the contents from file `filename' into `dest' starting `offset' bytes from the beginning
 void readBinaryFileToBuff(const char* filename,size_t offset,void* dest,size_t len) throw(MemException);
 
+/**
+ * Map `len' bytes of file `filename' starting at `offset' into memory, read-only or copy-on-write if `copyOnWrite' is true, and
+ * return a pointer to the first byte. The mapping itself is page aligned, its start and length are stored in `base' and `baselen'
+ * for passing to unmapFileRegion() later. Pages are read from the file as they're accessed.
+ */
+void* mapFileRegion(const char* filename,size_t offset,size_t len,bool copyOnWrite,void** base,size_t* baselen) throw(MemException);
+
+/// Unmap a region mapped by mapFileRegion() given the `base' and `baselen' values it returned
+void unmapFileRegion(void* base,size_t baselen) throw(MemException);
+
 /// Using mmap, copy the contents of `header' and then `src' into file `filename'
 void storeBufftoBinaryFile(const char* filename,void* src,size_t len,int* header, size_t headerlen) throw(MemException);
 
+/**
+ * Describes the contents of a matrix container file, see storeBuffToContainerFile(). The element tag names the element type
+ * (eg. "real" or "vec3") so that readers can check it matches the matrix being read into, with `elemsize' being its size in
+ * bytes. The `meta' string is the metadata serialized with MetaType::serializeMeta(). If `swapEndian' is true in information
+ * read from a file then the file was written on a platform of the opposite byte order.
+ */
+struct MatrixContainerInfo
+{
+	std::string elemtag;
+	std::string name;
+	std::string type;
+	std::string meta;
+	size_t elemsize;
+	sval n;
+	sval m;
+	sval chunkRows;
+	bool compressed;
+	bool swapEndian;
+
+	MatrixContainerInfo() : elemsize(0), n(0), m(0), chunkRows(0), compressed(true), swapEndian(false) {}
+
+	/// Returns the number of chunks the rows are stored in
+	sval numChunks() const { return chunkRows==0 ? 0 : (n+chunkRows-1)/chunkRows; }
+};
+
+/**
+ * Store the n*m elements of `src' described by `info' into the container file `filename'. The file records the element type,
+ * dimensions, name, type string, metadata, and byte order followed by the rows in chunks of `info.chunkRows' rows (or about 1MB
+ * if 0). If `info.compressed' is true each chunk has its bytes shuffled into planes by their position in the element and is
+ * then compressed with a fast LZ codec, chunks which don't become smaller are stored as they are. Each chunk has a checksum
+ * which is verified when it's read. Chunks are compressed in batches with `numThreads' threads (0 for one per processor) and
+ * written in order.
+ */
+void storeBuffToContainerFile(const char* filename, const void* src, const MatrixContainerInfo& info, sval numThreads=0)
+		throw(IndexException,ValueException,MemException,RenderException);
+
+/// Read the description of the matrix stored in container file `filename'
+MatrixContainerInfo readContainerFileInfo(const char* filename) throw(MemException,ValueException);
+
+/**
+ * Decompress rows [startRow,startRow+numRows) from container file `filename' into `dest', which must have space for numRows
+ * rows. Only the chunks containing these rows are decompressed, using `numThreads' threads (0 for one per processor). The
+ * element tag and size and the column count `m' must match those of the file, an empty `elemtag' matching any type. Returns
+ * true if the file's byte order is the opposite of this platform's so the elements' bytes must be swapped.
+ */
+bool readContainerFileToBuff(const char* filename, void* dest, const char* elemtag, size_t elemsize, sval m, sval startRow, sval numRows,
+		sval numThreads=0) throw(IndexException,ValueException,MemException,RenderException);
+
+/**
+ * A single large shared memory segment which is sub-allocated into the data of many shared matrices, avoiding the cost of
+ * creating, sizing, and mapping a separate segment for each one and staying within the system's limits on shared segments.
+ * The process creating the arena allocates from it, other processes attach to it with attach() using its shared name and
+ * capacity and then refer to the matrices within it by their offsets. Allocations are never freed individually, instead
+ * once every allocation has been released with release() the whole arena can be reused by calling reset().
+ *
+ * Arenas are reference counted: the creator holds one reference and every allocation (including attachments) holds one,
+ * the arena is unmapped and deleted when the last is released with decRef() or release(). The creator's process unlinks
+ * the segment when its arena is deleted so other processes should be finished with it by then.
+ */
+class SharedArena
+{
+protected:
+	std::string _name;
+	std::string _sharedname;
+	size_t _capacity;
+	size_t _used; // bytes allocated so far including the header, allocations are bumped from the start of the segment
+	sval _numAllocated; // number of allocations not yet released in this process
+	sval _refcount;
+	bool _isCreator;
+	std::string _pid; // process which mapped the segment, a child forked from it inherits this object but must map its own
+	void* _base;
+	mutable Mutex mutex;
+
+#ifdef WIN32
+	HANDLE mapFile;
+#endif
+
+	SharedArena(const char* sharedname, size_t capacity, bool isCreator, const char* name) throw(MemException);
+
+	~SharedArena();
+
+	/// Count in the segment header of allocations attached by processes other than the creator, shared between all of them
+	volatile u32* attachCount() const { return (volatile u32*)_base; }
+
+	/// Returns true if this object was mapped by the calling process rather than inherited through fork()
+	bool isMappedHere() const { return _pid==getPIDStr(); }
+
+	/// Returns true if allocations attached to this object are counted in the segment header
+	bool isCounted() const { return !_isCreator && isMappedHere(); }
+
+	/// Returns true if `size' bytes can be allocated (NOTE: `mutex' must be held)
+	bool fits(size_t size) const;
+
+public:
+	/// Alignment of every allocation in bytes, this keeps each matrix on separate cache lines
+	static const size_t Alignment=64;
+
+	/// Bytes at the start of every segment reserved for the count of attached allocations, allocations follow this
+	static const size_t HeaderSize=Alignment;
+
+	/**
+	 * Create a new arena of `capacity' bytes with a shared name chosen from `name', this has one reference held by the caller.
+	 * The first HeaderSize bytes are used by the arena so `capacity' must be larger than this.
+	 */
+	static SharedArena* create(const char* name, size_t capacity) throw(MemException);
+
+	/**
+	 * Return the arena with shared name `sharedname' of `capacity' bytes, mapping it into this process if not already, with
+	 * one reference added for an allocation which is released with release() when the matrix using it is cleared. In a
+	 * process other than the creator this also counts the allocation in the segment header so that the creator won't
+	 * reset the arena while it's still in use here.
+	 */
+	static SharedArena* attach(const char* sharedname, size_t capacity) throw(MemException);
+
+	const char* getName() const { return _name.c_str(); }
+	const char* getSharedName() const { return _sharedname.c_str(); }
+	size_t getCapacity() const { return _capacity; }
+	size_t getUsed() const { return _used; }
+	sval numAllocated() const { return _numAllocated; }
+	bool isCreator() const { return _isCreator && isMappedHere(); }
+
+	/// Returns the number of allocations attached by other processes and not yet released, these block reset()
+	sval numAttached() const { return atomic_add_u32(attachCount(),0); }
+
+	/// Returns true if `size' bytes can be allocated from this arena
+	bool canAllocate(size_t size) const;
+
+	/// Returns a pointer to the byte at `offset' in the arena
+	void* ptr(size_t offset) const { return ((char*)_base)+offset; }
+
+	/**
+	 * Allocate `size' bytes, returning the offset of the zeroed allocation. This adds a reference which is removed by
+	 * release(). Only the creator can allocate since the allocation state is local to its process.
+	 */
+	size_t allocate(size_t size) throw(MemException);
+
+	/// Release an allocation made by allocate() or attach(), deleting this arena if it was the last reference
+	void release();
+
+	/// Free all allocations at once so the arena can be reused, which is only valid once they have all been released in every process
+	void reset() throw(MemException);
+
+	void incRef();
+
+	/// Remove a reference, deleting this arena if it was the last
+	void decRef();
+};
+
+/**
+ * A pool of arenas that matrices can be allocated from without regard to arena capacity. A new arena is created when the
+ * current one is full, unless an existing arena has had all its allocations released in which case it's reset and reused.
+ * An arena is only reused once matrices unpickled from it in other processes have also been released.
+ * Allocating a timestep's worth of matrices, releasing them, then allocating the next timestep's therefore cycles through
+ * the same segments rather than creating new ones.
+ */
+class SharedArenaPool
+{
+protected:
+	std::string _name;
+	size_t _arenaSize;
+	std::vector<SharedArena*> arenas;
+	Mutex mutex;
+
+public:
+	/// Create a pool whose arenas have shared names chosen from `name' and are `arenaSize' bytes or larger if needed
+	SharedArenaPool(const char* name, size_t arenaSize) : _name(name), _arenaSize(arenaSize) {}
+
+	/// Release the pool's references to its arenas, those still having allocations are deleted when these are released
+	~SharedArenaPool();
+
+	sval numArenas() const { return arenas.size(); }
+
+	SharedArena* getArena(sval i) const throw(IndexException);
+
+	/// Allocate `size' bytes from an arena in the pool, storing the offset in `offset' and returning the arena
+	SharedArena* allocate(size_t size, size_t* offset) throw(MemException);
+};
+
 /// This base type provides facilities for maintaining name-value metadata pairs
 class MetaType
 {
@@ -1594,11 +2064,22 @@ template<> struct SwapEndian<indexval> { static indexval swap(indexval t) { retu
 template<> struct SwapEndian<vec3> { static vec3 swap(vec3 t) { return vec3(swapEndian64(t.x()),swapEndian64(t.y()),swapEndian64(t.z())); } };
 template<> struct SwapEndian<color> { static color swap(color t) { return color(swapEndian32(t.r()),swapEndian32(t.g()),swapEndian32(t.b()),swapEndian32(t.a())); } };
 
+// Type names stored in matrix container files to identify element types, types without a name are only checked by size
+template<typename T> struct ContainerElemTag { static const char* name() { return ""; } };
+template<> struct ContainerElemTag<real> { static const char* name() { return "real"; } };
+template<> struct ContainerElemTag<float> { static const char* name() { return "float"; } };
+template<> struct ContainerElemTag<indexval> { static const char* name() { return "indexval"; } };
+template<> struct ContainerElemTag<u16> { static const char* name() { return "u16"; } };
+template<> struct ContainerElemTag<i16> { static const char* name() { return "i16"; } };
+template<> struct ContainerElemTag<vec3> { static const char* name() { return "vec3"; } };
+template<> struct ContainerElemTag<color> { static const char* name() { return "color"; } };
+
 /** 
  * This represents a 2-dimensional array of data elements of type T. There are four typedefs given below for T being
  * vec3, color, indexval, and real. A number of methods are provided for doing arithmetic with all the elements of a
  * matrix and with whole matrices. A facility is provided for defining matrices as shared memory segments suitable for
- * communication between processes. 
+ * communication between processes. A matrix can also view a region of a file mapped into memory, either read-only or
+ * copy-on-write, so that data is paged in from the file as accessed and is shared with other processes mapping the file.
  *
  * Matrix types are indexed in (row,column) or (Y,X) order since they are used to represent lists or entries, are thus
  * expandable by adding rows but not columns, and are stored in row major order.
@@ -1615,6 +2096,15 @@ protected:
 	sval _n,_m; // _n rows, _m columns
 
 	bool _isShared; // true if the memory is shared, false if locally allocated memory
+
+	std::string _filename; // name of the file `data' is mapped from, empty if not file-mapped
+	size_t _fileoffset; // byte offset in _filename of the start of `data'
+	void* _mapbase; // start of the page-aligned file mapping containing `data', NULL if not file-mapped
+	size_t _maplen; // length of the mapping at _mapbase
+	bool _isCopyOnWrite; // true if writes to a file-mapped matrix are kept private, false if it's read-only
+
+	SharedArena* _arena; // arena `data' is allocated from, NULL if the matrix has its own segment or isn't shared
+	size_t _arenaoffset; // byte offset of `data' in _arena
 	
 #ifdef WIN32
 	HANDLE mapFile;
@@ -1624,7 +2114,7 @@ public:
 	
 	/// Constructs a matrix named `name' of `n' rows and `m' columns, local if `isShared' is false and shared otherwise
 	Matrix(const char* name,sval n, sval m=1,bool isShared=false)  throw(MemException) :
-			_name(name), _type(""),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false)
+			_name(name), _type(""),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false),_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(NULL),_arenaoffset(0)
 	{
 		checkDimension("m",m);
 		setShared(isShared);
@@ -1632,7 +2122,7 @@ public:
 
 	/// Constructs a matrix named `name' with type `type' of `n' rows and `m' columns, local if `isShared' is false and shared otherwise
 	Matrix(const char* name,const char* type,sval n, sval m=1,bool isShared=false)  throw(MemException) :
-			_name(name), _type(type),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false)
+			_name(name), _type(type),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false),_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(NULL),_arenaoffset(0)
 	{
 		checkDimension("m",m);
 		setShared(isShared);
@@ -1640,7 +2130,7 @@ public:
 
 	/// Constructor for unpickling only, do not use
 	Matrix(const char* name,const char* type,const char* sharedname,const char* serialmeta,sval n, sval m) throw(MemException)  :
-			_name(name), _type(type),_sharedname(sharedname),data(0),_n_actual(n),_n(n),_m(m),_isShared(true)
+			_name(name), _type(type),_sharedname(sharedname),data(0),_n_actual(n),_n(n),_m(m),_isShared(true),_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(NULL),_arenaoffset(0)
 	{
 		checkDimension("n",n);
 		checkDimension("m",m);
@@ -1648,9 +2138,47 @@ public:
 		data=createShared();
 	}
 
+	/**
+	 * Constructs a matrix of `n' rows and `m' columns whose data is the region of file `filename' starting at byte `offset', 
+	 * which is mapped into memory rather than read. If `copyOnWrite' is false the matrix is read-only, methods which modify it
+	 * throw MemException but writing through at() or dataPtr() will fault so code doing so must call checkWritable() first.
+	 * Otherwise writes are private to this matrix and do not alter the file. The file-mapped matrix cannot be resized.
+	 */
+	Matrix(const char* name,const char* type,const char* filename,size_t offset,sval n, sval m,bool copyOnWrite) throw(MemException)  :
+			_name(name), _type(type),_sharedname(""),data(0),_n_actual(n),_n(n),_m(m),_isShared(false),
+			_filename(filename),_fileoffset(offset),_mapbase(NULL),_maplen(0),_isCopyOnWrite(copyOnWrite),_arena(NULL),_arenaoffset(0)
+	{
+		checkDimension("n",n);
+		checkDimension("m",m);
+		data=(T*)mapFileRegion(filename,offset,memSize(),copyOnWrite,&_mapbase,&_maplen);
+	}
+
+	/**
+	 * Constructs a shared matrix of `n' rows and `m' columns whose data is the allocation at byte `offset' in `arena', this
+	 * takes ownership of the allocation's reference and releases it when cleared. Use the constructor below to allocate
+	 * from an arena, this is for allocations made with SharedArenaPool::allocate() or SharedArena::attach().
+	 */
+	Matrix(const char* name,const char* type,sval n, sval m,SharedArena* arena,size_t offset) throw(MemException)  :
+			_name(name), _type(type),_sharedname(arena->getSharedName()),data(0),_n_actual(n),_n(n),_m(m),_isShared(true),
+			_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(arena),_arenaoffset(offset)
+	{
+		data=(T*)arena->ptr(offset);
+	}
+
+	/// Constructs a shared matrix of `n' rows and `m' columns whose data is allocated from `arena'
+	Matrix(const char* name,const char* type,sval n, sval m,SharedArena* arena) throw(MemException)  :
+			_name(name), _type(type),_sharedname(arena->getSharedName()),data(0),_n_actual(n),_n(n),_m(m),_isShared(true),
+			_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(arena),_arenaoffset(0)
+	{
+		checkDimension("n",n);
+		checkDimension("m",m);
+		_arenaoffset=arena->allocate(memSize());
+		data=(T*)arena->ptr(_arenaoffset);
+	}
+
 	/// Constructor for converting a memory pointer into a Matrix, this will copy n*m values from `array'.
 	Matrix(const char* name,const char* type,const T* array,sval n, sval m,bool isShared=false)  throw(MemException) :
-		_name(name), _type(type),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false)
+		_name(name), _type(type),_sharedname(""),data(0),_n_actual(0),_n(n),_m(m),_isShared(false),_fileoffset(0),_mapbase(NULL),_maplen(0),_isCopyOnWrite(false),_arena(NULL),_arenaoffset(0)
 	{
 		checkDimension("n",n);
 		checkDimension("m",m);
@@ -1684,13 +2212,44 @@ public:
 	/// Returns true if the matrix is allocated in shared memory
 	bool isShared() const { return _isShared; }
 
+	/// Returns true if the matrix's data is mapped from a file
+	bool isFileMapped() const { return _mapbase!=NULL; }
+
+	/// Returns true if the matrix is file-mapped and writes to it are kept private
+	bool isCopyOnWrite() const { return _mapbase!=NULL && _isCopyOnWrite; }
+
+	/// Returns true if the matrix is mapped read-only from a file, in which case writing to its data will fault
+	bool isReadOnly() const { return _mapbase!=NULL && !_isCopyOnWrite; }
+
+	/// Throws MemException if the matrix is read-only, this must be called before writing to its data through at() or dataPtr()
+	void checkWritable() const throw(MemException)
+	{
+		if(isReadOnly())
+			throw MemException("Cannot modify matrix mapped read-only from file "+_filename);
+	}
+
+	/// Get the name of the file this matrix is mapped from, an empty string if not file-mapped
+	const char* getFileName() const { return _filename.c_str(); }
+
+	/// Get the byte offset in the mapped file of the matrix's data
+	size_t getFileOffset() const { return _fileoffset; }
+
+	/// Returns true if the matrix's data is allocated from a SharedArena, in which case it is also shared
+	bool isArenaAllocated() const { return _arena!=NULL; }
+
+	/// Get the arena the matrix's data is allocated from, NULL if not arena allocated
+	SharedArena* getArena() const { return _arena; }
+
+	/// Get the byte offset in the arena of the matrix's data
+	size_t getArenaOffset() const { return _arenaoffset; }
+
 	/**
 	 * Toggles whether this matrix is in local memory or shared. If this matrix is local and the
 	 * given argument is true, then a new shared segment is created, the data is copied into it, and
 	 * the local segment is deallocated. If the matrix is shared and the argument false, a new local
 	 * segment is allocated. The shared segment is then released and, if this matrix is the creator of
 	 * the segment, it removes it from the system. If the argument is the same as the shared status, 
-	 * nothing is done.
+	 * nothing is done, so a file-mapped matrix is made shared by copying but never made local.
 	 */
 	void setShared(bool val) throw(MemException)
 	{
@@ -1708,7 +2267,10 @@ public:
 
 			if(data){
 				memcpy(shared,data,size);
-				delete[] data;
+				if(_mapbase)
+					unmapFile();
+				else
+					delete[] data;
 			}
 			else
 				memset(shared,0,size);
@@ -1731,6 +2293,8 @@ public:
 				closeShared(data);
 				unlinkShared(_sharedname);
 			}
+			else if(_mapbase)
+				unmapFile();
 			else if(data!=NULL)
 				delete[] data;
 		}
@@ -1751,16 +2315,18 @@ public:
 	sval memSize() const { return sval(sizeof(T)*_n*_m); }
 
 	/// Set every cell of the matrix to the given value
-	void fill(const T& t)
+	void fill(const T& t) throw(MemException)
 	{
+		checkWritable();
 		T* d=data;
 		for(sval n=0;n<_n*_m;n++)
 			*d++=t;
 	}
 
 	/// Copy the data bitwise from `r', the number of bytes copied is the minimum or either matrices' size
-	template<typename R> void copyFrom(const Matrix<R>* r)
+	template<typename R> void copyFrom(const Matrix<R>* r) throw(MemException)
 	{
+		checkWritable();
 		sval minsize=_min(memSize(),r->memSize());
 		if(minsize>0)
 			memcpy(data,r->dataPtr(),minsize);
@@ -1806,8 +2372,9 @@ public:
 	
 	/// Apply the function `op' to each cell from (minrow,mincol) to (maxrow-1,maxcol-1), passing in `ctx' as the first argument for each call
 	template<typename Ctx>
-	void applyFunc(T (*op)(Ctx,const T&,sval,sval),Ctx ctx,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1)
+	void applyFunc(T (*op)(Ctx,const T&,sval,sval),Ctx ctx,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1) throw(MemException)
 	{
+		checkWritable();
 		maxcol=_min(_m,maxcol);
 		maxrow=_min(_n,maxrow);
 		
@@ -1818,8 +2385,9 @@ public:
 	
 	/// Apply the operation OpType::op to every cell from (minrow,mincol) to (maxrow-1,maxcol-1) in the matrix with `r' as the second operand
 	template<typename R, typename OpType>
-	void scalarop(const R& r,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1)
+	void scalarop(const R& r,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1) throw(MemException)
 	{
+		checkWritable();
 		maxcol=_min(_m,maxcol);
 		maxrow=_min(_n,maxrow);
 		
@@ -1830,8 +2398,9 @@ public:
 
 	/// Apply the operation OpType::op to every cell from (minrow,mincol) to (maxrow-1,maxcol-1) in the matrix with the equivalent cell in `mat' as the second operand
 	template<typename R, typename OpType>
-	void matop(const Matrix<R>& mat,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1)
+	void matop(const Matrix<R>& mat,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1) throw(MemException)
 	{
+		checkWritable();
 		maxcol=_min(_min(mat.m(),_m),maxcol);
 		maxrow=_min(_min(mat.n(),_n),maxrow);
 		
@@ -1888,8 +2457,9 @@ public:
 		return matop<R,DivOp<T,T,R> >(mat,minrow,mincol,maxrow,maxcol);
 	}
 
-	void reorderColumns(const sval *orderinds) throw(IndexException)
+	void reorderColumns(const sval *orderinds) throw(IndexException,MemException)
 	{
+		checkWritable();
 		T* buff=new T[_m];
 
 		for(sval j=0;j<_m;j++)
@@ -1906,8 +2476,9 @@ public:
 		delete buff;
 	}
 
-	void swapEndian()
+	void swapEndian() throw(MemException)
 	{
+		checkWritable();
 		sval len=_n*_m;
 		for(sval i=0;i<len;i++)
 			data[i]=SwapEndian<T>::swap(data[i]);
@@ -1927,7 +2498,7 @@ public:
 	T getAt(sval n, sval m=0) const throw(IndexException) { return data[getIndex(n,m)]; }
 
 	/// Set the value at (n,m) to t
-	void setAt(const T& t, sval n, sval m=0) throw(IndexException) { data[getIndex(n,m)]=t; }
+	void setAt(const T& t, sval n, sval m=0) throw(IndexException,MemException) { checkWritable(); data[getIndex(n,m)]=t; }
 
 	/// Resize the matrix to have _newn rows, throws exception if shared
 	void setN(sval _newn) throw(MemException) 
@@ -1988,6 +2559,7 @@ public:
 	/// Read a binary file of data into this matrix starting from byte `offset'
 	void readBinaryFile(const char* filename,size_t offset) throw(MemException)
 	{
+		checkWritable();
 		readBinaryFileToBuff(filename,offset,data,memSize());
 	}
 
@@ -2004,6 +2576,57 @@ public:
 		storeBufftoBinaryFile(filename,data,memSize(),header,headerlen);
 	}
 
+	/**
+	 * Store this matrix with its name, type, and metadata in the chunked container file `filename', see storeBuffToContainerFile()
+	 * for the meaning of the arguments.
+	 */
+	void storeContainerFile(const char* filename, sval chunkRows=0, bool compressed=true, sval numThreads=0) const
+		throw(IndexException,ValueException,MemException,RenderException)
+	{
+		MatrixContainerInfo info;
+		info.elemtag=ContainerElemTag<T>::name();
+		info.name=_name;
+		info.type=_type;
+		info.meta=serializeMeta();
+		info.elemsize=sizeof(T);
+		info.n=_n;
+		info.m=_m;
+		info.chunkRows=chunkRows;
+		info.compressed=compressed;
+
+		storeBuffToContainerFile(filename,data,info,numThreads);
+	}
+
+	/**
+	 * Read `numRows' rows starting at `startRow' from the container file `filename' into this matrix, or every row from `startRow'
+	 * onward if `numRows' is -1. The file must store this matrix's element type with the same number of columns. This matrix is
+	 * resized to `numRows' rows, which isn't possible if it's shared so it then must already have this many. The type string and
+	 * metadata stored in the file are copied to this matrix.
+	 */
+	void readContainerFile(const char* filename, sval startRow=0, sval numRows=-1, sval numThreads=0)
+		throw(IndexException,ValueException,MemException,RenderException)
+	{
+		MatrixContainerInfo info=readContainerFileInfo(filename);
+
+		if(numRows==sval(-1))
+			numRows=startRow<info.n ? info.n-startRow : 0;
+
+		checkWritable();
+
+		if(info.m!=_m)
+			throw ValueException("filename","Container file has a different number of columns than this matrix",__FILE__,__LINE__);
+
+		if(numRows!=_n)
+			setN(numRows);
+
+		if(readContainerFileToBuff(filename,data,ContainerElemTag<T>::name(),sizeof(T),_m,startRow,numRows,numThreads))
+			for(sval i=0;i<_n*_m;i++)
+				data[i]=SwapEndian<T>::swap(data[i]);
+
+		_type=info.type;
+		deserializeMeta(info.meta);
+	}
+
 	/// Find the row-column pair in the matrix where `t' is found, or indexpair(n(),0) if not found (None in Python)
 	indexpair indexOf(const T& t,sval aftern=0,sval afterm=0) const
 	{
@@ -2037,8 +2660,21 @@ protected:
 	{
 		if(_isShared)
 			throw MemException("Operation may only be performed on non-shared matrices");
+
+		if(_mapbase)
+			throw MemException("Operation may only be performed on non-file-mapped matrices");
 	}
-	
+
+	/// Unmap the file region `data' refers to, this leaves the matrix with no data
+	void unmapFile() throw(MemException)
+	{
+		void* base=_mapbase;
+		_mapbase=NULL;
+		_filename="";
+		_fileoffset=0;
+		unmapFileRegion(base,_maplen);
+	}
+	
 	inline void checkDimension(const char* name, sval dim) const throw(MemException)
 	{
 		if(dim==0){
@@ -2198,12 +2834,21 @@ protected:
 		return ptr;
 	}
 
-	/// Unmap the given shared segment, and delete it if this object created it
+	/// Unmap the given shared segment, and delete it if this object created it, or release it if allocated from an arena
 	void closeShared(T* ptr) throw(MemException)
 	{
 		if(!ptr)
 			return;
 
+		if(_arena){
+			SharedArena* arena=_arena;
+			_arena=NULL;
+			_arenaoffset=0;
+			_sharedname="";
+			arena->release();
+			return;
+		}
+
 #ifdef WIN32
 		if(!UnmapViewOfFile(ptr))
 			throw MemException("Failed to unmap file view");
@@ -2240,6 +2885,11 @@ typedef Matrix<vec3> Vec3Matrix;
 typedef Matrix<indexval> IndexMatrix;
 typedef Matrix<color> ColorMatrix;
 
+// compact image matrix types, these use a half or a quarter of the memory of RealMatrix for image data
+typedef Matrix<float> FloatMatrix;
+typedef Matrix<u16> UShortMatrix;
+typedef Matrix<i16> ShortMatrix;
+
 /**
  * DataSet objects store a Vec3Matrix, IndexMatrix instances which represent node properties or topologies which
  * use the given nodes, and RealMatrix instances which represent field values for the nodes and/or for the topologies.
@@ -2321,6 +2971,9 @@ public:
 	virtual void fillColor(color col) {}
 	virtual void fillColor(const ColorMatrix *mat,indexval depth) {}
 	virtual void fillColor(const RealMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) {}
+	virtual void fillColor(const FloatMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) {}
+	virtual void fillColor(const UShortMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) {}
+	virtual void fillColor(const ShortMatrix *mat,indexval depth,real minval=0.0,real maxval=1.0, const Material* colormat=NULL,const RealMatrix *alphamat=NULL,bool mulAlpha=true) {}
 };
 
 /// Represents a GPU program (vertex/fragment/geometry shader)
@@ -2411,6 +3064,22 @@ public:
 		sort();
 	}
 
+	/// Returns the index i such that pos(i)<p<=pos(i+1), where pos(0)<p<pos(size()-1), found by binary search
+	indexval findSegment(real p) const
+	{
+		indexval lo=1, hi=vals.n()-1;
+
+		while(lo<hi){
+			indexval mid=(lo+hi)/2;
+			if(vals[mid].first<p)
+				lo=mid+1;
+			else
+				hi=mid;
+		}
+
+		return lo-1;
+	}
+
 	indexval find(real pos, const T& value) const
 	{
 		indexval i=0;
@@ -2701,8 +3370,36 @@ protected:
 
 	std::string name;
 
+	/// Incremented by updateSpectrum() whenever the spectrum or alpha curve changes
+	u32 specVersion;
+
+	/// Colors interpolated at LUTSize evenly spaced positions in the unit interval, rebuilt when stale by lookupTable()
+	mutable std::vector<color> lut;
+	mutable u32 lutVersion;
+	mutable real lutAlpha;
+	mutable Mutex lutMutex;
+
+	/// Rebuild `lut' if the spectrum or alpha value changed since it was last built (NOTE: lutMutex must be held)
+	void updateLUT() const
+	{
+		real alpha=getAlpha();
+		if(spec.size()==0) // leave the table empty so that the default color is always used directly
+			lut.clear();
+		else if(lut.empty() || lutVersion!=specVersion || lutAlpha!=alpha){
+			lut.resize(LUTSize);
+			for(sval i=0;i<LUTSize;i++)
+				lut[i]=interpolateColor(real(i)/(LUTSize-1));
+		}
+
+		lutVersion=specVersion;
+		lutAlpha=alpha;
+	}
+
 public:
-	Spectrum(const std::string& name="") : alphacurve(true), name(name) {}
+	/// Number of entries in the color lookup table
+	static const sval LUTSize=4096;
+
+	Spectrum(const std::string& name="") : alphacurve(true), name(name), specVersion(0), lutVersion(0), lutAlpha(0) {}
 
 	virtual const char* getName() const { return name.c_str(); }
 
@@ -2724,7 +3421,40 @@ public:
 
 	virtual real getAlpha() const { return 1.0; }
 
-	virtual void updateSpectrum() {}
+	/// Called whenever the spectrum changes, this invalidates the color lookup table so overrides must call this method
+	virtual void updateSpectrum() { specVersion++; }
+
+	/// Copy the color lookup table into `table', rebuilding it first if the spectrum or alpha has changed
+	void lookupTable(std::vector<color>& table) const
+	{
+		critical(&lutMutex){
+			updateLUT();
+			table=lut;
+		}
+	}
+	
+	/// Look up the color for `pos' in `table' if it's in the unit interval, otherwise interpolate it directly
+	color lookupColor(real pos, const std::vector<color>& table) const
+	{
+		if(pos>=0 && pos<=1 && !table.empty()) // false for NaN as well as values outside the table
+			return table[sval(pos*(table.size()-1)+0.5)];
+		else
+			return interpolateColor(pos);
+	}
+
+	/** 
+	 * Returns the color for `pos' from the lookup table, this is interpolateColor(pos) to within 1/LUTSize of the unit interval. 
+	 * Positions outside the unit interval are interpolated directly.
+	 */
+	color lookupColor(real pos) const
+	{
+		color result;
+		critical(&lutMutex){
+			updateLUT();
+			result=lookupColor(pos,lut);
+		}
+		return result;
+	}
 
 	/// Add a color value to the spectrum at the given position then resort the spectrum
 	virtual void addSpectrumValue(real pos,color value)
@@ -2836,9 +3566,7 @@ public:
 		else if(pos>=spec.pos(specsize-1))
 			result=spec.get(specsize-1);
 		else{
-			sval index=0;
-			while(index<specsize-1 && spec.pos(index+1)<pos)
-				index++;
+			sval index=spec.findSegment(pos);
 
 			color cmin=spec.get(index);
 			color cmax=spec.get(index+1);
@@ -2867,24 +3595,14 @@ public:
 	 */
 	virtual void fillColorMatrix(ColorMatrix *col,const RealMatrix *mat,bool useValAsAlpha=false) throw(IndexException) 
 	{
-		bool hasMatAlpha=mat->m()>=col->m()*2;
-		sval len=_min(col->n(),mat->n());
-		sval width=_min(col->m(),mat->m());
-		
-		for(sval i=0;i<len;i++){
-			for(sval j=0;j<width;j++){
-				float val=mat->getAt(i,j);
-				color c=interpolateColor(val);
-				
-				if(hasMatAlpha)
-					c.a(mat->getAt(i,col->m()+j)*c.a());
-				else if(useValAsAlpha)
-					c.a(val*c.a());
-				
-				col->setAt(c,i,j);
-			}
-		}
+		interpolateColors(mat,col,useValAsAlpha);
 	}
+
+	/**
+	 * Interpolate colors for every value in `mat' into `col' using the lookup table, as described for fillColorMatrix(). The
+	 * rows are split between threads if there are many values.
+	 */
+	void interpolateColors(const RealMatrix *mat,ColorMatrix *col,bool useValAsAlpha=false) const throw(IndexException);
 };
 
 
@@ -3004,8 +3722,6 @@ public:
 	virtual bool setGPUParamReal(ProgramType pt,const std::string& name, real val) { return false; }
 	virtual bool setGPUParamVec3(ProgramType pt,const std::string& name, vec3 val) { return false; }
 	virtual bool setGPUParamColor(ProgramType pt,const std::string& name, color val) { return false; }
-
-	virtual void updateSpectrum() {}
 };
 
 /**
@@ -3049,6 +3765,47 @@ public:
 	virtual bool isVisible() const { return false; }
 };
 
+/**
+ * Vertex layout used by the renderer's hardware buffers: position, normal, color as a 32-bit ABGR value (see color::toABGR()),
+ * and 3D texture coordinate. A Matrix<PackedVertex>, possibly in shared memory filled by another process, can be given to
+ * Figure::fillPackedData() to be uploaded directly without any intermediate copy.
+ */
+struct PackedVertex
+{
+	float pos[3];
+	float norm[3];
+	rgba col;
+	float tex[3];
+};
+
+typedef Matrix<PackedVertex> PackedVertexMatrix;
+
+/**
+ * Pack the vertices from `vecs', with columns (position, normal, unused, uvw) as with MatrixVertexBuffer, and the colors from
+ * `cols' into `verts' starting at row `start'. Missing components are zeroed and a missing color matrix yields white vertices.
+ */
+void packVertices(const Vec3Matrix* vecs, const ColorMatrix* cols, PackedVertexMatrix* verts, sval start=0) throw(ValueException);
+
+/**
+ * Spatially coherent subset of a triangle mesh with its own bounds and a range of index values for each level of detail.
+ * The ranges are (start,count) pairs where level 0 is the chunk's full resolution triangles.
+ */
+struct MeshChunk
+{
+	vec3 minv, maxv;
+	std::vector<std::pair<sval,sval> > levels;
+};
+
+/**
+ * Split the triangles of the mesh (`verts',`inds'), with 3 indices per triangle, into chunks of at most `trisPerChunk' by
+ * recursive median splitting. The reordered triangles are stored in `outinds', with the level 0 ranges of all chunks first
+ * so that together they form one contiguous range of the full mesh, followed by `numLevels'-1 decimated levels for each chunk.
+ * Each level is computed by clustering the chunk's vertices on a grid half as fine as the last, using the first vertex in each
+ * cell as its representative, so levels refer only to the original vertices. Chunk bounds and ranges are stored in `chunks'.
+ */
+void chunkTriangleMesh(const PackedVertex* verts, sval numverts, const indexval* inds, sval numtris, sval trisPerChunk, sval numLevels,
+		std::vector<indexval>& outinds, std::vector<MeshChunk>& chunks) throw(IndexException);
+
 /** 
  * A VertexBuffer is used by Figure objects to fill their internal representations with vertex, normal, color, and texture 
  * UV coords. This can be subtyped in Python to adapt Python data structures to C++ for small figures.
@@ -3216,6 +3973,11 @@ public:
 
 	sval getIndex(sval i) const { return extinds!=NULL ? extinds->at(i) : i; }
 
+	/// Get the matrices this buffer reads from, these allow clients to access the data directly instead of through virtual calls
+	const Vec3Matrix* getVecs() const { return vecs; }
+	const ColorMatrix* getCols() const { return cols; }
+	const IndexMatrix* getExtInds() const { return extinds; }
+
 	virtual vec3 getVertex(int i) const { return vecs->at(getIndex(i)); }
 	virtual vec3 getNormal(int i) const { return vecs->at(getIndex(i),1); }
 	virtual color getColor(int i) const { return cols->at(getIndex(i)); }
@@ -3269,10 +4031,16 @@ public:
 		else
 			return sval(indices->n());
 	}
+	/// Get the matrices this buffer reads from, these allow clients to access the data directly instead of through virtual calls
+	const IndexMatrix* getIndices() const { return indices; }
+	const IndexMatrix* getExtInds() const { return extinds; }
+
 	virtual sval indexWidth(int i) const { return sval(indices!=NULL ? indices->m() : 0); }
 	virtual sval getIndex(int i,int j) const { return sval(indices->getAt(extinds!=NULL ? extinds->getAt(i) : i,j)); }
 };
 
+class TriMeshBVH;
+
 /// Represents a ray emanating from a point and moving in a direction. It provides methods for doing intersection tests.
 class Ray
 {
@@ -3556,8 +4324,155 @@ public:
 		
 		return results;
 	}
+
+	/**
+	 * Intersects the ray with the triangle mesh stored in `bvh', returning results in the same form as the above method.
+	 * The hierarchy is traversed nearest node first so the results are sorted by increasing distance, and if `numResults'
+	 * is greater than 0 only that many of the nearest intersected triangles are returned. Triangle indices in the results
+	 * and `excludeInd' refer to rows in the index matrix the hierarchy was built from.
+	 *
+	 * In python this method is called intersectsTriMeshBVH and returns the same list as intersectsTriMesh.
+	 */
+	std::vector<indextriple> intersectsTriMesh(const TriMeshBVH* bvh, sval numResults=0,sval excludeInd=-1) const throw(IndexException);
+};
+
+/**
+ * A bounding volume hierarchy over a triangle mesh defined by a node matrix and a triangle index matrix. The hierarchy is
+ * stored entirely in matrix objects so that it can be placed in shared memory and passed between processes along with
+ * the mesh matrices. The nodes of the tree are stored in `bounds' as (min,max) row pairs and in `nodeinfo' as (first,count)
+ * row pairs. If count is 0 the node is internal and its children are at rows first and first+1, otherwise the node is a leaf
+ * and its triangles are the `count' values of `triorder' starting at row `first'. The `triorder' matrix is a permutation of
+ * the triangle indices of the mesh. None of the matrices are owned by this object, so one can be constructed around
+ * matrices which already contain a built hierarchy (such as after unpickling) without needing to call build() again.
+ */
+class TriMeshBVH
+{
+	const Vec3Matrix* nodes;
+	const IndexMatrix* inds;
+	Vec3Matrix* bounds;
+	IndexMatrix* nodeinfo;
+	IndexMatrix* triorder;
+
+public:
+	/// Construct the hierarchy for the mesh (`nodes',`inds') stored in the given matrices, call build() to fill these if needed
+	TriMeshBVH(const Vec3Matrix* nodes, const IndexMatrix* inds, Vec3Matrix* bounds, IndexMatrix* nodeinfo, IndexMatrix* triorder) throw(ValueException) :
+		nodes(nodes), inds(inds), bounds(bounds), nodeinfo(nodeinfo), triorder(triorder)
+	{
+		CHECK_NULL(nodes);
+		CHECK_NULL(inds);
+		CHECK_NULL(bounds);
+		CHECK_NULL(nodeinfo);
+		CHECK_NULL(triorder);
+	}
+
+	const Vec3Matrix* getNodes() const { return nodes; }
+	const IndexMatrix* getIndices() const { return inds; }
+	const Vec3Matrix* getBounds() const { return bounds; }
+	const IndexMatrix* getNodeInfo() const { return nodeinfo; }
+	const IndexMatrix* getTriOrder() const { return triorder; }
+
+	/// Returns the number of tree nodes in the hierarchy
+	sval numTreeNodes() const { return bounds->n(); }
+
+	/// Returns true if the hierarchy has been built for the current triangle count of the mesh
+	bool isBuilt() const { return triorder->n()==_max<sval>(1,inds->n()) && bounds->n()==nodeinfo->n() && bounds->m()==2 && nodeinfo->m()==2; }
+
+	/**
+	 * Build the hierarchy by recursively dividing the triangles at the median centroid along the longest axis until at most
+	 * `leafSize' triangles are in each node. The storage matrices are resized so they cannot be shared while this is done.
+	 */
+	void build(sval leafSize=4) throw(IndexException,MemException);
+
+	/**
+	 * Intersects `ray' with the hierarchy, see Ray::intersectsTriMesh(const TriMeshBVH*,sval,sval) for the meaning of the
+	 * arguments. The `results' vector is cleared before intersections are added.
+	 */
+	void intersect(const Ray& ray, std::vector<indextriple>& results, sval numResults=0, sval excludeInd=-1) const throw(IndexException);
+};
+
+inline std::vector<indextriple> Ray::intersectsTriMesh(const TriMeshBVH* bvh, sval numResults,sval excludeInd) const throw(IndexException)
+{
+	std::vector<indextriple> results;
+	bvh->intersect(*this,results,numResults,excludeInd);
+	return results;
+}
+
+/**
+ * Intersects a batch of rays with the mesh stored in `bvh', dividing the rays between `numThreads' threads (or one per
+ * processor if 0). Ray i starts at row i of `origins' and points in the direction of row i of `dirs', or row 0 if `dirs'
+ * has only one row. The number of results per ray is the number of columns in `dists' and `triinds', for ray i the
+ * nearest hits are stored in row i of these matrices in increasing order of distance as the (t) distance values and the
+ * intersected triangle indices respectively. Columns without a hit are filled with -1. If `excludeInds' is not NULL,
+ * ray i will skip the triangle given at row i of that matrix. Rays with zero-length directions produce no hits.
+ */
+void intersectsTriMeshRays(const TriMeshBVH* bvh, const Vec3Matrix* origins, const Vec3Matrix* dirs, RealMatrix* dists, IndexMatrix* triinds,
+		const IndexMatrix* excludeInds=NULL, sval numThreads=0) throw(IndexException,ValueException,MemException,RenderException);
+
+/**
+ * A bounding volume hierarchy over the elements of a linear tetrahedral (Tet1NL) or hexahedral (Hex1NL) mesh, defined by a
+ * node matrix and an index matrix with 4 or 8 columns, used to find which element contains a point and at what xi coordinate.
+ * The hierarchy is stored in matrices exactly as a TriMeshBVH is, with `elemorder' being a permutation of the element indices,
+ * so that it can likewise be shared between processes and reconstructed around already built matrices.
+ */
+class ElemMeshBVH
+{
+	const Vec3Matrix* nodes;
+	const IndexMatrix* inds;
+	Vec3Matrix* bounds;
+	IndexMatrix* nodeinfo;
+	IndexMatrix* elemorder;
+
+public:
+	/// Construct the hierarchy for the mesh (`nodes',`inds') stored in the given matrices, call build() to fill these if needed
+	ElemMeshBVH(const Vec3Matrix* nodes, const IndexMatrix* inds, Vec3Matrix* bounds, IndexMatrix* nodeinfo, IndexMatrix* elemorder) throw(ValueException) :
+		nodes(nodes), inds(inds), bounds(bounds), nodeinfo(nodeinfo), elemorder(elemorder)
+	{
+		CHECK_NULL(nodes);
+		CHECK_NULL(inds);
+		CHECK_NULL(bounds);
+		CHECK_NULL(nodeinfo);
+		CHECK_NULL(elemorder);
+
+		if(inds->m()!=4 && inds->m()!=8)
+			throw ValueException("inds","Index matrix must define linear tetrahedra or hexahedra with 4 or 8 columns",__FILE__,__LINE__);
+	}
+
+	const Vec3Matrix* getNodes() const { return nodes; }
+	const IndexMatrix* getIndices() const { return inds; }
+	const Vec3Matrix* getBounds() const { return bounds; }
+	const IndexMatrix* getNodeInfo() const { return nodeinfo; }
+	const IndexMatrix* getElemOrder() const { return elemorder; }
+
+	/// Returns the number of tree nodes in the hierarchy
+	sval numTreeNodes() const { return bounds->n(); }
+
+	/// Returns true if the hierarchy has been built for the current element count of the mesh
+	bool isBuilt() const { return elemorder->n()==_max<sval>(1,inds->n()) && bounds->n()==nodeinfo->n() && bounds->m()==2 && nodeinfo->m()==2; }
+
+	/// Build the hierarchy over the bounding boxes of the elements as TriMeshBVH::build() does over triangles
+	void build(sval leafSize=4) throw(IndexException,MemException);
+
+	/**
+	 * Returns the index of an element containing `pt' and stores the point's xi coordinate in that element in `xi', or returns
+	 * -1 if no element contains it. Element `hint' is tested first if it isn't -1, which is much faster for successive points
+	 * that are near each other. Points on the boundary between elements are placed in whichever is found first. The xi values
+	 * are calculated with pointSearchLinTet() or pointSearchLinHex().
+	 */
+	sval locate(const vec3& pt, vec3& xi, sval hint=-1) const throw(IndexException);
+
+	/// Returns true if `pt' is in element `elem', storing its xi coordinate in `xi'
+	bool inElem(const vec3& pt, sval elem, vec3& xi) const throw(IndexException);
 };
 
+/**
+ * Locate every point of `pts' in the mesh stored in `bvh', dividing the points between `numThreads' threads (or one per
+ * processor if 0). For point i the containing element's index is stored in row i of `elems' and its xi coordinate in row i
+ * of `xis', or -1 and vec3(-1) if it's outside the mesh. Each thread tests the element it last found first, so ordering
+ * points so that successive ones are close together (such as image voxels in raster order) greatly speeds up the search.
+ */
+void locatePoints(const ElemMeshBVH* bvh, const Vec3Matrix* pts, IndexMatrix* elems, Vec3Matrix* xis, sval numThreads=0)
+		throw(IndexException,ValueException,MemException,RenderException);
+
 /** 
  * Represents the combination of translation, scale, and rotation operations. When multiplying a vector v
  * by a transform t, the order of operations is to scale, rotate, then translate. If isInverse() is true
@@ -3841,6 +4756,26 @@ public:
 	virtual void renderToStream(void* stream,sval width,sval height, TextureFormat format=TF_RGB24,real stereoOffset=0.0) throw(RenderException) {}
 	/// Create an offscreen texture, render to it, then blit the contents to the returned Image object, which can then be used to save the image to file.
 	virtual Image* renderToImage(sval width,sval height, TextureFormat format=TF_RGB24,real stereoOffset=0.0) throw(RenderException) { return 0; }
+
+	/**
+	 * Begin a batch capture of the frames rendered by captureFrame() or capturePoses(), which reuses one offscreen texture of the
+	 * given size (or the viewport's size if 0) for every frame. Frames are written by a background thread to files named with
+	 * `fileprefix', a 4 digit frame number, and `extension', or appended unencoded to the file `fileprefix' if `extension' is
+	 * ".raw". At most `queueSize' frames wait to be written, beyond this capturing waits for the writer.
+	 */
+	virtual void beginCapture(const std::string& fileprefix,const std::string& extension,sval width=0,sval height=0,TextureFormat format=TF_RGB24,
+			real stereoOffset=0.0,sval queueSize=4) throw(RenderException) {}
+
+	/// Render the scene in its current state as the next frame of the capture begun with beginCapture()
+	virtual void captureFrame() throw(RenderException) {}
+
+	/// Capture a frame from each position in `positions' looking at the same row of `lookats', or the current look-at point if NULL
+	virtual void capturePoses(const Vec3Matrix* positions,const Vec3Matrix* lookats=NULL) throw(RenderException) {}
+
+	/// Wait for every captured frame to be written and end the capture, returning the number of frames written
+	virtual sval endCapture() throw(RenderException) { return 0; }
+
+	virtual bool isCapturing() const { return false; }
 };
 
 /**
@@ -3897,6 +4832,45 @@ public:
 	 * If `doubleSided' is true and the index buffer defined triangles, create backfaces for triangles with correct normals. 
 	 */
 	virtual void fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill=false,bool doubleSided=false) throw(RenderException) {}
+
+	/**
+	 * Fill the figure's data from vertices already in the hardware buffer layout and a matrix of indices, these are copied
+	 * directly into the hardware buffers without an intermediate copy. If `deferFill' is true the copy is done at render time 
+	 * and so the matrices must remain valid until then or until the next fill operation.
+	 */
+	virtual void fillPackedData(const PackedVertexMatrix* verts, const IndexMatrix* inds,bool deferFill=false) throw(RenderException) {}
+
+	/**
+	 * Set whether fillData() stores normals in the hardware buffer as 16-bit normalized values rather than floats, saving 
+	 * memory at the cost of precision. Normals and texture coordinates are only stored if the vertex buffer provides them.
+	 */
+	virtual void setPackedNormals(bool val) {}
+	virtual bool isPackedNormals() const { return false; }
+
+	/**
+	 * Set fillData() to divide triangle meshes into spatial chunks of about `trisPerChunk' triangles each, which are culled
+	 * individually and drawn with one of `numLevels' levels of detail chosen by their size on screen. A chunk size of 0
+	 * disables chunking, chunked figures aren't depth sorted as a whole but their chunks are ordered by the render queue.
+	 */
+	virtual void setChunking(sval trisPerChunk,sval numLevels=1) {}
+	virtual sval getChunkSize() const { return 0; }
+	virtual sval getChunkLevels() const { return 1; }
+
+	/**
+	 * Add a keyframe of positions `nodes' for the figure's vertices with optional field values from `field' normalized to the 
+	 * range [`minval',`maxval']. Keyframes are uploaded once and blended at render time by a vertex program like res/keyframeVP.cg
+	 * at the time given to setKeyframeTime(), so animating a figure doesn't require refilling its data every frame.
+	 */
+	virtual void addKeyframe(const Vec3Matrix* nodes,const RealMatrix* field=NULL,real minval=0.0,real maxval=1.0) throw(RenderException) {}
+	virtual void clearKeyframes() {}
+	virtual sval numKeyframes() const { return 0; }
+
+	/**
+	 * Set the time in keyframe units, eg. 1.5 is half way between keyframes 1 and 2, which are blended with the same Catmull-Rom
+	 * spline as cubicInterpMatrices() if `cubic' is true or linearly otherwise. Times outside [0,numKeyframes()-1] are clamped.
+	 */
+	virtual void setKeyframeTime(real t,bool cubic=true) {}
+	virtual real getKeyframeTime() const { return 0; }
 	
 	/// Sets the figure's visibility
 	virtual void setVisible(bool isVisible){}
@@ -3946,6 +4920,13 @@ public:
 
 	virtual int numBillboards() const {return 0;}
 
+	/**
+	 * Set whether the next fillData() stores the points in a single vertex buffer drawn as point sprites rather than as
+	 * billboards, this applies to point billboards only. Changes to colors, positions, and size then upload only what changed.
+	 */
+	virtual void setPointCloud(bool val) {}
+	virtual bool isPointCloud() const { return false; }
+
 	virtual void fillData(const VertexBuffer* vb, const IndexBuffer* ib,bool deferFill=false,bool doubleSided=false) throw(RenderException) {}
 
 	virtual void setBillboardPos(indexval index, const vec3& pos) throw(IndexException) {}
@@ -3988,6 +4969,14 @@ public:
 	virtual vec3 getGlyphScale() const { return vec3(); }
 	virtual void setGlyphName(const std::string& name) {}
 	virtual std::string getGlyphName() const {return ""; }
+
+	/**
+	 * Set whether glyphs are drawn by instancing one copy of the glyph mesh rather than filling a copy per glyph, this takes
+	 * effect at the next fillData() call. If instancing isn't supported by the renderer or material the mesh is filled instead.
+	 */
+	virtual void setInstanced(bool val) {}
+	virtual bool isInstanced() const { return false; }
+
 	virtual void addGlyphMesh(const std::string& name,const Vec3Matrix* nodes, const Vec3Matrix* norms, const IndexMatrix* inds) {}
 };
 
@@ -4093,6 +5082,190 @@ private:
 	}
 };
 
+/// Timing and upload statistics for one rendered frame, all times are wall time in seconds
+struct FrameStats
+{
+	u64 frame;           // frame number counted from the first profiled frame
+	real frameTime;      // total time for the frame including applying resource ops and rendering
+	real opsTime;        // time spent applying queued ResourceOp objects
+	real updateTime;     // time spent in figures' render queue updates, including the sorting and commits they do
+	real sortTime;       // time spent depth sorting triangles
+	real commitTime;     // time spent committing vertex and index data to hardware buffers
+	real textureTime;    // time spent committing texture data
+	sval numOps;         // number of ResourceOp objects applied
+	sval pendingOps;     // number of ResourceOp objects pending at the start of the frame
+	sval numUpdates;     // number of figure render queue updates
+	sval numSorts;       // number of depth sorts performed
+	sval numUploads;     // number of buffer and texture uploads
+	u64 uploadBytes;     // total size of uploads in bytes
+};
+
+/**
+ * Records FrameStats for a number of recent frames in a ring buffer. The renderer calls beginFrame() and endFrame() around
+ * each frame and the record/add methods in between, these do nothing if profiling isn't enabled. ProfileScope is used to
+ * time code blocks and add the elapsed time to a FrameStats member.
+ */
+class FrameProfiler
+{
+	std::vector<FrameStats> frames;
+	FrameStats current;
+	sval capacity;
+	sval first;
+	bool enabled;
+	bool inFrame;
+	real frameStart;
+	u64 frameCount;
+	mutable Mutex mutex;
+
+public:
+	FrameProfiler(sval capacity=256) : capacity(_max<sval>(1,capacity)), first(0), enabled(false), inFrame(false), frameStart(0), frameCount(0)
+	{
+		memset(&current,0,sizeof(FrameStats));
+	}
+
+	bool isEnabled() const { return enabled; }
+
+	void setEnabled(bool val) { enabled=val; inFrame=false; }
+
+	/// Set the number of frames to store, this clears the stored frames
+	void setCapacity(sval cap)
+	{
+		critical(&mutex){
+			capacity=_max<sval>(1,cap);
+			frames.clear();
+			first=0;
+		}
+	}
+
+	sval getCapacity() const { return capacity; }
+
+	/// Clear stored frames and restart the frame count
+	void clear()
+	{
+		critical(&mutex){
+			frames.clear();
+			first=0;
+			frameCount=0;
+		}
+	}
+
+	/// Returns the number of stored frames, at most getCapacity()
+	sval numFrames() const 
+	{ 
+		sval result=0;
+		critical(&mutex){
+			result=sval(frames.size());
+		}
+		return result;
+	}
+
+	/// Returns stored frame `i', 0 being the oldest and numFrames()-1 the most recent
+	FrameStats getFrame(sval i) const throw(IndexException)
+	{
+		FrameStats result;
+		critical(&mutex){
+			if(i>=frames.size())
+				throw IndexException("i",i,frames.size());
+
+			result=frames[(first+i)%frames.size()];
+		}
+		return result;
+	}
+
+	/// Start recording a frame with `pendingOps' resource operations queued
+	void beginFrame(sval pendingOps)
+	{
+		if(!enabled)
+			return;
+
+		critical(&mutex){
+			memset(&current,0,sizeof(FrameStats));
+			current.frame=frameCount++;
+			current.pendingOps=pendingOps;
+			frameStart=getWallTime();
+			inFrame=true;
+		}
+	}
+
+	/// Finish recording the current frame and store it in the ring buffer, overwriting the oldest if full
+	void endFrame()
+	{
+		if(!enabled || !inFrame)
+			return;
+
+		critical(&mutex){
+			current.frameTime=getWallTime()-frameStart;
+			inFrame=false;
+
+			if(frames.size()<capacity)
+				frames.push_back(current);
+			else{
+				frames[first]=current;
+				first=(first+1)%capacity;
+			}
+		}
+	}
+
+	/// Add `dt' seconds to the time member `field' and increment the counter member `counter' if given
+	void addTime(real FrameStats::* field, real dt, sval FrameStats::* counter=NULL)
+	{
+		if(!enabled || !inFrame)
+			return;
+
+		critical(&mutex){
+			current.*field+=dt;
+			if(counter)
+				current.*counter+=1;
+		}
+	}
+
+	/// Add `n' to the counter member `counter'
+	void addCount(sval FrameStats::* counter, sval n)
+	{
+		if(!enabled || !inFrame)
+			return;
+
+		critical(&mutex){
+			current.*counter+=n;
+		}
+	}
+
+	/// Record an upload of `bytes' bytes to a hardware buffer or texture
+	void addUpload(size_t bytes)
+	{
+		if(!enabled || !inFrame)
+			return;
+
+		critical(&mutex){
+			current.numUploads++;
+			current.uploadBytes+=bytes;
+		}
+	}
+};
+
+/// Times the scope it's declared in and adds the elapsed time to `field' of the given profiler's current frame
+class ProfileScope
+{
+	FrameProfiler* profiler;
+	real FrameStats::* field;
+	sval FrameStats::* counter;
+	real start;
+
+public:
+	ProfileScope(FrameProfiler* profiler, real FrameStats::* field, sval FrameStats::* counter=NULL) :
+		profiler(profiler && profiler->isEnabled() ? profiler : NULL), field(field), counter(counter), start(0)
+	{
+		if(this->profiler)
+			start=getWallTime();
+	}
+
+	~ProfileScope()
+	{
+		if(profiler)
+			profiler->addTime(field,getWallTime()-start,counter);
+	}
+};
+
 /**
  * This class represents the rendering scene and the factory for all render-related objects including cameras, lights, figures, and materials. It also
  * is responsible for loading textures and other properties (more to be added later). Only one instance should ever exist which is created by the
@@ -4103,6 +5276,9 @@ class RenderScene
 	bool renderHighQuality;
 	bool alwaysHighQuality;
 
+protected:
+	FrameProfiler profiler;
+
 public:
 	RenderScene() : renderHighQuality(false), alwaysHighQuality(false) {}
 
@@ -4157,6 +5333,12 @@ public:
 	/// Set the background skybox to the given color if `enabled' is true, otherwise disable it.
 	virtual void setBGObject(color col,bool enabled){}
 
+	/**
+	 * Set the time in seconds and number of bytes of uploads per frame after which pending resource operations which upload 
+	 * data, such as texture commits, are left for later frames. A value of 0 means no limit, which is the default.
+	 */
+	virtual void setResourceOpBudget(real seconds, size_t bytes) {}
+
 	/// Set whether rendering should be done using high quality passes or not
 	void setRenderHighQuality(bool val) { renderHighQuality=val; }
 	
@@ -4168,6 +5350,9 @@ public:
 	
 	/// Returns whether to always render in high quality mode.
 	bool getAlwaysHighQuality() const  { return alwaysHighQuality; }
+
+	/// Returns the profiler recording frame statistics for this scene, this is disabled by default
+	FrameProfiler* getProfiler() { return &profiler; }
 };
 
 /**
@@ -4227,87 +5412,255 @@ template<typename T,typename V> void setMatrixMinMax(Matrix<T>* mat,const V& min
 	mat->meta("max",os.str().c_str());
 }
 
-/// Partial templates for converting strings to primitives/vec3
-template<typename T> struct StrConvert { static T conv(const char* str) { return T(); } };
-template<> struct StrConvert<real> { static real conv(const char* str) { return atof(str); } };
-template<> struct StrConvert<indexval> { static indexval conv(const char* str) { return atol(str); } };
-
-/// Partial templates for converting a line of text into a list of primitives/vec3
-template<typename T> struct ParseLine 
-{ 
-	static void parse(const char* line,sval numvals,T* list) 
-	{
-		char *buf=new char[strlen(line)+1];
-		strcpy(buf,line);
-			
-		char* p=strtok(buf," \t\r\n");
-	
-		for(sval x=0;x<numvals && p;x++){
-			list[x]=StrConvert<T>::conv(p);
-			p=strtok(NULL," \t\r\n");
-		}
-			
-		delete buf;
-	} 
-};
+/// Returns true if `c' separates values in text files
+inline bool isTextSpace(char c) { return c==' ' || c=='\t' || c=='\r' || c=='\n'; }
 
-/// vec3 specific case to handle turning 3 parsed values into 1 object
-template<> struct ParseLine<vec3>
-{ 
-	static void parse(const char* line,sval numvals,vec3* list) 
-	{
-		char *buf=new char[strlen(line)+1];
-		strcpy(buf,line);
-			
-		char* p=strtok(buf," \t\r\n");
-	
-		for(sval i=0;i<numvals && p;i++){
-			real x=StrConvert<real>::conv(p);
-			p=strtok(NULL," \t\r\n");
-			real y=(p ? StrConvert<real>::conv(p) : 0);
-			p=strtok(NULL," \t\r\n");
-			real z=(p ? StrConvert<real>::conv(p) : 0);
-			p=strtok(NULL," \t\r\n");
-			list[i]=vec3(x,y,z);
-		}
-			
-		delete buf;
-	} 
-};
+/// Returns the first position in [p,end) which isn't whitespace, or `end'
+inline const char* skipTextSpace(const char* p, const char* end)
+{
+	while(p<end && isTextSpace(*p))
+		p++;
+	return p;
+}
 
-/// Reads the text file into the given matrix, ignoring the header of integers and using the dimensions of `mat' to determine line width
-template<typename T>
-void readTextFileMatrix(const std::string & filename, sval numHeaders, Matrix<T>* mat)
+/// Returns the first whitespace position in [p,end), or `end'
+inline const char* skipTextToken(const char* p, const char* end)
 {
-	std::ifstream in(filename.c_str());
+	while(p<end && !isTextSpace(*p))
+		p++;
+	return p;
+}
 
-	if(!in)
-		return;
+/**
+ * Parse the real value whose text starts at `p' and store it in `val', returning the position following the token. The
+ * format is that of strtod() in the C locale regardless of the current locale, including "inf" and "nan". Values with at
+ * most 15 significant digits and small exponents are converted exactly, others within an ulp or so. Text in the token that
+ * isn't part of a number is skipped, and a token with no number stores 0 like atof() does. No memory is allocated so this
+ * can be used by multiple threads at once.
+ */
+const char* parseTextReal(const char* p, const char* end, real* val);
 
-	std::string line;
-	sval numvals=sval(mat->m());
-	T* entry=new T[numvals];
+/// Parse the integer whose text starts at `p' into `val' like atol() in the C locale, returning the position after the token
+template<typename I>
+const char* parseTextInt(const char* p, const char* end, I* val)
+{
+	bool neg=p<end && *p=='-';
+	if(p<end && (*p=='-' || *p=='+'))
+		p++;
 
-	if(numHeaders>0){
-		sval* header=new sval[numHeaders];
-		std::getline(in,line);	
-		ParseLine<sval>::parse(line.c_str(),numHeaders,header);
-		delete header;
-	}
+	I v=0;
+	for(;p<end && *p>='0' && *p<='9';p++)
+		v=I(v*10+(*p-'0'));
 
-	while(std::getline(in,line)){		
-		if(line.find_first_not_of(" \n\t\r")==std::string::npos)
-			continue;
+	*val=neg ? I(I(0)-v) : v;
+	return skipTextToken(p,end);
+}
+
+/// Count the lines in [p,end) which contain something other than whitespace, the last line needn't end with a newline
+sval countTextLines(const char* p, const char* end);
+
+/**
+ * Partial templates for parsing one value starting at `p' from text ending at `end', returning the position following it.
+ * There is no generic definition so reading text into a matrix of a type without a specialization fails to compile.
+ */
+template<typename T> struct TextValue;
+
+template<> struct TextValue<real> 
+{ 
+	static const char* parse(const char* p, const char* end, real* val) { return parseTextReal(p,end,val); } 
+};
+
+template<> struct TextValue<indexval> 
+{ 
+	static const char* parse(const char* p, const char* end, indexval* val) { return parseTextInt(p,end,val); } 
+};
+
+template<> struct TextValue<float> 
+{ 
+	static const char* parse(const char* p, const char* end, float* val) 
+	{ 
+		real v;
+		p=parseTextReal(p,end,&v);
+		*val=float(v);
+		return p;
+	} 
+};
 
-		ParseLine<T>::parse(line.c_str(),numvals,entry);
+/// Parse an integer into the 16-bit type I, values outside of I's range are clamped to its minimum or maximum
+template<typename I> struct TextValueShort 
+{ 
+	static const char* parse(const char* p, const char* end, I* val) 
+	{ 
+		i64 v;
+		p=parseTextInt(p,end,&v);
+		*val=I(clamp<i64>(v,std::numeric_limits<I>::min(),std::numeric_limits<I>::max()));
+		return p;
+	} 
+};
 
-		mat->append(entry[0]);
-		sval pos=mat->n()-1;
-		for(sval x=1;x<numvals;x++)
-			mat->at(pos,x)=entry[x];
+template<> struct TextValue<u16> : public TextValueShort<u16> {};
+template<> struct TextValue<i16> : public TextValueShort<i16> {};
+
+/// vec3 specific case to handle turning 3 parsed values into 1 object, missing components are 0
+template<> struct TextValue<vec3> 
+{ 
+	static const char* parse(const char* p, const char* end, vec3* val)
+	{
+		real c[3]={0,0,0};
+		for(int i=0;i<3 && p<end;i++)
+			p=skipTextSpace(parseTextReal(p,end,&c[i]),end);
+
+		*val=vec3(c[0],c[1],c[2]);
+		return p;
 	}
+};
 
-	delete entry;
+/// color specific case reading 4 parsed values as RGBA, missing components default to 1 like color's constructor
+template<> struct TextValue<color> 
+{ 
+	static const char* parse(const char* p, const char* end, color* val)
+	{
+		real c[4]={1,1,1,1};
+		for(int i=0;i<4 && p<end;i++)
+			p=skipTextSpace(parseTextReal(p,end,&c[i]),end);
+
+		*val=color(float(c[0]),float(c[1]),float(c[2]),float(c[3]));
+		return p;
+	}
+};
+
+/// Parse up to `numvals' whitespace separated values from [p,end) into `list', returning how many were parsed
+template<typename T>
+sval parseTextValues(const char* p, const char* end, sval numvals, T* list)
+{
+	sval count=0;
+	for(p=skipTextSpace(p,end);count<numvals && p<end;p=skipTextSpace(p,end))
+		p=TextValue<T>::parse(p,end,&list[count++]);
+
+	return count;
+}
+
+/// Parse a null-terminated line of text into a list of values, entries of `list' past the values in `line' are unchanged
+template<typename T> struct ParseLine 
+{ 
+	static void parse(const char* line,sval numvals,T* list) 
+	{
+		parseTextValues(line,line+strlen(line),numvals,list);
+	} 
+};
+
+/**
+ * Parses the lines of text between block boundaries into rows of a matrix for readTextFileMatrix(). When `counting' is true
+ * this stores the number of non-blank lines in each block in `rows', otherwise `rows' must hold the row each block starts at.
+ */
+template<typename T>
+class TextMatrixTask : public ParallelTask
+{
+public:
+	Matrix<T>* mat;
+	std::vector<const char*> bounds; // block i is [bounds[i],bounds[i+1]), each boundary is the start of a line
+	std::vector<sval> rows;
+	bool counting;
+
+	TextMatrixTask(Matrix<T>* mat) : mat(mat), counting(true) {}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		sval numvals=mat->m();
+
+		for(sval b=start;b<end;b++){
+			if(counting){
+				rows[b]=countTextLines(bounds[b],bounds[b+1]);
+				continue;
+			}
+
+			sval row=rows[b];
+			const char* p=bounds[b];
+			const char* blockend=bounds[b+1];
+
+			while(p<blockend){
+				const char* lineend=(const char*)memchr(p,'\n',blockend-p);
+				if(!lineend)
+					lineend=blockend;
+
+				if(skipTextSpace(p,lineend)<lineend){
+					T* list=&mat->at(row++,0);
+					for(sval x=parseTextValues(p,lineend,numvals,list);x<numvals;x++)
+						list[x]=T();
+				}
+
+				p=lineend+1;
+			}
+		}
+	}
+};
+
+/**
+ * Reads the text file into the given matrix, ignoring the header line if `numHeaders' is non-zero and using the dimensions of
+ * `mat' to determine line width. Each line which isn't blank is appended as a row, values missing from a line are set to T().
+ * The file is mapped into memory and divided into blocks of whole lines, the lines in each are counted in parallel so that the
+ * matrix can be sized once, and then the blocks are parsed in parallel directly into their rows. Nothing is read if the file
+ * doesn't exist.
+ */
+template<typename T>
+void readTextFileMatrix(const std::string & filename, sval numHeaders, Matrix<T>* mat) throw(MemException)
+{
+	static const size_t BlockSize=1<<20;
+
+	size_t len=0;
+	if(!getFileSize(filename.c_str(),&len) || len==0)
+		return;
+
+	void* base;
+	size_t baselen;
+	const char* text=(const char*)mapFileRegion(filename.c_str(),0,len,false,&base,&baselen);
+	const char* end=text+len;
+
+	try{
+		const char* p=text;
+
+		if(numHeaders>0){
+			p=(const char*)memchr(text,'\n',len);
+			p=p ? p+1 : end;
+		}
+
+		TextMatrixTask<T> task(mat);
+		sval numblocks=sval(((end-p)+BlockSize-1)/BlockSize);
+
+		// each boundary is moved forward to the start of the next line, blocks containing no line start are left empty
+		task.bounds.push_back(p);
+		for(sval b=1;b<numblocks;b++){
+			const char* q=_max(task.bounds.back(),p+b*BlockSize);
+			if(q>text && q[-1]!='\n'){
+				q=(const char*)memchr(q,'\n',end-q);
+				q=q ? q+1 : end;
+			}
+			task.bounds.push_back(q);
+		}
+		task.bounds.push_back(end);
+		task.rows.resize(numblocks,0);
+
+		runParallelTask(&task,numblocks,0,1);
+
+		sval startrow=mat->n();
+		for(sval b=0;b<numblocks;b++){
+			sval count=task.rows[b];
+			task.rows[b]=startrow;
+			startrow+=count;
+		}
+
+		if(startrow>mat->n()){
+			mat->setN(startrow);
+			task.counting=false;
+			runParallelTask(&task,numblocks,0,1);
+		}
+	}
+	catch(...){
+		unmapFileRegion(base,baselen);
+		throw;
+	}
+
+	unmapFileRegion(base,baselen);
 }
 
 
@@ -4340,6 +5693,24 @@ void convertUIntStreamToRealMatrix(const char* stream, RealMatrix* mat);
 void convertIntStreamToRealMatrix(const char* stream, RealMatrix* mat);
 void convertFloatStreamToRealMatrix(const char* stream, RealMatrix* mat);
 void convertRealStreamToRealMatrix(const char* stream, RealMatrix* mat);
+
+/// Returns the size in bytes of elements of type `type'
+sval getStreamTypeSize(StreamType type) throw(ValueException);
+
+/**
+ * Decode mat->n()*mat->m() values of type `type' from `stream' into `mat' in one pass, swapping their byte order if `swapEndian' 
+ * is true and storing val*slope+intercept for each value `val'. The "min" and "max" metadata of `mat' are set to the range of the
+ * stored values. The stream is decoded in chunks split between threads, it must be at least as long as the data to decode and
+ * need not be aligned. Throws ValueException if `mat' is empty.
+ */
+void decodeStreamToRealMatrix(const char* stream, StreamType type, RealMatrix* mat, bool swapEndian=false, real slope=1.0, real intercept=0.0) throw(ValueException);
+
+/**
+ * Decode values from the file `filename' starting from byte `offset' into `mat' as decodeStreamToRealMatrix() does. The file is
+ * mapped into memory rather than read so data is paged in by the decoding threads as they need it.
+ */
+void decodeFileToRealMatrix(const char* filename, size_t offset, StreamType type, RealMatrix* mat, bool swapEndian=false, 
+		real slope=1.0, real intercept=0.0) throw(MemException,ValueException);
 //void convertRGBA32StreamToRealMatrix(const u8* stream, RealMatrix* mat);
 
 //RealMatrix* readImageFile(const std::string& filename);
@@ -4360,15 +5731,150 @@ void calculateTetValueIntersects(real val, real a, real b, real c, real d, real*
 
 sval calculateHexValueIntersects(real val,const real* vals,intersect* results);
 
+/**
+ * Calculate the isosurfaces of the per-node field `field' for each value in `isovals' over the linear tetrahedra (Tet1NL)
+ * or hexahedra (Hex1NL) in `inds', with 4 or 8 columns respectively, whose nodes are in `nodes'. Each element is divided
+ * into tetrahedra (hexes into 6 along their 0-7 diagonals) which are intersected independently across `numThreads' threads
+ * (one per processor if 0 and there are enough elements), with vertices on shared edges welded together.
+ *
+ * The surface's vertices are stored in `outnodes' as (position,normal) rows, so it must have at least 2 columns, and the
+ * triangles indexing them in `outinds', these then being the vertex and index matrices for a FT_TRILIST figure. Normals
+ * point in the direction of increasing field value. If `doubleSided' is true then a second copy of each vertex with its
+ * normal reversed and of each triangle with its winding reversed are added so that the surface is lit from either side.
+ * If given, row i of `outedges' is set to the nodes (a,b) of the mesh edge vertex i lies on and the index of its value in
+ * `isovals' with `outlerps' set to its position along the edge, so other node fields can be interpolated onto the surface.
+ * If given, row i of `outelems' is set to the index of the first element containing that edge and the columns of `inds'
+ * a and b are in for that element, so the vertex's xi coordinate is the vertex's lerp between those of the two nodes.
+ */
+void calculateIsosurface(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const std::vector<real>& isovals,
+		Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges=NULL, RealMatrix* outlerps=NULL, IndexMatrix* outelems=NULL,
+		bool doubleSided=false, sval numThreads=0) throw(IndexException,ValueException,MemException);
+
+/**
+ * Calculate the isolines of the per-node field `field' for each value in `isovals' over the linear triangles (Tri1NL) or
+ * quads (Quad1NL) in `inds', with 3 or 4 columns respectively, whose nodes are in `nodes'. Quads are divided into two
+ * triangles along their 0-3 diagonals. The output matrices are the same as for calculateIsosurface() except `outinds' is
+ * filled with line segments and so must have 2 columns, these then being the vertex and index matrices for a FT_LINELIST 
+ * figure. The normal of each vertex is the average of the normals of the elements it lies on.
+ */
+void calculateIsoline(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const std::vector<real>& isovals,
+		Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges=NULL, RealMatrix* outlerps=NULL, IndexMatrix* outelems=NULL,
+		sval numThreads=0) throw(IndexException,ValueException,MemException);
+
 /// Linear Nodal Lagrange tetrahedron basis function, fills in `coeffs' for the given xi value, `coeffs' must be 4 long.
 void basis_Tet1NL(real xi0, real xi1, real xi2, real* coeffs);
 
 /// Linear Nodal Lagrange hexahedron basis function, fills in `coeffs' for the given xi value, `coeffs' must be 8 long.
 void basis_Hex1NL(real xi0, real xi1, real xi2, real* coeffs);
 
-real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix *knots);
+/// Most knots in one dimension the NURBS basis functions can use, that is control point count plus degree plus 1
+static const sval NURBSMaxKnots=128;
+
+/**
+ * Evaluate the NURBS basis function for control point `ctrlpt' of degree `degree' at `xi' for the knot vector `knots'. This
+ * uses the iterative Cox-de Boor recurrence over a stack array so needs `degree'+2 to be at most NURBSMaxKnots.
+ */
+real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix *knots) throw(IndexException,ValueException);
+
+/**
+ * Fill `coeffs' with the ul*vl*wl normalized NURBS coefficients for the xi value (u,v,w), using uniform knot vectors for each
+ * dimension's control point count and degree. The coefficient for control point (i,j,k) is at index i+j*ul+k*ul*vl.
+ */
+void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs) 
+		throw(ValueException);
+
+/// A basis function like basis_Tet1NL() which fills a fixed number of coefficients for a xi value
+typedef void (*BasisFunc)(real xi0, real xi1, real xi2, real* coeffs);
 
-void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs);
+/**
+ * Fill `coeffs' with the basis coefficients from `func' for each xi value in `xis', producing a table which can be evaluated 
+ * once for a type and sample grid then applied to every element with applyBasisTable(). Each row of `xis' is a xi value with
+ * 1 to 3 columns (missing components are 0) and `coeffs' is resized to have as many rows, its column count must be `numcoeffs'
+ * which is the number of coefficients `func' produces.
+ */
+void fillBasisTable(BasisFunc func, sval numcoeffs, const RealMatrix* xis, RealMatrix* coeffs) throw(ValueException);
+
+/// Fill `coeffs' with the basis_NURBS_default() coefficients for each xi value in `xis' as fillBasisTable() does
+void fillBasisTable_NURBS_default(const RealMatrix* xis, sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,
+		RealMatrix* coeffs) throw(ValueException);
+
+/// Interpolates values for elements in blocks of elements for applyBasisTable(), each item is an element
+template<typename T>
+class BasisTableTask : public ParallelTask
+{
+public:
+	const RealMatrix* coeffs;
+	const Matrix<T>* vals;
+	const IndexMatrix* inds;
+	Matrix<T>* out;
+
+	BasisTableTask(const RealMatrix* coeffs, const Matrix<T>* vals, const IndexMatrix* inds, Matrix<T>* out) :
+		coeffs(coeffs), vals(vals), inds(inds), out(out)
+	{}
+
+	virtual void run(sval start, sval end, sval threadIndex)
+	{
+		sval numcoeffs=coeffs->m(), numsamples=coeffs->n(), numcols=vals->m(), numvals=vals->n();
+		const real* table=coeffs->dataPtr();
+		const T* src=vals->dataPtr();
+		T* dest=out->dataPtr();
+		std::vector<const T*> elemrows(numcoeffs); // the value row for each node of the current element
+
+		for(sval e=start;e<end;e++){
+			for(sval c=0;c<numcoeffs;c++){
+				indexval ind=inds->at(e,c);
+				if(ind>=numvals)
+					throw IndexException("inds",ind,numvals);
+
+				elemrows[c]=src+size_t(ind)*numcols;
+			}
+
+			for(sval s=0;s<numsamples;s++){
+				const real* sc=table+size_t(s)*numcoeffs;
+				T* d=dest+(size_t(e)*numsamples+s)*numcols;
+
+				for(sval col=0;col<numcols;col++){
+					T sum=T();
+					for(sval c=0;c<numcoeffs;c++)
+						sum=sum+elemrows[c][col]*sc[c];
+					d[col]=sum;
+				}
+			}
+		}
+	}
+};
+
+/// Number of elements above which applyBasisTable() uses every processor by default
+static const sval ParallelBasisThreshold=1024;
+
+/**
+ * Interpolate the per-node values `vals' at every sample of the basis table `coeffs' for every element in `inds', which is
+ * the product of the table with each element's gathered values. The table has a row per sample with a column per element 
+ * node as produced by fillBasisTable(), `inds' must have as many columns. The result for sample `s' of element `e' is stored
+ * in row e*coeffs->n()+s of `out', which is resized to hold every sample and must have as many columns as `vals'. The elements
+ * are divided between `numThreads' threads, 0 for one thread per processor with enough elements.
+ */
+template<typename T>
+void applyBasisTable(const RealMatrix* coeffs, const Matrix<T>* vals, const IndexMatrix* inds, Matrix<T>* out, sval numThreads=0) 
+		throw(IndexException,ValueException,MemException)
+{
+	if(!coeffs || !vals || !inds || !out)
+		throw ValueException("coeffs","Input and output matrices must not be NULL");
+
+	if(coeffs->m()!=inds->m())
+		throw ValueException("inds","Index matrix must have a column for each basis coefficient");
+
+	if(out->m()!=vals->m())
+		throw ValueException("out","Output matrix must have as many columns as the value matrix");
+
+	out->setN(inds->n()*coeffs->n());
+
+	if(numThreads==0)
+		numThreads=inds->n()>=ParallelBasisThreshold ? getProcessorCount() : 1;
+
+	BasisTableTask<T> task(coeffs,vals,inds,out);
+	runParallelTask(&task,inds->n(),numThreads);
+}
 
 /// Produces the 4 coefficients for a Catmull-Rom spline in [value 1, value 2, derivative 1, derivative 2] orderings in `coeffs'.
 void catmullRomSpline(real t, real* coeffs);
@@ -4446,124 +5952,337 @@ void cubicInterpMatrices(real t,const Matrix<T>* v1,const Matrix<T>* v2,const Ma
 		}
 }
 
-/// Returns the bounding box (minx,miny,maxx,maxy) in matrix coordinates containing all values in `mat' greater than `threshold'.
-template<typename T>
-quadruple<int,int,int,int> calculateBoundSquare(const Matrix<T>* const mat,const T& threshold)
+/// Number of matrix values at or above which reduceMatrix() divides the rows between threads by default
+static const sval ParallelReduceThreshold=65536;
+
+/**
+ * Implements the threaded part of reduceMatrix(). Each item is a block of consecutive rows which is reduced into its own
+ * partial result, these are kept separate so that merging them in block order doesn't depend on thread scheduling.
+ */
+template<typename T, typename R>
+class MatrixReduceTask : public ParallelTask
 {
-	int minx=-1,maxx=-1,miny=-1,maxy=-1;
+public:
+	const Matrix<T>* mat;
+	const R& reducer;
+	sval rowsPerBlock;
+	std::vector<typename R::Result> partials;
 
-	sval rows=mat->n();
-	sval cols=mat->m();
+	MatrixReduceTask(const Matrix<T>* mat, const R& reducer, sval numBlocks) : 
+		mat(mat), reducer(reducer), rowsPerBlock((mat->n()+numBlocks-1)/numBlocks), partials(numBlocks,reducer.initial())
+	{}
 
-	for(sval i=0;i<rows && miny<0;i++)
-		for(sval j=0;j<cols;j++)
-			if(mat->at(i,j)>threshold){
-				miny=int(i);
-				break;
-			}
+	virtual void run(sval start, sval end, sval)
+	{
+		sval rows=mat->n(), cols=mat->m();
 
-	for(sval i=rows;i>0 && maxy<0;i--)
-		for(sval j=0;j<cols;j++)
-			if(mat->at(i-1,j)>threshold){
-				maxy=int(i-1);
-				break;
-			}
+		for(sval b=start;b<end;b++)
+			for(sval i=b*rowsPerBlock,last=_min(rows,(b+1)*rowsPerBlock);i<last;i++)
+				reducer.reduceRow(partials[b],&mat->atc(i),i,cols);
+	}
+};
 
-	for(sval j=0;j<cols && minx<0;j++)
-		for(sval i=0;i<rows;i++)
-			if(mat->at(i,j)>threshold){
-				minx=int(j);
-				break;
-			}
+/**
+ * Reduce the values of `mat' to a single result using `reducer'. The rows are divided into one block per thread, using
+ * `numThreads' threads or if this is 0 one thread per processor when `mat' has at least ParallelReduceThreshold values
+ * and one thread otherwise. Each block is reduced into a partial result and the partials are merged in row order at the
+ * end, so for a given number of threads the result is deterministic. The reducer type R must define the following:
+ *
+ *   typedef ... Result;                                                 // type of partial and final results
+ *   Result initial() const;                                             // returns an empty partial result
+ *   void reduceRow(Result& r, const T* row, sval n, sval cols) const;   // accumulates the values of row `n' into `r'
+ *   void merge(Result& r, const Result& next) const;                    // merges the partial for later rows `next' into `r'
+ *
+ * Rows are passed as contiguous arrays so that reduceRow() can be written as a plain loop which the compiler will vectorize.
+ * The reducer is shared between threads so these methods must not modify it.
+ */
+template<typename T, typename R>
+typename R::Result reduceMatrix(const Matrix<T>* mat, const R& reducer, sval numThreads=0)
+{
+	sval rows=mat->n(), cols=mat->m();
+	typename R::Result result=reducer.initial();
+
+	if(rows==0 || cols==0)
+		return result;
 
-	for(sval j=cols;j>0 && maxx<0;j--)
+	if(numThreads==0)
+		numThreads=rows*cols>=ParallelReduceThreshold ? getProcessorCount() : 1;
+
+	if(numThreads==1){
 		for(sval i=0;i<rows;i++)
-			if(mat->at(i,j-1)>threshold){
-				maxx=int(j-1);
-				break;
-			}
+			reducer.reduceRow(result,&mat->atc(i),i,cols);
+	}
+	else{
+		sval numBlocks=_min(rows,numThreads);
+		MatrixReduceTask<T,R> task(mat,reducer,numBlocks);
+		runParallelTask(&task,numBlocks,numThreads,1);
+
+		for(sval b=0;b<numBlocks;b++)
+			reducer.merge(result,task.partials[b]);
+	}
 
-	return quadruple<int,int,int,int>(minx,miny,maxx,maxy);
+	return result;
 }
 
+/// Reducer for minmaxMatrix(), partials are seeded with the first matrix value so that an empty block doesn't affect the result
 template<typename T>
-sval countValuesInRange(const Matrix<T> *mat, const T& minv, const T& maxv)
+struct MinMaxReducer
 {
-	sval count=0, rows=mat->n(), cols=mat->m();
+	typedef std::pair<T,T> Result;
+	T seed;
 
-	for(sval i=0;i<rows;i++)
+	MinMaxReducer(const T& seed) : seed(seed) {}
+
+	Result initial() const { return Result(seed,seed); }
+
+	void reduceRow(Result& r, const T* row, sval n, sval cols) const
+	{
+		T minv=r.first, maxv=r.second;
 		for(sval j=0;j<cols;j++){
-			sval val=mat->at(i,j);
-			if(val>=minv && val<=maxv)
-				count++;
+			minv=row[j]<minv ? row[j] : minv;
+			maxv=row[j]>maxv ? row[j] : maxv;
 		}
+		r.first=minv;
+		r.second=maxv;
+	}
 
-	return count;
-}
+	void merge(Result& r, const Result& next) const
+	{
+		r.first=next.first<r.first ? next.first : r.first;
+		r.second=next.second>r.second ? next.second : r.second;
+	}
+};
 
+/// Reducer for sumMatrix(), each row is summed separately before being added to the partial result
 template<typename T>
-std::vector<vec3> findBoundaryPoints(const Matrix<T>* mat, const T& threshold)
+struct SumReducer
 {
-	std::vector<vec3> result;
-	
-	sval rows=mat->n();
-	sval cols=mat->m();
-	
-	for(sval i=0;i<rows;i++)
+	typedef T Result;
+
+	Result initial() const { return T(); }
+
+	void reduceRow(Result& r, const T* row, sval n, sval cols) const
+	{
+		T sum=T();
+		for(sval j=0;j<cols;j++)
+			sum+=row[j];
+		r+=sum;
+	}
+
+	void merge(Result& r, const Result& next) const { r+=next; }
+};
+
+/// Reducer for countValuesInRange(), counts values in the inclusive range [minv,maxv]
+template<typename T>
+struct RangeCountReducer
+{
+	typedef sval Result;
+	T minv, maxv;
+
+	RangeCountReducer(const T& minv, const T& maxv) : minv(minv), maxv(maxv) {}
+
+	Result initial() const { return 0; }
+
+	void reduceRow(Result& r, const T* row, sval n, sval cols) const
+	{
+		sval count=0;
+		for(sval j=0;j<cols;j++)
+			count+=(row[j]>=minv && row[j]<=maxv) ? 1 : 0;
+		r+=count;
+	}
+
+	void merge(Result& r, const Result& next) const { r+=next; }
+};
+
+/// Reducer for calculateBoundSquare(), the result is (minx,miny,maxx,maxy) with -1 for each component if nothing was found
+template<typename T>
+struct BoundSquareReducer
+{
+	typedef quadruple<int,int,int,int> Result;
+	T threshold;
+
+	BoundSquareReducer(const T& threshold) : threshold(threshold) {}
+
+	Result initial() const { return Result(-1,-1,-1,-1); }
+
+	void reduceRow(Result& r, const T* row, sval n, sval cols) const
+	{
+		sval first=0, last=cols;
+
+		while(first<cols && !(row[first]>threshold))
+			first++;
+
+		if(first==cols)
+			return;
+
+		while(!(row[last-1]>threshold))
+			last--;
+
+		merge(r,Result(int(first),int(n),int(last-1),int(n)));
+	}
+
+	void merge(Result& r, const Result& next) const
+	{
+		if(next.first<0)
+			return;
+
+		if(r.first<0)
+			r=next;
+		else{
+			r.first=_min(r.first,next.first);
+			r.second=_min(r.second,next.second);
+			r.third=_max(r.third,next.third);
+			r.fourth=_max(r.fourth,next.fourth);
+		}
+	}
+};
+
+/// Reducer for findBoundaryPoints(), this needs `mat' to look at the neighbours of each value
+template<typename T>
+struct BoundaryPointsReducer
+{
+	typedef std::vector<vec3> Result;
+	const Matrix<T>* mat;
+	T threshold;
+
+	BoundaryPointsReducer(const Matrix<T>* mat, const T& threshold) : mat(mat), threshold(threshold) {}
+
+	Result initial() const { return Result(); }
+
+	void reduceRow(Result& r, const T* row, sval i, sval cols) const
+	{
+		sval rows=mat->n();
+
 		for(sval j=0;j<cols;j++){
-			T val=mat->atc(i,j);
-			if(val<threshold)
+			if(row[j]<threshold)
 				continue;
-			
+
 			bool allInternal=true;
 			for(sval n=_max<sval>(0,i-1);allInternal && n<_min(rows,i+1);n++)
 				for(sval m=_max<sval>(0,j-1);allInternal && m<_min(cols,j+1);m++)
 					if(n!=i || m!=j)
-						allInternal=allInternal && mat->getAt(n,m)>=threshold;
-				
+						allInternal=allInternal && mat->atc(n,m)>=threshold;
+
 			if(!allInternal)
-				result.push_back(vec3(i,j,0));
+				r.push_back(vec3(i,j,0));
 		}
-		
-	return result;
+	}
+
+	void merge(Result& r, const Result& next) const { r.insert(r.end(),next.begin(),next.end()); }
+};
+
+/// Returns the bounding box (minx,miny,maxx,maxy) in matrix coordinates containing all values in `mat' greater than `threshold'.
+template<typename T>
+quadruple<int,int,int,int> calculateBoundSquare(const Matrix<T>* const mat,const T& threshold)
+{
+	return reduceMatrix(mat,BoundSquareReducer<T>(threshold));
 }
 
 template<typename T>
-T sumMatrix(const Matrix<T> *mat)
+sval countValuesInRange(const Matrix<T> *mat, const T& minv, const T& maxv)
 {
-	T result=T();
-	sval rows=mat->n();
-	sval cols=mat->m();
-	
-	for(sval i=0;i<rows;i++)
-		for(sval j=0;j<cols;j++)
-			result+=mat->atc(i,j);
+	return reduceMatrix(mat,RangeCountReducer<T>(minv,maxv));
+}
 
-	return result;
+template<typename T>
+std::vector<vec3> findBoundaryPoints(const Matrix<T>* mat, const T& threshold)
+{
+	return reduceMatrix(mat,BoundaryPointsReducer<T>(mat,threshold));
+}
+
+template<typename T>
+T sumMatrix(const Matrix<T> *mat)
+{
+	return reduceMatrix(mat,SumReducer<T>());
 }
 
 template<typename T>
 std::pair<T,T> minmaxMatrix(const Matrix<T>* mat) throw(ValueException)
 {
-	sval rows=mat->n();
-	sval cols=mat->m();
-	
-	if(rows==0)
+	if(mat->n()==0)
 		throw ValueException("mat","Matrix must be non-empty");
 
-	std::pair<T,T> result(mat->atc(0,0),mat->atc(0,0));
+	return reduceMatrix(mat,MinMaxReducer<T>(mat->atc(0,0)));
+}
 
-	for(sval i=0;i<rows;i++)
-		for(sval j=0;j<cols;j++){
-			T val=mat->atc(i,j);
-			if(val<result.first)
-				result.first=val;
-			else if(val>result.second)
-				result.second=val;
-		}
+/// Operations recorded by RealMatrixExpr, the M suffixed forms take a matrix operand and the rest scalars or no operand
+enum ExprOpType { EO_ADD, EO_SUB, EO_MUL, EO_DIV, EO_MIN, EO_MAX, EO_MULADD, EO_CLAMP, 
+	EO_ADDM, EO_SUBM, EO_MULM, EO_DIVM, EO_MINM, EO_MAXM, EO_ABS, EO_NEG, EO_SQRT };
 
-	return result;
-}
+/**
+ * Records a chain of elementwise operations starting with the values of a source matrix which are evaluated together in
+ * one pass into a destination matrix with eval(). Each operation applies to the result of the previous ones, so for
+ * example RealMatrixExpr(mat).sub(minv).div(maxv-minv).clamp(0,1).eval(out) normalizes and clamps `mat' into `out'
+ * reading and writing each value once. Operand matrices must have the same dimensions as the source and are read only
+ * when evaluating, so they and the source must remain valid until then and may be the destination matrix itself.
+ */
+class RealMatrixExpr
+{
+protected:
+	/// A recorded operation with its scalar operands `a' and `b' or matrix operand `mat'
+	struct ExprOp
+	{
+		ExprOpType type;
+		real a, b;
+		const RealMatrix* mat;
+
+		ExprOp(ExprOpType type, real a=0, real b=0, const RealMatrix* mat=NULL) : type(type), a(a), b(b), mat(mat) {}
+	};
+
+	const RealMatrix* src;
+	std::vector<ExprOp> ops;
+
+	RealMatrixExpr& matop(ExprOpType type, const RealMatrix* mat) throw(ValueException);
+
+public:
+	/// Number of values evaluated at a time by each thread, small enough that a block remains in cache through every operation
+	static const sval BlockSize=1024;
+
+	RealMatrixExpr(const RealMatrix* src) throw(ValueException);
+
+	const RealMatrix* getSource() const { return src; }
+
+	/// Returns the number of operations recorded so far
+	sval numOps() const { return ops.size(); }
+
+	RealMatrixExpr& add(real v) { ops.push_back(ExprOp(EO_ADD,v)); return *this; }
+	RealMatrixExpr& sub(real v) { ops.push_back(ExprOp(EO_SUB,v)); return *this; }
+	RealMatrixExpr& mul(real v) { ops.push_back(ExprOp(EO_MUL,v)); return *this; }
+	RealMatrixExpr& div(real v) { ops.push_back(ExprOp(EO_DIV,v)); return *this; }
+
+	/// Replace each value with the lesser of itself and `v'
+	RealMatrixExpr& minval(real v) { ops.push_back(ExprOp(EO_MIN,v)); return *this; }
+	/// Replace each value with the greater of itself and `v'
+	RealMatrixExpr& maxval(real v) { ops.push_back(ExprOp(EO_MAX,v)); return *this; }
+	/// Replace each value `x' with x*a+b
+	RealMatrixExpr& muladd(real a, real b) { ops.push_back(ExprOp(EO_MULADD,a,b)); return *this; }
+	/// Clamp each value to the range [minv,maxv]
+	RealMatrixExpr& clamp(real minv, real maxv) { ops.push_back(ExprOp(EO_CLAMP,minv,maxv)); return *this; }
+
+	RealMatrixExpr& addm(const RealMatrix* mat) throw(ValueException) { return matop(EO_ADDM,mat); }
+	RealMatrixExpr& subm(const RealMatrix* mat) throw(ValueException) { return matop(EO_SUBM,mat); }
+	RealMatrixExpr& mulm(const RealMatrix* mat) throw(ValueException) { return matop(EO_MULM,mat); }
+	RealMatrixExpr& divm(const RealMatrix* mat) throw(ValueException) { return matop(EO_DIVM,mat); }
+	RealMatrixExpr& minvalm(const RealMatrix* mat) throw(ValueException) { return matop(EO_MINM,mat); }
+	RealMatrixExpr& maxvalm(const RealMatrix* mat) throw(ValueException) { return matop(EO_MAXM,mat); }
+
+	RealMatrixExpr& abs() { ops.push_back(ExprOp(EO_ABS)); return *this; }
+	RealMatrixExpr& neg() { ops.push_back(ExprOp(EO_NEG)); return *this; }
+	RealMatrixExpr& sqrt() { ops.push_back(ExprOp(EO_SQRT)); return *this; }
+
+	/// Remove all recorded operations
+	void clear() { ops.clear(); }
+
+	/**
+	 * Evaluate the expression for every value and store the results in `dest', which must have the same dimensions as the
+	 * source. Blocks of BlockSize values are divided between `numThreads' threads, or if this is 0 one thread per processor
+	 * when the matrix has at least ParallelReduceThreshold values and one thread otherwise.
+	 */
+	void eval(RealMatrix* dest, sval numThreads=0) const throw(ValueException);
+
+	/// Evaluate the operations for the `count' values starting at index `start' in the source, storing the results in `buff'
+	void evalBlock(sval start, sval count, real* buff) const;
+};
 
 template<typename T>
 T bilerpMatrix(const Matrix<T> *mat,real x, real y) throw(ValueException)
@@ -4619,16 +6338,56 @@ inline vec3 getPlaneXi(const vec3& pos, const vec3& planepos, const rotator& ori
 
 /**
  * Interpolate the data from the image volume defined by `stack' into the image `out'. The volume `stack' must be defined in a bottom-up ordering. The transform
- * `stacktransinv' represents the inverse transform for the image stack, and `outtrans' is the transform for the image `out'.
+ * `stacktransinv' represents the inverse transform for the image stack, and `outtrans' is the transform for the image `out'. Values are trilinearly 
+ * interpolated unless `nearest' is true in which case the nearest voxel's value is used. This is defined for the RealMatrix, FloatMatrix, 
+ * UShortMatrix, and ShortMatrix types, values are rounded to the nearest integer for the latter two.
+ */
+template<typename T>
+void interpolateImageStack(const std::vector<Matrix<T>*>& stack,const transform& stacktransinv,Matrix<T> *out,const transform& outtrans,bool nearest=false);
+
+/**
+ * Interpolate the data from the image volume `stack' into the volume `out', both being bottom-up orderings of `timesteps' consecutive volumes of 
+ * equal depth, so that each output volume is sampled from the input volume at the same timestep. Each output volume spans the unit cube in the 
+ * space of `outtrans' with its first image at z=0 and its last at z=1, and its images must have the same number of rows. The "min" and "max" 
+ * metadata values of each output image are set as interpolateImageStack() does. The work is split between threads.
  */
-void interpolateImageStack(const std::vector<RealMatrix*>& stack,const transform& stacktransinv,RealMatrix *out,const transform& outtrans);
+template<typename T>
+void interpolateImageVolume(const std::vector<Matrix<T>*>& stack,const transform& stacktransinv,const std::vector<Matrix<T>*>& out,
+		const transform& outtrans, sval timesteps=1, bool nearest=false) throw(ValueException);
 
 /**
  * Sample the value of the image stack at the image coordinate `pt', which must be in the unit cube otherwise 0 is returned.
  */
-real getImageStackValue(const std::vector<RealMatrix*>& stack,const vec3& pos);
+template<typename T>
+real getImageStackValue(const std::vector<Matrix<T>*>& stack,const vec3& pos);
 
-void calculateImageHistogram(const RealMatrix* img, RealMatrix* hist, i32 minv); 
+/// Count the values of `img' into `hist' whose rows are for the values minv, minv+1, etc., defined for the same image types as interpolateImageStack()
+template<typename T>
+void calculateImageHistogram(const Matrix<T>* img, RealMatrix* hist, i32 minv); 
+
+/**
+ * Stable least-significant-digit radix sort of the indices 0 to n-1 by the 16-bit values in `keys', using two passes of 8
+ * bits each. The sorted permutation is stored in `order', `temp' is working storage of the same length.
+ */
+void radixSortKeys16(const u16* keys, u32* order, u32* temp, size_t n);
+
+/**
+ * Sort the `numtris' triangles indexed by `inds' back-to-front from the camera position `campos' into `outinds', which must
+ * be `numtris'*3 in length. The triangles' centroids are given as triples of floats in `cents'. The distances are quantized
+ * into 16-bit keys so that the farthest triangles have the lowest keys and are ordered with radixSortKeys16(), the vectors
+ * `dists', `keys', `order', and `temp' are working storage which is resized as needed so it can be reused between calls.
+ */
+void depthSortTriangles(const float* cents, const indexval* inds, size_t numtris, const vec3& campos, indexval* outinds,
+		std::vector<float>& dists, std::vector<u16>& keys, std::vector<u32>& order, std::vector<u32>& temp);
+
+/**
+ * Convert the `width' values of `vals' into RGBA colors stored as 4 floats each in `cols', as done for texture fills. Each value
+ * is scaled to the unit interval between `minval' and `maxval' and then looked up in `lut' using `spec' if this isn't NULL, the
+ * unit value is otherwise used as an opaque grey. If `alphas' isn't NULL its `width' values replace the alpha components. If
+ * `mulAlpha' is true the alpha components are multiplied by the unit values.
+ */
+void valuesToColors(float* cols, const real* vals, sval width, real minval, real maxval, const Spectrum* spec,
+		const std::vector<color>& lut, const real* alphas=NULL, bool mulAlpha=false);
 
 /** 
  * Calculate the normals for triangles defined by the `nodes' array and indices `inds'. This requires that `nodes' be 
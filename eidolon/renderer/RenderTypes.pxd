@@ -28,6 +28,8 @@ from libcpp.pair cimport pair
 
 cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
     ctypedef unsigned char u8
+    ctypedef unsigned short u16
+    ctypedef short i16
     ctypedef long i32
     ctypedef long long i64
     ctypedef unsigned long u32
@@ -117,6 +119,16 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         V_BOTTOM
         V_CENTER
 
+    cdef enum StreamType:
+        ST_UBYTE
+        ST_BYTE
+        ST_USHORT
+        ST_SHORT
+        ST_UINT
+        ST_INT
+        ST_FLOAT
+        ST_DOUBLE
+
 
     T _min[T](const T& a, const T& b)
     T _max[T](const T& a, const T& b)
@@ -125,8 +137,11 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
     void initSharedDir(const string& path)
     string getSharedDir()
     void unlinkShared(const string& name)
+    sval getProcessorCount()
 
     cdef cppclass Ray
+    cdef cppclass TriMeshBVH
+    cdef cppclass SharedArena
 
     cdef cppclass color:
         color()
@@ -325,9 +340,28 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         real* getPointer() const
         
         
+    cdef cppclass MatrixContainerInfo:
+        string elemtag
+        string name
+        string type
+        string meta
+        size_t elemsize
+        sval n
+        sval m
+        sval chunkRows
+        bint compressed
+        bint swapEndian
+
+        sval numChunks() const
+
+    MatrixContainerInfo readContainerFileInfo(const char* filename) except +
+
     cdef cppclass Matrix[T]:
         Matrix(const char* name,const char* type,sval n, sval m,bint isShared) except +MemoryError
         Matrix(const char* name,const char* type,const char* sharedname,const char* serialmeta,sval n, sval m) except +MemoryError
+        Matrix(const char* name,const char* type,const char* filename,size_t offset,sval n, sval m,bint copyOnWrite) except +MemoryError
+        Matrix(const char* name,const char* type,sval n, sval m,SharedArena* arena,size_t offset) except +MemoryError
+        Matrix(const char* name,const char* type,sval n, sval m,SharedArena* arena) except +MemoryError
 
         T* dataPtr() const
 
@@ -349,30 +383,39 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void setType(const char* type)
 
         bint isShared() const
+        bint isFileMapped() const
+        bint isCopyOnWrite() const
+        bint isReadOnly() const
+        void checkWritable() except +MemoryError const
+        const char* getFileName() const
+        size_t getFileOffset() const
+        bint isArenaAllocated() const
+        SharedArena* getArena() const
+        size_t getArenaOffset() const
         void setShared(bint val) except +MemoryError
         void clear() except +MemoryError
         sval n() const
         sval m() const
         sval memSize() const
-        void fill(const T& t)
+        void fill(const T& t) except +MemoryError
 
-        void copyFrom[R](const Matrix[R]* r)
+        void copyFrom[R](const Matrix[R]* r) except +MemoryError
 
         Matrix[T]* subMatrix(const char* name,sval n, sval m,sval noff,sval moff,bint isShared) except +MemoryError const
         Matrix[T]* reshape(const char* name,sval n, sval m,bint isShared) except +MemoryError const
 
-        void add[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void sub[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void mul[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void div[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol)
+        void add[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void sub[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void mul[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void div[R](const R& t,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
 
-        void addm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void subm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void mulm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol)
-        void divm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol)
+        void addm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void subm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void mulm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
+        void divm[R](const Matrix[R]& v,sval minrow,sval mincol,sval maxrow,sval maxcol) except +MemoryError
 
 #       void reorderColumns(const sval *orderinds) except +IndexError # unused? dangerous anyway
-        void swapEndian()
+        void swapEndian() except +MemoryError
 
         T& at(sval n, sval m) const
         const T& atc(sval n, sval m) const
@@ -394,6 +437,8 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void readBinaryFile(const char* filename,size_t offset) except +MemoryError
         void readTextFile(const char* filename,sval numHeaders) except +MemoryError
         void storeBinaryFile(const char* filename, int* header, sval headerlen) except +MemoryError
+        void storeContainerFile(const char* filename, sval chunkRows, bint compressed, sval numThreads) except +
+        void readContainerFile(const char* filename, sval startRow, sval numRows, sval numThreads) except +
         indexpair indexOf(const T& t,sval aftern,sval afterm) const
 
 
@@ -401,8 +446,47 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
     ctypedef Matrix[real] RealMatrix
     ctypedef Matrix[indexval] IndexMatrix
     ctypedef Matrix[color] ColorMatrix
+    ctypedef Matrix[float] FloatMatrix
+    ctypedef Matrix[u16] UShortMatrix
+    ctypedef Matrix[i16] ShortMatrix
+
+    cdef struct PackedVertex:
+        float pos[3]
+        float norm[3]
+        rgba col
+        float tex[3]
+
+    ctypedef Matrix[PackedVertex] PackedVertexMatrix
+
+    void packVertices(const Vec3Matrix* vecs, const ColorMatrix* cols, PackedVertexMatrix* verts, sval start) except +ValueError
 
 
+    cdef cppclass SharedArena:
+        @staticmethod
+        SharedArena* create(const char* name, size_t capacity) except +MemoryError
+        @staticmethod
+        SharedArena* attach(const char* sharedname, size_t capacity) except +MemoryError
+
+        const char* getName() const
+        const char* getSharedName() const
+        size_t getCapacity() const
+        size_t getUsed() const
+        sval numAllocated() const
+        bint isCreator() const
+        sval numAttached() const
+        bint canAllocate(size_t size) const
+        size_t allocate(size_t size) except +MemoryError
+        void release()
+        void reset() except +MemoryError
+        void incRef()
+        void decRef()
+
+    cdef cppclass SharedArenaPool:
+        SharedArenaPool(const char* name, size_t arenaSize)
+        sval numArenas() const
+        SharedArena* getArena(sval i) except +IndexError const
+        SharedArena* allocate(size_t size, size_t* offset) except +MemoryError
+
     cdef cppclass Ray:
         Ray()
         Ray(const Ray& r)
@@ -427,6 +511,51 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         realtriple intersectsTri(const vec3& v0, const vec3& v1, const vec3& v2)
 
         vector[indextriple] intersectsTriMesh(const Vec3Matrix* nodes, const IndexMatrix* inds,const Vec3Matrix* centers, const RealMatrix* radii2, sval numResults,sval excludeInd) except +IndexError const
+        vector[indextriple] intersectsTriMesh(const TriMeshBVH* bvh, sval numResults,sval excludeInd) except +IndexError const
+
+
+    cdef cppclass TriMeshBVH:
+        TriMeshBVH(const Vec3Matrix* nodes, const IndexMatrix* inds, Vec3Matrix* bounds, IndexMatrix* nodeinfo, IndexMatrix* triorder) except +ValueError
+
+        sval numTreeNodes() const
+        bint isBuilt() const
+        void build(sval leafSize) except +
+
+    cdef cppclass ElemMeshBVH:
+        ElemMeshBVH(const Vec3Matrix* nodes, const IndexMatrix* inds, Vec3Matrix* bounds, IndexMatrix* nodeinfo, IndexMatrix* elemorder) except +ValueError
+
+        sval numTreeNodes() const
+        bint isBuilt() const
+        void build(sval leafSize) except +
+        sval locate(const vec3& pt, vec3& xi, sval hint) except +IndexError const
+
+    cdef cppclass RealMatrixExpr:
+        RealMatrixExpr(const RealMatrix* src) except +ValueError
+
+        sval numOps() const
+
+        RealMatrixExpr& add(real v)
+        RealMatrixExpr& sub(real v)
+        RealMatrixExpr& mul(real v)
+        RealMatrixExpr& div(real v)
+        RealMatrixExpr& minval(real v)
+        RealMatrixExpr& maxval(real v)
+        RealMatrixExpr& muladd(real a, real b)
+        RealMatrixExpr& clamp(real minv, real maxv)
+
+        RealMatrixExpr& addm(const RealMatrix* mat) except +ValueError
+        RealMatrixExpr& subm(const RealMatrix* mat) except +ValueError
+        RealMatrixExpr& mulm(const RealMatrix* mat) except +ValueError
+        RealMatrixExpr& divm(const RealMatrix* mat) except +ValueError
+        RealMatrixExpr& minvalm(const RealMatrix* mat) except +ValueError
+        RealMatrixExpr& maxvalm(const RealMatrix* mat) except +ValueError
+
+        RealMatrixExpr& abs()
+        RealMatrixExpr& neg()
+        RealMatrixExpr& sqrt()
+
+        void clear()
+        void eval(RealMatrix* dest, sval numThreads) except +ValueError
 
 
     cdef cppclass Config:
@@ -491,6 +620,7 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         sval numSpectrumValues() const
         indexval getSpectrumIndex(real pos,color value) const
         color interpolateColor(real pos) const
+        color lookupColor(real pos) const
         void removeSpectrumValue(int index) except +IndexError
         real getSpectrumPos(int index) except +IndexError const
         color getSpectrumValue(int index) except +IndexError const
@@ -506,6 +636,7 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         bint isLinearAlpha() const
 
         void fillColorMatrix(ColorMatrix *col,const RealMatrix *mat,bint useValAsAlpha) except +IndexError
+        void interpolateColors(const RealMatrix *mat,ColorMatrix *col,bint useValAsAlpha) except +IndexError const
         
 
     cdef cppclass Material(Spectrum):
@@ -651,6 +782,12 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void renderToFile(const string& filename,sval width,sval height, TextureFormat format,real stereoOffset) except+
         void renderToStream(void* stream,sval width,sval height, TextureFormat format,real stereoOffset) except+
         Image* renderToImage(sval width,sval height, TextureFormat format,real stereoOffset) except+
+
+        void beginCapture(const string& fileprefix,const string& extension,sval width,sval height,TextureFormat format,real stereoOffset,sval queueSize) except+
+        void captureFrame() except+
+        void capturePoses(const Vec3Matrix* positions,const Vec3Matrix* lookats) except+
+        sval endCapture() except+
+        bint isCapturing() const
         
 
     cdef cppclass Figure:
@@ -667,6 +804,17 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         pair[vec3,vec3] getAABB() const
 
         void fillData(const VertexBuffer* vb, const IndexBuffer* ib,bint deferFill,bint doubleSided) except+
+        void fillPackedData(const PackedVertexMatrix* verts, const IndexMatrix* inds,bint deferFill) except+
+        void setPackedNormals(bint val)
+        bint isPackedNormals() const
+        void setChunking(sval trisPerChunk, sval numLevels)
+        sval getChunkSize() const
+        sval getChunkLevels() const
+        void addKeyframe(const Vec3Matrix* nodes,const RealMatrix* field,real minval,real maxval) except+
+        void clearKeyframes()
+        sval numKeyframes() const
+        void setKeyframeTime(real t,bint cubic)
+        real getKeyframeTime() const
         void setVisible(bint isVisible)
         bint isVisible() const
 
@@ -699,6 +847,9 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
 
         int numBillboards()
 
+        void setPointCloud(bool val)
+        bool isPointCloud() const
+
         void setBillboardPos(indexval index, const vec3& pos) except +IndexError
         void setBillboardDir(indexval index, const vec3& dir) except +IndexError
         void setBillboardColor(indexval index, const color& col) except +IndexError
@@ -751,6 +902,9 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void setGlyphName(const string& name)
         string getGlyphName() const
 
+        void setInstanced(bool val)
+        bool isInstanced() const
+
         void addGlyphMesh(const string& name,const Vec3Matrix* nodes,const Vec3Matrix* norms, const IndexMatrix* inds)
         
         
@@ -790,6 +944,9 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void fillColor(color col)
         void fillColor(const ColorMatrix *mat,indexval depth)
         void fillColor(const RealMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bint mulAlpha)
+        void fillColor(const FloatMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bint mulAlpha)
+        void fillColor(const UShortMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bint mulAlpha)
+        void fillColor(const ShortMatrix *mat,indexval depth,real minval,real maxval, const Material* colormat,const RealMatrix *alphamat,bint mulAlpha)
 
 
     cdef cppclass GPUProgram:
@@ -810,6 +967,30 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void setProfiles(const string& profiles)
 
 
+    cdef struct FrameStats:
+        u64 frame
+        real frameTime
+        real opsTime
+        real updateTime
+        real sortTime
+        real commitTime
+        real textureTime
+        sval numOps
+        sval pendingOps
+        sval numUpdates
+        sval numSorts
+        sval numUploads
+        u64 uploadBytes
+
+    cdef cppclass FrameProfiler:
+        bint isEnabled() const
+        void setEnabled(bint val)
+        void setCapacity(sval cap)
+        sval getCapacity() const
+        void clear()
+        sval numFrames() const
+        FrameStats getFrame(sval i) except +IndexError const
+
     cdef cppclass RenderScene:
 
         Camera* createCamera(const char* name,real left,real top,real width,real height) except+
@@ -836,6 +1017,10 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
         void setAlwaysHighQuality(bint val)
         bint getAlwaysHighQuality() const
 
+        FrameProfiler* getProfiler()
+
+        void setResourceOpBudget(real seconds, size_t bytes)
+
 
     cdef cppclass RenderAdapter:
         u64 createWindow(int width, int height) except+
@@ -850,8 +1035,14 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
 
     void basis_Tet1NL(real xi0, real xi1, real xi2,real* coeffs)
     void basis_Hex1NL(real xi0, real xi1, real xi2, real* coeffs)
-    real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix* knots)
-    void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs)
+    real basis_n_NURBS(sval ctrlpt,sval degree, real xi,const RealMatrix* knots) except +
+    void basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree,real* coeffs) except +
+
+    ctypedef void (*BasisFunc)(real xi0, real xi1, real xi2, real* coeffs)
+    void fillBasisTable(BasisFunc func, sval numcoeffs, const RealMatrix* xis, RealMatrix* coeffs) except +
+    void fillBasisTable_NURBS_default(const RealMatrix* xis, sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree, RealMatrix* coeffs) except +
+    void applyBasisTable(const RealMatrix* coeffs, const Vec3Matrix* vals, const IndexMatrix* inds, Vec3Matrix* out, sval numThreads) except +
+    void applyBasisTable(const RealMatrix* coeffs, const RealMatrix* vals, const IndexMatrix* inds, RealMatrix* out, sval numThreads) except +
 
     bint pointInTet(vec3 pt, vec3 n1, vec3 n2, vec3 n3, vec3 n4)
     bint pointInHex(vec3 pt, vec3 n1, vec3 n2, vec3 n3, vec3 n4, vec3 n5, vec3 n6, vec3 n7, vec3 n8)
@@ -860,27 +1051,36 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
 
     float calculateTetVolume(vec3 a, vec3 b, vec3 c, vec3 d)
 
-    pair[vec3,vec3] calculateBoundBox(const Vec3Matrix* mat)
+    pair[vec3,vec3] calculateBoundBox(const Vec3Matrix* mat) except +
+
+    sval getStreamTypeSize(StreamType type) except +
+    void decodeStreamToRealMatrix(const char* stream, StreamType type, RealMatrix* mat, bint swapEndian, real slope, real intercept) except +
+    void decodeFileToRealMatrix(const char* filename, size_t offset, StreamType type, RealMatrix* mat, bint swapEndian, real slope, real intercept) except +
 
-    quadruple[int,int,int,int] calculateBoundSquare[T](const Matrix[T]* mat, const T& threshold)
+    void intersectsTriMeshRays(const TriMeshBVH* bvh, const Vec3Matrix* origins, const Vec3Matrix* dirs, RealMatrix* dists, IndexMatrix* triinds, const IndexMatrix* excludeInds, sval numThreads) except +
+    void locatePoints(const ElemMeshBVH* bvh, const Vec3Matrix* pts, IndexMatrix* elems, Vec3Matrix* xis, sval numThreads) except +
 
-    vector[vec3] findBoundaryPoints[T](const Matrix[T]* mat, T threshold)
+    quadruple[int,int,int,int] calculateBoundSquare[T](const Matrix[T]* mat, const T& threshold) except +
 
-    sval countValuesInRange(const RealMatrix* mat, real minv,real mavx)
+    vector[vec3] findBoundaryPoints[T](const Matrix[T]* mat, T threshold) except +
 
-    real sumMatrix(const RealMatrix* mat)
+    sval countValuesInRange(const RealMatrix* mat, real minv,real mavx) except +
+
+    real sumMatrix(const RealMatrix* mat) except +
 
     pair[T,T] minmaxMatrix[T](const Matrix[T]* mat) except+
 
-    real trilerpMatrices(const RealMatrix* mat1, const RealMatrix* mat2, vec3 v1, vec3 v2) except+
+    T trilerpMatrices[T](const Matrix[T]* mat1, const Matrix[T]* mat2, vec3 v1, vec3 v2) except+
 
     vec3 getPlaneXi(const vec3& pos, const vec3& planepos, const rotator& orientinv, const vec3& dimvec)
 
-    void interpolateImageStack(const vector[RealMatrix*]& stack,const transform& stacktransinv,RealMatrix *out,const transform& outtrans)
+    void interpolateImageStack[T](const vector[Matrix[T]*]& stack,const transform& stacktransinv,Matrix[T] *out,const transform& outtrans,bint nearest) except +
+
+    void interpolateImageVolume[T](const vector[Matrix[T]*]& stack,const transform& stacktransinv,const vector[Matrix[T]*]& out,const transform& outtrans, sval timesteps, bint nearest) except +
 
-    real getImageStackValue(const vector[RealMatrix*]& stack,const vec3& pos)
+    real getImageStackValue[T](const vector[Matrix[T]*]& stack,const vec3& pos)
 
-    void calculateImageHistogram(const RealMatrix* img, RealMatrix* hist, i32 minv)
+    void calculateImageHistogram[T](const Matrix[T]* img, RealMatrix* hist, i32 minv) except +
 
     realtriple calculateTriPlaneSlice(const vec3& planept, const vec3& planenorm, const vec3& a, const vec3& b, const vec3& c)
 
@@ -890,6 +1090,10 @@ cdef extern from "RenderTypes.h" namespace "RenderTypes" nogil:
 
     sval calculateHexValueIntersects(real val,real* vals,intersect* results)
 
+    void calculateIsosurface(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const vector[real]& isovals, Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges, RealMatrix* outlerps, IndexMatrix* outelems, bint doubleSided, sval numThreads) except +
+
+    void calculateIsoline(const Vec3Matrix* nodes, const IndexMatrix* inds, const RealMatrix* field, const vector[real]& isovals, Vec3Matrix* outnodes, IndexMatrix* outinds, IndexMatrix* outedges, RealMatrix* outlerps, IndexMatrix* outelems, sval numThreads) except +
+
 
 # use a separate extern definition without "nogil" for these types since they call into Cython/Python during which time the GIL must be held
 cdef extern from "RenderTypes.h" namespace "RenderTypes":
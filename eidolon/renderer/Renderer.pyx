@@ -21,6 +21,7 @@
 
 import cython
 from cpython cimport Py_buffer
+from cpython.buffer cimport PyBUF_WRITABLE
 from cython.operator cimport dereference as deref
 
 # import array library and Cython declarations
@@ -28,16 +29,20 @@ import array
 from cpython cimport array
 
 # C/C++ declarations
+from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp.pair cimport pair
 from libc.string cimport memcpy
 
 # import RenderTypes declarations, aliasing class types by prepending i to the names
 cimport RenderTypes
-from RenderTypes cimport FigureType,BlendMode,TextureFormat,ProgramType,VAlignType, HAlignType
-from RenderTypes cimport real,rgba,sval,indexval,i32, u64, realpair, realtriple,indexpair,indextriple,intersect
-from RenderTypes cimport vec3 as ivec3, color as icolor, rotator as irotator, transform as itransform, mat4 as imat4, Ray as iRay
+from RenderTypes cimport FigureType,BlendMode,TextureFormat,ProgramType,VAlignType, HAlignType, StreamType
+from RenderTypes cimport real,rgba,sval,indexval,i32, u64, u16, i16, realpair, realtriple,indexpair,indextriple,intersect
+from RenderTypes cimport vec3 as ivec3, color as icolor, rotator as irotator, transform as itransform, mat4 as imat4, Ray as iRay, TriMeshBVH as iTriMeshBVH, ElemMeshBVH as iElemMeshBVH
+from RenderTypes cimport RealMatrixExpr as iRealMatrixExpr, SharedArena as iSharedArena, SharedArenaPool as iSharedArenaPool
 from RenderTypes cimport Matrix as iMatrix, Vec3Matrix as iVec3Matrix, RealMatrix as iRealMatrix,IndexMatrix as iIndexMatrix, ColorMatrix as iColorMatrix
+from RenderTypes cimport FloatMatrix as iFloatMatrix, UShortMatrix as iUShortMatrix, ShortMatrix as iShortMatrix
+from RenderTypes cimport PackedVertex as iPackedVertex, PackedVertexMatrix as iPackedVertexMatrix
 from RenderTypes cimport Config as iConfig
 from RenderTypes cimport VertexBuffer as iVertexBuffer, IndexBuffer as iIndexBuffer, MatrixVertexBuffer as iMatrixVertexBuffer,MatrixIndexBuffer as iMatrixIndexBuffer
 from RenderTypes cimport CallbackVertexBuffer as iCallbackVertexBuffer, CallbackIndexBuffer as iCallbackIndexBuffer
@@ -88,6 +93,15 @@ V_TOP       = RenderTypes.V_TOP
 V_BOTTOM    = RenderTypes.V_BOTTOM
 V_CENTER    = RenderTypes.V_CENTER
 
+ST_UBYTE    = RenderTypes.ST_UBYTE
+ST_BYTE     = RenderTypes.ST_BYTE
+ST_USHORT   = RenderTypes.ST_USHORT
+ST_SHORT    = RenderTypes.ST_SHORT
+ST_UINT     = RenderTypes.ST_UINT
+ST_INT      = RenderTypes.ST_INT
+ST_FLOAT    = RenderTypes.ST_FLOAT
+ST_DOUBLE   = RenderTypes.ST_DOUBLE
+
 
 def equalsEpsilon(real v1, real v2):
     return RenderTypes.equalsEpsilon(v1,v2)
@@ -101,6 +115,9 @@ def getSharedDir():
 def unlinkShared(name):
     RenderTypes.unlinkShared(name)
 
+def getProcessorCount():
+    return RenderTypes.getProcessorCount()
+
 
 cdef class color:
     cdef icolor val
@@ -627,6 +644,17 @@ cdef class Ray:
 
         return result
 
+    def intersectsTriMeshBVH(self, TriMeshBVH bvh,sval numResults=0,sval excludeInd=-1):
+        cdef vector[indextriple] triples=self.val.intersectsTriMesh(bvh.val,numResults,excludeInd)
+        cdef indextriple rp
+        cdef list result=[]
+
+        for i in range(triples.size()):
+            rp=triples[i]
+            result.append((rp.first,rp.second.first,rp.second.second,rp.second.third))
+
+        return result
+
 
 cdef class transform:
     cdef itransform val
@@ -741,6 +769,80 @@ cdef class transform:
         return (m[0],m[1],m[2],m[3]),(m[4],m[5],m[6],m[7]),(m[8],m[9],m[10],m[11]),(m[12],m[13],m[14],m[15])
 
 
+cdef class SharedArena:
+    '''
+    A shared memory segment of `capacity' bytes which many shared matrices are allocated from, see the C++ SharedArena
+    type. Matrices are created in it with the arena*Matrix() functions and hold a reference to the segment, so it's only
+    removed once this object and every matrix allocated from it are gone. Pickled matrices refer to the arena by its shared
+    name and their offsets, so unpickling many matrices from one arena maps its segment only once. The first 64 bytes of
+    the segment count the matrices unpickled in other processes, so `capacity' must be larger than this.
+    '''
+    cdef iSharedArena* val
+
+    def __init__(self,str name,size_t capacity):
+        self.val=iSharedArena.create(name,capacity)
+
+    def __dealloc__(self):
+        if self.val!=NULL:
+            self.val.decRef()
+
+    def getName(self):
+        return self.val.getName()
+
+    def getSharedName(self):
+        return self.val.getSharedName()
+
+    def getCapacity(self):
+        return self.val.getCapacity()
+
+    def getUsed(self):
+        return self.val.getUsed()
+
+    def numAllocated(self):
+        return self.val.numAllocated()
+
+    def numAttached(self):
+        '''Returns the number of matrices unpickled from this arena in other processes which haven't been cleared yet.'''
+        return self.val.numAttached()
+
+    def canAllocate(self,size_t size):
+        return self.val.canAllocate(size)
+
+    def reset(self):
+        '''Free all allocations so the arena can be reused, this is only valid once every matrix in it has been cleared in every process.'''
+        self.val.reset()
+
+
+cdef class SharedArenaPool:
+    '''
+    A pool of SharedArena segments of at least `arenaSize' bytes, which can be passed to the arena*Matrix() functions in
+    place of an arena. Arenas whose matrices have all been cleared are reused, so per-timestep matrices which are cleared
+    before the next timestep's are allocated cycle through the same segments. Matrices unpickled in other processes keep
+    their arena from being reused until they are cleared, but the pickled matrix must be kept until it has been unpickled.
+    '''
+    cdef iSharedArenaPool* val
+
+    def __init__(self,str name,size_t arenaSize=64*1024*1024):
+        self.val=new iSharedArenaPool(name,arenaSize)
+
+    def __dealloc__(self):
+        del self.val
+
+    def numArenas(self):
+        return self.val.numArenas()
+
+
+cdef iSharedArena* _allocateFromArena(object arena,size_t size,size_t* offset) except NULL:
+    '''Allocate `size' bytes from a SharedArena or SharedArenaPool, storing the offset in `offset' and returning the arena.'''
+    cdef iSharedArena* result
+    if isinstance(arena,SharedArenaPool):
+        return (<SharedArenaPool>arena).val.allocate(size,offset)
+
+    result=(<SharedArena?>arena).val
+    offset[0]=result.allocate(size)
+    return result
+
+
 # used to get around a declaration bug
 _MemoryError=MemoryError
 _IndexError=IndexError
@@ -749,6 +851,309 @@ include "IndexMatrix.pyx"
 include "RealMatrix.pyx"
 include "Vec3Matrix.pyx"
 include "ColorMatrix.pyx"
+include "FloatMatrix.pyx"
+include "UShortMatrix.pyx"
+include "ShortMatrix.pyx"
+
+
+cdef class TriMeshBVH:
+    '''
+    Bounding volume hierarchy for the triangle mesh (nodes,inds) used with Ray.intersectsTriMeshBVH(). The hierarchy is stored
+    in the matrices `bounds', `nodeinfo', and `triorder' which are created and built here if not given. If `isShared' is
+    True these are moved to shared memory once built so that this object can be pickled along with shared mesh matrices.
+    '''
+    cdef iTriMeshBVH* val
+    cdef readonly Vec3Matrix nodes
+    cdef readonly IndexMatrix inds
+    cdef readonly Vec3Matrix bounds
+    cdef readonly IndexMatrix nodeinfo
+    cdef readonly IndexMatrix triorder
+
+    def __init__(self,Vec3Matrix nodes,IndexMatrix inds,sval leafSize=4,bint isShared=False,Vec3Matrix bounds=None,IndexMatrix nodeinfo=None,IndexMatrix triorder=None):
+        cdef bint doBuild=bounds is None or nodeinfo is None or triorder is None
+        cdef str name=inds.getName()
+
+        self.nodes=nodes
+        self.inds=inds
+        self.bounds=bounds if bounds is not None else Vec3Matrix(name+'_bvhbounds',1,2)
+        self.nodeinfo=nodeinfo if nodeinfo is not None else IndexMatrix(name+'_bvhnodeinfo',1,2)
+        self.triorder=triorder if triorder is not None else IndexMatrix(name+'_bvhtriorder',1)
+        self.val=new iTriMeshBVH(nodes.mat,inds.mat,self.bounds.mat,self.nodeinfo.mat,self.triorder.mat)
+
+        if doBuild:
+            self.checkWritable()
+            with nogil:
+                self.val.build(leafSize)
+
+            if isShared:
+                self.bounds.setShared(True)
+                self.nodeinfo.setShared(True)
+                self.triorder.setShared(True)
+
+    def __dealloc__(self):
+        del self.val
+
+    def __reduce__(self):
+        return TriMeshBVH,(self.nodes,self.inds,0,False,self.bounds,self.nodeinfo,self.triorder)
+
+    def numTreeNodes(self):
+        return self.val.numTreeNodes()
+
+    def isBuilt(self):
+        return self.val.isBuilt()
+
+    def build(self,sval leafSize=4):
+        self.checkWritable()
+        self.bounds.setShared(False)
+        self.nodeinfo.setShared(False)
+        self.triorder.setShared(False)
+        with nogil:
+            self.val.build(leafSize)
+
+    cdef checkWritable(self):
+        self.bounds.checkWritable()
+        self.nodeinfo.checkWritable()
+        self.triorder.checkWritable()
+
+
+cdef class ElemMeshBVH:
+    '''
+    Bounding volume hierarchy for the linear tet or hex mesh (nodes,inds) used to locate points in elements with locate() and
+    locatePoints(). The hierarchy is stored in the matrices `bounds', `nodeinfo', and `elemorder' which are created and built
+    here if not given, these are moved to shared memory once built if `isShared' is True as with TriMeshBVH.
+    '''
+    cdef iElemMeshBVH* val
+    cdef readonly Vec3Matrix nodes
+    cdef readonly IndexMatrix inds
+    cdef readonly Vec3Matrix bounds
+    cdef readonly IndexMatrix nodeinfo
+    cdef readonly IndexMatrix elemorder
+
+    def __init__(self,Vec3Matrix nodes,IndexMatrix inds,sval leafSize=4,bint isShared=False,Vec3Matrix bounds=None,IndexMatrix nodeinfo=None,IndexMatrix elemorder=None):
+        cdef bint doBuild=bounds is None or nodeinfo is None or elemorder is None
+        cdef str name=inds.getName()
+
+        self.nodes=nodes
+        self.inds=inds
+        self.bounds=bounds if bounds is not None else Vec3Matrix(name+'_bvhbounds',1,2)
+        self.nodeinfo=nodeinfo if nodeinfo is not None else IndexMatrix(name+'_bvhnodeinfo',1,2)
+        self.elemorder=elemorder if elemorder is not None else IndexMatrix(name+'_bvhelemorder',1)
+        self.val=new iElemMeshBVH(nodes.mat,inds.mat,self.bounds.mat,self.nodeinfo.mat,self.elemorder.mat)
+
+        if doBuild:
+            self.checkWritable()
+            with nogil:
+                self.val.build(leafSize)
+
+            if isShared:
+                self.bounds.setShared(True)
+                self.nodeinfo.setShared(True)
+                self.elemorder.setShared(True)
+
+    def __dealloc__(self):
+        del self.val
+
+    def __reduce__(self):
+        return ElemMeshBVH,(self.nodes,self.inds,0,False,self.bounds,self.nodeinfo,self.elemorder)
+
+    def numTreeNodes(self):
+        return self.val.numTreeNodes()
+
+    def isBuilt(self):
+        return self.val.isBuilt()
+
+    def build(self,sval leafSize=4):
+        self.checkWritable()
+        self.bounds.setShared(False)
+        self.nodeinfo.setShared(False)
+        self.elemorder.setShared(False)
+        with nogil:
+            self.val.build(leafSize)
+
+    cdef checkWritable(self):
+        self.bounds.checkWritable()
+        self.nodeinfo.checkWritable()
+        self.elemorder.checkWritable()
+
+    def locate(self,vec3 pt,sval hint=-1):
+        '''Returns (elem,xi) for the element containing `pt' and its xi coordinate there, or None if it's outside the mesh.'''
+        cdef ivec3 xi
+        cdef sval elem=self.val.locate(pt.val,xi,hint)
+        return None if elem==<sval>-1 else (elem,vec3._new(xi))
+
+
+cdef class RealMatrixExpr:
+    '''
+    Records a chain of elementwise operations on the values of `src' which are evaluated in one multithreaded pass by
+    eval(). Each method returns this object so that operations can be chained, eg. normalizing and clamping a field:
+
+        RealMatrixExpr(field).sub(minv).div(maxv-minv).clamp(0,1).eval(out)
+
+    Operand matrices must have the same dimensions as `src', references to them are kept until clear() is called.
+    '''
+    cdef iRealMatrixExpr* val
+    cdef readonly RealMatrix src
+    cdef list operands
+
+    def __init__(self,RealMatrix src):
+        self.src=src
+        self.operands=[]
+        self.val=new iRealMatrixExpr(src.mat)
+
+    def __dealloc__(self):
+        del self.val
+
+    def numOps(self):
+        return self.val.numOps()
+
+    def add(self,real v):
+        self.val.add(v)
+        return self
+
+    def sub(self,real v):
+        self.val.sub(v)
+        return self
+
+    def mul(self,real v):
+        self.val.mul(v)
+        return self
+
+    def div(self,real v):
+        self.val.div(v)
+        return self
+
+    def minval(self,real v):
+        self.val.minval(v)
+        return self
+
+    def maxval(self,real v):
+        self.val.maxval(v)
+        return self
+
+    def muladd(self,real a,real b):
+        self.val.muladd(a,b)
+        return self
+
+    def clamp(self,real minv,real maxv):
+        self.val.clamp(minv,maxv)
+        return self
+
+    def addm(self,RealMatrix mat):
+        self.val.addm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def subm(self,RealMatrix mat):
+        self.val.subm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def mulm(self,RealMatrix mat):
+        self.val.mulm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def divm(self,RealMatrix mat):
+        self.val.divm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def minvalm(self,RealMatrix mat):
+        self.val.minvalm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def maxvalm(self,RealMatrix mat):
+        self.val.maxvalm(mat.mat)
+        self.operands.append(mat)
+        return self
+
+    def abs(self):
+        self.val.abs()
+        return self
+
+    def neg(self):
+        self.val.neg()
+        return self
+
+    def sqrt(self):
+        self.val.sqrt()
+        return self
+
+    def clear(self):
+        self.val.clear()
+        self.operands=[]
+
+    def eval(self,RealMatrix dest=None,sval numThreads=0):
+        '''Evaluate the expression into `dest', or into a new matrix with the dimensions of `src' if None, and return it.'''
+        if dest is None:
+            dest=RealMatrix(self.src.getName()+'_expr',self.src.n(),self.src.m())
+        else:
+            dest.checkWritable()
+
+        with nogil:
+            self.val.eval(dest.mat,numThreads)
+
+        return dest
+
+
+cdef class PackedVertexMatrix:
+    '''
+    Matrix of vertices in the renderer's hardware buffer layout, see PackedVertex. A worker process can create one of these
+    in shared memory, fill it with fill(), and pass it back pickled so that Figure.fillPackedData() uploads it directly.
+    '''
+    cdef iPackedVertexMatrix* mat
+
+    def __init__(self,str name,*args):
+        cdef str mtype=''
+        cdef sval n=1
+
+        args=list(args)
+        if len(args) and isinstance(args[0],str):
+            mtype=args.pop(0)
+
+        if len(args)>2 and isinstance(args[0],str): # shared name, serialized metadata, and size given by __reduce__
+            self.mat=new iPackedVertexMatrix(name,mtype,args[0],args[1],int(args[2]),1)
+        else:
+            if len(args):
+                n=int(args.pop(0))
+            self.mat=new iPackedVertexMatrix(name,mtype,n,1,bool(args[0]) if len(args) else False)
+
+    def __dealloc__(self):
+        del self.mat
+
+    def __reduce__(self):
+        if not self.isShared():
+            raise MemoryError('Only shared memory matrices can be pickled')
+
+        return PackedVertexMatrix,(self.getName(),self.mat.getType(),self.mat.getSharedName(),self.mat.serializeMeta(),self.n())
+
+    def __repr__(self):
+        return 'PackedVertexMatrix<%s, %i, %r>'%(self.getName(),self.n(),self.isShared())
+
+    def getName(self):
+        return self.mat.getName()
+
+    def isShared(self):
+        return self.mat.isShared()
+
+    def setShared(self,bint val):
+        self.mat.setShared(val)
+
+    def n(self):
+        return self.mat.n()
+
+    def __len__(self):
+        return self.mat.n()
+
+    def memSize(self):
+        return self.mat.memSize()
+
+    def fill(self,Vec3Matrix vecs,ColorMatrix cols=None,sval start=0):
+        '''Pack `vecs' (position, normal, unused, uvw columns) and optionally `cols' into this matrix starting at row `start'.'''
+        cdef iColorMatrix* cmat=ColorMatrix._getNone(cols)
+        with nogil:
+            RenderTypes.packVertices(vecs.mat,cmat,self.mat,start)
 
 
 cdef class Config:
@@ -1146,6 +1551,9 @@ cdef class Spectrum:
     def interpolateColor(self,real pos):
         return color._new(self.val.interpolateColor(pos))
 
+    def lookupColor(self,real pos):
+        return color._new(self.val.lookupColor(pos))
+
     def removeSpectrumValue(self,int index):
         self.val.removeSpectrumValue(index)
 
@@ -1180,8 +1588,14 @@ cdef class Spectrum:
         return self.val.isLinearAlpha()
 
     def fillColorMatrix(self,ColorMatrix col, RealMatrix mat,bint useValAsAlpha=False):
+        col.checkWritable()
         self.val.fillColorMatrix(col.mat,mat.mat,useValAsAlpha)
 
+    def interpolateColors(self,RealMatrix mat,ColorMatrix col,bint useValAsAlpha=False):
+        col.checkWritable()
+        with nogil:
+            self.val.interpolateColors(mat.mat,col.mat,useValAsAlpha)
+
 
 cdef class Material(Spectrum):
     cdef iMaterial* mval
@@ -1487,9 +1901,11 @@ cdef class Image:
         return self.val.encode(format)
 
     def fillRealMatrix(self,RealMatrix mat):
+        mat.checkWritable()
         self.val.fillRealMatrix(mat.mat)
 
     def fillColorMatrix(self,ColorMatrix mat):
+        mat.checkWritable()
         self.val.fillColorMatrix(mat.mat)
 
 
@@ -1663,9 +2079,31 @@ cdef class Camera:
         self._checkObjectNull()
         return Image._new(self.val.renderToImage(width,height,tformat,stereoOffset))
 
+    def beginCapture(self,str fileprefix,str extension='.png',sval width=0,sval height=0, TextureFormat tformat=TF_RGB24,real stereoOffset=0.0,sval queueSize=4):
+        self._checkObjectNull()
+        self.val.beginCapture(fileprefix,extension,width,height,tformat,stereoOffset,queueSize)
+
+    def captureFrame(self):
+        self._checkObjectNull()
+        self.val.captureFrame()
+
+    def capturePoses(self,Vec3Matrix positions,Vec3Matrix lookats=None):
+        cdef iVec3Matrix* lmat=lookats.mat if lookats!=None else <iVec3Matrix*>NULL
+        self._checkObjectNull()
+        self.val.capturePoses(positions.mat,lmat)
+
+    def endCapture(self):
+        self._checkObjectNull()
+        return self.val.endCapture()
+
+    def isCapturing(self):
+        self._checkObjectNull()
+        return self.val.isCapturing()
+
         
 cdef class Figure:
     cdef iFigure* val
+    cdef object packedData # references to matrices given to fillPackedData() which must remain valid for deferred fills
 
     @staticmethod
     cdef _new(iFigure* val):
@@ -1717,6 +2155,43 @@ cdef class Figure:
             ibuf=ib._get()
 
         self.val.fillData(vbuf,ibuf,deferFill,doubleSided)
+        self.packedData=None # released only once the renderer no longer refers to any pending matrices
+
+    def fillPackedData(self,PackedVertexMatrix verts, IndexMatrix inds=None,bint deferFill=False):
+        cdef iIndexMatrix* imat=IndexMatrix._getNone(inds)
+        self.val.fillPackedData(verts.mat,imat,deferFill)
+        self.packedData=(verts,inds) if deferFill else None
+
+    def setPackedNormals(self,bint val):
+        self.val.setPackedNormals(val)
+
+    def isPackedNormals(self):
+        return self.val.isPackedNormals()
+
+    def setChunking(self,sval trisPerChunk,sval numLevels=1):
+        self.val.setChunking(trisPerChunk,numLevels)
+
+    def getChunkSize(self):
+        return self.val.getChunkSize()
+
+    def getChunkLevels(self):
+        return self.val.getChunkLevels()
+
+    def addKeyframe(self,Vec3Matrix nodes,RealMatrix field=None,real minval=0.0,real maxval=1.0):
+        cdef iRealMatrix* fmat=field.mat if field!=None else <iRealMatrix*>NULL
+        self.val.addKeyframe(nodes.mat,fmat,minval,maxval)
+
+    def clearKeyframes(self):
+        self.val.clearKeyframes()
+
+    def numKeyframes(self):
+        return self.val.numKeyframes()
+
+    def setKeyframeTime(self,real t,bint cubic=True):
+        self.val.setKeyframeTime(t,cubic)
+
+    def getKeyframeTime(self):
+        return self.val.getKeyframeTime()
 
     def setVisible(self,bint isVisible):
         self.val.setVisible(isVisible)
@@ -1786,6 +2261,12 @@ cdef class BBSetFigure(Figure):
     def numBillboards(self):
         return self.bbval.numBillboards()
 
+    def setPointCloud(self,bint val):
+        self.bbval.setPointCloud(val)
+
+    def isPointCloud(self):
+        return self.bbval.isPointCloud()
+
     def setBillboardPos(self,indexval index, vec3 pos):
         self.bbval.setBillboardPos(index,pos.val)
 
@@ -1858,6 +2339,12 @@ cdef class GlyphFigure(Figure):
     def getGlyphName(self):
         return self.gval.getGlyphName()
 
+    def setInstanced(self,bint val):
+        self.gval.setInstanced(val)
+
+    def isInstanced(self):
+        return self.gval.isInstanced()
+
     def addGlyphMesh(self,str name,Vec3Matrix nodes,Vec3Matrix norms, IndexMatrix inds):
         self.gval.addGlyphMesh(name,nodes.mat,norms.mat,inds.mat)
         
@@ -2015,12 +2502,21 @@ cdef class Texture:
         self.val.fillBlack()
 
     def fillColor(self,col_mat,indexval depth=0,real minval=0.0,real maxval=1.0, Material colormat=None, RealMatrix alphamat=None,bint mulAlpha=True):
+        cdef iMaterial* cmat=colormat.mval if colormat!=None else <iMaterial*>NULL
+        cdef iRealMatrix* amat=alphamat.mat if alphamat!=None else <iRealMatrix*>NULL
+
         if isinstance(col_mat,color):
             self.val.fillColor((<color>col_mat).val)
         elif isinstance(col_mat,ColorMatrix):
             self.val.fillColor((<ColorMatrix>col_mat).mat,depth)
         elif isinstance(col_mat,RealMatrix):
-            self.val.fillColor((<RealMatrix>col_mat).mat,depth,minval,maxval,colormat.mval if colormat!=None else <iMaterial*>NULL,alphamat.mat if alphamat!=None else <iRealMatrix*>NULL,mulAlpha)
+            self.val.fillColor((<RealMatrix>col_mat).mat,depth,minval,maxval,cmat,amat,mulAlpha)
+        elif isinstance(col_mat,FloatMatrix):
+            self.val.fillColor((<FloatMatrix>col_mat).mat,depth,minval,maxval,cmat,amat,mulAlpha)
+        elif isinstance(col_mat,UShortMatrix):
+            self.val.fillColor((<UShortMatrix>col_mat).mat,depth,minval,maxval,cmat,amat,mulAlpha)
+        elif isinstance(col_mat,ShortMatrix):
+            self.val.fillColor((<ShortMatrix>col_mat).mat,depth,minval,maxval,cmat,amat,mulAlpha)
         # else col_mat is NULL so do nothing  
 
 cdef class GPUProgram:
@@ -2158,6 +2654,27 @@ cdef class RenderScene:
     def getAlwaysHighQuality(self):
         return self.val.getAlwaysHighQuality()
 
+    def setResourceOpBudget(self,real seconds=0,size_t numBytes=0):
+        '''Set the per-frame time and upload size after which texture commits and similar are left for later frames, 0 for no limit.'''
+        self.val.setResourceOpBudget(seconds,numBytes)
+
+    def setProfiling(self,bint enabled,sval capacity=0):
+        '''Enable or disable recording frame statistics, if `capacity' is given this many recent frames are kept.'''
+        if capacity>0:
+            self.val.getProfiler().setCapacity(capacity)
+        self.val.getProfiler().setEnabled(enabled)
+
+    def isProfiling(self):
+        return self.val.getProfiler().isEnabled()
+
+    def clearProfile(self):
+        self.val.getProfiler().clear()
+
+    def getProfileFrames(self):
+        '''Returns a list of dicts containing the FrameStats values for the stored frames, oldest first.'''
+        cdef RenderTypes.FrameProfiler* p=self.val.getProfiler()
+        return [p.getFrame(i) for i in range(p.numFrames())]
+
 
 cdef class RenderAdapter:
     cdef iRenderAdapter* val
@@ -2209,6 +2726,63 @@ def basis_NURBS_default(real u, real v, real w,sval ul, sval vl, sval wl, sval u
     return coeffs.tolist()
 
 
+def fillBasisTable(str basisname, RealMatrix xis, RealMatrix coeffs):
+    '''
+    Fill `coeffs' with the coefficients of the basis named by `basisname' (Tet1NL or Hex1NL) for each xi value in `xis', 
+    resizing it to have a row per xi value. The table can then be used with applyBasisTable() for every element.
+    '''
+    cdef RenderTypes.BasisFunc func
+    cdef sval numcoeffs
+
+    if basisname=='Tet1NL':
+        func=RenderTypes.basis_Tet1NL
+        numcoeffs=4
+    elif basisname=='Hex1NL':
+        func=RenderTypes.basis_Hex1NL
+        numcoeffs=8
+    else:
+        raise ValueError('Unknown basis function %r'%basisname)
+
+    coeffs.checkWritable()
+
+    with nogil:
+        RenderTypes.fillBasisTable(func,numcoeffs,xis.mat,coeffs.mat)
+
+
+def fillBasisTable_NURBS_default(RealMatrix xis, sval ul, sval vl, sval wl, sval udegree, sval vdegree, sval wdegree, RealMatrix coeffs):
+    '''Fill `coeffs' with the basis_NURBS_default() coefficients for each xi value in `xis' as fillBasisTable() does.'''
+    coeffs.checkWritable()
+    with nogil:
+        RenderTypes.fillBasisTable_NURBS_default(xis.mat,ul,vl,wl,udegree,vdegree,wdegree,coeffs.mat)
+
+
+def applyBasisTable(RealMatrix coeffs, vals, IndexMatrix inds, out, sval numThreads=0):
+    '''
+    Interpolate the per-node values `vals' (a Vec3Matrix or RealMatrix) at each sample of the basis table `coeffs' for every
+    element in `inds', storing the result for sample `s' of element `e' in row e*coeffs.n()+s of `out' which must be the 
+    same type as `vals'. 
+    '''
+    cdef iVec3Matrix* vecvals
+    cdef iVec3Matrix* vecout
+    cdef iRealMatrix* realvals
+    cdef iRealMatrix* realout
+
+    if isinstance(vals,Vec3Matrix) and isinstance(out,Vec3Matrix):
+        vecvals=(<Vec3Matrix>vals).mat
+        (<Vec3Matrix>out).checkWritable()
+        vecout=(<Vec3Matrix>out).mat
+        with nogil:
+            RenderTypes.applyBasisTable(coeffs.mat,vecvals,inds.mat,vecout,numThreads)
+    elif isinstance(vals,RealMatrix) and isinstance(out,RealMatrix):
+        realvals=(<RealMatrix>vals).mat
+        (<RealMatrix>out).checkWritable()
+        realout=(<RealMatrix>out).mat
+        with nogil:
+            RenderTypes.applyBasisTable(coeffs.mat,realvals,inds.mat,realout,numThreads)
+    else:
+        raise ValueError('Value and output matrices must both be Vec3Matrix or RealMatrix')
+
+
 def pointInTet(vec3 pt, vec3 n1, vec3 n2, vec3 n3, vec3 n4):
     return RenderTypes.pointInTet(pt.val,n1.val,n2.val,n3.val,n4.val)
 
@@ -2234,6 +2808,80 @@ def calculateBoundBox(Vec3Matrix mat):
     return (vec3._new(r.first),vec3._new(r.second))
 
 
+def getStreamTypeSize(StreamType stype):
+    return RenderTypes.getStreamTypeSize(stype)
+
+
+def decodeStreamToRealMatrix(bytes stream, StreamType stype, RealMatrix mat, bint swapEndian=False, real slope=1.0, real intercept=0.0):
+    '''
+    Decode the values of type `stype' in `stream' into `mat', swapping byte order if `swapEndian' is True and rescaling each
+    value by `slope' and `intercept'. The stream must contain at least enough values to fill `mat'.
+    '''
+    cdef const char* cstream=stream
+    if len(stream)<mat.n()*mat.m()*RenderTypes.getStreamTypeSize(stype):
+        raise ValueError('Stream too short to fill matrix')
+
+    mat.checkWritable()
+
+    with nogil:
+        RenderTypes.decodeStreamToRealMatrix(cstream,stype,mat.mat,swapEndian,slope,intercept)
+
+
+def decodeFileToRealMatrix(str filename, size_t offset, StreamType stype, RealMatrix mat, bint swapEndian=False, real slope=1.0, real intercept=0.0):
+    '''
+    Decode the values of type `stype' from file `filename' starting at byte `offset' into `mat', see decodeStreamToRealMatrix().
+    '''
+    cdef string cfilename=filename
+    mat.checkWritable()
+    with nogil:
+        RenderTypes.decodeFileToRealMatrix(cfilename.c_str(),offset,stype,mat.mat,swapEndian,slope,intercept)
+
+
+def readContainerFileInfo(str filename):
+    '''
+    Returns a dictionary describing the matrix stored in container file `filename', read with the readContainerFile()
+    method of the matrix type named by the 'elemtag' value.
+    '''
+    cdef RenderTypes.MatrixContainerInfo info=RenderTypes.readContainerFileInfo(filename)
+    return {
+        'elemtag':info.elemtag,
+        'name':info.name,
+        'type':info.type,
+        'meta':info.meta,
+        'elemsize':info.elemsize,
+        'n':info.n,
+        'm':info.m,
+        'chunkRows':info.chunkRows,
+        'numChunks':info.numChunks(),
+        'compressed':info.compressed,
+        'swapEndian':info.swapEndian
+    }
+
+
+def intersectsTriMeshRays(TriMeshBVH bvh, Vec3Matrix origins, Vec3Matrix dirs, RealMatrix dists, IndexMatrix triinds, IndexMatrix excludeInds=None, sval numThreads=0):
+    '''
+    Intersect the rays defined by `origins' and `dirs' with the mesh in `bvh', storing the nearest hit distances and
+    triangle indices for each ray in `dists' and `triinds'. The GIL is released while the rays are processed in parallel.
+    '''
+    cdef iIndexMatrix* exinds=IndexMatrix._getNone(excludeInds)
+    dists.checkWritable()
+    triinds.checkWritable()
+    with nogil:
+        RenderTypes.intersectsTriMeshRays(bvh.val,origins.mat,dirs.mat,dists.mat,triinds.mat,exinds,numThreads)
+
+
+def locatePoints(ElemMeshBVH bvh, Vec3Matrix pts, IndexMatrix elems, Vec3Matrix xis, sval numThreads=0):
+    '''
+    Locate every point of `pts' in the mesh of `bvh', storing the index of each point's containing element in `elems' and
+    its xi coordinate in `xis', or -1 and vec3(-1) for points outside the mesh. The GIL is released while the points are
+    processed in parallel.
+    '''
+    elems.checkWritable()
+    xis.checkWritable()
+    with nogil:
+        RenderTypes.locatePoints(bvh.val,pts.mat,elems.mat,xis.mat,numThreads)
+
+
 def calculateBoundSquare(object mat, real threshold):
     cdef RenderTypes.quadruple[int,int,int,int] result
 
@@ -2269,33 +2917,122 @@ def minmaxMatrixReal(RealMatrix mat):
 def minmaxMatrixIndex(IndexMatrix mat):
     return RenderTypes.minmaxMatrix[indexval](mat.mat)
 
+def minmaxMatrixFloat(FloatMatrix mat):
+    return RenderTypes.minmaxMatrix[float](mat.mat)
+
+def minmaxMatrixUShort(UShortMatrix mat):
+    return RenderTypes.minmaxMatrix[u16](mat.mat)
 
-def trilerpMatrices(RealMatrix mat1, RealMatrix mat2, vec3 v1, vec3 v2):
-    return RenderTypes.trilerpMatrices(mat1.mat,mat2.mat,v1.val,v2.val)
+def minmaxMatrixShort(ShortMatrix mat):
+    return RenderTypes.minmaxMatrix[i16](mat.mat)
+
+
+def trilerpMatrices(mat1, mat2, vec3 v1, vec3 v2):
+    if isinstance(mat1,FloatMatrix):
+        return RenderTypes.trilerpMatrices[float]((<FloatMatrix?>mat1).mat,(<FloatMatrix?>mat2).mat,v1.val,v2.val)
+    else:
+        return RenderTypes.trilerpMatrices[real]((<RealMatrix?>mat1).mat,(<RealMatrix?>mat2).mat,v1.val,v2.val)
 
 
 def getPlaneXi(vec3 pos, vec3 planepos, rotator orientinv, vec3 dimvec):
     return vec3._new(RenderTypes.getPlaneXi(pos.val,planepos.val,orientinv.val,dimvec.val))
 
 
-def interpolateImageStack(list stack,transform stacktransinv,RealMatrix out,transform outtrans):
-    cdef vector[iRealMatrix*] cstack
-    for i in stack:
-        cstack.push_back((<RealMatrix?>i).mat)
-
-    RenderTypes.interpolateImageStack(cstack,stacktransinv.val,out.mat,outtrans.val)
+def interpolateImageStack(list stack,transform stacktransinv,out,transform outtrans,bint nearest=False):
+    '''
+    Interpolate the image volume `stack' into the image `out', these must be matrices of the same type which can be any of
+    RealMatrix, FloatMatrix, UShortMatrix, or ShortMatrix.
+    '''
+    interpolateImageVolume(stack,stacktransinv,[out],outtrans,1,nearest)
 
 
-def getImageStackValue(list stack,vec3 pos):
-    cdef vector[iRealMatrix*] cstack
-    for i in stack:
-        cstack.push_back((<RealMatrix?>i).mat)
+def interpolateImageVolume(list stack,transform stacktransinv,list out,transform outtrans,sval timesteps=1,bint nearest=False):
+    '''
+    Interpolate the image volume `stack' into the volume `out', these must all be matrices of the same type as the first
+    output image which can be any of RealMatrix, FloatMatrix, UShortMatrix, or ShortMatrix.
+    '''
+    cdef vector[iRealMatrix*] rstack, rout
+    cdef vector[iFloatMatrix*] fstack, fout
+    cdef vector[iUShortMatrix*] usstack, usout
+    cdef vector[iShortMatrix*] sstack, sout
+    cdef itransform strans=stacktransinv.val
+    cdef itransform otrans=outtrans.val
+
+    if len(out)==0:
+        raise ValueError('Output list must be non-empty')
+
+    if isinstance(out[0],FloatMatrix):
+        for i in stack:
+            fstack.push_back((<FloatMatrix?>i).mat)
+        for i in out:
+            (<FloatMatrix?>i).checkWritable()
+            fout.push_back((<FloatMatrix>i).mat)
+
+        with nogil:
+            RenderTypes.interpolateImageVolume[float](fstack,strans,fout,otrans,timesteps,nearest)
+    elif isinstance(out[0],UShortMatrix):
+        for i in stack:
+            usstack.push_back((<UShortMatrix?>i).mat)
+        for i in out:
+            (<UShortMatrix?>i).checkWritable()
+            usout.push_back((<UShortMatrix>i).mat)
+
+        with nogil:
+            RenderTypes.interpolateImageVolume[u16](usstack,strans,usout,otrans,timesteps,nearest)
+    elif isinstance(out[0],ShortMatrix):
+        for i in stack:
+            sstack.push_back((<ShortMatrix?>i).mat)
+        for i in out:
+            (<ShortMatrix?>i).checkWritable()
+            sout.push_back((<ShortMatrix>i).mat)
+
+        with nogil:
+            RenderTypes.interpolateImageVolume[i16](sstack,strans,sout,otrans,timesteps,nearest)
+    else:
+        for i in stack:
+            rstack.push_back((<RealMatrix?>i).mat)
+        for i in out:
+            (<RealMatrix?>i).checkWritable()
+            rout.push_back((<RealMatrix>i).mat)
 
-    return RenderTypes.getImageStackValue(cstack,pos.val)
+        with nogil:
+            RenderTypes.interpolateImageVolume[real](rstack,strans,rout,otrans,timesteps,nearest)
 
 
-def calculateImageHistogram(RealMatrix img, RealMatrix hist, i32 minv):
-    return RenderTypes.calculateImageHistogram(img.mat,hist.mat,minv)
+def getImageStackValue(list stack,vec3 pos):
+    cdef vector[iRealMatrix*] rstack
+    cdef vector[iFloatMatrix*] fstack
+    cdef vector[iUShortMatrix*] usstack
+    cdef vector[iShortMatrix*] sstack
+
+    if len(stack)>0 and isinstance(stack[0],FloatMatrix):
+        for i in stack:
+            fstack.push_back((<FloatMatrix?>i).mat)
+        return RenderTypes.getImageStackValue[float](fstack,pos.val)
+    elif len(stack)>0 and isinstance(stack[0],UShortMatrix):
+        for i in stack:
+            usstack.push_back((<UShortMatrix?>i).mat)
+        return RenderTypes.getImageStackValue[u16](usstack,pos.val)
+    elif len(stack)>0 and isinstance(stack[0],ShortMatrix):
+        for i in stack:
+            sstack.push_back((<ShortMatrix?>i).mat)
+        return RenderTypes.getImageStackValue[i16](sstack,pos.val)
+    else:
+        for i in stack:
+            rstack.push_back((<RealMatrix?>i).mat)
+        return RenderTypes.getImageStackValue[real](rstack,pos.val)
+
+
+def calculateImageHistogram(img, RealMatrix hist, i32 minv):
+    hist.checkWritable()
+    if isinstance(img,FloatMatrix):
+        RenderTypes.calculateImageHistogram[float]((<FloatMatrix>img).mat,hist.mat,minv)
+    elif isinstance(img,UShortMatrix):
+        RenderTypes.calculateImageHistogram[u16]((<UShortMatrix>img).mat,hist.mat,minv)
+    elif isinstance(img,ShortMatrix):
+        RenderTypes.calculateImageHistogram[i16]((<ShortMatrix>img).mat,hist.mat,minv)
+    else:
+        RenderTypes.calculateImageHistogram[real]((<RealMatrix?>img).mat,hist.mat,minv)
 
 
 def calculateTriPlaneSlice(vec3 planept, vec3 planenorm, vec3 a, vec3 b, vec3 c):
@@ -2328,3 +3065,43 @@ def calculateHexValueIntersects(real val,real a, real b, real c, real d, real e,
     cdef sval result=RenderTypes.calculateHexValueIntersects(val,vals,intersects)
     return tuple((intersects[i].first,intersects[i].second,intersects[i].third) for i in range(result))
 
+
+def calculateIsosurface(Vec3Matrix nodes, IndexMatrix inds, RealMatrix field, isovals, bint doubleSided=False, str name='isosurface', sval numThreads=0):
+    '''
+    Calculate the isosurfaces of the per-node `field' for each of the values in `isovals' over the linear tet or hex mesh
+    (nodes,inds). This returns the matrices (outnodes,outinds,outedges,outlerps,outelems) where `outnodes' and `outinds' are
+    the vertex (position,normal) and triangle matrices for a FT_TRILIST figure, `outedges' and `outlerps' state which mesh
+    edge each vertex is on, which isovalue it's for, and where along the edge it's placed, and `outelems' states the first
+    element with that edge and the columns of `inds' the edge's nodes are in. See the C++ function for details.
+    '''
+    cdef vector[real] vals=[float(v) for v in isovals]
+    cdef Vec3Matrix outnodes=Vec3Matrix(name+'_nodes',1,2)
+    cdef IndexMatrix outinds=IndexMatrix(name+'_inds','Tri1NL',1,3)
+    cdef IndexMatrix outedges=IndexMatrix(name+'_edges',1,3)
+    cdef RealMatrix outlerps=RealMatrix(name+'_lerps',1)
+    cdef IndexMatrix outelems=IndexMatrix(name+'_elems',1,3)
+
+    with nogil:
+        RenderTypes.calculateIsosurface(nodes.mat,inds.mat,field.mat,vals,outnodes.mat,outinds.mat,outedges.mat,outlerps.mat,outelems.mat,doubleSided,numThreads)
+
+    return outnodes,outinds,outedges,outlerps,outelems
+
+
+def calculateIsoline(Vec3Matrix nodes, IndexMatrix inds, RealMatrix field, isovals, str name='isoline', sval numThreads=0):
+    '''
+    Calculate the isolines of the per-node `field' for each of the values in `isovals' over the linear triangle or quad 
+    mesh (nodes,inds). This returns (outnodes,outinds,outedges,outlerps,outelems) as calculateIsosurface() does except
+    `outinds' defines line segments for a FT_LINELIST figure.
+    '''
+    cdef vector[real] vals=[float(v) for v in isovals]
+    cdef Vec3Matrix outnodes=Vec3Matrix(name+'_nodes',1,2)
+    cdef IndexMatrix outinds=IndexMatrix(name+'_inds','Line1NL',1,2)
+    cdef IndexMatrix outedges=IndexMatrix(name+'_edges',1,3)
+    cdef RealMatrix outlerps=RealMatrix(name+'_lerps',1)
+    cdef IndexMatrix outelems=IndexMatrix(name+'_elems',1,3)
+
+    with nogil:
+        RenderTypes.calculateIsoline(nodes.mat,inds.mat,field.mat,vals,outnodes.mat,outinds.mat,outedges.mat,outlerps.mat,outelems.mat,numThreads)
+
+    return outnodes,outinds,outedges,outlerps,outelems
+
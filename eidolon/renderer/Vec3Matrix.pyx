@@ -34,6 +34,43 @@ cdef ivec3 Vec3MatrixCallback(void* func,ivec3 val, sval n, sval m) with gil:
     return vec3._get(o(vec3._new(val),n,m))
 
 
+def mapVec3MatrixFile(str name,str mtype,str filename,size_t offset,sval n,sval m=1,bint copyOnWrite=False,str serialmeta=''):
+    '''
+    Create a Vec3Matrix of `n' rows and `m' columns whose data is mapped from `filename' starting from byte `offset' rather
+    than read into memory. See the C++ file-mapping constructor for Matrix, this is also used to unpickle such matrices.
+    Unless `copyOnWrite' is True the matrix is read-only, methods modifying it raise ValueError and buffer views of it
+    are read-only.
+    '''
+    cdef Vec3Matrix mat=Vec3Matrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[ivec3](name,mtype,filename,offset,n,m,copyOnWrite)
+    mat.mat.deserializeMeta(serialmeta)
+    return mat
+
+
+def arenaVec3Matrix(str name,object arena,sval n,sval m=1,str mtype=''):
+    '''
+    Create a shared Vec3Matrix of `n' rows and `m' columns whose data is allocated from `arena', which may be a SharedArena
+    or SharedArenaPool. The matrix holds a reference to its arena's segment until it is cleared or deleted.
+    '''
+    cdef size_t offset=0
+    cdef iSharedArena* a=_allocateFromArena(arena,sizeof(ivec3)*n*m,&offset)
+    cdef Vec3Matrix mat=Vec3Matrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[ivec3](name,mtype,n,m,a,offset)
+    return mat
+
+
+def attachVec3MatrixArena(str name,str mtype,str sharedname,size_t capacity,size_t offset,sval n,sval m,str serialmeta=''):
+    '''Create a Vec3Matrix from the allocation at `offset' in the arena named `sharedname', this is used to unpickle arena matrices.'''
+    cdef iSharedArena* a=iSharedArena.attach(sharedname,capacity)
+    cdef Vec3Matrix mat=Vec3Matrix(name)
+    del mat.mat
+    mat.mat=new iMatrix[ivec3](name,mtype,n,m,a,offset)
+    mat.mat.deserializeMeta(serialmeta)
+    return mat
+
+
 cdef class Vec3Matrix:
     cdef iMatrix[ivec3]* mat
     cdef Py_ssize_t shape[2]
@@ -92,6 +129,10 @@ cdef class Vec3Matrix:
         if self.viewCount>0:
             raise MemoryError('Cannot perform operation, external views of matrix exist')
 
+    cdef checkWritable(self):
+        if self.isReadOnly():
+            raise ValueError('Cannot modify matrix mapped read-only from file %s'%self.mat.getFileName())
+
     def subMatrix(self,str name,sval n, sval m=1,sval noff=0,sval moff=0,bint isShared=False):
         return Vec3Matrix._new(self.mat.subMatrix(name,n,m,noff,moff,isShared))
 
@@ -99,6 +140,7 @@ cdef class Vec3Matrix:
         return Vec3Matrix._new(self.mat.reshape(name,n,m,isShared))
 
     def applyCell(self,object func,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         maxcol=RenderTypes._min[sval](self.mat.m(),maxcol)
         maxrow=RenderTypes._min[sval](self.mat.n(),maxrow)
         for n in range(minrow,maxrow):
@@ -139,8 +181,17 @@ cdef class Vec3Matrix:
         return 'Vec3Matrix<%s, %i x %i, %r>'%(self.getName(),self.n(),self.m(),self.isShared())
 
     def __reduce__(self):
+        cdef iSharedArena* arena=self.mat.getArena()
+        if arena!=NULL:
+            args=(self.getName(),self.getType(),arena.getSharedName(),arena.getCapacity(),self.mat.getArenaOffset(),self.n(),self.m(),self.mat.serializeMeta())
+            return attachVec3MatrixArena,args
+
+        if self.isFileMapped() and not self.isCopyOnWrite():
+            args=(self.getName(),self.getType(),self.getFileName(),self.getFileOffset(),self.n(),self.m(),False,self.mat.serializeMeta())
+            return mapVec3MatrixFile,args
+
         if not self.isShared():
-            raise MemoryError('Only shared memory matrices can be pickled')
+            raise MemoryError('Only shared memory or read-only file-mapped matrices can be pickled')
 
         return Vec3Matrix,(self.getName(),self.getType(),self.mat.getSharedName(),self.mat.serializeMeta(),self.n(),self.m())
 
@@ -157,6 +208,28 @@ cdef class Vec3Matrix:
     def isShared(self):
         return self.mat.isShared()
 
+    def isFileMapped(self):
+        return self.mat.isFileMapped()
+
+    def isCopyOnWrite(self):
+        return self.mat.isCopyOnWrite()
+
+    def isReadOnly(self):
+        '''Returns True if this matrix is mapped read-only from a file, methods which modify it then raise ValueError.'''
+        return self.mat.isReadOnly()
+
+    def getFileName(self):
+        return self.mat.getFileName()
+
+    def getFileOffset(self):
+        return self.mat.getFileOffset()
+
+    def isArenaAllocated(self):
+        return self.mat.isArenaAllocated()
+
+    def getArenaOffset(self):
+        return self.mat.getArenaOffset()
+
     def n(self):
         return self.mat.n()
 
@@ -180,15 +253,18 @@ cdef class Vec3Matrix:
         self.mat.setShared(val)
 
     def swapEndian(self):
+        self.checkWritable()
         self.mat.swapEndian()
 
     def getAt(self,sval n,sval m=0):
         return vec3._new(self.mat.getAt(n,m))
 
     def setAt(self,vec3 v,sval n,sval m=0):
+        self.checkWritable()
         self.mat.setAt(vec3._get(v),n,m)
 
     def fill(self,vec3 v):
+        self.checkWritable()
         self.mat.fill(vec3._get(v))
 
     def setN(self,sval newn):
@@ -240,6 +316,7 @@ cdef class Vec3Matrix:
 
     def setRow(self,sval n,*vals):
         cdef sval i,minlen=RenderTypes._min[sval](self.mat.m(),len(vals))
+        self.checkWritable()
         
         if n>=self.mat.n():
             raise IndexError("Bad value %i for index 'n' (0<=n<%i"%(n,self.n()))
@@ -278,6 +355,7 @@ cdef class Vec3Matrix:
         cdef object line
         cdef sval n=min(self.mat.n(),len(listmat))
         cdef sval m=self.mat.m()
+        self.checkWritable()
 
         try:
             m=min(m,len(listmat[0]))
@@ -294,20 +372,42 @@ cdef class Vec3Matrix:
 
     def fromIterable(self,iterable):
         cdef object it=iter(iterable)
+        self.checkWritable()
         self.setN(len(iterable))
         for i in range(len(iterable)):
             self.mat.ats(i,0,vec3._get(next(it)))
 
     def readBinaryFile(self, str filename,size_t offset):
+        self.checkWritable()
         self.mat.readBinaryFile(filename,offset)
 
     def readTextFile(self, str filename,sval numHeaders):
+        self.checkWritable()
         self.mat.readTextFile(filename,numHeaders)
 
     def storeBinaryFile(self, str filename, list header):
         cdef array.array a=array.array('i',header)
         self.mat.storeBinaryFile(filename,a.data.as_ints,len(header))
 
+    def storeContainerFile(self, str filename, sval chunkRows=0, bint compressed=True, sval numThreads=0):
+        '''
+        Store this matrix with its type and metadata in chunked container file `filename', each chunk having `chunkRows'
+        rows (about 1MB if 0) and being compressed if `compressed' is True using `numThreads' threads (0 for all).
+        '''
+        cdef string fname=filename
+        with nogil:
+            self.mat.storeContainerFile(fname.c_str(),chunkRows,compressed,numThreads)
+
+    def readContainerFile(self, str filename, sval startRow=0, sval numRows=-1, sval numThreads=0):
+        '''
+        Read `numRows' rows (the rest of the file if -1) starting at `startRow' from container file `filename' into this
+        matrix, resizing it to that many rows. Only the chunks containing the requested rows are decompressed.
+        '''
+        cdef string fname=filename
+        self.checkWritable()
+        with nogil:
+            self.mat.readContainerFile(fname.c_str(),startRow,numRows,numThreads)
+
     def __getitem__(self,index):
         origindex=index
 
@@ -354,6 +454,7 @@ cdef class Vec3Matrix:
         raise TypeError('Index %r is not supported'%(origindex,))
 
     def __setitem__(self,index,value):
+        self.checkWritable()
         origindex=index
 
         if isinstance(index,tuple):
@@ -418,6 +519,10 @@ cdef class Vec3Matrix:
 
     def __getbuffer__(self, Py_buffer *buffer, int flags):
         cdef Py_ssize_t itemsize = sizeof(real)
+        cdef bint readonly=self.isReadOnly()
+
+        if readonly and (flags&PyBUF_WRITABLE):
+            raise BufferError('Cannot create a writable view of a matrix mapped read-only from file')
 
         self.shape[0] = self.mat.n()
         self.shape[1] = self.mat.m()*3
@@ -432,7 +537,7 @@ cdef class Vec3Matrix:
         buffer.len = self.mat.memSize()
         buffer.ndim = 2
         buffer.obj = self
-        buffer.readonly = 0
+        buffer.readonly = readonly
         buffer.shape = self.shape
         buffer.strides = self.strides
         buffer.suboffsets = NULL
@@ -445,6 +550,7 @@ cdef class Vec3Matrix:
         self.mat.copyFrom[real](m.mat)
 
     def add(self,t,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         if isinstance(t,Vec3Matrix):
             self.mat.addm[ivec3](deref((<Vec3Matrix>t).mat),minrow,mincol,maxrow,maxcol)
         elif isinstance(t,(int,long,float)):
@@ -453,6 +559,7 @@ cdef class Vec3Matrix:
             self.mat.add[ivec3](vec3._get(t),minrow,mincol,maxrow,maxcol)
 
     def sub(self,t,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         if isinstance(t,Vec3Matrix):
             self.mat.subm[ivec3](deref((<Vec3Matrix>t).mat),minrow,mincol,maxrow,maxcol)
         elif isinstance(t,(int,long,float)):
@@ -461,6 +568,7 @@ cdef class Vec3Matrix:
             self.mat.sub[ivec3](vec3._get(t),minrow,mincol,maxrow,maxcol)
 
     def mul(self,t,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         if isinstance(t,Vec3Matrix):
             self.mat.mulm[ivec3](deref((<Vec3Matrix>t).mat),minrow,mincol,maxrow,maxcol)
         elif isinstance(t,rotator):
@@ -473,6 +581,7 @@ cdef class Vec3Matrix:
             self.mat.mul[ivec3](vec3._get(t),minrow,mincol,maxrow,maxcol)
 
     def div(self,t,sval minrow=0,sval mincol=0,sval maxrow=-1,sval maxcol=-1):
+        self.checkWritable()
         if isinstance(t,Vec3Matrix):
             self.mat.divm[ivec3](deref((<Vec3Matrix>t).mat),minrow,mincol,maxrow,maxcol)
         elif isinstance(t,(int,long,float)):
@@ -60,11 +60,14 @@ def generateMatrix(prefix,ttype,ptype=None,tofunc='',fromfunc=''):
         o.write(''.join(text).format(T=ttype,N=prefix,P=ptype,_To=tofunc,_From=fromfunc))
 
 
-# generate code for RealMatrix, IndexMatrix, Vec3Matrix, ColorMatrix
+# generate code for RealMatrix, IndexMatrix, Vec3Matrix, ColorMatrix, FloatMatrix, UShortMatrix, ShortMatrix
 generateMatrix('Real','real')
 generateMatrix('Index','indexval')
 generateMatrix('Vec3','ivec3','vec3','vec3._new','vec3._get')
 generateMatrix('Color','icolor','color','color._new','color._get')
+generateMatrix('Float','float')
+generateMatrix('UShort','u16')
+generateMatrix('Short','i16')
 
 # platform identifiers, exactly 1 should be true
 isDarwin=platform.system().lower()=='darwin'
@@ -114,7 +117,7 @@ elif isWindows:
     
 else:
     assert isLinux
-    libraries+=['m','rt']
+    libraries+=['m','rt','pthread']
     platdir='linux'
     destfile+='so.%s'%platdir
     
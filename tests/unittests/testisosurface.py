@@ -0,0 +1,115 @@
+# Eidolon Biomedical Framework
+# Copyright (C) 2016-8 Eric Kerfoot, King's College London, all rights reserved
+# 
+# This file is part of Eidolon.
+#
+# Eidolon is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# 
+# Eidolon is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License along
+# with this program (LICENSE.txt).  If not, see <http://www.gnu.org/licenses/>
+
+
+import unittest
+from eidolon import (
+	vec3, Vec3Matrix, IndexMatrix, RealMatrix, ElemType, BoundBox, generateHexBox, listResults, calculateIsosurfaceRange, 
+	calculateIsosurfaceNative
+)
+
+# tets each hex is divided into, as used by the native isosurface calculation
+hexTets=[(0,1,3,7), (0,1,5,7), (0,2,3,7), (0,2,6,7), (0,4,5,7), (0,4,6,7)]
+
+
+def linearField(n):
+	'''A field linear in space so that every isosurface is the same plane whichever way it's calculated.'''
+	return n.x()+2*n.y()+3*n.z()
+
+
+def createMesh(useTets):
+	'''Returns (nodes,inds,field) for a 3x3x3 hex mesh, divided into tets if `useTets' is True.'''
+	nodelist,hexes=generateHexBox(2,2,2)
+	
+	nodes=Vec3Matrix('nodes',0)
+	field=RealMatrix('field',0)
+	for n in nodelist:
+		nodes.append(n)
+		field.append(linearField(n))
+		
+	if useTets:
+		inds=IndexMatrix('inds','Tet1NL',0,4)
+		for h in hexes:
+			for t in hexTets:
+				inds.append(*[h[i] for i in t])
+	else:
+		inds=IndexMatrix('inds','Hex1NL',0,8)
+		for h in hexes:
+			inds.append(*h)
+			
+	return nodes,inds,field
+
+
+def surfaceArea(nodes,inds):
+	'''Returns the total area of the triangles `inds' indexing the first column of `nodes'.'''
+	area=0
+	for i in range(inds.n()):
+		a,b,c=inds.getRow(i)
+		area+=nodes.getAt(a).triArea(nodes.getAt(b),nodes.getAt(c))
+		
+	return area
+	
+
+class TestIsosurface(unittest.TestCase):
+	def compareMethods(self,useTets):
+		'''Compare the surfaces from the native and per-element Python calculations of the mesh's isosurfaces.'''
+		nodes,inds,field=createMesh(useTets)
+		vals=[1.25,2.6,4.1] # chosen to not pass through any nodes, whose values are multiples of 1/3
+		elemtype=ElemType[inds.getType()]
+		
+		pynodes,pyinds,pyprops=listResults(calculateIsosurfaceRange(inds.n(),1,None,nodes,inds,0,field,inds,0,6,vals,0))[0]
+		natnodes,natinds,natprops=calculateIsosurfaceNative(nodes,inds,field,vals,0)
+		
+		self.assertAlmostEqual(surfaceArea(natnodes,natinds),surfaceArea(pynodes,pyinds))
+		
+		for i in range(natnodes.n()):
+			pos=natnodes.getAt(i)
+			elem=natprops.getAt(i)
+			elemnodes=nodes.mapIndexRow(inds,elem)
+			
+			# each vertex is on one of the isosurfaces and its xi coordinate must be at the same place in its element
+			self.assertTrue(any(abs(linearField(pos)-v)<1e-10 for v in vals))
+			self.assertTrue(elemtype.applyBasis(elemnodes,*natnodes.getAt(i,2)).distTo(pos)<1e-10)
+			
+	def testHexNativeMatchesPython(self):
+		'''Test the native isosurface over linear hexes matches the Python calculation.'''
+		self.compareMethods(False)
+		
+	def testTetNativeMatchesPython(self):
+		'''Test the native isosurface over linear tets matches the Python calculation.'''
+		self.compareMethods(True)
+		
+	def testNativeEmpty(self):
+		'''Test the native calculation returns no surface for a value outside the field's range.'''
+		nodes,inds,field=createMesh(False)
+		self.assertEqual(calculateIsosurfaceNative(nodes,inds,field,[10.0],0),(None,None,None))
+		
+	def testInternalPlane(self):
+		'''Test a bound box's internal plane point is on the plane, including for a flat box.'''
+		for box in (BoundBox([vec3(0,0,0),vec3(1,2,3)]), BoundBox([vec3(0,0,0),vec3(1,2,0)])):
+			pt=box.center
+			norm=vec3(1,1,0).norm()
+			center,radius=box.getInternalPlane(pt,norm)
+			
+			self.assertTrue(abs(center.planeDist(pt,norm))<1e-10)
+			self.assertTrue(center in box)
+			self.assertTrue(radius>0)
+			
+			
+if __name__ == '__main__':
+	unittest.main()
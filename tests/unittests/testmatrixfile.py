@@ -0,0 +1,359 @@
+# Eidolon Biomedical Framework
+# Copyright (C) 2016-8 Eric Kerfoot, King's College London, all rights reserved
+# 
+# This file is part of Eidolon.
+#
+# Eidolon is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# 
+# Eidolon is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License along
+# with this program (LICENSE.txt).  If not, see <http://www.gnu.org/licenses/>
+
+
+import os
+import math
+import random
+import shutil
+import tempfile
+import unittest
+import numpy as np
+from eidolon import (
+	RealMatrix, IndexMatrix, Vec3Matrix, FloatMatrix, UShortMatrix, ShortMatrix, ColorMatrix, vec3, mapRealMatrixFile, readContainerFileInfo, fillBasisTable, decodeStreamToRealMatrix,
+	ST_DOUBLE
+)
+
+
+def createRealMatrix(name,n,m):
+	'''Returns a RealMatrix of `n' rows and `m' columns where row i is (i*m, i*m+1, ...).'''
+	mat=RealMatrix(name,'',n,m)
+	for i in range(n):
+		mat.setRow(i,*[float(i*m+j) for j in range(m)])
+		
+	return mat
+	
+
+def readTextReference(filename,numHeaders):
+	'''Returns the rows of text file `filename' parsed line by line as the original loader did, by splitting on whitespace.'''
+	with open(filename) as o:
+		lines=o.read().splitlines()
+		
+	if numHeaders>0:
+		lines=lines[1:]
+		
+	return [tuple(float(v) for v in line.split()) for line in lines if line.strip()]
+
+
+class TestMatrixFile(unittest.TestCase):
+	def setUp(self):
+		self.tempdir=tempfile.mkdtemp()
+		
+	def tearDown(self):
+		shutil.rmtree(self.tempdir)
+		
+	def writeText(self,text):
+		'''Write `text' to a file in the temporary directory without newline translation, returning the filename.'''
+		filename=os.path.join(self.tempdir,'mat.txt')
+		with open(filename,'w',newline='') as o:
+			o.write(text)
+			
+		return filename
+		
+	def testTextSeparators(self):
+		'''Test values separated by spaces, tabs, and CRLF line endings are read and blank lines skipped.'''
+		filename=self.writeText('1 2\t3\r\n  4\t\t5  6 \r\n\n\t\n7 8 9\n')
+		
+		mat=RealMatrix('mat','',0,3)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(1.0,2.0,3.0),(4.0,5.0,6.0),(7.0,8.0,9.0)])
+		
+	def testTextTrailingRow(self):
+		'''Test the last row is read when the file doesn't end with a newline, and that reading replaces existing rows.'''
+		filename=self.writeText('1 2\n3 4')
+		
+		mat=createRealMatrix('mat',5,2)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(1.0,2.0),(3.0,4.0)])
+		
+	def testTextHeaderMissingValues(self):
+		'''Test the header line is skipped and values missing from short lines are set to 0.'''
+		filename=self.writeText('2 3\n1 2 3\n4\n')
+		
+		mat=RealMatrix('mat','',0,3)
+		mat.readTextFile(filename,1)
+		self.assertEqual(mat.toList(),[(1.0,2.0,3.0),(4.0,0.0,0.0)])
+		
+	def testTextMalformedReals(self):
+		'''Test malformed real values are read like atof(), taking the leading number of a token or 0 if there isn't one.'''
+		filename=self.writeText('1.5x -abc 2e 3e+\nnan -inf 1e3 .5\n')
+		
+		mat=RealMatrix('mat','',0,4)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.getRow(0),(1.5,0.0,2.0,3.0))
+		
+		row=mat.getRow(1)
+		self.assertTrue(math.isnan(row[0]))
+		self.assertEqual(row[1:],(float('-inf'),1000.0,0.5))
+		
+	def testTextMalformedIndices(self):
+		'''Test malformed index values are read like atol(), truncating reals and reading non-numbers as 0.'''
+		filename=self.writeText('1 2 3\n4 5 x\n7.9 -0 +8\n')
+		
+		mat=IndexMatrix('mat','',0,3)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(1,2,3),(4,5,0),(7,0,8)])
+		
+	def testTextFloat(self):
+		'''Test float values are read as reals and narrowed rather than being left as 0.'''
+		filename=self.writeText('1.5 -2.25\n1e3 x\n')
+		
+		mat=FloatMatrix('mat','',0,2)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(1.5,-2.25),(1000.0,0.0)])
+		
+	def testTextUShort(self):
+		'''Test unsigned short values are read as integers with values outside of 0 to 65535 clamped to that range.'''
+		filename=self.writeText('1 65535 70000 -5\n12.7 x\n')
+		
+		mat=UShortMatrix('mat','',0,4)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(1,65535,65535,0),(12,0,0,0)])
+		
+	def testTextShort(self):
+		'''Test short values are read as signed integers with values outside of -32768 to 32767 clamped to that range.'''
+		filename=self.writeText('-1 32767 40000 -40000\n+7 x\n')
+		
+		mat=ShortMatrix('mat','',0,4)
+		mat.readTextFile(filename,0)
+		self.assertEqual(mat.toList(),[(-1,32767,32767,-32768),(7,0,0,0)])
+		
+	def testTextVec3(self):
+		'''Test vec3 values are read from triples of values on each line with missing components set to 0.'''
+		filename=self.writeText('1 2 3 4 5 6\n7 8\n')
+		
+		mat=Vec3Matrix('mat',0,2)
+		mat.readTextFile(filename,0)
+		rows=[tuple((v.x(),v.y(),v.z()) for v in row) for row in mat.toList()]
+		self.assertEqual(rows,[((1.0,2.0,3.0),(4.0,5.0,6.0)),((7.0,8.0,0.0),(0.0,0.0,0.0))])
+		
+	def testTextColor(self):
+		'''Test color values are read from groups of 4 RGBA values on each line with missing components set to 1.'''
+		filename=self.writeText('0.5 0.25 0 0.75 1 0\n')
+		
+		mat=ColorMatrix('mat',0,2)
+		mat.readTextFile(filename,0)
+		rows=[tuple((c.r(),c.g(),c.b(),c.a()) for c in row) for row in mat.toList()]
+		self.assertEqual(rows,[((0.5,0.25,0.0,0.75),(1.0,0.0,1.0,1.0))])
+		
+	def testTextMatchesReference(self):
+		'''Test a file spanning several parse blocks is read with the same values as the original line by line loader.'''
+		rand=random.Random(12345)
+		lines=['%i %i'%(40000,4)]
+		for i in range(40000):
+			vals=[rand.uniform(-1e6,1e6) for j in range(4)]
+			vals[i%4]=rand.choice([0,1e-20,-3.5e15,12345])
+			lines.append(' '.join('%.12g'%v for v in vals)+('\r' if i%3==0 else ''))
+			
+		filename=self.writeText('\n'.join(lines))
+		
+		mat=RealMatrix('mat','',0,4)
+		mat.readTextFile(filename,1)
+		self.assertGreater(os.path.getsize(filename),2**20)
+		self.assertEqual(mat.toList(),readTextReference(filename,1))
+		
+	def testMappedRead(self):
+		'''Test a file-mapped matrix reads the values stored in its file at the given offset.'''
+		mat=createRealMatrix('mat',20,3)
+		filename=os.path.join(self.tempdir,'mat.bin')
+		mat.storeBinaryFile(filename,[1,2])
+		
+		mapped=mapRealMatrixFile('mapped','',filename,8,20,3)
+		self.assertTrue(mapped.isFileMapped())
+		self.assertEqual(mapped.toList(),mat.toList())
+		
+	def testMappedReadOnly(self):
+		'''Test a read-only mapped matrix raises exceptions rather than writing to its mapping.'''
+		mat=createRealMatrix('mat',10,2)
+		filename=os.path.join(self.tempdir,'mat.bin')
+		mat.storeBinaryFile(filename,[])
+		
+		mapped=mapRealMatrixFile('mapped','',filename,0,10,2)
+		self.assertTrue(mapped.isReadOnly())
+		
+		self.assertRaises(ValueError,mapped.setAt,1.0,0,0)
+		self.assertRaises(ValueError,mapped.setRow,0,1.0,2.0)
+		self.assertRaises(ValueError,mapped.fill,5.0)
+		self.assertRaises(ValueError,mapped.add,1.0)
+		self.assertRaises(ValueError,mapped.__setitem__,0,(1.0,2.0))
+		self.assertRaises(MemoryError,mapped.setN,20)
+		self.assertRaises(MemoryError,mapped.setM,1)
+		
+		# native functions writing to output matrices must also refuse read-only ones
+		xis=RealMatrix('xis','',1,3)
+		self.assertRaises(ValueError,fillBasisTable,'Tet1NL',xis,mapped)
+		self.assertRaises(ValueError,decodeStreamToRealMatrix,bytes(160),ST_DOUBLE,mapped)
+		
+		arr=np.asarray(mapped)
+		self.assertFalse(arr.flags.writeable)
+		self.assertEqual(mapped.toList(),mat.toList())
+		
+	def testMappedCopyOnWrite(self):
+		'''Test writes to a copy-on-write mapped matrix are kept private and don't alter the file.'''
+		mat=createRealMatrix('mat',10,2)
+		filename=os.path.join(self.tempdir,'mat.bin')
+		mat.storeBinaryFile(filename,[])
+		
+		mapped=mapRealMatrixFile('mapped','',filename,0,10,2,True)
+		self.assertFalse(mapped.isReadOnly())
+		mapped.fill(-1.0)
+		self.assertEqual(mapped.getRow(5),(-1.0,-1.0))
+		
+		mapped2=mapRealMatrixFile('mapped2','',filename,0,10,2)
+		self.assertEqual(mapped2.toList(),mat.toList())
+		
+	def testStoreBinaryTruncates(self):
+		'''Test storing a binary file over a larger one leaves only the header and the new matrix's data.'''
+		filename=os.path.join(self.tempdir,'mat.bin')
+		createRealMatrix('mat',100,3).storeBinaryFile(filename,[])
+		
+		mat=createRealMatrix('mat',2,3)
+		mat.storeBinaryFile(filename,[7,8])
+		self.assertEqual(os.path.getsize(filename),2*4+mat.memSize())
+		self.assertEqual(np.fromfile(filename,np.int32,2).tolist(),[7,8])
+		
+	def testStoreBinaryEmpty(self):
+		'''Test storing an empty matrix produces an empty file, or just the header if one is given.'''
+		filename=os.path.join(self.tempdir,'mat.bin')
+		createRealMatrix('mat',10,3).storeBinaryFile(filename,[])
+		
+		mat=RealMatrix('mat','',0,3)
+		mat.storeBinaryFile(filename,[])
+		self.assertEqual(os.path.getsize(filename),0)
+		
+		mat.storeBinaryFile(filename,[1,2])
+		self.assertEqual(np.fromfile(filename,np.int32).tolist(),[1,2])
+		
+	def testStoreBinaryBadPath(self):
+		'''Test storing to a file which can't be created raises an exception.'''
+		filename=os.path.join(self.tempdir,'missing','mat.bin')
+		self.assertRaises(MemoryError,createRealMatrix('mat',2,2).storeBinaryFile,filename,[])
+		
+	def testContainerRoundTrip(self):
+		'''Test a matrix's values, type, and metadata are read back from compressed and uncompressed containers.'''
+		mat=createRealMatrix('mat',1000,3)
+		mat.setType('testtype')
+		mat.meta('key','value')
+		
+		for compressed in (True,False):
+			filename=os.path.join(self.tempdir,'mat%i.emc'%compressed)
+			mat.storeContainerFile(filename,64,compressed)
+			
+			info=readContainerFileInfo(filename)
+			self.assertEqual((info['n'],info['m'],info['chunkRows'],info['numChunks']),(1000,3,64,16))
+			self.assertEqual((info['name'],info['type'],info['compressed']),('mat','testtype',compressed))
+			
+			mat2=RealMatrix('mat2','',0,3)
+			mat2.readContainerFile(filename)
+			self.assertEqual(mat2.toList(),mat.toList())
+			self.assertEqual(mat2.getType(),'testtype')
+			self.assertEqual(mat2.meta('key'),'value')
+			
+	def testContainerThreads(self):
+		'''Test containers written and read with one and with many threads hold the same values, including incompressible ones.'''
+		rand=random.Random(12345)
+		mat=RealMatrix('mat','',5000,2)
+		for i in range(mat.n()):
+			mat.setRow(i,rand.random(),float(i))
+			
+		filename1=os.path.join(self.tempdir,'mat1.emc')
+		filename2=os.path.join(self.tempdir,'mat2.emc')
+		mat.storeContainerFile(filename1,100,True,1)
+		mat.storeContainerFile(filename2,100,True,0)
+		
+		with open(filename1,'rb') as o1, open(filename2,'rb') as o2:
+			self.assertEqual(o1.read(),o2.read())
+			
+		for numThreads in (1,0):
+			mat2=RealMatrix('mat2','',0,2)
+			mat2.readContainerFile(filename1,0,mat.n(),numThreads)
+			self.assertEqual(mat2.toList(),mat.toList())
+			
+	def testContainerTypes(self):
+		'''Test index and vec3 matrices round trip through containers.'''
+		inds=IndexMatrix('inds','',300,4)
+		for i in range(inds.n()):
+			inds.setRow(i,i,i*2,i*3,2**32-1-i)
+			
+		nodes=Vec3Matrix('nodes',300)
+		for i in range(nodes.n()):
+			nodes.setAt(vec3(i,-i*0.5,1e-10*i),i)
+			
+		for mat,mat2 in ((inds,IndexMatrix('inds2','',0,4)),(nodes,Vec3Matrix('nodes2',0))):
+			filename=os.path.join(self.tempdir,mat.getName()+'.emc')
+			mat.storeContainerFile(filename,50)
+			mat2.readContainerFile(filename)
+			self.assertEqual(mat2.toList(),mat.toList())
+		
+	def testContainerPartialRead(self):
+		'''Test reading ranges of rows which start and end within chunks.'''
+		mat=createRealMatrix('mat',1000,3)
+		filename=os.path.join(self.tempdir,'mat.emc')
+		mat.storeContainerFile(filename,64)
+		rows=mat.toList()
+		
+		mat2=RealMatrix('mat2','',0,3)
+		mat2.readContainerFile(filename,100,200)
+		self.assertEqual(mat2.toList(),rows[100:300])
+		
+		mat2.readContainerFile(filename,950)
+		self.assertEqual(mat2.toList(),rows[950:])
+		
+		mat2.readContainerFile(filename,1000)
+		self.assertEqual(mat2.n(),0)
+		
+		self.assertRaises(RuntimeError,mat2.readContainerFile,filename,990,20)
+		
+	def testContainerEmpty(self):
+		'''Test an empty matrix round trips through a container.'''
+		filename=os.path.join(self.tempdir,'mat.emc')
+		RealMatrix('mat','',0,3).storeContainerFile(filename)
+		
+		mat=createRealMatrix('mat2',5,3)
+		mat.readContainerFile(filename)
+		self.assertEqual(mat.n(),0)
+		
+	def testContainerMismatch(self):
+		'''Test reading a container into a matrix of another element type or width raises an exception.'''
+		filename=os.path.join(self.tempdir,'mat.emc')
+		createRealMatrix('mat',10,3).storeContainerFile(filename)
+		
+		self.assertRaises(RuntimeError,RealMatrix('mat2','',0,2).readContainerFile,filename)
+		self.assertRaises(RuntimeError,IndexMatrix('mat2','',0,3).readContainerFile,filename)
+		
+	def testContainerCorrupt(self):
+		'''Test containers with altered chunk data or which are truncated raise exceptions rather than returning bad values.'''
+		filename=os.path.join(self.tempdir,'mat.emc')
+		createRealMatrix('mat',1000,3).storeContainerFile(filename,64)
+		
+		with open(filename,'rb') as o:
+			data=bytearray(o.read())
+			
+		for i,newdata in enumerate([data[:len(data)//2],data[:10]]):
+			badfile=os.path.join(self.tempdir,'trunc%i.emc'%i)
+			with open(badfile,'wb') as o:
+				o.write(newdata)
+				
+			self.assertRaises(RuntimeError,RealMatrix('mat2','',0,3).readContainerFile,badfile)
+			
+		data[len(data)//2]^=0xff
+		badfile=os.path.join(self.tempdir,'altered.emc')
+		with open(badfile,'wb') as o:
+			o.write(data)
+			
+		self.assertRaises(RuntimeError,RealMatrix('mat2','',0,3).readContainerFile,badfile)
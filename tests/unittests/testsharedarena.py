@@ -0,0 +1,88 @@
+# Eidolon Biomedical Framework
+# Copyright (C) 2016-8 Eric Kerfoot, King's College London, all rights reserved
+# 
+# This file is part of Eidolon.
+#
+# Eidolon is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# 
+# Eidolon is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# 
+# You should have received a copy of the GNU General Public License along
+# with this program (LICENSE.txt).  If not, see <http://www.gnu.org/licenses/>
+
+
+import os
+import multiprocessing
+import unittest
+from eidolon import SharedArena, SharedArenaPool, arenaRealMatrix
+
+
+def holdArenaMatrix(conn):
+	'''Receive an arena matrix, send back its values when asked, then clear it and acknowledge.'''
+	mat=conn.recv()
+	conn.send(True)
+	conn.recv()
+	conn.send(mat.toList())
+	mat.clear()
+	conn.send(True)
+	
+	
+class TestSharedArena(unittest.TestCase):
+	def setUp(self):
+		self.name='testarena%i'%os.getpid()
+		
+	def testAllocation(self):
+		'''Test allocations are aligned past the arena header and reset only succeeds once they're cleared.'''
+		arena=SharedArena(self.name,4096)
+		mat=arenaRealMatrix('mat',arena,10,3)
+		self.assertEqual(mat.getArenaOffset()%64,0)
+		self.assertGreaterEqual(mat.getArenaOffset(),64)
+		self.assertEqual(arena.numAllocated(),1)
+		self.assertEqual(arena.numAttached(),0)
+		self.assertRaises(MemoryError,arena.reset)
+		
+		mat.clear()
+		arena.reset()
+		self.assertFalse(arena.canAllocate(4096))
+		self.assertTrue(arena.canAllocate(4096-64))
+		
+	def testWorkerBlocksReuse(self):
+		'''Test a pool doesn't reuse an arena while a worker process still holds a matrix unpickled from it.'''
+		pool=SharedArenaPool(self.name,4096)
+		mat=arenaRealMatrix('mat',pool,400) # large enough that two matrices don't fit in one arena
+		mat.fill(1.0)
+		expected=mat.toList()
+		
+		parent,child=multiprocessing.Pipe()
+		proc=multiprocessing.Process(target=holdArenaMatrix,args=(child,))
+		proc.start()
+		try:
+			parent.send(mat)
+			self.assertTrue(parent.recv())
+			
+			# the only local allocation is cleared but the worker's copy must keep the arena from being reset
+			mat.clear()
+			mat2=arenaRealMatrix('mat2',pool,400)
+			mat2.fill(2.0)
+			self.assertEqual(pool.numArenas(),2)
+			
+			parent.send(True)
+			self.assertEqual(parent.recv(),expected)
+			self.assertTrue(parent.recv())
+		finally:
+			proc.join()
+			
+		# once the worker has cleared its matrix the first arena can be reused
+		mat2.clear()
+		mat3=arenaRealMatrix('mat3',pool,400)
+		self.assertEqual(pool.numArenas(),2)
+		
+		
+if __name__ == '__main__':
+	unittest.main()